@@ -0,0 +1,214 @@
+#define LOG_MODULE LOG_MODULE_BLUETOOTH
+
+#include "ble_occupancy.h"
+
+#include <stdlib.h>
+#include "ble_occupancy_db.h"
+#include "btstack.h"
+#include "multi_printf.h"
+#include "pico/cyw43_arch.h"
+
+// The fused state as a GATT service for door displays and room controllers nearby, next to the SPP console on the
+// same controller. The values are little endian: the occupants an int16, the confidence an uint16 in per mille and
+// the motion an uint8 that is 1 while the PIR sees motion. One LE client at a time, it reads the values without
+// pairing and gets a notification whenever one it subscribed to changes
+
+#define COUNT_VALUE_HANDLE ATT_CHARACTERISTIC_8F6D0002_4E3A_4C7B_9D2E_6A1B3C5D7E9F_01_VALUE_HANDLE
+#define COUNT_CONFIGURATION_HANDLE ATT_CHARACTERISTIC_8F6D0002_4E3A_4C7B_9D2E_6A1B3C5D7E9F_01_CLIENT_CONFIGURATION_HANDLE
+#define CONFIDENCE_VALUE_HANDLE ATT_CHARACTERISTIC_8F6D0003_4E3A_4C7B_9D2E_6A1B3C5D7E9F_01_VALUE_HANDLE
+#define CONFIDENCE_CONFIGURATION_HANDLE ATT_CHARACTERISTIC_8F6D0003_4E3A_4C7B_9D2E_6A1B3C5D7E9F_01_CLIENT_CONFIGURATION_HANDLE
+#define MOTION_VALUE_HANDLE ATT_CHARACTERISTIC_8F6D0004_4E3A_4C7B_9D2E_6A1B3C5D7E9F_01_VALUE_HANDLE
+#define MOTION_CONFIGURATION_HANDLE ATT_CHARACTERISTIC_8F6D0004_4E3A_4C7B_9D2E_6A1B3C5D7E9F_01_CLIENT_CONFIGURATION_HANDLE
+
+#define VALUE_COUNT (1 << 0)
+#define VALUE_CONFIDENCE (1 << 1)
+#define VALUE_MOTION (1 << 2)
+
+// The confidence moves a little with every radar frame, only a change this big is worth a notification
+#define CONFIDENCE_NOTIFY_STEP_PERMILLE 10
+
+// 100 ms in units of 0.625 ms, so a display finds the sensor quickly after it lost the connection
+#define ADVERTISING_INTERVAL 160
+
+static const uint8_t advertising_data[] = {
+        // Flags: LE general discoverable, BR/EDR not supported
+        2, BLUETOOTH_DATA_TYPE_FLAGS, 0x06,
+        // The occupancy service, little endian
+        17, BLUETOOTH_DATA_TYPE_COMPLETE_LIST_OF_128_BIT_SERVICE_CLASS_UUIDS,
+        0x9f, 0x7e, 0x5d, 0x3c, 0x1b, 0x6a, 0x2e, 0x9d, 0x7b, 0x4c, 0x3a, 0x4e, 0x01, 0x00, 0x6d, 0x8f,
+};
+
+static const uint8_t scan_response_data[] = {
+        14, BLUETOOTH_DATA_TYPE_COMPLETE_LOCAL_NAME, 'I', 'M', 'S', 'X', '8', '1', ' ', 'S', 'e', 'n', 's', 'o', 'r',
+};
+
+// Only touched with the async context lock held, BTstack runs with it and the main loop takes it
+static hci_con_handle_t con_handle = HCI_CON_HANDLE_INVALID;
+static uint8_t subscribed = 0;
+static uint8_t pending = 0;
+
+static int16_t current_count = 0;
+static uint16_t current_confidence = 0;
+static bool current_motion = false;
+
+static uint16_t encode_value(uint16_t attribute_handle, uint8_t *value) {
+    switch (attribute_handle) {
+        case COUNT_VALUE_HANDLE:
+            little_endian_store_16(value, 0, (uint16_t) current_count);
+            return 2;
+        case CONFIDENCE_VALUE_HANDLE:
+            little_endian_store_16(value, 0, current_confidence);
+            return 2;
+        case MOTION_VALUE_HANDLE:
+            value[0] = current_motion;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static uint16_t att_read_callback(hci_con_handle_t connection, uint16_t attribute_handle, uint16_t offset,
+                                  uint8_t *buffer, uint16_t buffer_size) {
+    uint8_t value[2];
+    uint16_t len = encode_value(attribute_handle, value);
+    if (!len) {
+        return 0;
+    }
+    return att_read_callback_handle_blob(value, len, offset, buffer, buffer_size);
+}
+
+static int att_write_callback(hci_con_handle_t connection, uint16_t attribute_handle, uint16_t transaction_mode,
+                              uint16_t offset, uint8_t *buffer, uint16_t buffer_size) {
+    if (transaction_mode != ATT_TRANSACTION_MODE_NONE || buffer_size < 2) {
+        return 0;
+    }
+
+    uint8_t value;
+    switch (attribute_handle) {
+        case COUNT_CONFIGURATION_HANDLE:
+            value = VALUE_COUNT;
+            break;
+        case CONFIDENCE_CONFIGURATION_HANDLE:
+            value = VALUE_CONFIDENCE;
+            break;
+        case MOTION_CONFIGURATION_HANDLE:
+            value = VALUE_MOTION;
+            break;
+        default:
+            return 0;
+    }
+
+    if (little_endian_read_16(buffer, 0) == GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION) {
+        subscribed |= value;
+    } else {
+        subscribed &= ~value;
+        pending &= ~value;
+    }
+    return 0;
+}
+
+/**
+ * Send the notification of one changed value, and ask for another turn if more are waiting
+ */
+static void send_notification() {
+    if (con_handle == HCI_CON_HANDLE_INVALID || !pending) {
+        return;
+    }
+
+    // The lowest pending value goes first
+    uint8_t value_bit = pending & -pending;
+    uint16_t attribute_handle = value_bit == VALUE_COUNT ? COUNT_VALUE_HANDLE :
+                                value_bit == VALUE_CONFIDENCE ? CONFIDENCE_VALUE_HANDLE : MOTION_VALUE_HANDLE;
+    uint8_t value[2];
+    uint16_t len = encode_value(attribute_handle, value);
+
+    if (att_server_notify(con_handle, attribute_handle, value, len) == ERROR_CODE_SUCCESS) {
+        pending &= ~value_bit;
+    }
+
+    if (pending) {
+        att_server_request_can_send_now_event(con_handle);
+    }
+}
+
+static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size) {
+    if (packet_type != HCI_EVENT_PACKET) {
+        return;
+    }
+
+    switch (hci_event_packet_get_type(packet)) {
+        case ATT_EVENT_CONNECTED:
+            con_handle = att_event_connected_get_handle(packet);
+            subscribed = 0;
+            pending = 0;
+            LOG_INFO("BLE client connected\n");
+            break;
+
+        case ATT_EVENT_DISCONNECTED:
+            if (att_event_disconnected_get_handle(packet) == con_handle) {
+                con_handle = HCI_CON_HANDLE_INVALID;
+                subscribed = 0;
+                pending = 0;
+                LOG_INFO("BLE client disconnected\n");
+            }
+            break;
+
+        case ATT_EVENT_CAN_SEND_NOW:
+            send_notification();
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * Register the occupancy GATT service and start advertising it. Must be called before BTstack is powered on
+ */
+void ble_occupancy_init() {
+    att_server_init(profile_data, att_read_callback, att_write_callback);
+    att_server_register_packet_handler(packet_handler);
+
+    bd_addr_t null_addr = {0};
+    gap_advertisements_set_params(ADVERTISING_INTERVAL, ADVERTISING_INTERVAL, 0, 0, null_addr, 0x07, 0x00);
+    gap_advertisements_set_data(sizeof(advertising_data), (uint8_t *) advertising_data);
+    gap_scan_response_set_data(sizeof(scan_response_data), (uint8_t *) scan_response_data);
+    gap_advertisements_enable(1);
+}
+
+/**
+ * @brief Publish the fused state, subscribed clients are notified of the values that changed.
+ * Must be called from the main loop
+ * @param count The fused number of occupants
+ * @param confidence How likely the fused state is to be right, in per mille
+ * @param motion True if the PIR sees motion
+ */
+void ble_occupancy_update(int16_t count, uint16_t confidence, bool motion) {
+    uint8_t changed = 0;
+    if (count != current_count) {
+        changed |= VALUE_COUNT;
+    }
+    if (abs((int32_t) confidence - current_confidence) >= CONFIDENCE_NOTIFY_STEP_PERMILLE) {
+        changed |= VALUE_CONFIDENCE;
+    }
+    if (motion != current_motion) {
+        changed |= VALUE_MOTION;
+    }
+    if (!changed) {
+        return;
+    }
+
+    async_context_acquire_lock_blocking(cyw43_arch_async_context());
+    current_count = count;
+    current_motion = motion;
+    if (changed & VALUE_CONFIDENCE) {
+        current_confidence = confidence;
+    }
+
+    bool idle = !pending;
+    pending |= changed & subscribed;
+    if (idle && pending && con_handle != HCI_CON_HANDLE_INVALID) {
+        att_server_request_can_send_now_event(con_handle);
+    }
+    async_context_release_lock(cyw43_arch_async_context());
+}
@@ -1,3 +1,5 @@
+#define LOG_MODULE LOG_MODULE_BLUETOOTH
+
 #include "bluetooth_spp.h"
 
 
@@ -41,77 +43,118 @@
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "ble_occupancy.h"
 #include "btstack.h"
+#include "console.h"
+#include "event_loop.h"
 #include "multi_printf.h"
+#include "pico/cyw43_arch.h"
+#include "pico/printf.h"
 #include "version.h"
-#include "reset.h"
 
-#ifdef USE_NEW_MINEW_RADAR
+#define RFCOMM_SERVER_CHANNEL 1
 
-#include "minewsemi_radar.h"
-#include "reset.h"
+// Must be a power of two. Holds what the client sent until the console task has split it into lines, so a client
+// can send commands a character at a time or several in one packet
+#define RECEIVE_RING_SIZE 1024
+#define MAX_LINE_SIZE 256
 
-#endif
+// Must be a power of two. Log lines go out as they are flushed, so this only has to hold a burst of them
+#define SEND_RING_SIZE 4096
 
-#define COMMAND_PREFIX "AT+"
-#define COMMAND_PREFIX_SIZE (sizeof(COMMAND_PREFIX) - 1)
-#define COMMAND_POSTFIX "\r\n"
-#define COMMAND_POSTFIX_SIZE (sizeof(COMMAND_POSTFIX) - 1)
-#define COMMAND_START_MINEW_RADAR_STUDY "MINEW-STUDY"
-#define COMMAND_START_MINEW_RADAR_STUDY_SIZE (sizeof(COMMAND_START_MINEW_RADAR_STUDY) - 1)
-#define COMMAND_RESET_MINEW_RADAR "MINEW-RESET"
-#define COMMAND_RESET_MINEW_RADAR_SIZE (sizeof(COMMAND_RESET_MINEW_RADAR) - 1)
-#define COMMAND_SEND_COMMAND_TO_MINW_RADAR "MINEW-COMMAND="
-#define COMMAND_SEND_COMMAND_TO_MINW_RADAR_SIZE (sizeof(COMMAND_SEND_COMMAND_TO_MINW_RADAR) - 1)
-#define COMMAND_RESET_PICO "PICO-RESET"
-#define COMMAND_RESET_PICO_SIZE (sizeof(COMMAND_RESET_PICO) - 1)
-#define COMMAND_GET_PICO_VERSION "PICO-VERSION"
-#define COMMAND_GET_PICO_VERSION_SIZE (sizeof(COMMAND_GET_PICO_VERSION) - 1)
-
-#define COMPLETE_BLUETOOTH_AUTH_MESSAGE BLUETOOTH_AUTH_TOKEN"\r\n"
-#define COMPLETE_BLUETOOTH_AUTH_MESSAGE_SIZE (sizeof(COMPLETE_BLUETOOTH_AUTH_MESSAGE) - 1)
+static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
 
-#define RFCOMM_SERVER_CHANNEL 1
+static uint16_t rfcomm_channel_id;
+static uint16_t rfcomm_max_frame_size;
+static bool rfcomm_user_has_authenticated;
+static uint8_t spp_service_buffer[150];
+static btstack_packet_callback_registration_t hci_event_callback_registration;
 
-#define RFCOMM_SEND_TIMER_PERIOD_MS 100
+// BTstack appends what the client sends, the console task takes it out while it holds the async context lock, so
+// the two never run at the same time. Data that does not fit is dropped and the line it belongs to is discarded
+static uint8_t receive_ring[RECEIVE_RING_SIZE];
+static uint32_t receive_head = 0;
+static uint32_t receive_tail = 0;
+static bool receive_overflow = false;
+
+// The line being assembled by the console task
+static char line[MAX_LINE_SIZE];
+static uint16_t line_size = 0;
+static bool line_discarded = false;
+
+// Single producer (the main loop), single consumer (BTstack). Every message is appended whole or not at all, so
+// the client never gets part of a line. Only the main loop writes head and only BTstack writes tail
+static uint8_t send_ring[SEND_RING_SIZE];
+static volatile uint32_t send_head = 0;
+static volatile uint32_t send_tail = 0;
+static volatile bool send_requested = false;
+// Set by BTstack when the channel closes. The ring is emptied by the main loop the next time it writes, as only it
+// may move the head, and BTstack sends nothing until then
+static volatile bool send_reset_pending = false;
+
+// BTstack can preempt the main loop but not the other way around, so either BTstack clears the flag before
+// the main loop looks at it, or it sees the bytes the main loop appended before it looked
+static void take_send_reset() {
+    if (send_reset_pending) {
+        send_reset_pending = false;
+        send_head = send_tail;
+    }
+}
 
-#define MAX_SEND_MESSAGE_SIZE 1000
-#define SEND_QUEUE_SIZE 20
+static void request_send() {
+    if (send_requested) {
+        return;
+    }
+    send_requested = true;
 
-typedef enum {
-    SEND_MESSAGE_FREE,
-    SEND_MESSAGE_RESERVED,
-    SEND_MESSAGE_SEND
-} send_status_t;
+    async_context_acquire_lock_blocking(cyw43_arch_async_context());
+    if (rfcomm_channel_id) {
+        rfcomm_request_can_send_now_event(rfcomm_channel_id);
+    }
+    async_context_release_lock(cyw43_arch_async_context());
+}
 
 typedef struct {
-    uint32_t send_id;
-    send_status_t status;
-    uint8_t buffer[MAX_SEND_MESSAGE_SIZE];
-    uint16_t send_len;
-} send_queue_entry_t;
-
-
-static volatile uint32_t current_send_id = 1;
-static send_queue_entry_t send_queue[SEND_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t end;
+} ring_printf_t;
+
+static void ring_putc(char c, void *arg) {
+    ring_printf_t *out = arg;
+    if (out->head != out->end) {
+        send_ring[out->head++ & (SEND_RING_SIZE - 1)] = c;
+    }
+}
 
+/**
+ * @brief Format a message straight into the send ring, so a long line needs no buffer on the stack and is not cut
+ * short. Must be called from the main loop
+ * @param format The format string
+ * @param args The arguments
+ * @return True if the message was queued, False if no client is connected or there is not room for all of it
+ */
+bool bluetooth_vprintf(const char *format, va_list args) {
+    take_send_reset();
+    if (!rfcomm_channel_id || !rfcomm_user_has_authenticated) return false;
 
-static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+    va_list copy;
+    va_copy(copy, args);
+    int size = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
 
-static uint16_t rfcomm_channel_id;
-static bool rfcomm_user_has_authenticated;
-static uint8_t spp_service_buffer[150];
-static btstack_packet_callback_registration_t hci_event_callback_registration;
+    uint32_t head = send_head;
+    if (size < 0 || size > SEND_RING_SIZE - (head - send_tail)) return false;
 
-static btstack_timer_source_t rfcomm_send_timer;
+    ring_printf_t out = {.head = head, .end = head + size};
+    vfctprintf(ring_putc, &out, format, args);
 
-bool bluetooth_vprintf(const char *format, va_list args) {
-    uint8_t *buffer = get_free_send_buffer(MAX_SEND_MESSAGE_SIZE);
-    if (buffer == NULL) return false;
-    int size = vsnprintf((char *) buffer, MAX_SEND_MESSAGE_SIZE, format, args);
-    return mark_buffer_to_send(buffer, size);
+    __dmb();
+    send_head = out.end;
+    request_send();
+    return true;
 }
 
 bool bluetooth_printf(const char *format, ...) {
@@ -122,86 +165,68 @@ bool bluetooth_printf(const char *format, ...) {
     return result;
 }
 
-static void start_send_timer() {
-    btstack_run_loop_set_timer(&rfcomm_send_timer, RFCOMM_SEND_TIMER_PERIOD_MS);
-    btstack_run_loop_add_timer(&rfcomm_send_timer);
-}
-
 /**
- * @brief Get a free send buffer
- * @param prelim_size preliminary size of the buffer. The actual size of the buffer may be smaller
- * @return buffer or NULL if no buffer is available or size is too large or no client is connected
+ * @brief Queue raw bytes to send to the client. Must be called from the main loop
+ * @param data The bytes to send
+ * @param len Number of bytes
+ * @return True if the bytes were queued, False if no client is connected or there is not room for all of them
  */
-uint8_t *get_free_send_buffer(size_t prelim_size) {
-    if (prelim_size > MAX_SEND_MESSAGE_SIZE || !rfcomm_channel_id || !rfcomm_user_has_authenticated) return NULL;
-
-    for (int i = 0; i < SEND_QUEUE_SIZE; i++) {
-        if (send_queue[i].status == SEND_MESSAGE_FREE) {
-            send_queue[i].status = SEND_MESSAGE_RESERVED;
-            send_queue[i].send_id = current_send_id++;
-            send_queue[i].send_len = prelim_size;
-            return send_queue[i].buffer;
-        }
-    }
-    return NULL;
+bool bluetooth_write(const uint8_t *data, size_t len) {
+    take_send_reset();
+    if (!rfcomm_channel_id || !rfcomm_user_has_authenticated) return false;
+
+    uint32_t head = send_head;
+    if (len > SEND_RING_SIZE - (head - send_tail)) return false;
+
+    uint32_t offset = head & (SEND_RING_SIZE - 1);
+    size_t first = len < SEND_RING_SIZE - offset ? len : SEND_RING_SIZE - offset;
+    memcpy(&send_ring[offset], data, first);
+    memcpy(send_ring, data + first, len - first);
+
+    __dmb();
+    send_head = head + len;
+    request_send();
+    return true;
 }
 
 /**
- * @brief Mark buffer as ready to send
- * @param buffer buffer to send
- * @param actual_size actual size of the buffer
+ * @brief Callback for RFCOMM events.
+ * Sends as many queued bytes as fit in one RFCOMM frame and requests another can send now event if more are queued
  */
-bool mark_buffer_to_send(const uint8_t *buffer, size_t actual_size) {
+void rfcomm_send_now_event() {
+    send_requested = false;
 
-    for (int i = 0; i < SEND_QUEUE_SIZE; i++) {
-        if (send_queue[i].buffer == buffer) {
-            if (!rfcomm_channel_id || actual_size > MAX_SEND_MESSAGE_SIZE) {
-                send_queue[i].status = SEND_MESSAGE_FREE;
-                return false;
-            }
-            send_queue[i].status = SEND_MESSAGE_SEND;
-            send_queue[i].send_len = actual_size;
-            return true;
-        }
-    }
+    // What is left in the ring was meant for the client that went away
+    if (send_reset_pending) return;
 
-    return false;
-}
+    uint32_t tail = send_tail;
+    uint32_t queued = send_head - tail;
+    if (!queued || !rfcomm_channel_id) return;
+    __dmb();
 
-/**
- * @brief Callback for RFCOMM events.
- * Sends one message from the queue if possible and requests another can send now event if more messages are ready to send
- */
-void rfcomm_send_now_event() {
-    uint32_t lowest_message_id = 0xffffffff;
-    uint32_t lowest_message_index = 0;
-    uint32_t messages_ready_to_send = 0;
-    for (int i = 0; i < SEND_QUEUE_SIZE; ++i) {
-        if (send_queue[i].status == SEND_MESSAGE_SEND) {
-            if (send_queue[i].send_id <= lowest_message_id) {
-                lowest_message_id = send_queue[i].send_id;
-                lowest_message_index = i;
-                messages_ready_to_send++;
-            }
-        }
+    // Up to the end of the ring, the rest goes in the next frame
+    uint32_t offset = tail & (SEND_RING_SIZE - 1);
+    uint16_t len = queued < SEND_RING_SIZE - offset ? queued : SEND_RING_SIZE - offset;
+    if (len > rfcomm_max_frame_size) {
+        len = rfcomm_max_frame_size;
     }
 
-    if (!messages_ready_to_send) return;
-
-    send_queue_entry_t *entry = &send_queue[lowest_message_index];
-    rfcomm_send(rfcomm_channel_id, entry->buffer, entry->send_len);
-    entry->status = SEND_MESSAGE_FREE;
+    if (rfcomm_send(rfcomm_channel_id, &send_ring[offset], len) == ERROR_CODE_SUCCESS) {
+        send_tail = tail + len;
+    }
 
-    if (messages_ready_to_send > 1) {
+    if (send_head != send_tail) {
+        send_requested = true;
         rfcomm_request_can_send_now_event(rfcomm_channel_id);
+    } else {
+        // Lets a long output like a profiler dump go on
+        event_loop_post(EVENT_SPP_DRAINED);
     }
 }
 
-void process_authenticate_packet(uint8_t *packet, uint16_t size) {
-
-    if (size == COMPLETE_BLUETOOTH_AUTH_MESSAGE_SIZE && memcmp(packet, COMPLETE_BLUETOOTH_AUTH_MESSAGE, 4) == 0) {
+static void process_authentication_line(const char *text) {
+    if (strcmp(text, BLUETOOTH_AUTH_TOKEN) == 0) {
         rfcomm_user_has_authenticated = true;
-        start_send_timer();
         bluetooth_printf("Authenticated\n");
         bluetooth_printf("Version: %s\n", FIRMWARE_STRING);
         printf("Bluetooth user authenticated\n");
@@ -212,67 +237,64 @@ void process_authenticate_packet(uint8_t *packet, uint16_t size) {
     }
 }
 
-void process_received_command(uint8_t *packet, uint16_t size) {
-    if (size < COMMAND_PREFIX_SIZE + COMMAND_POSTFIX_SIZE ||
-        memcmp(packet, COMMAND_PREFIX, COMMAND_PREFIX_SIZE) != 0 ||
-        memcmp(packet + size - COMMAND_POSTFIX_SIZE, COMMAND_POSTFIX, COMMAND_POSTFIX_SIZE) != 0) {
-        multi_printf("Invalid command\n");
-        return;
-    }
-
-    uint8_t *command = packet + COMMAND_PREFIX_SIZE;
-    uint16_t command_size = size - (COMMAND_PREFIX_SIZE + COMMAND_POSTFIX_SIZE);
-
-#ifdef USE_NEW_MINEW_RADAR
-
-    if (command_size == COMMAND_START_MINEW_RADAR_STUDY_SIZE &&
-        memcmp(command, COMMAND_START_MINEW_RADAR_STUDY, COMMAND_START_MINEW_RADAR_STUDY_SIZE) == 0) {
-        multi_printf("Starting Minew radar calibration\n");
-        minewsemi_start_studying();
+static void process_line(char *text) {
+    if (!rfcomm_user_has_authenticated) {
+        process_authentication_line(text);
         return;
     }
 
-    if (command_size == COMMAND_RESET_MINEW_RADAR_SIZE &&
-        memcmp(command, COMMAND_RESET_MINEW_RADAR, COMMAND_RESET_MINEW_RADAR_SIZE) == 0) {
-        multi_printf("Resetting Minew radar\n");
-        minewsemi_request_reset_on_next_tick();
-        return;
-    }
+    console_execute(text);
+}
 
-    if (command_size > COMMAND_SEND_COMMAND_TO_MINW_RADAR_SIZE &&
-        memcmp(command, COMMAND_SEND_COMMAND_TO_MINW_RADAR, COMMAND_SEND_COMMAND_TO_MINW_RADAR_SIZE) == 0) {
-        multi_printf("Queueing command for Minew radar\n");
-        bool success = minewsemi_request_send_message(command + COMMAND_SEND_COMMAND_TO_MINW_RADAR_SIZE,
-                                                      command_size - COMMAND_SEND_COMMAND_TO_MINW_RADAR_SIZE);
-        if (!success) {
-            multi_printf("Failed to send message\n");
+/**
+ * Split what the client sent into lines and execute them. Runs as a task, so a slow command does not hold up BTstack
+ */
+void bluetooth_console_task() {
+    // The commands call into BTstack, which otherwise only runs from the async context
+    async_context_acquire_lock_blocking(cyw43_arch_async_context());
+
+    // A line ends with \r, \n or both, empty lines are skipped
+    while (rfcomm_channel_id && receive_tail != receive_head) {
+        char c = receive_ring[receive_tail++ & (RECEIVE_RING_SIZE - 1)];
+        if (c == '\r' || c == '\n') {
+            if (line_size && !line_discarded) {
+                line[line_size] = '\0';
+                process_line(line);
+            }
+            line_size = 0;
+            line_discarded = false;
+        } else if (line_discarded) {
+            continue;
+        } else if (line_size < MAX_LINE_SIZE - 1) {
+            line[line_size++] = c;
+        } else {
+            bluetooth_printf("Command too long\n");
+            line_discarded = true;
         }
-        return;
     }
 
-#endif
-
-    if (command_size == COMMAND_RESET_PICO_SIZE && memcmp(command, COMMAND_RESET_PICO, COMMAND_RESET_PICO_SIZE) == 0) {
-        multi_printf("Setting reset Pico request flag!\n");
-        request_pico_reset();
-        return;
+    if (receive_overflow) {
+        // Part of the line has been lost
+        bluetooth_printf("Receive buffer full, command dropped\n");
+        receive_overflow = false;
+        line_discarded = true;
     }
 
-    if (command_size == COMMAND_GET_PICO_VERSION_SIZE && memcmp(command, COMMAND_GET_PICO_VERSION, COMMAND_GET_PICO_VERSION_SIZE) == 0) {
-        bluetooth_printf("Version: %s\n", FIRMWARE_STRING);
-        return;
-    }
-
-    bluetooth_printf("Unknown command\n");
+    async_context_release_lock(cyw43_arch_async_context());
 }
 
-void process_received_message(uint8_t *packet, uint16_t size) {
-    if (!rfcomm_user_has_authenticated) {
-        process_authenticate_packet(packet, size);
+static void receive_data(const uint8_t *data, uint16_t size) {
+    // Nothing more is taken until the console task has caught up, so it knows where the gap is
+    if (receive_overflow || size > RECEIVE_RING_SIZE - (receive_head - receive_tail)) {
+        receive_overflow = true;
+        event_loop_post(EVENT_CONSOLE);
         return;
     }
 
-    process_received_command(packet, size);
+    for (uint16_t i = 0; i < size; i++) {
+        receive_ring[receive_head++ & (RECEIVE_RING_SIZE - 1)] = data[i];
+    }
+    event_loop_post(EVENT_CONSOLE);
 }
 
 
@@ -396,6 +418,7 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
                     } else {
                         rfcomm_channel_id = rfcomm_event_channel_opened_get_rfcomm_cid(packet);
                         mtu = rfcomm_event_channel_opened_get_max_frame_size(packet);
+                        rfcomm_max_frame_size = mtu;
                         printf("RFCOMM channel open succeeded. New RFCOMM Channel ID %u, max frame size %u\n",
                                rfcomm_channel_id, mtu);
                     }
@@ -409,6 +432,13 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
                     printf("RFCOMM channel closed\n");
                     rfcomm_channel_id = 0;
                     rfcomm_user_has_authenticated = false;
+                    receive_tail = receive_head;
+                    receive_overflow = false;
+                    line_size = 0;
+                    line_discarded = false;
+                    // Nothing more will be sent, the main loop empties the ring before it writes again
+                    send_reset_pending = true;
+                    send_requested = false;
                     break;
 
                 default:
@@ -417,7 +447,7 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
             break;
 
         case RFCOMM_DATA_PACKET:
-            process_received_message(packet, size);
+            receive_data(packet, size);
             break;
 
         default:
@@ -427,25 +457,11 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
 
 
 
-static void rfcomm_send_now_timer_handler(btstack_timer_source_t *ts) {
-
-    for (int i = 0; i < SEND_QUEUE_SIZE; ++i) {
-        if (send_queue[i].status == SEND_MESSAGE_SEND) {
-            rfcomm_request_can_send_now_event(rfcomm_channel_id);
-            break;
-        }
-    }
-
-    if (rfcomm_channel_id) {
-        btstack_run_loop_set_timer(ts, RFCOMM_SEND_TIMER_PERIOD_MS);
-        btstack_run_loop_add_timer(ts);
-    }
-}
-
-
 int btstack_init() {
 
+    console_init();
     spp_service_setup();
+    ble_occupancy_init();
 
     gap_discoverable_control(1);
     gap_ssp_set_io_capability(SSP_IO_CAPABILITY_DISPLAY_YES_NO);
@@ -454,8 +470,5 @@ int btstack_init() {
     // turn on!
     hci_power_control(HCI_POWER_ON);
 
-    btstack_run_loop_set_timer_handler(&rfcomm_send_timer, rfcomm_send_now_timer_handler);
-
-
     return 0;
 }
@@ -0,0 +1,330 @@
+#define LOG_MODULE LOG_MODULE_STORAGE
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flash_storage.h"
+#include "multi_printf.h"
+#include "occupancy_estimator.h"
+#include "reporting.h"
+#include "sensor_controller.h"
+
+#define CONFIG_DEFAULT_REPORT_INTERVAL_MS 60000
+#define CONFIG_DEFAULT_PIR_TIMEOUT_MS 90000
+#define CONFIG_DEFAULT_RADAR_RESET_TIMEOUT_MS 60000
+#define CONFIG_DEFAULT_RADAR_SENSITIVITY_PERCENT 100
+
+_Static_assert(sizeof(REPORTING_SERVER) <= CONFIG_STRING_LEN, "REPORTING_SERVER is too long for the config");
+_Static_assert(sizeof(REPORTING_PATH) <= CONFIG_STRING_LEN, "REPORTING_PATH is too long for the config");
+
+// In flash the settings that differ from the defaults are stored as
+//   uint8 id, uint8 length, the value
+// one after the other, numbers little endian. Settings the firmware does not know are skipped when loading, so
+// settings can be added and removed without losing the others
+
+typedef enum {
+    SETTING_UINT,
+    SETTING_STRING,
+} setting_type_t;
+
+typedef struct {
+    const char *key;
+    uint8_t id;           // Identifies the setting in flash, an id is never reused
+    setting_type_t type;
+    size_t offset;        // Of the value in config_t
+    uint32_t min;         // Range of a number
+    uint32_t max;
+    bool (*is_valid)(const char *value); // Checks a string
+    void (*apply)();      // Called when the setting changed, NULL for settings that are read from config every time
+    bool directive;       // May be changed by the reporting server in its response to a report
+} setting_t;
+
+static const config_t defaults = {
+        .report_interval_ms = CONFIG_DEFAULT_REPORT_INTERVAL_MS,
+        .pir_timeout_ms = CONFIG_DEFAULT_PIR_TIMEOUT_MS,
+        .count_window_ms = OCCUPANCY_TIME_CONSTANT_MS,
+        .radar_reset_timeout_ms = CONFIG_DEFAULT_RADAR_RESET_TIMEOUT_MS,
+        .radar_sensitivity_percent = CONFIG_DEFAULT_RADAR_SENSITIVITY_PERCENT,
+        .send_raw_stats = 0,
+        .reporting_server = REPORTING_SERVER,
+        .reporting_path = REPORTING_PATH,
+};
+
+config_t config;
+
+static bool is_hostname(const char *value) {
+    for (const char *c = value; *c; c++) {
+        if (!(*c >= 'a' && *c <= 'z') && !(*c >= 'A' && *c <= 'Z') && !(*c >= '0' && *c <= '9') && *c != '-' &&
+            *c != '.') {
+            return false;
+        }
+    }
+    return *value != '\0';
+}
+
+// Goes into the request line as it is, so no spaces or line breaks
+static bool is_path(const char *value) {
+    for (const char *c = value; *c; c++) {
+        if (*c <= ' ' || *c > '~') {
+            return false;
+        }
+    }
+    return *value == '/';
+}
+
+// In the order AT+CONFIG lists them
+static const setting_t settings[] = {
+        {"COUNT-WINDOW-MS", 3, SETTING_UINT, offsetof(config_t, count_window_ms), 1000, 600000, NULL,
+         sensor_controller_apply_count_window, false},
+        {"PIR-TIMEOUT-MS", 2, SETTING_UINT, offsetof(config_t, pir_timeout_ms), 1000, 3600000, NULL, NULL, false},
+        {"RADAR-RESET-TIMEOUT-MS", 4, SETTING_UINT, offsetof(config_t, radar_reset_timeout_ms), 10000, 3600000, NULL,
+         NULL, false},
+        {"RADAR-SENSITIVITY", 7, SETTING_UINT, offsetof(config_t, radar_sensitivity_percent), 10, 400, NULL, NULL,
+         true},
+        {"REPORT-INTERVAL-MS", 1, SETTING_UINT, offsetof(config_t, report_interval_ms), 10000, 3600000, NULL,
+         sensor_controller_apply_report_interval, true},
+        {"REPORTING-PATH", 6, SETTING_STRING, offsetof(config_t, reporting_path), 0, 0, is_path, NULL, false},
+        {"REPORTING-SERVER", 5, SETTING_STRING, offsetof(config_t, reporting_server), 0, 0, is_hostname,
+         reporting_apply_server, false},
+        {"SEND-RAW-STATS", 8, SETTING_UINT, offsetof(config_t, send_raw_stats), 0, 1, NULL, NULL, true},
+};
+
+#define SETTING_COUNT (sizeof(settings) / sizeof(settings[0]))
+
+static void *setting_value(const config_t *values, const setting_t *setting) {
+    return (uint8_t *) values + setting->offset;
+}
+
+static bool setting_equals(const setting_t *setting, const config_t *a, const config_t *b) {
+    if (setting->type == SETTING_UINT) {
+        return *(uint32_t *) setting_value(a, setting) == *(uint32_t *) setting_value(b, setting);
+    }
+    return strcmp(setting_value(a, setting), setting_value(b, setting)) == 0;
+}
+
+static bool setting_is_default(const setting_t *setting) {
+    return setting_equals(setting, &config, &defaults);
+}
+
+/**
+ * @brief Check a value and put it into config
+ * @param setting The setting
+ * @param value The value, a number as uint32_t or a terminated string
+ * @return False if the value is out of range
+ */
+static bool store_value(const setting_t *setting, const void *value) {
+    if (setting->type == SETTING_UINT) {
+        uint32_t number = *(const uint32_t *) value;
+        if (number < setting->min || number > setting->max) {
+            return false;
+        }
+        *(uint32_t *) setting_value(&config, setting) = number;
+    } else {
+        if (strlen(value) >= CONFIG_STRING_LEN || !setting->is_valid(value)) {
+            return false;
+        }
+        strcpy(setting_value(&config, setting), value);
+    }
+    return true;
+}
+
+/**
+ * @brief Put the settings that differ from the defaults into a flash record
+ * @param record Filled with the record
+ * @return Length of the record
+ */
+static size_t serialize(uint8_t *record) {
+    size_t len = 0;
+    for (uint8_t i = 0; i < SETTING_COUNT; i++) {
+        const setting_t *setting = &settings[i];
+        if (setting_is_default(setting)) {
+            continue;
+        }
+
+        uint8_t value_len = setting->type == SETTING_UINT ? sizeof(uint32_t) : strlen(setting_value(&config, setting));
+        record[len++] = setting->id;
+        record[len++] = value_len;
+        memcpy(record + len, setting_value(&config, setting), value_len);
+        len += value_len;
+    }
+    return len;
+}
+
+static void deserialize(const uint8_t *record, size_t len) {
+    size_t pos = 0;
+    while (pos + 2 <= len && pos + 2 + record[pos + 1] <= len) {
+        uint8_t id = record[pos];
+        uint8_t value_len = record[pos + 1];
+        const uint8_t *value = record + pos + 2;
+        pos += 2 + value_len;
+
+        const setting_t *setting = NULL;
+        for (uint8_t i = 0; i < SETTING_COUNT; i++) {
+            if (settings[i].id == id) {
+                setting = &settings[i];
+                break;
+            }
+        }
+        if (!setting) {
+            continue;
+        }
+
+        bool valid = false;
+        if (setting->type == SETTING_UINT && value_len == sizeof(uint32_t)) {
+            uint32_t number;
+            memcpy(&number, value, sizeof(number));
+            valid = store_value(setting, &number);
+        } else if (setting->type == SETTING_STRING && value_len < CONFIG_STRING_LEN) {
+            char text[CONFIG_STRING_LEN];
+            memcpy(text, value, value_len);
+            text[value_len] = '\0';
+            valid = store_value(setting, text);
+        }
+
+        if (!valid) {
+            LOG_WARN("Stored value of %s is invalid, using the default\n", setting->key);
+        }
+    }
+}
+
+/**
+ * Load the settings stored in flash over the built in defaults. Must be called before the other modules are
+ * initialized, they take their settings from config
+ */
+void config_init() {
+    config = defaults;
+
+    uint8_t record[FLASH_STORAGE_LOG_MAX_LEN];
+    size_t len = flash_storage_log_read(FLASH_STORAGE_CONFIG_OFFSET, record, sizeof(record));
+    deserialize(record, len);
+
+    uint8_t changed = 0;
+    for (uint8_t i = 0; i < SETTING_COUNT; i++) {
+        changed += !setting_is_default(&settings[i]);
+    }
+    multi_printf("Loaded the config, %u settings differ from the defaults\n", changed);
+}
+
+static const setting_t *find_setting(const char *key) {
+    for (uint8_t i = 0; i < SETTING_COUNT; i++) {
+        if (strcmp(settings[i].key, key) == 0) {
+            return &settings[i];
+        }
+    }
+    return NULL;
+}
+
+static config_result_t set_value(const setting_t *setting, const char *value) {
+    bool valid;
+    bool changed;
+    if (setting->type == SETTING_UINT) {
+        char *end;
+        uint32_t number = strtoul(value, &end, 10);
+        changed = number != *(uint32_t *) setting_value(&config, setting);
+        valid = *value != '\0' && *end == '\0' && store_value(setting, &number);
+    } else {
+        changed = strcmp(value, setting_value(&config, setting)) != 0;
+        valid = store_value(setting, value);
+    }
+
+    if (!valid) {
+        return CONFIG_INVALID_VALUE;
+    }
+    if (changed && setting->apply) {
+        setting->apply();
+    }
+    return CONFIG_OK;
+}
+
+/**
+ * @brief Change a setting and apply it straight away. It is not stored until config_save() is called.
+ * Must be called from the main loop
+ * @param key The name of the setting
+ * @param value The new value as text
+ * @return CONFIG_OK if the setting was changed
+ */
+config_result_t config_set(const char *key, const char *value) {
+    const setting_t *setting = find_setting(key);
+    if (!setting) {
+        return CONFIG_UNKNOWN_KEY;
+    }
+    return set_value(setting, value);
+}
+
+/**
+ * @brief Change a setting on behalf of the reporting server, like config_set(). Only the settings meant for tuning
+ * the sensor from the server can be changed this way, the others are reported as unknown
+ * @param key The name of the setting
+ * @param value The new value as text
+ * @return CONFIG_OK if the setting was changed
+ */
+config_result_t config_set_directive(const char *key, const char *value) {
+    const setting_t *setting = find_setting(key);
+    if (!setting || !setting->directive) {
+        return CONFIG_UNKNOWN_KEY;
+    }
+    return set_value(setting, value);
+}
+
+/**
+ * @brief Store the settings in flash, so they survive a reset. Does nothing if they did not change since they
+ * were last stored
+ * @return True if the settings are stored
+ */
+bool config_save() {
+    uint8_t record[FLASH_STORAGE_LOG_MAX_LEN];
+    uint8_t stored[FLASH_STORAGE_LOG_MAX_LEN];
+    size_t len = serialize(record);
+    size_t stored_len = flash_storage_log_read(FLASH_STORAGE_CONFIG_OFFSET, stored, sizeof(stored));
+
+    if (len == stored_len && memcmp(record, stored, len) == 0) {
+        return true;
+    }
+
+    if (!flash_storage_log_write(FLASH_STORAGE_CONFIG_OFFSET, record, len)) {
+        LOG_ERROR("Failed to store the config\n");
+        return false;
+    }
+    LOG_INFO("Config stored\n");
+    return true;
+}
+
+/**
+ * @brief Go back to the built in defaults, in effect straight away and stored
+ * @return True if the defaults are stored
+ */
+bool config_reset() {
+    config_t previous = config;
+    config = defaults;
+
+    for (uint8_t i = 0; i < SETTING_COUNT; i++) {
+        if (!setting_equals(&settings[i], &previous, &config) && settings[i].apply) {
+            settings[i].apply();
+        }
+    }
+
+    return config_save();
+}
+
+/**
+ * @brief Get a setting, for listing them all
+ * @param index Index of the setting
+ * @param value Filled with the value as text
+ * @param size Size of the value buffer
+ * @return The name of the setting, NULL if there is no setting with that index
+ */
+const char *config_get(uint8_t index, char *value, size_t size) {
+    if (index >= SETTING_COUNT) {
+        return NULL;
+    }
+
+    const setting_t *setting = &settings[index];
+    if (setting->type == SETTING_UINT) {
+        snprintf(value, size, "%lu", *(uint32_t *) setting_value(&config, setting));
+    } else {
+        snprintf(value, size, "%s", (const char *) setting_value(&config, setting));
+    }
+    return setting->key;
+}
@@ -0,0 +1,415 @@
+#define LOG_MODULE LOG_MODULE_BLUETOOTH
+
+#include "console.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bluetooth_spp.h"
+#include "config.h"
+#include "event_loop.h"
+#include "isr_benchmark.h"
+#include "latency.h"
+#include "multi_printf.h"
+#include "ota.h"
+#include "pico/platform.h"
+#include "profiler.h"
+#include "radar_mirror.h"
+#include "reset.h"
+#include "version.h"
+#include "wifi_manager.h"
+
+#ifdef USE_NEW_MINEW_RADAR
+
+#include "minewsemi_radar.h"
+#include "radar_stream.h"
+
+#endif
+
+#define COMMAND_PREFIX "AT+"
+#define COMMAND_PREFIX_SIZE (sizeof(COMMAND_PREFIX) - 1)
+
+static bool parse_uint(const char *text, uint32_t *value) {
+    char *end;
+    *value = strtoul(text, &end, 10);
+    return *text != '\0' && *end == '\0';
+}
+
+static void command_bench_isr(uint8_t argc, char *argv[]) {
+    uint32_t seconds;
+    if (!parse_uint(argv[0], &seconds) || !isr_benchmark_start(seconds)) {
+        bluetooth_printf("Usage: AT+BENCH-ISR=<1-%u s>, one benchmark at a time\n", ISR_BENCHMARK_MAX_SECONDS);
+    }
+}
+
+/**
+ * Handle AT+CONFIG, and AT+CONFIG=<key>,<value> which also stores the settings
+ */
+static void command_config(uint8_t argc, char *argv[]) {
+    if (argc == 0) {
+        char value[CONFIG_STRING_LEN];
+        const char *key;
+        for (uint8_t i = 0; (key = config_get(i, value, sizeof(value))); i++) {
+            bluetooth_printf("%s=%s\n", key, value);
+        }
+        return;
+    }
+
+    if (argc != 2) {
+        bluetooth_printf("Usage: AT+CONFIG=<key>,<value>\n");
+        return;
+    }
+
+    switch (config_set(argv[0], argv[1])) {
+        case CONFIG_OK:
+            bluetooth_printf("%s set to %s%s\n", argv[0], argv[1], config_save() ? "" : ", storing it failed");
+            break;
+        case CONFIG_UNKNOWN_KEY:
+            bluetooth_printf("Unknown setting, AT+CONFIG lists them\n");
+            break;
+        case CONFIG_INVALID_VALUE:
+            bluetooth_printf("Invalid value for %s\n", argv[0]);
+            break;
+    }
+}
+
+static void command_config_reset(uint8_t argc, char *argv[]) {
+    bluetooth_printf(config_reset() ? "Settings reset to the defaults\n" : "Failed to store the defaults\n");
+}
+
+static void command_help(uint8_t argc, char *argv[]);
+
+/**
+ * Handle AT+LATENCY, prints the summary and the non-empty buckets of every probe
+ */
+static void command_latency(uint8_t argc, char *argv[]) {
+    latency_histogram_t histogram;
+    // Room for every bucket with the largest limit and count
+    char buckets[LATENCY_BUCKET_COUNT * sizeof(" 8388608:4294967295")];
+
+    for (latency_probe_t probe = 0; probe < LATENCY_PROBE_COUNT; probe++) {
+        latency_get(probe, &histogram);
+
+        // Bucket n holds the durations under 2^n µs, listed as <limit>:<count>
+        int len = 0;
+        buckets[0] = 0;
+        for (uint8_t bucket = 0; bucket < LATENCY_BUCKET_COUNT && len < sizeof(buckets); bucket++) {
+            if (histogram.buckets[bucket]) {
+                len += snprintf(buckets + len, sizeof(buckets) - len, " %lu:%lu", 1ul << bucket,
+                                histogram.buckets[bucket]);
+            }
+        }
+
+        bluetooth_printf("%s: count %lu, avg %lu us, p50 %lu us, p99 %lu us, max %lu us, buckets%s\n",
+                         latency_probe_name(probe), histogram.count,
+                         histogram.count ? (uint32_t) (histogram.total_us / histogram.count) : 0,
+                         latency_percentile_us(&histogram, 500), latency_percentile_us(&histogram, 990),
+                         histogram.max_us, buckets);
+    }
+}
+
+/**
+ * Handle AT+LOG-CONSOLE, and AT+LOG-CONSOLE=<ON|OFF>
+ */
+static void command_log_console(uint8_t argc, char *argv[]) {
+    if (argc == 0) {
+        bluetooth_printf("Console log output: %s\n", multi_printf_is_console() ? "ON" : "OFF");
+    } else if (strcmp(argv[0], "ON") == 0) {
+        multi_printf_set_console(true);
+    } else if (strcmp(argv[0], "OFF") == 0) {
+        multi_printf_set_console(false);
+    } else {
+        bluetooth_printf("Usage: AT+LOG-CONSOLE=<ON|OFF>\n");
+    }
+}
+
+static void command_log_format(uint8_t argc, char *argv[]) {
+    if (strcmp(argv[0], "TEXT") == 0) {
+        multi_printf_set_tokenized(false);
+    } else if (strcmp(argv[0], "BINARY") == 0) {
+        multi_printf_set_tokenized(true);
+    } else {
+        bluetooth_printf("Unknown log format, use TEXT or BINARY\n");
+    }
+}
+
+/**
+ * Handle AT+LOG-LEVEL, and AT+LOG-LEVEL=<module>,<level> where module is a module name or ALL
+ */
+static void command_log_level(uint8_t argc, char *argv[]) {
+    if (argc == 0) {
+        for (uint8_t module = 0; module < LOG_MODULE_COUNT; module++) {
+            bluetooth_printf("%s=%s\n", multi_printf_module_name(module), multi_printf_level_name(log_levels[module]));
+        }
+        return;
+    }
+
+    if (argc != 2) {
+        bluetooth_printf("Usage: AT+LOG-LEVEL=<module|ALL>,<ERROR|WARN|INFO|DEBUG>\n");
+        return;
+    }
+
+    log_module_t module;
+    for (module = 0; module <= LOG_MODULE_COUNT; module++) {
+        if (strcmp(multi_printf_module_name(module), argv[0]) == 0) break;
+    }
+
+    log_level_t level;
+    for (level = LOG_LEVEL_ERROR; level <= LOG_LEVEL_DEBUG; level++) {
+        if (strcmp(multi_printf_level_name(level), argv[1]) == 0) break;
+    }
+
+    if (module > LOG_MODULE_COUNT || level > LOG_LEVEL_DEBUG) {
+        bluetooth_printf("Unknown log module or level\n");
+        return;
+    }
+
+    multi_printf_set_level(module, level);
+    bluetooth_printf("Log level of %s set to %s\n", multi_printf_module_name(module), multi_printf_level_name(level));
+}
+
+#ifdef USE_NEW_MINEW_RADAR
+
+static void command_minew_command(uint8_t argc, char *argv[]) {
+    multi_printf("Queueing command for Minew radar\n");
+    if (!minewsemi_request_send_message((uint8_t *) argv[0], strlen(argv[0]))) {
+        multi_printf("Failed to send message\n");
+    }
+}
+
+static void command_minew_reset(uint8_t argc, char *argv[]) {
+    multi_printf("Resetting Minew radar\n");
+    minewsemi_request_reset_on_next_tick();
+}
+
+static void command_minew_stream(uint8_t argc, char *argv[]) {
+    if (strcmp(argv[0], "ON") == 0) {
+        radar_stream_set_enabled(true);
+    } else if (strcmp(argv[0], "OFF") == 0) {
+        radar_stream_set_enabled(false);
+    } else {
+        bluetooth_printf("Usage: AT+MINEW-STREAM=<ON|OFF>\n");
+    }
+}
+
+static void command_minew_study(uint8_t argc, char *argv[]) {
+    multi_printf("Starting Minew radar calibration\n");
+    minewsemi_start_studying();
+}
+
+#endif
+
+static void command_pico_reset(uint8_t argc, char *argv[]) {
+    multi_printf("Setting reset Pico request flag!\n");
+    request_pico_reset(RESET_REASON_CONSOLE);
+}
+
+static void command_pico_version(uint8_t argc, char *argv[]) {
+    bluetooth_printf("Version: %s\n", FIRMWARE_STRING);
+}
+
+static void command_profile_dump(uint8_t argc, char *argv[]) {
+    profiler_dump_start();
+}
+
+static void command_profile_start(uint8_t argc, char *argv[]) {
+    uint32_t rate_hz;
+    if (!parse_uint(argv[0], &rate_hz) || !profiler_start(rate_hz)) {
+        bluetooth_printf("Usage: AT+PROFILE-START=<1-%u Hz>\n", PROFILER_MAX_RATE_HZ);
+    }
+}
+
+static void command_profile_stop(uint8_t argc, char *argv[]) {
+    profiler_stop();
+    bluetooth_printf("Profiler stopped with %lu samples\n", profiler_get_sample_count());
+}
+
+/**
+ * Handle AT+OTA, and AT+OTA=<path>
+ */
+static void command_ota(uint8_t argc, char *argv[]) {
+    if (argc == 0) {
+        ota_status_t status;
+        ota_get_status(&status);
+        bluetooth_printf("Firmware: %s, state: %s, last update: %s %s, patch %lu bytes, image %lu bytes\n",
+                         FIRMWARE_STRING, ota_state_name(status.state), ota_result_name(status.last_result),
+                         status.last_path[0] ? status.last_path : "-", status.patch_bytes, status.image_bytes);
+        return;
+    }
+
+    if (!ota_request(argv[0], true)) {
+        bluetooth_printf("Usage: AT+OTA=<path>, not while an update is on trial or in progress\n");
+        return;
+    }
+    bluetooth_printf("Updating from %s, the sensor resets once the update is written\n", argv[0]);
+}
+
+/**
+ * Handle AT+RADAR-MIRROR, and AT+RADAR-MIRROR=<ip[:port]|OFF>
+ */
+static void command_radar_mirror(uint8_t argc, char *argv[]) {
+    if (argc == 0) {
+        char collector[32];
+        radar_mirror_stats_t stats;
+        radar_mirror_get_collector(collector, sizeof(collector));
+        radar_mirror_get_stats(&stats);
+        bluetooth_printf("Collector: %s, sent %lu, dropped %lu, too long %lu, send errors %lu\n",
+                         collector[0] ? collector : "off", stats.sent, stats.dropped, stats.too_long, stats.send_errors);
+        return;
+    }
+
+    if (strcmp(argv[0], "OFF") == 0) {
+        radar_mirror_set_collector(NULL);
+        bluetooth_printf("Radar mirror off\n");
+        return;
+    }
+
+    if (!radar_mirror_set_collector(argv[0])) {
+        bluetooth_printf("Usage: AT+RADAR-MIRROR=<ip[:port]|OFF>\n");
+        return;
+    }
+    bluetooth_printf("Mirroring raw radar frames to %s\n", argv[0]);
+}
+
+static void command_tasks(uint8_t argc, char *argv[]) {
+    event_loop_task_stats_t stats;
+    for (uint8_t i = 0; event_loop_get_task_stats(i, &stats); i++) {
+        bluetooth_printf("%s: runs %lu, avg %lu us, max %lu us, deadline misses %lu\n", stats.name, stats.runs,
+                         stats.runs ? (uint32_t) (stats.total_runtime_us / stats.runs) : 0,
+                         stats.max_runtime_us, stats.deadline_misses);
+    }
+}
+
+static void command_wifi_status(uint8_t argc, char *argv[]) {
+    bluetooth_printf("Wifi connected: %d, RSSI: %ld dBm, Disconnects: %lu, Last disconnect reason: %d\n",
+                     wifi_manager_is_connected(), wifi_manager_get_rssi(), wifi_manager_get_disconnect_count(),
+                     wifi_manager_get_last_disconnect_reason());
+}
+
+// Sorted by name, a command is found with a binary search. console_init() checks the order
+static const console_command_t commands[] = {
+        {"BENCH-ISR", "<seconds>", "Clear the latency histograms and measure the interrupt latency for a while", 1, 1, command_bench_isr},
+        {"CONFIG", "<key>,<value>", "Show the settings, or change one and store it", 0, 2, command_config},
+        {"CONFIG-RESET", NULL, "Reset the settings to the defaults", 0, 0, command_config_reset},
+        {"HELP", NULL, "List the commands", 0, 0, command_help},
+        {"LATENCY", NULL, "Show the latency histograms", 0, 0, command_latency},
+        {"LOG-CONSOLE", "<ON|OFF>", "Show or switch the log output on the USB/UART console", 0, 1, command_log_console},
+        {"LOG-FORMAT", "<TEXT|BINARY>", "Switch the Bluetooth output between text and the binary tokenized format", 1, 1, command_log_format},
+        {"LOG-LEVEL", "<module|ALL>,<ERROR|WARN|INFO|DEBUG>", "Show the log levels, or set the level of a module", 0, 2, command_log_level},
+#ifdef USE_NEW_MINEW_RADAR
+        {"MINEW-COMMAND", "<AT+xxx>", "Send a command to the Minew radar", 1, 1, command_minew_command},
+        {"MINEW-RESET", NULL, "Reset the Minew radar", 0, 0, command_minew_reset},
+        {"MINEW-STREAM", "<ON|OFF>", "Stream the decoded radar frames", 1, 1, command_minew_stream},
+        {"MINEW-STUDY", NULL, "Start the study/calibration mode of the Minew radar", 0, 0, command_minew_study},
+#endif
+        {"OTA", "<path>", "Show the update status, or update from a patch on the reporting server", 0, 1, command_ota},
+        {"PICO-RESET", NULL, "Reset the sensor", 0, 0, command_pico_reset},
+        {"PICO-VERSION", NULL, "Show the firmware version", 0, 0, command_pico_version},
+        {"PROFILE-DUMP", NULL, "Send the profiler samples", 0, 0, command_profile_dump},
+        {"PROFILE-START", "<Hz>", "Start the sampling profiler", 1, 1, command_profile_start},
+        {"PROFILE-STOP", NULL, "Stop the sampling profiler", 0, 0, command_profile_stop},
+        {"RADAR-MIRROR", "<ip[:port]|OFF>", "Show or set where the raw radar frames are mirrored to", 0, 1, command_radar_mirror},
+        {"TASKS", NULL, "Show the runtime statistics of the main loop tasks", 0, 0, command_tasks},
+        {"WIFI-STATUS", NULL, "Show the wifi link status", 0, 0, command_wifi_status},
+};
+
+#define COMMAND_COUNT (sizeof(commands) / sizeof(commands[0]))
+
+// AT+NAME, AT+NAME=<args> or, if the arguments are optional, AT+NAME[=<args>]
+static void format_syntax(const console_command_t *command, char *buf, size_t size) {
+    if (!command->usage) {
+        snprintf(buf, size, COMMAND_PREFIX"%s", command->name);
+    } else if (command->min_args == 0) {
+        snprintf(buf, size, COMMAND_PREFIX"%s[=%s]", command->name, command->usage);
+    } else {
+        snprintf(buf, size, COMMAND_PREFIX"%s=%s", command->name, command->usage);
+    }
+}
+
+static void command_help(uint8_t argc, char *argv[]) {
+    char syntax[80];
+    for (uint8_t i = 0; i < COMMAND_COUNT; i++) {
+        format_syntax(&commands[i], syntax, sizeof(syntax));
+        bluetooth_printf("%s - %s\n", syntax, commands[i].help);
+    }
+}
+
+static void print_usage(const console_command_t *command) {
+    char syntax[80];
+    format_syntax(command, syntax, sizeof(syntax));
+    bluetooth_printf("Usage: %s\n", syntax);
+}
+
+static const console_command_t *find_command(const char *name) {
+    uint8_t low = 0;
+    uint8_t high = COMMAND_COUNT;
+
+    while (low < high) {
+        uint8_t middle = (low + high) / 2;
+        int order = strcmp(name, commands[middle].name);
+        if (order == 0) {
+            return &commands[middle];
+        }
+        if (order < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Check the command table, must be called once before the first command is executed. Stops the firmware if the
+ * table is not sorted, so a command added in the wrong place shows on the first boot rather than going missing
+ */
+void console_init() {
+    for (uint8_t i = 1; i < COMMAND_COUNT; i++) {
+        if (strcmp(commands[i - 1].name, commands[i].name) >= 0) {
+            // A command after this one could not be found
+            panic("Console command %s is out of order\n", commands[i].name);
+        }
+    }
+}
+
+/**
+ * @brief Execute a console command line. Must be called from the main loop
+ * @param line The line without its line ending, split into arguments in place
+ */
+void console_execute(char *line) {
+    if (strncmp(line, COMMAND_PREFIX, COMMAND_PREFIX_SIZE) != 0) {
+        bluetooth_printf("Invalid command, commands start with "COMMAND_PREFIX"\n");
+        return;
+    }
+
+    char *name = line + COMMAND_PREFIX_SIZE;
+    char *args = strchr(name, '=');
+    if (args) {
+        *args++ = '\0';
+    }
+
+    const console_command_t *command = find_command(name);
+    if (!command) {
+        bluetooth_printf("Unknown command, "COMMAND_PREFIX"HELP lists them\n");
+        return;
+    }
+
+    // The last argument the command takes gets the rest of the line, so it can hold commas
+    uint8_t argc = 0;
+    char *argv[CONSOLE_MAX_ARGS];
+    while (args && argc < command->max_args) {
+        argv[argc++] = args;
+        args = argc < command->max_args ? strchr(args, ',') : NULL;
+        if (args) {
+            *args++ = '\0';
+        }
+    }
+
+    if (args || argc < command->min_args) {
+        print_usage(command);
+        return;
+    }
+
+    command->handler(argc, argv);
+}
@@ -0,0 +1,381 @@
+#define LOG_MODULE LOG_MODULE_NET
+
+#include "dns_cache.h"
+#include <string.h>
+
+#include "latency.h"
+#include "lwip/dns.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+#include "multi_printf.h"
+#include "pico/cyw43_arch.h"
+#include "pico/rand.h"
+#include "pico/time.h"
+
+// The address is refreshed in the background with a query of our own, so a report can always use the address we
+// already have while a refresh is in flight. lwIP's resolver keeps the TTL of an answer to itself and only asks
+// the network again once it has run out, the own query sees the TTL and refreshes shortly before that
+#define DNS_CACHE_SERVER_PORT 53
+#define DNS_CACHE_QUERY_TIMEOUT_MS 5000
+// Refresh this long before the TTL runs out, or at half the TTL if that is shorter
+#define DNS_CACHE_REFRESH_MARGIN_S 30
+// Retry interval after a failed refresh
+#define DNS_CACHE_REFRESH_INTERVAL_MS 30000
+// Shortest interval between refreshes, for answers with a TTL of a few seconds or none
+#define DNS_CACHE_MIN_REFRESH_INTERVAL_MS 10000
+
+#define DNS_HEADER_LEN 12
+#define DNS_TYPE_A 1
+#define DNS_CLASS_IN 1
+// Longest answer over UDP without EDNS
+#define DNS_MAX_MESSAGE_LEN 512
+
+static const char *cached_hostname = NULL;
+static ip_addr_t cached_addr;
+static bool cached_addr_valid = false;
+static ip_addr_t fallback_addr;
+static bool fallback_addr_valid = false;
+
+static struct udp_pcb *pcb = NULL;
+static volatile bool refresh_in_progress = false;
+// Set from lwIP callbacks when the cached address failed, the tick starts a refresh
+static volatile bool refresh_requested = false;
+static uint64_t next_refresh_time = 0;
+static uint64_t query_deadline = 0;
+static uint32_t refresh_start = 0;
+static uint16_t query_id = 0;
+// Set by the lwIP callback, the refresh is finished by the tick
+static volatile bool answer_received = false;
+static volatile uint32_t answer_ttl_s = 0;
+
+// Only one query is in flight, the answer is copied here in the lwIP callback
+static uint8_t message[DNS_MAX_MESSAGE_LEN];
+
+static uint32_t get_uint(const uint8_t *in, uint8_t len) {
+    uint32_t value = 0;
+    while (len--) {
+        value = value << 8 | *in++;
+    }
+    return value;
+}
+
+/**
+ * @brief Skip a name in a DNS message
+ * @param offset Offset of the name
+ * @param len Length of the message
+ * @return Offset after the name, or len if the message ends before it does
+ */
+static uint16_t skip_name(uint16_t offset, uint16_t len) {
+    while (offset < len) {
+        uint8_t label_len = message[offset];
+        if (label_len == 0) {
+            return offset + 1;
+        }
+        if ((label_len & 0xc0) == 0xc0) {
+            // A pointer to the rest of the name elsewhere ends it here
+            return offset + 2 <= len ? offset + 2 : len;
+        }
+        offset += 1 + label_len;
+    }
+    return len;
+}
+
+/**
+ * @brief Find the address and its TTL in the answer to a query
+ * @param len Length of the answer in message
+ * @param addr Filled with the address
+ * @param ttl_s Filled with the shortest TTL on the way to the address, CNAME records included
+ * @return False if the answer has no address
+ */
+static bool parse_answer(uint16_t len, ip_addr_t *addr, uint32_t *ttl_s) {
+    uint16_t flags = get_uint(message + 2, 2);
+    // A response, to our query, without an error
+    if (len < DNS_HEADER_LEN || get_uint(message, 2) != query_id || !(flags & 0x8000) || (flags & 0x000f)) {
+        return false;
+    }
+
+    uint16_t questions = get_uint(message + 4, 2);
+    uint16_t answers = get_uint(message + 6, 2);
+    uint16_t offset = DNS_HEADER_LEN;
+    while (questions--) {
+        offset = skip_name(offset, len) + 4;
+    }
+
+    *ttl_s = UINT32_MAX;
+    while (answers-- && offset < len) {
+        offset = skip_name(offset, len);
+        if (offset + 10 > len) {
+            return false;
+        }
+        uint16_t type = get_uint(message + offset, 2);
+        uint16_t class = get_uint(message + offset + 2, 2);
+        uint32_t ttl = get_uint(message + offset + 4, 4);
+        uint16_t data_len = get_uint(message + offset + 8, 2);
+        offset += 10;
+        if (offset + data_len > len) {
+            return false;
+        }
+
+        if (ttl < *ttl_s) {
+            *ttl_s = ttl;
+        }
+        if (type == DNS_TYPE_A && class == DNS_CLASS_IN && data_len == 4) {
+            ip_addr_set_ip4_u32(addr, lwip_htonl(get_uint(message + offset, 4)));
+            return true;
+        }
+        offset += data_len;
+    }
+    return false;
+}
+
+static void dns_cache_recv(void *arg, struct udp_pcb *udp, struct pbuf *p, const ip_addr_t *addr, u16_t port) {
+    if (!refresh_in_progress || answer_received || port != DNS_CACHE_SERVER_PORT ||
+        !ip_addr_cmp(addr, dns_getserver(0))) {
+        pbuf_free(p);
+        return;
+    }
+
+    uint16_t len = pbuf_copy_partial(p, message, sizeof(message), 0);
+    pbuf_free(p);
+
+    ip_addr_t resolved;
+    uint32_t ttl_s;
+    if (!parse_answer(len, &resolved, &ttl_s)) {
+        // Not the answer or no address in it, the query times out if no better one comes
+        return;
+    }
+
+    latency_end(LATENCY_DNS, refresh_start);
+    dns_cache_store(cached_hostname, &resolved);
+    answer_ttl_s = ttl_s;
+    answer_received = true;
+}
+
+/**
+ * @brief Write a query for the A record of the cached host
+ * @param out Where to write the query
+ * @param size Size of out
+ * @return Length of the query, 0 if it does not fit or the hostname is not a valid name
+ */
+static uint16_t write_query(uint8_t *out, uint16_t size) {
+    // The labels take one length byte more than the hostname, then the empty label, the type and the class
+    size_t len = DNS_HEADER_LEN + strlen(cached_hostname) + 2 + 4;
+    if (len > size) {
+        return 0;
+    }
+
+    memset(out, 0, DNS_HEADER_LEN);
+    out[0] = query_id >> 8;
+    out[1] = query_id;
+    out[2] = 0x01; // Recursion desired
+    out[5] = 1;    // One question
+
+    // www.example.com as 3www7example3com0
+    uint8_t *label = out + DNS_HEADER_LEN;
+    uint8_t label_len = 0;
+    for (const char *c = cached_hostname;; c++) {
+        if (*c != '.' && *c != '\0') {
+            if (++label_len > 63) {
+                return 0;
+            }
+            label[label_len] = *c;
+            continue;
+        }
+        if (!label_len) {
+            return 0;
+        }
+        label[0] = label_len;
+        label += label_len + 1;
+        label_len = 0;
+        if (!*c) {
+            break;
+        }
+    }
+
+    label[0] = 0;
+    label[1] = 0;
+    label[2] = DNS_TYPE_A;
+    label[3] = 0;
+    label[4] = DNS_CLASS_IN;
+    return len;
+}
+
+/**
+ * @brief Finish a refresh and schedule the next one
+ * @param success True if an address was received
+ * @param ttl_s The TTL of the address
+ */
+static void refresh_done(bool success, uint32_t ttl_s) {
+    uint64_t interval_ms = DNS_CACHE_REFRESH_INTERVAL_MS;
+    if (success) {
+        uint32_t margin_s = ttl_s / 2 < DNS_CACHE_REFRESH_MARGIN_S ? ttl_s / 2 : DNS_CACHE_REFRESH_MARGIN_S;
+        interval_ms = (uint64_t) (ttl_s - margin_s) * 1000;
+        if (interval_ms < DNS_CACHE_MIN_REFRESH_INTERVAL_MS) {
+            interval_ms = DNS_CACHE_MIN_REFRESH_INTERVAL_MS;
+        }
+    }
+    next_refresh_time = time_us_64() + interval_ms * 1000;
+    refresh_in_progress = false;
+}
+
+static void dns_cache_refresh(void) {
+    ip_addr_t addr;
+
+    // An address needs no resolving
+    if (ipaddr_aton(cached_hostname, &addr)) {
+        dns_cache_store(cached_hostname, &addr);
+        next_refresh_time = UINT64_MAX;
+        return;
+    }
+
+    refresh_requested = false;
+    bool sent = false;
+    cyw43_arch_lwip_begin();
+    if (!pcb) {
+        pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+        if (pcb) {
+            udp_recv(pcb, dns_cache_recv, NULL);
+        }
+    }
+    const ip_addr_t *server = dns_getserver(0);
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, DNS_HEADER_LEN + DNS_MAX_NAME_LENGTH + 2 + 4, PBUF_RAM);
+    if (pcb && p && !ip_addr_isany(server)) {
+        query_id = get_rand_32();
+        uint16_t len = write_query(p->payload, p->len);
+        if (len) {
+            pbuf_realloc(p, len);
+            answer_received = false;
+            refresh_in_progress = true;
+            refresh_start = latency_start();
+            query_deadline = time_us_64() + DNS_CACHE_QUERY_TIMEOUT_MS * 1000;
+            sent = udp_sendto(pcb, p, server, DNS_CACHE_SERVER_PORT) == ERR_OK;
+            refresh_in_progress = sent;
+        }
+    }
+    if (p) {
+        pbuf_free(p);
+    }
+    cyw43_arch_lwip_end();
+
+    if (!sent) {
+        multi_printf("Error sending background DNS query for %s\n", cached_hostname);
+        refresh_done(false, 0);
+    }
+}
+
+/**
+ * @brief Initialize the DNS cache for a host. It is resolved in the background on the next tick
+ * @param hostname The hostname to keep resolved. Must stay valid for the lifetime of the program, call this again
+ * when it changes
+ * @param fallback_ip Static IP address used if the host has never been resolved, or NULL for none
+ */
+void dns_cache_init(const char *hostname, const char *fallback_ip) {
+    cached_hostname = hostname;
+    cached_addr_valid = false;
+    // An answer to a query for the previous host is ignored
+    refresh_in_progress = false;
+
+    fallback_addr_valid = false;
+    if (fallback_ip) {
+        fallback_addr_valid = ipaddr_aton(fallback_ip, &fallback_addr);
+        if (!fallback_addr_valid) {
+            multi_printf("Invalid DNS fallback address %s\n", fallback_ip);
+        }
+    }
+
+    // Resolve on the first tick
+    next_refresh_time = 0;
+}
+
+/**
+ * @brief Get the cached address of a host
+ * Returns the last address the resolver gave us, even if the resolver has since become unreachable
+ * @param hostname The hostname to look up
+ * @param addr Filled with the address if one is available
+ * @return True if the host has been resolved before, False otherwise
+ */
+bool dns_cache_lookup(const char *hostname, ip_addr_t *addr) {
+    if (!cached_hostname || strcmp(hostname, cached_hostname) != 0) {
+        return false;
+    }
+
+    bool found = false;
+
+    cyw43_arch_lwip_begin();
+    if (cached_addr_valid) {
+        ip_addr_copy(*addr, cached_addr);
+        found = true;
+    }
+    cyw43_arch_lwip_end();
+
+    return found;
+}
+
+/**
+ * @brief Get the static fallback address of a host, for when it has never been resolved
+ * @param hostname The hostname to look up
+ * @param addr Filled with the address if one is configured
+ * @return True if a fallback address is configured, False otherwise
+ */
+bool dns_cache_get_fallback(const char *hostname, ip_addr_t *addr) {
+    if (!cached_hostname || strcmp(hostname, cached_hostname) != 0 || !fallback_addr_valid) {
+        return false;
+    }
+
+    ip_addr_copy(*addr, fallback_addr);
+    return true;
+}
+
+/**
+ * @brief Store a freshly resolved address for a host
+ * @param hostname The hostname that was resolved
+ * @param addr The resolved address
+ */
+void dns_cache_store(const char *hostname, const ip_addr_t *addr) {
+    if (!cached_hostname || strcmp(hostname, cached_hostname) != 0) {
+        return;
+    }
+
+    cyw43_arch_lwip_begin();
+    ip_addr_copy(cached_addr, *addr);
+    cached_addr_valid = true;
+    cyw43_arch_lwip_end();
+}
+
+/**
+ * @brief Drop the cached address of a host after a connection to it failed, it is resolved again on the next tick
+ * @param hostname The hostname
+ */
+void dns_cache_invalidate(const char *hostname) {
+    if (!cached_hostname || strcmp(hostname, cached_hostname) != 0) {
+        return;
+    }
+
+    cyw43_arch_lwip_begin();
+    if (cached_addr_valid) {
+        multi_printf("Connecting to %s failed, dropping its cached address\n", hostname);
+    }
+    cached_addr_valid = false;
+    cyw43_arch_lwip_end();
+    refresh_requested = true;
+}
+
+/**
+ * Tick function to be called periodically while the network is up. Refreshes the cached address in the background
+ */
+void dns_cache_tick(void) {
+    if (!cached_hostname) {
+        return;
+    }
+
+    if (refresh_in_progress) {
+        if (answer_received) {
+            refresh_done(true, answer_ttl_s);
+        } else if (time_us_64() >= query_deadline) {
+            multi_printf("Background DNS refresh of %s timed out, keeping last known address\n", cached_hostname);
+            refresh_done(false, 0);
+        }
+    } else if (refresh_requested || time_us_64() >= next_refresh_time) {
+        dns_cache_refresh();
+    }
+}
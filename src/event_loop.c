@@ -0,0 +1,228 @@
+#include "event_loop.h"
+
+#include "hardware/sync.h"
+#include "hardware/watchdog.h"
+#include "hot_path.h"
+#include "latency.h"
+#include "pico/time.h"
+#include "reset.h"
+
+#define EVENT_LOOP_MAX_TASKS 16
+
+// Wake up at least this often to feed the watchdog
+#define EVENT_LOOP_MAX_SLEEP_MS 1000
+
+typedef struct {
+    const char *name;
+    uint32_t events;
+    uint32_t period_us;
+    uint32_t deadline_us;
+    event_loop_task_fn_t fn;
+    uint64_t next_due_us;
+    event_loop_task_stats_t stats;
+} event_loop_task_t;
+
+static volatile uint32_t pending_events = 0;
+
+static event_loop_task_t tasks[EVENT_LOOP_MAX_TASKS];
+static uint8_t task_count = 0;
+
+static uint32_t current_task_delay_us = 0;
+
+static uint64_t idle_us = 0;
+static uint64_t idle_since_us = 0;
+
+/**
+ * Initialize the event loop, must be called before any event is posted
+ */
+void event_loop_init() {
+    pending_events = 0;
+    idle_us = 0;
+    idle_since_us = time_us_64();
+}
+
+/**
+ * @brief Post events to the main loop. Safe to call from any context
+ * @param events The events to post
+ */
+void __hot_path_func(event_loop_post)(uint32_t events) {
+    uint32_t interrupts = save_and_disable_interrupts();
+    pending_events |= events;
+    restore_interrupts(interrupts);
+
+    // Wakes the main loop even if it is just about to go to sleep
+    __sev();
+}
+
+/**
+ * @brief Register a task. Tasks run in the order they were added
+ * @param name Name of the task in the statistics
+ * @param events The events that run the task, 0 for none
+ * @param period_ms How often to run the task, 0 to only run it for its events
+ * @param deadline_ms How long after its release the task must have finished, 0 for no deadline
+ * @param fn The task
+ * @return True if the task was added
+ */
+bool event_loop_add_task(const char *name, uint32_t events, uint32_t period_ms, uint32_t deadline_ms,
+                         event_loop_task_fn_t fn) {
+    if (task_count == EVENT_LOOP_MAX_TASKS) {
+        return false;
+    }
+
+    event_loop_task_t *task = &tasks[task_count++];
+    task->name = name;
+    task->events = events;
+    task->period_us = period_ms * 1000;
+    task->deadline_us = deadline_ms * 1000;
+    task->fn = fn;
+    task->next_due_us = time_us_64() + task->period_us;
+    task->stats = (event_loop_task_stats_t) {.name = name};
+    return true;
+}
+
+/**
+ * @brief Change how often a task runs. The next periodic run is one new period from now
+ * @param fn The task
+ * @param period_ms How often to run the task, 0 to only run it for its events
+ * @return False if the task is not registered
+ */
+bool event_loop_set_task_period(event_loop_task_fn_t fn, uint32_t period_ms) {
+    for (uint8_t i = 0; i < task_count; i++) {
+        if (tasks[i].fn == fn) {
+            tasks[i].period_us = period_ms * 1000;
+            tasks[i].next_due_us = time_us_64() + tasks[i].period_us;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Get the statistics of a task
+ * @param index Index of the task, in the order they were added
+ * @param stats Where to store the statistics
+ * @return False if there is no task with that index
+ */
+bool event_loop_get_task_stats(uint8_t index, event_loop_task_stats_t *stats) {
+    if (index >= task_count) {
+        return false;
+    }
+
+    *stats = tasks[index].stats;
+    return true;
+}
+
+/**
+ * @return How long after its release the running task started, in µs. Only valid when called from a task
+ */
+uint32_t event_loop_get_task_delay_us() {
+    return current_task_delay_us;
+}
+
+/**
+ * @brief Sleep until an event is posted or the time is reached
+ * @param until_us Time since boot to wake up at
+ * @return The events that were posted, they are cleared
+ */
+static uint32_t event_loop_wait(uint64_t until_us) {
+    absolute_time_t timeout = from_us_since_boot(until_us);
+    uint64_t sleep_start = time_us_64();
+    uint64_t isr_start_us = latency_total_us(LATENCY_UART_ISR);
+
+    // Any interrupt wakes the core, so this also returns for interrupts that did not post anything
+    while (!pending_events && sleep_start < until_us) {
+        if (best_effort_wfe_or_timeout(timeout)) {
+            break;
+        }
+    }
+
+    // The radar interrupt is not idle time. The rest of the interrupt work, the cyw43 and lwIP background processing,
+    // the PIR and the timers, is not measured and is counted as idle
+    uint64_t slept_us = time_us_64() - sleep_start;
+    uint64_t isr_us = latency_total_us(LATENCY_UART_ISR) - isr_start_us;
+    if (isr_us < slept_us) {
+        idle_us += slept_us - isr_us;
+    }
+
+    uint32_t interrupts = save_and_disable_interrupts();
+    uint32_t events = pending_events;
+    pending_events = 0;
+    restore_interrupts(interrupts);
+
+    return events;
+}
+
+static void event_loop_run_task(event_loop_task_t *task, uint64_t release_us) {
+    uint64_t start = time_us_64();
+    current_task_delay_us = start - release_us;
+    reset_record_set_task(task - tasks);
+    task->fn();
+    reset_record_set_task(RESET_RECORD_NO_TASK);
+    uint64_t end = time_us_64();
+
+    uint32_t runtime_us = end - start;
+    task->stats.runs++;
+    task->stats.total_runtime_us += runtime_us;
+    if (runtime_us > task->stats.max_runtime_us) {
+        task->stats.max_runtime_us = runtime_us;
+    }
+
+    // Counts the time the task waited behind the others too, that is what starves a task
+    if (task->deadline_us && end - release_us > task->deadline_us) {
+        task->stats.deadline_misses++;
+    }
+}
+
+/**
+ * Run the tasks forever. Sleeps until a task has an event posted or its period is due, and feeds the watchdog
+ */
+void event_loop_run() {
+    while (true) {
+        watchdog_update();
+
+        uint64_t wake_at = time_us_64() + EVENT_LOOP_MAX_SLEEP_MS * 1000;
+        for (uint8_t i = 0; i < task_count; i++) {
+            if (tasks[i].period_us && tasks[i].next_due_us < wake_at) {
+                wake_at = tasks[i].next_due_us;
+            }
+        }
+
+        uint32_t events = event_loop_wait(wake_at);
+        uint64_t now = time_us_64();
+
+        for (uint8_t i = 0; i < task_count; i++) {
+            event_loop_task_t *task = &tasks[i];
+            bool due = task->period_us && now >= task->next_due_us;
+            if (!due && !(events & task->events)) {
+                continue;
+            }
+
+            // A periodic run was released when it became due, an event run when the loop woke up for it
+            uint64_t release_us = now;
+            if (due) {
+                release_us = task->next_due_us;
+                task->next_due_us += task->period_us;
+                if (task->next_due_us <= now) {
+                    // Fell behind by more than a period, skip the missed runs instead of running them back to back
+                    task->next_due_us = now + task->period_us;
+                }
+            }
+
+            event_loop_run_task(task, release_us);
+        }
+    }
+}
+
+/**
+ * @brief Get how much of the time since the last call was spent asleep, less the time in the radar interrupt
+ * @return Idle time in per mille
+ */
+uint16_t event_loop_take_idle_permille() {
+    uint64_t now = time_us_64();
+    uint64_t elapsed_us = now - idle_since_us;
+    uint16_t idle_permille = elapsed_us ? (idle_us * 1000) / elapsed_us : 0;
+
+    idle_us = 0;
+    idle_since_us = now;
+    return idle_permille;
+}
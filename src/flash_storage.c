@@ -0,0 +1,231 @@
+#define LOG_MODULE LOG_MODULE_STORAGE
+
+#include "flash_storage.h"
+#include <string.h>
+
+#include "hardware/sync.h"
+#include "multi_printf.h"
+
+#define FLASH_STORAGE_MAGIC 0x4c525331 // "LRS1"
+#define FLASH_STORAGE_LOG_MAGIC 0x4c524c31 // "LRL1"
+
+#define FLASH_STORAGE_LOG_PAGES_PER_SECTOR (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+#define FLASH_STORAGE_LOG_PAGES (FLASH_STORAGE_LOG_SECTORS * FLASH_STORAGE_LOG_PAGES_PER_SECTOR)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t len;
+    uint32_t crc;
+} flash_storage_header_t;
+
+// Starts every page of a log. The CRC covers the sequence number and the record
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t len;
+    uint32_t crc;
+} flash_storage_log_header_t;
+
+_Static_assert(sizeof(flash_storage_log_header_t) + FLASH_STORAGE_LOG_MAX_LEN == FLASH_PAGE_SIZE,
+               "A log record and its header fill one page");
+
+static uint8_t sector_buffer[FLASH_SECTOR_SIZE];
+
+/**
+ * @brief Calculate the CRC-32 of a buffer
+ * @param crc CRC of the preceding data, or 0 to start a new calculation
+ * @param data The data
+ * @param len Length of the data
+ * @return The CRC-32
+ */
+uint32_t flash_storage_crc32(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *bytes++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+/**
+ * @brief Read a record previously written with flash_storage_write
+ * @param offset Offset of the sector holding the record from the start of flash
+ * @param data Filled with the record
+ * @param len Size of the record
+ * @return True if a valid record of this size was found, False otherwise
+ */
+bool flash_storage_read(uint32_t offset, void *data, size_t len) {
+    const uint8_t *sector = (const uint8_t *) (XIP_BASE + offset);
+    const flash_storage_header_t *header = (const flash_storage_header_t *) sector;
+
+    if (header->magic != FLASH_STORAGE_MAGIC || header->len != len) {
+        return false;
+    }
+
+    if (flash_storage_crc32(0, sector + sizeof(flash_storage_header_t), len) != header->crc) {
+        multi_printf("Flash record at 0x%08lx has an invalid CRC\n", offset);
+        return false;
+    }
+
+    memcpy(data, sector + sizeof(flash_storage_header_t), len);
+    return true;
+}
+
+/**
+ * @brief Erase a sector and write a record to it
+ * Interrupts are disabled while the flash is erased and programmed, so this should not be called often.
+ * @param offset Offset of the sector to write from the start of flash
+ * @param data The record to write
+ * @param len Size of the record. Must fit in a sector together with the record header
+ * @return True if the record was written, False otherwise
+ */
+bool flash_storage_write(uint32_t offset, const void *data, size_t len) {
+    if (len > FLASH_SECTOR_SIZE - sizeof(flash_storage_header_t) || offset % FLASH_SECTOR_SIZE != 0) {
+        return false;
+    }
+
+    flash_storage_header_t header = {
+            .magic = FLASH_STORAGE_MAGIC,
+            .len = len,
+            .crc = flash_storage_crc32(0, data, len),
+    };
+
+    // Only program the pages we need, the rest of the sector stays erased
+    size_t program_len = (sizeof(header) + len + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1);
+    memset(sector_buffer, 0xff, program_len);
+    memcpy(sector_buffer, &header, sizeof(header));
+    memcpy(sector_buffer + sizeof(header), data, len);
+
+    uint32_t interrupts = save_and_disable_interrupts();
+    flash_range_erase(offset, FLASH_SECTOR_SIZE);
+    flash_range_program(offset, sector_buffer, program_len);
+    restore_interrupts(interrupts);
+
+    return memcmp((const void *) (XIP_BASE + offset), sector_buffer, program_len) == 0;
+}
+
+static const flash_storage_log_header_t *log_page(uint32_t offset, uint32_t page) {
+    return (const flash_storage_log_header_t *) (XIP_BASE + offset + page * FLASH_PAGE_SIZE);
+}
+
+static uint32_t log_record_crc(uint32_t sequence, const void *data, size_t len) {
+    return flash_storage_crc32(flash_storage_crc32(0, &sequence, sizeof(sequence)), data, len);
+}
+
+static bool log_page_is_erased(uint32_t offset, uint32_t page) {
+    const uint32_t *words = (const uint32_t *) log_page(offset, page);
+    for (uint32_t i = 0; i < FLASH_PAGE_SIZE / sizeof(uint32_t); i++) {
+        if (words[i] != 0xffffffff) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Find the newest valid record of a log
+ * @param offset Offset of the first sector of the log from the start of flash
+ * @return The page holding it, -1 if the log holds no valid record
+ */
+static int32_t log_find_newest(uint32_t offset) {
+    int32_t newest = -1;
+    uint32_t newest_sequence = 0;
+
+    for (uint32_t page = 0; page < FLASH_STORAGE_LOG_PAGES; page++) {
+        const flash_storage_log_header_t *header = log_page(offset, page);
+        if (header->magic != FLASH_STORAGE_LOG_MAGIC || header->len > FLASH_STORAGE_LOG_MAX_LEN ||
+            log_record_crc(header->sequence, header + 1, header->len) != header->crc) {
+            // Erased, or torn by a reset during the write
+            continue;
+        }
+
+        // Compared as a difference so the sequence number may wrap
+        if (newest < 0 || (int32_t) (header->sequence - newest_sequence) > 0) {
+            newest = page;
+            newest_sequence = header->sequence;
+        }
+    }
+
+    return newest;
+}
+
+/**
+ * @brief Read the newest record of a log written with flash_storage_log_write
+ * @param offset Offset of the first sector of the log from the start of flash
+ * @param data Filled with the record
+ * @param max_len Size of the buffer
+ * @return The length of the record, 0 if the log holds no valid record that fits the buffer
+ */
+size_t flash_storage_log_read(uint32_t offset, void *data, size_t max_len) {
+    int32_t newest = log_find_newest(offset);
+    if (newest < 0) {
+        return 0;
+    }
+
+    const flash_storage_log_header_t *header = log_page(offset, newest);
+    if (header->len > max_len) {
+        return 0;
+    }
+
+    memcpy(data, header + 1, header->len);
+    return header->len;
+}
+
+/**
+ * @brief Append a record to a log. Every record takes the next erased page and a sector is only erased when the
+ * log wraps around into it, so it is erased once per FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE writes instead of every
+ * write. The records before stay valid until the new one has been written.
+ * Interrupts are disabled while the flash is erased and programmed, so this should not be called often.
+ * @param offset Offset of the first sector of the log from the start of flash
+ * @param data The record to write
+ * @param len Size of the record, at most FLASH_STORAGE_LOG_MAX_LEN
+ * @return True if the record was written, False otherwise
+ */
+bool flash_storage_log_write(uint32_t offset, const void *data, size_t len) {
+    if (len > FLASH_STORAGE_LOG_MAX_LEN || offset % FLASH_SECTOR_SIZE != 0) {
+        return false;
+    }
+
+    int32_t newest = log_find_newest(offset);
+    uint32_t sequence = newest < 0 ? 0 : log_page(offset, newest)->sequence + 1;
+    uint32_t page = newest < 0 ? FLASH_STORAGE_LOG_PAGES - 1 : newest;
+
+    flash_storage_log_header_t header = {
+            .magic = FLASH_STORAGE_LOG_MAGIC,
+            .sequence = sequence,
+            .len = len,
+            .crc = log_record_crc(sequence, data, len),
+    };
+    memset(sector_buffer, 0xff, FLASH_PAGE_SIZE);
+    memcpy(sector_buffer, &header, sizeof(header));
+    memcpy(sector_buffer + sizeof(header), data, len);
+
+    for (uint32_t tries = 0; tries < FLASH_STORAGE_LOG_PAGES; tries++) {
+        page = (page + 1) % FLASH_STORAGE_LOG_PAGES;
+
+        // Entering a sector erases it. The newest record is always in the other one
+        bool erase = page % FLASH_STORAGE_LOG_PAGES_PER_SECTOR == 0;
+        if (!erase && !log_page_is_erased(offset, page)) {
+            // Left over from a write that was interrupted, it cannot be programmed again until the sector is erased
+            continue;
+        }
+
+        uint32_t page_offset = offset + page * FLASH_PAGE_SIZE;
+        uint32_t interrupts = save_and_disable_interrupts();
+        if (erase) {
+            flash_range_erase(page_offset, FLASH_SECTOR_SIZE);
+        }
+        flash_range_program(page_offset, sector_buffer, FLASH_PAGE_SIZE);
+        restore_interrupts(interrupts);
+
+        if (memcmp((const void *) (XIP_BASE + page_offset), sector_buffer, FLASH_PAGE_SIZE) == 0) {
+            return true;
+        }
+        multi_printf("Flash log page at 0x%08lx failed to verify\n", page_offset);
+    }
+
+    return false;
+}
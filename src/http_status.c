@@ -0,0 +1,521 @@
+#define LOG_MODULE LOG_MODULE_NET
+
+#include "http_status.h"
+
+#include <malloc.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "latency.h"
+#include "lwip/pbuf.h"
+#include "lwip/tcp.h"
+#include "multi_printf.h"
+#include "pico/cyw43_arch.h"
+#include "pico/time.h"
+#include "pir_sensor.h"
+#include "reporting.h"
+#include "sensor_controller.h"
+#include "sensor_fusion.h"
+#include "version.h"
+
+// A plain HTTP server for building management systems on the same network, it answers
+//   GET /status   the fused state, the radar health and the last report as JSON
+//   GET /metrics  counters and latencies in the Prometheus text format
+// and closes the connection after every response. The responses are rendered by the main loop once a period, a
+// request is answered from the last rendering without formatting anything, so scraping never holds up sensing.
+// Nothing is rendered, and the buffers are not allocated, until the first request
+
+#define HTTP_STATUS_MAX_CONNECTIONS 4
+
+// Only the request line is looked at, the rest of the request is ignored
+#define HTTP_STATUS_REQUEST_LINE_LEN 64
+
+// Room for the response header in front of the body, the body is rendered first so its length is known
+#define HTTP_STATUS_HEADER_LEN 160
+#define HTTP_STATUS_STATUS_BODY_LEN 512
+// The metrics with every latency probe in use and every number at its widest come to about 6.8 KB
+#define HTTP_STATUS_METRICS_BODY_LEN 7168
+
+// lwIP polls every 2 * 500 ms, a connection that has made no progress for 5 polls is dropped
+#define HTTP_STATUS_POLL_INTERVAL 2
+#define HTTP_STATUS_MAX_IDLE_POLLS 5
+
+// Gives the seconds and the µs of a duration in µs for "%lu.%06lu"
+#define SECONDS(us) (uint32_t) ((us) / 1000000), (uint32_t) ((us) % 1000000)
+
+#define METRIC_PREFIX "live_room_sensor_"
+
+// Linker symbols around the heap
+extern char __bss_end__;
+extern char __StackLimit;
+
+typedef struct {
+    char status_buf[HTTP_STATUS_HEADER_LEN + HTTP_STATUS_STATUS_BODY_LEN];
+    char metrics_buf[HTTP_STATUS_HEADER_LEN + HTTP_STATUS_METRICS_BODY_LEN];
+    const char *status;
+    uint16_t status_len;
+    const char *metrics;
+    uint16_t metrics_len;
+    // Connections still sending from this snapshot, only changed with the lwIP lock held
+    uint8_t users;
+} snapshot_t;
+
+typedef struct {
+    struct tcp_pcb *pcb;
+    char request_line[HTTP_STATUS_REQUEST_LINE_LEN];
+    uint8_t request_len;
+    snapshot_t *snapshot; // The snapshot the response is sent from, NULL for the fixed responses
+    const char *response; // NULL until the request line is complete
+    uint16_t response_len;
+    uint16_t written;
+    uint16_t acked;
+    uint8_t idle_polls;
+    bool in_use;
+} connection_t;
+
+typedef struct {
+    char *buf;
+    uint16_t size;
+    uint16_t len;
+    bool overflow;
+} text_t;
+
+static const char RESPONSE_BAD_REQUEST[] =
+        "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char RESPONSE_NOT_FOUND[] =
+        "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char RESPONSE_METHOD_NOT_ALLOWED[] =
+        "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char RESPONSE_UNAVAILABLE[] =
+        "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+static const char *const report_result_names[] = {
+        [REPORT_RESULT_NONE] = "none",
+        [REPORT_RESULT_SENT] = "sent",
+        [REPORT_RESULT_NO_WIFI] = "no-wifi",
+        [REPORT_RESULT_FORMAT_ERROR] = "format-error",
+};
+
+// Two snapshots, allocated once the first request has come in
+static snapshot_t *snapshots = NULL;
+// The snapshot requests are answered from, only changed with the lwIP lock held
+static uint8_t current_snapshot = 0;
+static bool snapshot_ready = false;
+static volatile bool snapshot_requested = false;
+
+static connection_t connections[HTTP_STATUS_MAX_CONNECTIONS];
+static struct tcp_pcb *listen_pcb = NULL;
+
+static void append(text_t *text, const char *format, ...) {
+    if (text->overflow) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text->buf + text->len, text->size - text->len, format, args);
+    va_end(args);
+
+    if (len < 0 || len >= text->size - text->len) {
+        text->overflow = true;
+        return;
+    }
+    text->len += len;
+}
+
+static void append_metric_header(text_t *text, const char *name, const char *type, const char *help) {
+    append(text, "# HELP " METRIC_PREFIX "%s %s\n# TYPE " METRIC_PREFIX "%s %s\n", name, help, name, type);
+}
+
+/**
+ * @brief Put the response header in front of a rendered body
+ * @param buf The buffer, the body starts HTTP_STATUS_HEADER_LEN into it
+ * @param body_len Length of the body
+ * @param content_type Content type of the body
+ * @param response_len Set to the length of the whole response
+ * @return The start of the response, NULL if the header did not fit
+ */
+static const char *prepend_header(char *buf, uint16_t body_len, const char *content_type, uint16_t *response_len) {
+    char header[HTTP_STATUS_HEADER_LEN];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: %s\r\n"
+                              "Content-Length: %u\r\n"
+                              "Cache-Control: no-store\r\n"
+                              "Connection: close\r\n"
+                              "\r\n", content_type, body_len);
+    if (header_len < 0 || header_len >= sizeof(header)) {
+        return NULL;
+    }
+
+    char *start = buf + HTTP_STATUS_HEADER_LEN - header_len;
+    memcpy(start, header, header_len);
+    *response_len = header_len + body_len;
+    return start;
+}
+
+static bool render_status(snapshot_t *snapshot, uint32_t now_ms, const radar_health_t *radar,
+                          const reporting_status_t *report) {
+    text_t text = {snapshot->status_buf + HTTP_STATUS_HEADER_LEN, HTTP_STATUS_STATUS_BODY_LEN, 0, false};
+    uint16_t confidence = sensor_fusion_get_confidence();
+
+    append(&text, "{\"firmwareVersion\":\"%s\",\"uptimeMs\":%lu,\"occupants\":%d,\"confidence\":%u.%03u,\"pirState\":%s",
+           FIRMWARE_STRING, now_ms, sensor_fusion_get_count(), confidence / 1000, confidence % 1000,
+           pir_sensor_get_state() ? "true" : "false");
+    append(&text, ",\"radar\":{\"count\":%d,\"valid\":%s,\"frames\":%lu,\"frameErrors\":%lu}",
+           radar->count, radar->count >= 0 ? "true" : "false", radar->frames, radar->frame_errors);
+    append(&text, ",\"lastReport\":{\"result\":\"%s\"", report_result_names[report->last_result]);
+    if (report->last_result != REPORT_RESULT_NONE) {
+        append(&text, ",\"ageMs\":%lu,\"durationMs\":%lu", now_ms - report->last_time_ms, report->last_duration_ms);
+    }
+    append(&text, ",\"sent\":%lu,\"skipped\":%lu,\"retries\":%lu}}\n", report->sent, report->skipped,
+           report->retries);
+
+    if (text.overflow) {
+        return false;
+    }
+    snapshot->status = prepend_header(snapshot->status_buf, text.len, "application/json", &snapshot->status_len);
+    return snapshot->status != NULL;
+}
+
+static bool render_metrics(snapshot_t *snapshot, uint32_t now_ms, const radar_health_t *radar,
+                           const reporting_status_t *report) {
+    text_t text = {snapshot->metrics_buf + HTTP_STATUS_HEADER_LEN, HTTP_STATUS_METRICS_BODY_LEN, 0, false};
+    uint16_t confidence = sensor_fusion_get_confidence();
+
+    append_metric_header(&text, "uptime_seconds", "gauge", "Time since boot");
+    append(&text, METRIC_PREFIX "uptime_seconds %lu.%03lu\n", now_ms / 1000, now_ms % 1000);
+    append_metric_header(&text, "occupants", "gauge", "Fused number of occupants");
+    append(&text, METRIC_PREFIX "occupants %d\n", sensor_fusion_get_count());
+    append_metric_header(&text, "confidence", "gauge", "How likely the fused number of occupants is to be right");
+    append(&text, METRIC_PREFIX "confidence %u.%03u\n", confidence / 1000, confidence % 1000);
+    append_metric_header(&text, "pir_motion", "gauge", "1 while the output of a PIR is high");
+    append(&text, METRIC_PREFIX "pir_motion %d\n", pir_sensor_get_state());
+
+    append_metric_header(&text, "radar_count", "gauge", "Averaged radar count, -1 if the radar has gone quiet");
+    append(&text, METRIC_PREFIX "radar_count %d\n", radar->count);
+    append_metric_header(&text, "radar_frames_total", "counter", "Complete radar frames received");
+    append(&text, METRIC_PREFIX "radar_frames_total %lu\n", radar->frames);
+    append_metric_header(&text, "radar_frame_errors_total", "counter",
+                         "Radar frames dropped for a bad checksum, layout or length");
+    append(&text, METRIC_PREFIX "radar_frame_errors_total %lu\n", radar->frame_errors);
+
+    append_metric_header(&text, "reports_total", "counter", "Reports by result");
+    append(&text, METRIC_PREFIX "reports_total{result=\"sent\"} %lu\n", report->sent);
+    append(&text, METRIC_PREFIX "reports_total{result=\"skipped\"} %lu\n", report->skipped);
+    append_metric_header(&text, "report_retries_total", "counter", "Report requests that failed and were retried");
+    append(&text, METRIC_PREFIX "report_retries_total %lu\n", report->retries);
+    append_metric_header(&text, "last_report_duration_seconds", "gauge", "How long the last report took");
+    append(&text, METRIC_PREFIX "last_report_duration_seconds %lu.%03lu\n", report->last_duration_ms / 1000,
+           report->last_duration_ms % 1000);
+
+    // The quantiles are the upper ends of the histogram buckets, see latency_percentile_us()
+    append_metric_header(&text, "latency_seconds", "summary", "Latencies since boot by probe");
+    for (latency_probe_t probe = 0; probe < LATENCY_PROBE_COUNT; probe++) {
+        latency_histogram_t histogram;
+        latency_get(probe, &histogram);
+        if (!histogram.count) {
+            continue;
+        }
+
+        const char *name = latency_probe_name(probe);
+        append(&text, METRIC_PREFIX "latency_seconds{probe=\"%s\",quantile=\"0.5\"} %lu.%06lu\n", name,
+               SECONDS(latency_percentile_us(&histogram, 500)));
+        append(&text, METRIC_PREFIX "latency_seconds{probe=\"%s\",quantile=\"0.99\"} %lu.%06lu\n", name,
+               SECONDS(latency_percentile_us(&histogram, 990)));
+        append(&text, METRIC_PREFIX "latency_seconds_sum{probe=\"%s\"} %lu.%06lu\n", name,
+               SECONDS(histogram.total_us));
+        append(&text, METRIC_PREFIX "latency_seconds_count{probe=\"%s\"} %lu\n", name, histogram.count);
+    }
+
+    append_metric_header(&text, "latency_max_seconds", "gauge", "Longest latency since boot by probe");
+    for (latency_probe_t probe = 0; probe < LATENCY_PROBE_COUNT; probe++) {
+        latency_histogram_t histogram;
+        latency_get(probe, &histogram);
+        if (histogram.count) {
+            append(&text, METRIC_PREFIX "latency_max_seconds{probe=\"%s\"} %lu.%06lu\n", latency_probe_name(probe),
+                   SECONDS(histogram.max_us));
+        }
+    }
+
+    // newlib never hands heap back to the system, what it took is the most the heap was ever in use
+    struct mallinfo heap = mallinfo();
+    append_metric_header(&text, "heap_high_water_bytes", "gauge", "Most heap in use since boot");
+    append(&text, METRIC_PREFIX "heap_high_water_bytes %lu\n", (uint32_t) heap.arena);
+    append_metric_header(&text, "heap_in_use_bytes", "gauge", "Heap in use");
+    append(&text, METRIC_PREFIX "heap_in_use_bytes %lu\n", (uint32_t) heap.uordblks);
+    append_metric_header(&text, "heap_size_bytes", "gauge", "Size of the heap");
+    append(&text, METRIC_PREFIX "heap_size_bytes %lu\n", (uint32_t) (&__StackLimit - &__bss_end__));
+
+    if (text.overflow) {
+        return false;
+    }
+    snapshot->metrics = prepend_header(snapshot->metrics_buf, text.len, "text/plain; version=0.0.4",
+                                       &snapshot->metrics_len);
+    return snapshot->metrics != NULL;
+}
+
+/**
+ * @brief Stop using a connection
+ * @param connection The connection
+ * @param abort Reset the connection instead of closing it. Must be used while lwIP may still hold unacknowledged
+ * data from a snapshot, a closing connection would go on retransmitting it after the snapshot is rendered again
+ * @return ERR_ABRT if the connection was aborted, the callback must return it
+ */
+static err_t close_connection(connection_t *connection, bool abort) {
+    struct tcp_pcb *pcb = connection->pcb;
+    if (connection->snapshot) {
+        connection->snapshot->users--;
+        connection->snapshot = NULL;
+    }
+    connection->in_use = false;
+
+    tcp_arg(pcb, NULL);
+    tcp_recv(pcb, NULL);
+    tcp_sent(pcb, NULL);
+    tcp_err(pcb, NULL);
+    tcp_poll(pcb, NULL, 0);
+
+    if (!abort && tcp_close(pcb) == ERR_OK) {
+        return ERR_OK;
+    }
+    tcp_abort(pcb);
+    return ERR_ABRT;
+}
+
+/**
+ * @brief Queue as much of the response as the send buffer takes. The response is not copied, the snapshot holds it
+ * until it has been acknowledged
+ * @param connection The connection
+ * @return ERR_ABRT if the connection was aborted, the callback must return it
+ */
+static err_t send_response(connection_t *connection) {
+    while (connection->written < connection->response_len) {
+        uint16_t len = connection->response_len - connection->written;
+        uint16_t space = tcp_sndbuf(connection->pcb);
+        if (len > space) {
+            len = space;
+        }
+        if (!len) {
+            break;
+        }
+
+        err_t err = tcp_write(connection->pcb, connection->response + connection->written, len, 0);
+        if (err == ERR_MEM) {
+            // Out of segments, the sent callback tries again
+            break;
+        } else if (err != ERR_OK) {
+            return close_connection(connection, true);
+        }
+        connection->written += len;
+    }
+
+    tcp_output(connection->pcb);
+    return ERR_OK;
+}
+
+/**
+ * @brief Pick the response to a complete request line and start sending it
+ * @param connection The connection
+ * @return ERR_ABRT if the connection was aborted, the callback must return it
+ */
+static err_t handle_request(connection_t *connection) {
+    const char *line = connection->request_line;
+    const char *response = NULL;
+    uint16_t response_len = 0;
+
+    if (strncmp(line, "GET ", 4) != 0) {
+        response = RESPONSE_METHOD_NOT_ALLOWED;
+        response_len = sizeof(RESPONSE_METHOD_NOT_ALLOWED) - 1;
+    } else {
+        const char *path = line + 4;
+        size_t path_len = strcspn(path, " ?\r\n");
+        bool status = path_len == 7 && strncmp(path, "/status", 7) == 0;
+        bool metrics = path_len == 8 && strncmp(path, "/metrics", 8) == 0;
+
+        if (!status && !metrics) {
+            response = RESPONSE_NOT_FOUND;
+            response_len = sizeof(RESPONSE_NOT_FOUND) - 1;
+        } else if (!snapshot_ready) {
+            snapshot_requested = true;
+            response = RESPONSE_UNAVAILABLE;
+            response_len = sizeof(RESPONSE_UNAVAILABLE) - 1;
+        } else {
+            snapshot_t *snapshot = &snapshots[current_snapshot];
+            snapshot->users++;
+            connection->snapshot = snapshot;
+            response = status ? snapshot->status : snapshot->metrics;
+            response_len = status ? snapshot->status_len : snapshot->metrics_len;
+        }
+    }
+
+    connection->response = response;
+    connection->response_len = response_len;
+    return send_response(connection);
+}
+
+static err_t on_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
+    connection_t *connection = arg;
+    if (!p) {
+        // The client closed its side. A response that is under way is still delivered
+        return connection->response ? ERR_OK : close_connection(connection, false);
+    }
+    if (err != ERR_OK) {
+        pbuf_free(p);
+        return err;
+    }
+
+    connection->idle_polls = 0;
+    if (!connection->response) {
+        uint16_t space = sizeof(connection->request_line) - 1 - connection->request_len;
+        uint16_t len = pbuf_copy_partial(p, connection->request_line + connection->request_len, space, 0);
+        connection->request_len += len;
+        connection->request_line[connection->request_len] = '\0';
+    }
+    tcp_recved(pcb, p->tot_len);
+    pbuf_free(p);
+
+    if (connection->response) {
+        return ERR_OK;
+    }
+    if (strchr(connection->request_line, '\n')) {
+        return handle_request(connection);
+    }
+    if (connection->request_len == sizeof(connection->request_line) - 1) {
+        connection->response = RESPONSE_BAD_REQUEST;
+        connection->response_len = sizeof(RESPONSE_BAD_REQUEST) - 1;
+        return send_response(connection);
+    }
+    return ERR_OK;
+}
+
+static err_t on_sent(void *arg, struct tcp_pcb *pcb, u16_t len) {
+    connection_t *connection = arg;
+    connection->idle_polls = 0;
+    connection->acked += len;
+
+    if (connection->acked >= connection->response_len) {
+        return close_connection(connection, false);
+    }
+    return send_response(connection);
+}
+
+static err_t on_poll(void *arg, struct tcp_pcb *pcb) {
+    connection_t *connection = arg;
+    if (++connection->idle_polls >= HTTP_STATUS_MAX_IDLE_POLLS) {
+        return close_connection(connection, true);
+    }
+    // Retry a response that did not fit the send queue last time
+    return connection->response ? send_response(connection) : ERR_OK;
+}
+
+static void on_error(void *arg, err_t err) {
+    // lwIP has already freed the pcb
+    connection_t *connection = arg;
+    if (connection->snapshot) {
+        connection->snapshot->users--;
+        connection->snapshot = NULL;
+    }
+    connection->in_use = false;
+}
+
+static err_t on_accept(void *arg, struct tcp_pcb *pcb, err_t err) {
+    if (err != ERR_OK || !pcb) {
+        return ERR_VAL;
+    }
+
+    connection_t *connection = NULL;
+    for (uint8_t i = 0; i < HTTP_STATUS_MAX_CONNECTIONS; i++) {
+        if (!connections[i].in_use) {
+            connection = &connections[i];
+            break;
+        }
+    }
+    if (!connection) {
+        tcp_abort(pcb);
+        return ERR_ABRT;
+    }
+
+    memset(connection, 0, sizeof(*connection));
+    connection->pcb = pcb;
+    connection->in_use = true;
+
+    // Give way to the reporting connection when lwIP runs out of pcbs
+    tcp_setprio(pcb, TCP_PRIO_MIN);
+    tcp_arg(pcb, connection);
+    tcp_recv(pcb, on_recv);
+    tcp_sent(pcb, on_sent);
+    tcp_err(pcb, on_error);
+    tcp_poll(pcb, on_poll, HTTP_STATUS_POLL_INTERVAL);
+    return ERR_OK;
+}
+
+/**
+ * Start listening for status and metrics requests on the wireless interface
+ */
+void http_status_init() {
+    cyw43_arch_lwip_begin();
+    struct tcp_pcb *pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
+    if (pcb && tcp_bind(pcb, IP_ANY_TYPE, HTTP_STATUS_PORT) == ERR_OK) {
+        listen_pcb = tcp_listen_with_backlog(pcb, HTTP_STATUS_MAX_CONNECTIONS);
+    }
+    if (listen_pcb) {
+        tcp_accept(listen_pcb, on_accept);
+    } else if (pcb) {
+        tcp_close(pcb);
+    }
+    cyw43_arch_lwip_end();
+
+    if (!listen_pcb) {
+        multi_printf("Could not start the status server on port %d\n", HTTP_STATUS_PORT);
+    }
+}
+
+/**
+ * Render the responses to the next requests from the current state. Must be called from the main loop
+ */
+void http_status_task() {
+    if (!listen_pcb) {
+        return;
+    }
+
+    if (!snapshots) {
+        if (!snapshot_requested) {
+            return;
+        }
+        snapshots = calloc(2, sizeof(snapshot_t));
+        if (!snapshots) {
+            LOG_ERROR("Could not allocate the status responses\n");
+            snapshot_requested = false;
+            return;
+        }
+    }
+
+    // Connections only ever take the current snapshot, so the other one can be rendered without the lwIP lock once
+    // the last connection sending from it is done
+    cyw43_arch_lwip_begin();
+    uint8_t next = current_snapshot ^ 1;
+    bool unused = snapshots[next].users == 0;
+    cyw43_arch_lwip_end();
+    if (!unused) {
+        return;
+    }
+
+    uint32_t now_ms = time_us_64() / 1000;
+    radar_health_t radar;
+    sensor_controller_get_radar_health(&radar);
+    reporting_status_t report;
+    reporting_get_status(&report);
+
+    snapshot_t *snapshot = &snapshots[next];
+    if (!render_status(snapshot, now_ms, &radar, &report) || !render_metrics(snapshot, now_ms, &radar, &report)) {
+        LOG_ERROR("Status response does not fit its buffer\n");
+        return;
+    }
+
+    cyw43_arch_lwip_begin();
+    current_snapshot = next;
+    snapshot_ready = true;
+    cyw43_arch_lwip_end();
+}
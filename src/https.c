@@ -1,3 +1,5 @@
+#define LOG_MODULE LOG_MODULE_NET
+
 #include "https.h"
 #include <string.h>
 #include <time.h>
@@ -7,26 +9,61 @@
 #include "lwip/altcp_tls.h"
 #include "lwip/dns.h"
 #include "lwip/pbuf.h"
+#include "lwip/prot/tcp.h"
+#include "lwip/tcp.h"
 #include "pico/cyw43_arch.h"
 #include "pico/stdlib.h"
+#include "dns_cache.h"
+#include "latency.h"
+#include "lwip_hooks.h"
 #include "multi_printf.h"
 
+#define HTTPS_WAIT_SLEEP_MS 100
+// altcp_poll() counts in coarse TCP timer ticks of 500 ms and only takes a u8_t, so poll every second and count the
+// seconds the connection stalls in idle_polls instead of passing the timeout itself
+#define HTTPS_POLL_INTERVAL 2
+
 typedef struct TLS_CLIENT_T_ {
     struct altcp_pcb *pcb;
+    const char *hostname;
     bool complete;
     int error;
     const char *http_request;
     size_t http_request_len;
     int timeout;
+    int idle_polls;
+    uint32_t dns_start;
+    uint32_t connect_start;
+    uint32_t handshake_start;
+    uint32_t request_sent;
+    bool response_started;
+    bool received_since_poll;
+    struct pbuf *received; // Received but not yet passed on, the server waits for us to take it
+    https_response_fn_t on_response;
+    void *response_arg;
 } TLS_CLIENT_T;
 
+typedef struct {
+    char *buffer;
+    size_t size;
+    size_t len;
+} response_buffer_t;
+
 static struct altcp_tls_config *tls_config = NULL;
 
+// altcp_tls only reports the connection once the TLS handshake is done. The TCP handshake is timed on its own by
+// https_tcp_inpacket_hook(), which sees the SYN-ACK. This client is the only one that opens connections, so the
+// connection in SYN-SENT is the one of this request
+static TLS_CLIENT_T *connecting = NULL;
+
 static err_t tls_client_close(void *arg) {
     TLS_CLIENT_T *state = (TLS_CLIENT_T *) arg;
     err_t err = ERR_OK;
 
     state->complete = true;
+    if (connecting == state) {
+        connecting = NULL;
+    }
     if (state->pcb != NULL) {
         altcp_arg(state->pcb, NULL);
         altcp_poll(state->pcb, NULL, 0);
@@ -51,6 +88,8 @@ static err_t tls_client_connected(void *arg, struct altcp_pcb *pcb, err_t err) {
         return tls_client_close(state);
     }
 
+    latency_end(LATENCY_TLS_HANDSHAKE, state->handshake_start);
+
     multi_printf("connected to server, sending request\n");
     err = altcp_write(state->pcb, state->http_request, state->http_request_len, TCP_WRITE_FLAG_COPY);
     if (err != ERR_OK) {
@@ -58,13 +97,27 @@ static err_t tls_client_connected(void *arg, struct altcp_pcb *pcb, err_t err) {
         state->error = (int) err;
         return tls_client_close(state);
     }
+    state->request_sent = latency_start();
 
     return ERR_OK;
 }
 
 static err_t tls_client_poll(void *arg, struct altcp_pcb *pcb) {
     TLS_CLIENT_T *state = (TLS_CLIENT_T *) arg;
+    if (state->received_since_poll) {
+        // Only a connection that stalls times out, a long response that keeps coming does not
+        state->received_since_poll = false;
+        state->idle_polls = 0;
+        return ERR_OK;
+    }
+    if (++state->idle_polls < state->timeout) {
+        return ERR_OK;
+    }
     multi_printf("timed out\n");
+    if (connecting == state) {
+        // The server never answered the SYN, the address may be stale
+        dns_cache_invalidate(state->hostname);
+    }
     state->error = PICO_ERROR_TIMEOUT;
     return tls_client_close(arg);
 }
@@ -72,6 +125,10 @@ static err_t tls_client_poll(void *arg, struct altcp_pcb *pcb) {
 static void tls_client_err(void *arg, err_t err) {
     TLS_CLIENT_T *state = (TLS_CLIENT_T *) arg;
     multi_printf("tls_client_err %d\n", err);
+    if (connecting == state) {
+        // The TCP handshake failed, the address may be stale
+        dns_cache_invalidate(state->hostname);
+    }
     tls_client_close(state);
     state->error = PICO_ERROR_GENERIC;
 }
@@ -84,29 +141,55 @@ static err_t tls_client_recv(void *arg, struct altcp_pcb *pcb, struct pbuf *p, e
     }
 
     if (p->tot_len > 0) {
-        /* For simplicity this examples creates a buffer on stack the size of the data pending here,
-           and copies all the data to it in one go.
-           Do be aware that the amount of data can potentially be a bit large (TLS record size can be 16 KB),
-           so you may want to use a smaller fixed size buffer and copy the data to it using a loop, if memory is a concern */
-        char buf[p->tot_len + 1];
-
-        pbuf_copy_partial(p, buf, p->tot_len, 0);
-        buf[p->tot_len] = 0;
-
-        printf("***\nnew data received from server:\n***\n\n%s\n", buf);
-
-        altcp_recved(pcb, p->tot_len);
+        if (!state->response_started) {
+            state->response_started = true;
+            latency_end(LATENCY_RESPONSE, state->request_sent);
+        }
+        state->received_since_poll = true;
+
+        // Passed on from the main loop, the data is only acknowledged once it has been taken so the TCP window
+        // keeps a slow consumer from being overrun
+        if (state->received) {
+            pbuf_cat(state->received, p);
+        } else {
+            state->received = p;
+        }
+        return ERR_OK;
     }
     pbuf_free(p);
 
     return ERR_OK;
 }
 
+/**
+ * @brief Called by lwIP for every TCP segment that arrives for a connection, see LWIP_HOOK_TCP_INPACKET_PCB
+ * @param pcb The connection
+ * @param hdr The TCP header of the segment
+ * @param optlen Length of the TCP options
+ * @param opt1len Length of the options in the first pbuf
+ * @param opt2 Options in the next pbuf, NULL if they are all in the first one
+ * @param p The segment
+ * @return ERR_OK to process the segment
+ */
+err_t https_tcp_inpacket_hook(struct tcp_pcb *pcb, struct tcp_hdr *hdr, u16_t optlen, u16_t opt1len, u8_t *opt2,
+                              struct pbuf *p) {
+    if (connecting && pcb->state == SYN_SENT && (TCPH_FLAGS(hdr) & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK)) {
+        latency_end(LATENCY_CONNECT, connecting->connect_start);
+        connecting->handshake_start = latency_start();
+        connecting = NULL;
+    }
+    return ERR_OK;
+}
+
 static void tls_client_connect_to_server_ip(const ip_addr_t *ipaddr, TLS_CLIENT_T *state) {
     err_t err;
     u16_t port = 443;
 
     multi_printf("connecting to server IP %s port %d\n", ipaddr_ntoa(ipaddr), port);
+    state->connect_start = latency_start();
+    // In case the SYN-ACK is not seen, the TLS handshake is then timed with the TCP one
+    state->handshake_start = state->connect_start;
+    connecting = state;
     err = altcp_connect(state->pcb, ipaddr, port, tls_client_connected);
     if (err != ERR_OK) {
         multi_printf("error initiating connect, err=%d\n", err);
@@ -116,9 +199,17 @@ static void tls_client_connect_to_server_ip(const ip_addr_t *ipaddr, TLS_CLIENT_
 }
 
 static void tls_client_dns_found(const char *hostname, const ip_addr_t *ipaddr, void *arg) {
+    ip_addr_t fallback_ip;
+
+    latency_end(LATENCY_DNS, ((TLS_CLIENT_T *) arg)->dns_start);
+
     if (ipaddr) {
         multi_printf("DNS resolving complete\n");
+        dns_cache_store(hostname, ipaddr);
         tls_client_connect_to_server_ip(ipaddr, (TLS_CLIENT_T *) arg);
+    } else if (dns_cache_get_fallback(hostname, &fallback_ip)) {
+        multi_printf("error resolving hostname %s, using fallback address\n", hostname);
+        tls_client_connect_to_server_ip(&fallback_ip, (TLS_CLIENT_T *) arg);
     } else {
         multi_printf("error resolving hostname %s\n", hostname);
         ((TLS_CLIENT_T *) arg)->error = PICO_ERROR_NO_DATA;
@@ -132,6 +223,7 @@ static bool tls_client_open(const char *hostname, void *arg) {
     ip_addr_t server_ip;
     TLS_CLIENT_T *state = (TLS_CLIENT_T *) arg;
 
+    state->hostname = hostname;
     state->pcb = altcp_tls_new(tls_config, IPADDR_TYPE_ANY);
     if (!state->pcb) {
         multi_printf("failed to create pcb\n");
@@ -139,13 +231,20 @@ static bool tls_client_open(const char *hostname, void *arg) {
     }
 
     altcp_arg(state->pcb, state);
-    altcp_poll(state->pcb, tls_client_poll, state->timeout * 2);
+    altcp_poll(state->pcb, tls_client_poll, HTTPS_POLL_INTERVAL);
     altcp_recv(state->pcb, tls_client_recv);
     altcp_err(state->pcb, tls_client_err);
 
     /* Set SNI */
     mbedtls_ssl_set_hostname(altcp_tls_context(state->pcb), hostname);
 
+    if (dns_cache_lookup(hostname, &server_ip)) {
+        cyw43_arch_lwip_begin();
+        tls_client_connect_to_server_ip(&server_ip, state);
+        cyw43_arch_lwip_end();
+        return true;
+    }
+
     multi_printf("resolving %s\n", hostname);
 
     // cyw43_arch_lwip_begin/end should be used around calls into lwIP to ensure correct locking.
@@ -154,13 +253,16 @@ static bool tls_client_open(const char *hostname, void *arg) {
     // case you switch the cyw43_arch type later.
     cyw43_arch_lwip_begin();
 
+    state->dns_start = latency_start();
     err = dns_gethostbyname(hostname, &server_ip, tls_client_dns_found, state);
     if (err == ERR_OK) {
         /* host is in DNS cache */
+        dns_cache_store(hostname, &server_ip);
         tls_client_connect_to_server_ip(&server_ip, state);
     } else if (err != ERR_INPROGRESS) {
         multi_printf("error initiating DNS resolving, err=%d\n", err);
-        tls_client_close(state->pcb);
+        tls_client_dns_found(hostname, NULL, state);
+        err = state->error ? err : ERR_OK;
     }
 
     cyw43_arch_lwip_end();
@@ -179,8 +281,77 @@ static TLS_CLIENT_T *tls_client_init(void) {
     return state;
 }
 
-bool send_https_request(const uint8_t *cert, size_t cert_len, const char *server, const char *request,
-                        size_t request_len, int timeout) {
+/**
+ * @brief Pass the received data on to the consumer and acknowledge it
+ * @param state The request
+ * @return True if there was any data
+ */
+static bool pass_on_received(TLS_CLIENT_T *state) {
+    cyw43_arch_lwip_begin();
+    struct pbuf *p = state->received;
+    state->received = NULL;
+    cyw43_arch_lwip_end();
+
+    if (!p) {
+        return false;
+    }
+
+    // Outside of the lwIP lock, so the consumer can take its time, write flash for instance
+    bool keep_going = state->error == 0;
+    for (struct pbuf *q = p; q && keep_going; q = q->next) {
+        keep_going = state->on_response(q->payload, q->len, state->response_arg);
+    }
+
+    cyw43_arch_lwip_begin();
+    if (state->pcb) {
+        altcp_recved(state->pcb, p->tot_len);
+        if (!keep_going) {
+            multi_printf("response rejected, closing\n");
+            state->error = PICO_ERROR_GENERIC;
+            tls_client_close(state);
+        }
+    } else if (!keep_going && state->error == 0) {
+        state->error = PICO_ERROR_GENERIC;
+    }
+    pbuf_free(p);
+    cyw43_arch_lwip_end();
+    return true;
+}
+
+static bool copy_to_buffer(const uint8_t *data, size_t len, void *arg) {
+    response_buffer_t *response = (response_buffer_t *) arg;
+
+    // Keep as much of the response as fits, the rest is dropped
+    size_t space = response->size - response->len - 1;
+    if (len > space) {
+        len = space;
+    }
+    memcpy(response->buffer + response->len, data, len);
+    response->len += len;
+    response->buffer[response->len] = '\0';
+    return true;
+}
+
+/**
+ * @brief Send a request over HTTPS and pass the response on as it arrives, until the server closes the connection
+ * @param cert The CA certificate of the server
+ * @param cert_len Length of the certificate
+ * @param server Hostname of the server
+ * @param request The complete HTTP request
+ * @param request_len Length of the request
+ * @param timeout How long the connection may stall, in whole seconds, must be positive
+ * @param on_response Called from the main loop with every part of the response, headers included
+ * @param arg Passed to on_response
+ * @return True if the request was sent, the whole response was taken and the server closed the connection
+ */
+bool send_https_request_streamed(const uint8_t *cert, size_t cert_len, const char *server, const char *request,
+                                 size_t request_len, int timeout, https_response_fn_t on_response, void *arg) {
+    uint32_t request_start = latency_start();
+
+    if (timeout <= 0) {
+        multi_printf("invalid timeout %d s\n", timeout);
+        return false;
+    }
 
     tls_config = altcp_tls_create_config_client(cert, cert_len);
     assert(tls_config);
@@ -190,19 +361,53 @@ bool send_https_request(const uint8_t *cert, size_t cert_len, const char *server
 
     TLS_CLIENT_T *state = tls_client_init();
     if (!state) {
+        altcp_tls_free_config(tls_config);
+        latency_end(LATENCY_REQUEST, request_start);
         return false;
     }
     state->http_request = request;
     state->http_request_len = request_len;
     state->timeout = timeout;
+    state->on_response = on_response;
+    state->response_arg = arg;
     if (!tls_client_open(server, state)) {
+        free(state);
+        altcp_tls_free_config(tls_config);
+        latency_end(LATENCY_REQUEST, request_start);
         return false;
     }
-    while (!state->complete) {
+    while (!state->complete || state->received) {
         watchdog_update();
+        multi_printf_flush();
+        if (pass_on_received(state)) {
+            continue;
+        }
+        // lwIP runs from interrupts in the background, so sleep until one of them has had a chance to finish the request
+        best_effort_wfe_or_timeout(make_timeout_time_ms(HTTPS_WAIT_SLEEP_MS));
     }
     int err = state->error;
     free(state);
     altcp_tls_free_config(tls_config);
+    latency_end(LATENCY_REQUEST, request_start);
     return err == 0;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Send a request over HTTPS and wait for the server to close the connection
+ * @param cert The CA certificate of the server
+ * @param cert_len Length of the certificate
+ * @param server Hostname of the server
+ * @param request The complete HTTP request
+ * @param request_len Length of the request
+ * @param timeout How long the connection may stall, in whole seconds, must be positive
+ * @param response Filled with the start of the response, terminated. Empty if nothing was received
+ * @param response_size Size of the response buffer
+ * @return True if the request was sent and the server closed the connection
+ */
+bool send_https_request(const uint8_t *cert, size_t cert_len, const char *server, const char *request,
+                        size_t request_len, int timeout, char *response, size_t response_size) {
+    response_buffer_t buffer = {.buffer = response, .size = response_size, .len = 0};
+    response[0] = '\0';
+    return send_https_request_streamed(cert, cert_len, server, request, request_len, timeout, copy_to_buffer,
+                                       &buffer);
+}
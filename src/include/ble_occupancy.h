@@ -0,0 +1,21 @@
+#ifndef LIVE_ROOM_SENSOR_BLE_OCCUPANCY_H
+#define LIVE_ROOM_SENSOR_BLE_OCCUPANCY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Register the occupancy GATT service and start advertising it. Must be called before BTstack is powered on
+ */
+void ble_occupancy_init();
+
+/**
+ * @brief Publish the fused state, subscribed clients are notified of the values that changed.
+ * Must be called from the main loop
+ * @param count The fused number of occupants
+ * @param confidence How likely the fused state is to be right, in per mille
+ * @param motion True if the PIR sees motion
+ */
+void ble_occupancy_update(int16_t count, uint16_t confidence, bool motion);
+
+#endif//LIVE_ROOM_SENSOR_BLE_OCCUPANCY_H
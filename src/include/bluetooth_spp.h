@@ -9,24 +9,30 @@
 
 int btstack_init();
 
+/**
+ * Split what the client sent into lines and execute them. Runs as a task, so a slow command does not hold up BTstack
+ */
+void bluetooth_console_task();
+
 
 bool bluetooth_printf(const char *__restrict, ...)
 _ATTRIBUTE ((__format__(__printf__, 1, 2)));
 
-bool bluetooth_vprintf(const char *format, va_list args);
-
 /**
- * @brief Mark buffer as ready to send
- * @param buffer buffer to send
- * @param actual_size actual size of the buffer
+ * @brief Format a message straight into the send ring, so a long line needs no buffer on the stack and is not cut
+ * short. Must be called from the main loop
+ * @param format The format string
+ * @param args The arguments
+ * @return True if the message was queued, False if no client is connected or there is not room for all of it
  */
-bool mark_buffer_to_send(const uint8_t *buffer, size_t actual_size);
+bool bluetooth_vprintf(const char *format, va_list args);
 
 /**
- * @brief Get a free send buffer
- * @param prelim_size preliminary size of the buffer. The actual size of the buffer may be smaller
- * @return buffer or NULL if no buffer is available or size is too large or no client is connected
+ * @brief Queue raw bytes to send to the client. Must be called from the main loop
+ * @param data The bytes to send
+ * @param len Number of bytes
+ * @return True if the bytes were queued, False if no client is connected or there is not room for all of them
  */
-uint8_t *get_free_send_buffer(size_t prelim_size);
+bool bluetooth_write(const uint8_t *data, size_t len);
 
 #endif //LIVE_ROOM_SENSOR_BLUETOOTH_SPP_H
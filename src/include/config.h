@@ -0,0 +1,77 @@
+#ifndef LIVE_ROOM_SENSOR_CONFIG_H
+#define LIVE_ROOM_SENSOR_CONFIG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Room for a hostname or path and its terminator
+#define CONFIG_STRING_LEN 64
+
+typedef struct {
+    uint32_t report_interval_ms;        // How often a report is sent
+    uint32_t pir_timeout_ms;            // How long after the last PIR trigger a report still says there was motion
+    uint32_t count_window_ms;           // Time constant of the averaged radar count
+    uint32_t radar_reset_timeout_ms;    // Least time between two resets of a radar that stopped sending counts
+    uint32_t radar_sensitivity_percent; // Weight of a radar detection in the fusion filter, 100 is the built in weight
+    uint32_t send_raw_stats;            // 1 to add the raw radar and request counters to every report
+    char reporting_server[CONFIG_STRING_LEN];
+    char reporting_path[CONFIG_STRING_LEN];
+} config_t;
+
+typedef enum {
+    CONFIG_OK,
+    CONFIG_UNKNOWN_KEY,
+    CONFIG_INVALID_VALUE,
+} config_result_t;
+
+// The settings in effect. Read it directly, also from interrupts, but only change it through config_set()
+extern config_t config;
+
+/**
+ * Load the settings stored in flash over the built in defaults. Must be called before the other modules are
+ * initialized, they take their settings from config
+ */
+void config_init();
+
+/**
+ * @brief Change a setting and apply it straight away. It is not stored until config_save() is called.
+ * Must be called from the main loop
+ * @param key The name of the setting
+ * @param value The new value as text
+ * @return CONFIG_OK if the setting was changed
+ */
+config_result_t config_set(const char *key, const char *value);
+
+/**
+ * @brief Change a setting on behalf of the reporting server, like config_set(). Only the settings meant for tuning
+ * the sensor from the server can be changed this way, the others are reported as unknown
+ * @param key The name of the setting
+ * @param value The new value as text
+ * @return CONFIG_OK if the setting was changed
+ */
+config_result_t config_set_directive(const char *key, const char *value);
+
+/**
+ * @brief Store the settings in flash, so they survive a reset. Does nothing if they did not change since they
+ * were last stored
+ * @return True if the settings are stored
+ */
+bool config_save();
+
+/**
+ * @brief Go back to the built in defaults, in effect straight away and stored
+ * @return True if the defaults are stored
+ */
+bool config_reset();
+
+/**
+ * @brief Get a setting, for listing them all
+ * @param index Index of the setting
+ * @param value Filled with the value as text
+ * @param size Size of the value buffer
+ * @return The name of the setting, NULL if there is no setting with that index
+ */
+const char *config_get(uint8_t index, char *value, size_t size);
+
+#endif//LIVE_ROOM_SENSOR_CONFIG_H
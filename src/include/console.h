@@ -0,0 +1,36 @@
+#ifndef LIVE_ROOM_SENSOR_CONSOLE_H
+#define LIVE_ROOM_SENSOR_CONSOLE_H
+
+#include <stdint.h>
+
+#define CONSOLE_MAX_ARGS 4
+
+/**
+ * @brief Handles a console command
+ * @param argc Number of arguments, 0 if the command had no =
+ * @param argv The arguments, split at the commas. The last one a command takes holds the rest of the line
+ */
+typedef void (*console_handler_t)(uint8_t argc, char *argv[]);
+
+typedef struct {
+    const char *name;    // Without the AT+ prefix
+    const char *usage;   // What goes after the =, NULL if the command takes no arguments
+    const char *help;
+    uint8_t min_args;
+    uint8_t max_args;
+    console_handler_t handler;
+} console_command_t;
+
+/**
+ * Check the command table, must be called once before the first command is executed. Stops the firmware if the
+ * table is not sorted, so a command added in the wrong place shows on the first boot rather than going missing
+ */
+void console_init();
+
+/**
+ * @brief Execute a console command line. Must be called from the main loop
+ * @param line The line without its line ending, split into arguments in place
+ */
+void console_execute(char *line);
+
+#endif//LIVE_ROOM_SENSOR_CONSOLE_H
@@ -0,0 +1,50 @@
+#ifndef LIVE_ROOM_SENSOR_DNS_CACHE_H
+#define LIVE_ROOM_SENSOR_DNS_CACHE_H
+
+#include <stdbool.h>
+#include "lwip/ip_addr.h"
+
+/**
+ * @brief Initialize the DNS cache for a host. It is resolved in the background on the next tick
+ * @param hostname The hostname to keep resolved. Must stay valid for the lifetime of the program, call this again
+ * when it changes
+ * @param fallback_ip Static IP address used if the host has never been resolved, or NULL for none
+ */
+void dns_cache_init(const char *hostname, const char *fallback_ip);
+
+/**
+ * @brief Get the cached address of a host
+ * Returns the last address the resolver gave us, even if the resolver has since become unreachable
+ * @param hostname The hostname to look up
+ * @param addr Filled with the address if one is available
+ * @return True if the host has been resolved before, False otherwise
+ */
+bool dns_cache_lookup(const char *hostname, ip_addr_t *addr);
+
+/**
+ * @brief Get the static fallback address of a host, for when it has never been resolved
+ * @param hostname The hostname to look up
+ * @param addr Filled with the address if one is configured
+ * @return True if a fallback address is configured, False otherwise
+ */
+bool dns_cache_get_fallback(const char *hostname, ip_addr_t *addr);
+
+/**
+ * @brief Store a freshly resolved address for a host
+ * @param hostname The hostname that was resolved
+ * @param addr The resolved address
+ */
+void dns_cache_store(const char *hostname, const ip_addr_t *addr);
+
+/**
+ * @brief Drop the cached address of a host after a connection to it failed, it is resolved again on the next tick
+ * @param hostname The hostname
+ */
+void dns_cache_invalidate(const char *hostname);
+
+/**
+ * Tick function to be called periodically while the network is up. Refreshes the cached address in the background
+ */
+void dns_cache_tick(void);
+
+#endif//LIVE_ROOM_SENSOR_DNS_CACHE_H
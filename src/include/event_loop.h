@@ -0,0 +1,84 @@
+#ifndef LIVE_ROOM_SENSOR_EVENT_LOOP_H
+#define LIVE_ROOM_SENSOR_EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Work the main loop has to do. Events are posted by interrupts and the lwIP and BTstack callbacks, a task runs when
+// one of its events is posted or its period is due, and the main loop sleeps in between
+#define EVENT_SENSOR (1u << 0)   // PIR edges or a radar count to feed to the sensor fusion
+#define EVENT_RADAR (1u << 1)    // Radar reset requests and queued commands
+#define EVENT_WIFI (1u << 2)     // Wifi link changes
+#define EVENT_LOG (1u << 3)      // Log records waiting to be flushed
+#define EVENT_RESET (1u << 4)    // A reset has been requested
+#define EVENT_CONSOLE (1u << 5)  // A console command has been received
+#define EVENT_SPP_DRAINED (1u << 6)// Everything queued for the Bluetooth SPP client has been sent
+#define EVENT_MIRROR (1u << 7)   // Raw radar frames waiting for the UDP collector
+#define EVENT_OTA (1u << 8)      // A firmware update has been requested
+
+typedef void (*event_loop_task_fn_t)();
+
+typedef struct {
+    const char *name;
+    uint32_t runs;
+    uint64_t total_runtime_us;
+    uint32_t max_runtime_us;
+    uint32_t deadline_misses;
+} event_loop_task_stats_t;
+
+/**
+ * Initialize the event loop, must be called before any event is posted
+ */
+void event_loop_init();
+
+/**
+ * @brief Post events to the main loop. Safe to call from any context
+ * @param events The events to post
+ */
+void event_loop_post(uint32_t events);
+
+/**
+ * @brief Register a task. Tasks run in the order they were added
+ * @param name Name of the task in the statistics
+ * @param events The events that run the task, 0 for none
+ * @param period_ms How often to run the task, 0 to only run it for its events
+ * @param deadline_ms How long after its release the task must have finished, 0 for no deadline
+ * @param fn The task
+ * @return True if the task was added
+ */
+bool event_loop_add_task(const char *name, uint32_t events, uint32_t period_ms, uint32_t deadline_ms,
+                         event_loop_task_fn_t fn);
+
+/**
+ * @brief Change how often a task runs. The next periodic run is one new period from now
+ * @param fn The task
+ * @param period_ms How often to run the task, 0 to only run it for its events
+ * @return False if the task is not registered
+ */
+bool event_loop_set_task_period(event_loop_task_fn_t fn, uint32_t period_ms);
+
+/**
+ * @brief Get the statistics of a task
+ * @param index Index of the task, in the order they were added
+ * @param stats Where to store the statistics
+ * @return False if there is no task with that index
+ */
+bool event_loop_get_task_stats(uint8_t index, event_loop_task_stats_t *stats);
+
+/**
+ * @return How long after its release the running task started, in µs. Only valid when called from a task
+ */
+uint32_t event_loop_get_task_delay_us();
+
+/**
+ * Run the tasks forever. Sleeps until a task has an event posted or its period is due, and feeds the watchdog
+ */
+void event_loop_run() __attribute__((noreturn));
+
+/**
+ * @brief Get how much of the time since the last call was spent asleep, less the time in the radar interrupt
+ * @return Idle time in per mille
+ */
+uint16_t event_loop_take_idle_permille();
+
+#endif//LIVE_ROOM_SENSOR_EVENT_LOOP_H
@@ -0,0 +1,70 @@
+#ifndef LIVE_ROOM_SENSOR_FLASH_STORAGE_H
+#define LIVE_ROOM_SENSOR_FLASH_STORAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hardware/flash.h"
+#include "pico/btstack_flash_bank.h"
+
+// Sectors reserved for our own persistent data, counted down from the sectors btstack uses for its link keys
+#define FLASH_STORAGE_WIFI_CACHE_OFFSET (PICO_FLASH_BANK_STORAGE_OFFSET - FLASH_SECTOR_SIZE)
+#define FLASH_STORAGE_CONFIG_OFFSET (FLASH_STORAGE_WIFI_CACHE_OFFSET - FLASH_STORAGE_LOG_SECTORS * FLASH_SECTOR_SIZE)
+
+// A record log spans this many sectors, so the sector holding the newest record is never the one being erased
+#define FLASH_STORAGE_LOG_SECTORS 2
+
+// Largest record a log holds, every record takes one flash page
+#define FLASH_STORAGE_LOG_MAX_LEN (FLASH_PAGE_SIZE - 16)
+
+/**
+ * @brief Read a record previously written with flash_storage_write
+ * @param offset Offset of the sector holding the record from the start of flash
+ * @param data Filled with the record
+ * @param len Size of the record
+ * @return True if a valid record of this size was found, False otherwise
+ */
+bool flash_storage_read(uint32_t offset, void *data, size_t len);
+
+/**
+ * @brief Erase a sector and write a record to it
+ * Interrupts are disabled while the flash is erased and programmed, so this should not be called often.
+ * @param offset Offset of the sector to write from the start of flash
+ * @param data The record to write
+ * @param len Size of the record. Must fit in a sector together with the record header
+ * @return True if the record was written, False otherwise
+ */
+bool flash_storage_write(uint32_t offset, const void *data, size_t len);
+
+/**
+ * @brief Read the newest record of a log written with flash_storage_log_write
+ * @param offset Offset of the first sector of the log from the start of flash
+ * @param data Filled with the record
+ * @param max_len Size of the buffer
+ * @return The length of the record, 0 if the log holds no valid record that fits the buffer
+ */
+size_t flash_storage_log_read(uint32_t offset, void *data, size_t max_len);
+
+/**
+ * @brief Append a record to a log. Every record takes the next erased page and a sector is only erased when the
+ * log wraps around into it, so it is erased once per FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE writes instead of every
+ * write. The records before stay valid until the new one has been written.
+ * Interrupts are disabled while the flash is erased and programmed, so this should not be called often.
+ * @param offset Offset of the first sector of the log from the start of flash
+ * @param data The record to write
+ * @param len Size of the record, at most FLASH_STORAGE_LOG_MAX_LEN
+ * @return True if the record was written, False otherwise
+ */
+bool flash_storage_log_write(uint32_t offset, const void *data, size_t len);
+
+/**
+ * @brief Calculate the CRC-32 of a buffer
+ * @param crc CRC of the preceding data, or 0 to start a new calculation
+ * @param data The data
+ * @param len Length of the data
+ * @return The CRC-32
+ */
+uint32_t flash_storage_crc32(uint32_t crc, const void *data, size_t len);
+
+#endif//LIVE_ROOM_SENSOR_FLASH_STORAGE_H
@@ -0,0 +1,16 @@
+#ifndef LIVE_ROOM_SENSOR_HOT_PATH_H
+#define LIVE_ROOM_SENSOR_HOT_PATH_H
+
+// Functions on the radar and PIR ingest path: the interrupt handlers, the framers and what they call per frame.
+// Built with RAM_HOT_PATH they run from SRAM, so a cache miss after mbedTLS or BTstack evicted them from the XIP
+// cache no longer adds to their latency. They all go in the .time_critical.hot_path section, which the SDK linker
+// script copies to SRAM with the rest of .time_critical, and which shows up on its own in the map file.
+// Without RAM_HOT_PATH the annotation does nothing, which also keeps the host tools building
+#ifdef RAM_HOT_PATH
+#include "pico/platform.h"
+#define __hot_path_func(func_name) __not_in_flash("hot_path") func_name
+#else
+#define __hot_path_func(func_name) func_name
+#endif
+
+#endif//LIVE_ROOM_SENSOR_HOT_PATH_H
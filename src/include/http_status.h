@@ -0,0 +1,16 @@
+#ifndef LIVE_ROOM_SENSOR_HTTP_STATUS_H
+#define LIVE_ROOM_SENSOR_HTTP_STATUS_H
+
+#define HTTP_STATUS_PORT 80
+
+/**
+ * Start listening for status and metrics requests on the wireless interface
+ */
+void http_status_init();
+
+/**
+ * Render the responses to the next requests from the current state. Must be called from the main loop
+ */
+void http_status_task();
+
+#endif//LIVE_ROOM_SENSOR_HTTP_STATUS_H
@@ -5,8 +5,43 @@
 #include <stddef.h>
 #include <stdint.h>
 
-bool
-send_https_request(const uint8_t *cert, size_t cert_len, const char *server, const char *request, size_t request_len,
-                   int timeout);
+/**
+ * @brief Takes the next part of a response
+ * @param data The data
+ * @param len Length of the data
+ * @param arg The argument given with the request
+ * @return False to abort the request
+ */
+typedef bool (*https_response_fn_t)(const uint8_t *data, size_t len, void *arg);
+
+/**
+ * @brief Send a request over HTTPS and wait for the server to close the connection
+ * @param cert The CA certificate of the server
+ * @param cert_len Length of the certificate
+ * @param server Hostname of the server
+ * @param request The complete HTTP request
+ * @param request_len Length of the request
+ * @param timeout How long the connection may stall, in whole seconds, must be positive
+ * @param response Filled with the start of the response, terminated. Empty if nothing was received
+ * @param response_size Size of the response buffer
+ * @return True if the request was sent and the server closed the connection
+ */
+bool send_https_request(const uint8_t *cert, size_t cert_len, const char *server, const char *request,
+                        size_t request_len, int timeout, char *response, size_t response_size);
+
+/**
+ * @brief Send a request over HTTPS and pass the response on as it arrives, until the server closes the connection
+ * @param cert The CA certificate of the server
+ * @param cert_len Length of the certificate
+ * @param server Hostname of the server
+ * @param request The complete HTTP request
+ * @param request_len Length of the request
+ * @param timeout How long the connection may stall, in whole seconds, must be positive
+ * @param on_response Called from the main loop with every part of the response, headers included
+ * @param arg Passed to on_response
+ * @return True if the request was sent, the whole response was taken and the server closed the connection
+ */
+bool send_https_request_streamed(const uint8_t *cert, size_t cert_len, const char *server, const char *request,
+                                 size_t request_len, int timeout, https_response_fn_t on_response, void *arg);
 
 #endif//LIVE_ROOM_SENSOR_HTTPS_H
@@ -0,0 +1,19 @@
+#ifndef LIVE_ROOM_SENSOR_ISR_BENCHMARK_H
+#define LIVE_ROOM_SENSOR_ISR_BENCHMARK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Measure interrupt latency for a while, to compare builds with and without RAM_HOT_PATH.
+ * Clears all latency histograms, then fires a timer interrupt every millisecond that records how late its handler
+ * started and how long the per frame radar code takes in it. Run it across at least one report, so TLS runs
+ * meanwhile, and read the results with AT+LATENCY: bench-entry, bench-hot-path, uart-isr and frame-parse
+ * @param seconds How long to run, up to ISR_BENCHMARK_MAX_SECONDS
+ * @return False if the duration is out of range or there is no free timer alarm
+ */
+bool isr_benchmark_start(uint32_t seconds);
+
+#define ISR_BENCHMARK_MAX_SECONDS 3600
+
+#endif//LIVE_ROOM_SENSOR_ISR_BENCHMARK_H
@@ -0,0 +1,103 @@
+#ifndef LIVE_ROOM_SENSOR_LATENCY_H
+#define LIVE_ROOM_SENSOR_LATENCY_H
+
+#include <stdint.h>
+#include "pico/time.h"
+
+// Bucket n counts durations from 2^(n-1) up to 2^n µs, bucket 0 durations under 1 µs.
+// The last bucket also counts everything longer, from 4.2 s, which is close to the watchdog timeout
+#define LATENCY_BUCKET_COUNT 24
+
+typedef enum {
+    LATENCY_UART_ISR,      // One invocation of the radar UART interrupt
+    LATENCY_FRAME_PARSE,   // Parsing one complete radar frame
+    LATENCY_SENSOR_DELAY,  // How late the sensor task starts after it was due
+    LATENCY_REPORT_FORMAT, // Formatting the report request
+    LATENCY_DNS,           // A DNS query, from sending it to the answer
+    LATENCY_CONNECT,       // The TCP handshake with the reporting server
+    LATENCY_TLS_HANDSHAKE, // The TLS handshake, after the TCP handshake
+    LATENCY_RESPONSE,      // From sending the request to the first byte of the response
+    LATENCY_REQUEST,       // A whole report request, the main loop does not feed the watchdog from elsewhere meanwhile
+    LATENCY_BENCH_ENTRY,   // ISR benchmark: from the timer alarm to the start of its handler
+    LATENCY_BENCH_HOT_PATH,// ISR benchmark: the handler running the estimator and statistics code of a radar frame
+    LATENCY_PROBE_COUNT
+} latency_probe_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t total_us;
+    uint32_t buckets[LATENCY_BUCKET_COUNT];
+} latency_histogram_t;
+
+/**
+ * @param duration_us A duration in µs
+ * @return The histogram bucket the duration falls in
+ */
+static inline uint8_t latency_bucket(uint32_t duration_us) {
+    uint8_t bucket = duration_us ? 32 - __builtin_clz(duration_us) : 0;
+    return bucket < LATENCY_BUCKET_COUNT ? bucket : LATENCY_BUCKET_COUNT - 1;
+}
+
+/**
+ * @brief Record a duration at a probe. Safe to call from any context, it takes a few dozen cycles
+ * @param probe The probe
+ * @param duration_us The duration in µs
+ */
+void latency_record(latency_probe_t probe, uint32_t duration_us);
+
+/**
+ * @return A timestamp to pass to latency_end()
+ */
+static inline uint32_t latency_start() {
+    return time_us_32();
+}
+
+/**
+ * @brief Record the time since a timestamp at a probe
+ * @param probe The probe
+ * @param start The timestamp from latency_start()
+ */
+static inline void latency_end(latency_probe_t probe, uint32_t start) {
+    latency_record(probe, time_us_32() - start);
+}
+
+/**
+ * @brief Get a copy of the histogram of a probe, it covers the time since boot
+ * @param probe The probe
+ * @param histogram Where to store the copy
+ */
+void latency_get(latency_probe_t probe, latency_histogram_t *histogram);
+
+/**
+ * @brief Get the sum of all durations recorded at a probe, without copying its histogram
+ * @param probe The probe
+ * @return The sum in µs
+ */
+uint64_t latency_total_us(latency_probe_t probe);
+
+/**
+ * @brief Estimate a percentile from a histogram
+ * @param histogram The histogram
+ * @param permille The percentile in per mille, 500 for the median
+ * @return The upper end of the bucket the percentile falls in, in µs, capped at the longest duration recorded
+ */
+uint32_t latency_percentile_us(const latency_histogram_t *histogram, uint16_t permille);
+
+/**
+ * Clear the histograms of all probes
+ */
+void latency_reset();
+
+/**
+ * @param probe The probe
+ * @return The name of the probe as shown on the console
+ */
+const char *latency_probe_name(latency_probe_t probe);
+
+/**
+ * Log a one line summary of every probe that has recorded anything, for the periodic health report
+ */
+void latency_log_summary();
+
+#endif//LIVE_ROOM_SENSOR_LATENCY_H
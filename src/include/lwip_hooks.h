@@ -0,0 +1,26 @@
+#ifndef LIVE_ROOM_SENSOR_LWIP_HOOKS_H
+#define LIVE_ROOM_SENSOR_LWIP_HOOKS_H
+
+#include "lwip/arch.h"
+#include "lwip/err.h"
+
+struct tcp_pcb;
+struct tcp_hdr;
+struct pbuf;
+
+/**
+ * @brief Called by lwIP for every TCP segment that arrives for a connection, see LWIP_HOOK_TCP_INPACKET_PCB
+ * @param pcb The connection
+ * @param hdr The TCP header of the segment
+ * @param optlen Length of the TCP options
+ * @param opt1len Length of the options in the first pbuf
+ * @param opt2 Options in the next pbuf, NULL if they are all in the first one
+ * @param p The segment
+ * @return ERR_OK to process the segment
+ */
+err_t https_tcp_inpacket_hook(struct tcp_pcb *pcb, struct tcp_hdr *hdr, u16_t optlen, u16_t opt1len, u8_t *opt2,
+                              struct pbuf *p);
+
+#define LWIP_HOOK_TCP_INPACKET_PCB https_tcp_inpacket_hook
+
+#endif//LIVE_ROOM_SENSOR_LWIP_HOOKS_H
@@ -14,6 +14,8 @@
 #define MEM_ALIGNMENT 4
 #define MEM_SIZE 4000
 #define MEMP_NUM_TCP_SEG 32
+// The reporting connection and the status server's connections, with room for those in TIME_WAIT
+#define MEMP_NUM_TCP_PCB 8
 #define MEMP_NUM_ARP_QUEUE 10
 #define PBUF_POOL_SIZE 24
 #define LWIP_ARP 1
@@ -41,8 +43,12 @@
 #define LWIP_DNS 1
 #define LWIP_TCP_KEEPALIVE 1
 #define LWIP_NETIF_TX_SINGLE_PBUF 1
+// The radar mirror sends its frames from its own buffers
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
 #define DHCP_DOES_ARP_CHECK 0
 #define LWIP_DHCP_DOES_ACD_CHECK 0
+// Lets https.c time the TCP handshake underneath altcp_tls
+#define LWIP_HOOK_FILENAME "lwip_hooks.h"
 
 #ifndef NDEBUG
 #define LWIP_DEBUG 1
@@ -5,12 +5,28 @@
 
 #include <stdint.h>
 
+// Size of the UART receive buffer, no frame is longer
+#define MICRADAR_RX_BUF_SIZE 256
+
 /**
  * Get the current averaged count of detected objects
  * @return
  */
 int16_t micradar_get_current_count();
 
+/**
+ * @brief Change the time constant of the averaged count
+ * @param window_ms The new time constant
+ */
+void micradar_set_count_window(uint32_t window_ms);
+
+/**
+ * @brief Get the frame counters of the radar since boot
+ * @param frames Set to the number of complete frames received
+ * @param errors Set to the number of frames dropped for a bad checksum or for not fitting the receive buffer
+ */
+void micradar_get_frame_counters(uint32_t *frames, uint32_t *errors);
+
 
 /**
  * Initialize the radar sensor
@@ -6,6 +6,9 @@
 #include <stdbool.h>
 #include "stdint.h"
 
+// Size of the UART receive buffer, no frame is longer
+#define MINEWSEMI_RX_BUF_SIZE 8192
+
 /**
  * Initialize the radar sensor
  */
@@ -17,6 +20,19 @@ void minewsemi_init(void);
  */
 int16_t minewsemi_get_current_count(void);
 
+/**
+ * @brief Change the time constant of the averaged count
+ * @param window_ms The new time constant
+ */
+void minewsemi_set_count_window(uint32_t window_ms);
+
+/**
+ * @brief Get the frame counters of the radar since boot
+ * @param frames Set to the number of complete frames received
+ * @param errors Set to the number of frames dropped for an invalid layout or length
+ */
+void minewsemi_get_frame_counters(uint32_t *frames, uint32_t *errors);
+
 /**
  * Tick function to be called periodically
  */
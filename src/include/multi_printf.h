@@ -1,14 +1,165 @@
 #ifndef LIVE_ROOM_SENSOR_DUAL_PRINTF_H
 #define LIVE_ROOM_SENSOR_DUAL_PRINTF_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include "_ansi.h"
 
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+} log_level_t;
+
+typedef enum {
+    LOG_MODULE_MAIN,
+    LOG_MODULE_RADAR,
+    LOG_MODULE_PIR,
+    LOG_MODULE_SENSOR,
+    LOG_MODULE_WIFI,
+    LOG_MODULE_NET,
+    LOG_MODULE_REPORTING,
+    LOG_MODULE_BLUETOOTH,
+    LOG_MODULE_STORAGE,
+    LOG_MODULE_OTA,
+    LOG_MODULE_COUNT
+} log_module_t;
+
+// A source file logs as its own module by defining LOG_MODULE before it includes this header
+#ifndef LOG_MODULE
+#define LOG_MODULE LOG_MODULE_MAIN
+#endif
+
+extern volatile uint8_t log_levels[LOG_MODULE_COUNT];
+
+// Format strings are collected in the log_strings section, an offset into it is the token of the string in a binary
+// log. The section is extracted from the ELF file into the dictionary that tools/log_decode.py needs
+#define LOG_STRING(string) ({ static const char __attribute__((section("log_strings"))) log_string[] = string; log_string; })
+
+// How an argument is stored in a record. The tags of all the arguments of a call are worked out when it is compiled
+// and passed along, so a record is captured without looking at the format string, which is left to the flush
+typedef enum {
+    LOG_ARG_NONE,
+    LOG_ARG_WORD,
+    LOG_ARG_WIDE,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STRING
+} log_arg_tag_t;
+
+#define LOG_ARG_TAG_BITS 4
+#define LOG_MAX_ARGS 8
+
+// char pointers are taken as strings, a string in RAM is copied into the record as it may be gone by the flush
+#define LOG_ARG_TAG(arg) _Generic((arg) + 0,                                               \
+        char *: LOG_ARG_STRING,                                                            \
+        const char *: LOG_ARG_STRING,                                                      \
+        volatile char *: LOG_ARG_STRING,                                                   \
+        unsigned char *: LOG_ARG_STRING,                                                   \
+        const unsigned char *: LOG_ARG_STRING,                                             \
+        volatile unsigned char *: LOG_ARG_STRING,                                          \
+        float: LOG_ARG_DOUBLE,                                                             \
+        double: LOG_ARG_DOUBLE,                                                            \
+        default: sizeof((arg) + 0) > sizeof(uint32_t) ? LOG_ARG_WIDE : LOG_ARG_WORD)
+
+#define LOG_ARG_COUNT(format, ...) LOG_ARG_COUNT_(format, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_ARG_COUNT_(format, _1, _2, _3, _4, _5, _6, _7, _8, count, ...) count
+#define LOG_ARG_TAGS_SELECT(count) LOG_ARG_TAGS_SELECT_(count)
+#define LOG_ARG_TAGS_SELECT_(count) LOG_ARG_TAGS_##count
+#define LOG_ARG_TAGS_0() 0
+#define LOG_ARG_TAGS_1(arg) ((uint32_t) LOG_ARG_TAG(arg))
+#define LOG_ARG_TAGS_2(arg, ...) (LOG_ARG_TAGS_1(arg) | (LOG_ARG_TAGS_1(__VA_ARGS__) << LOG_ARG_TAG_BITS))
+#define LOG_ARG_TAGS_3(arg, ...) (LOG_ARG_TAGS_1(arg) | (LOG_ARG_TAGS_2(__VA_ARGS__) << LOG_ARG_TAG_BITS))
+#define LOG_ARG_TAGS_4(arg, ...) (LOG_ARG_TAGS_1(arg) | (LOG_ARG_TAGS_3(__VA_ARGS__) << LOG_ARG_TAG_BITS))
+#define LOG_ARG_TAGS_5(arg, ...) (LOG_ARG_TAGS_1(arg) | (LOG_ARG_TAGS_4(__VA_ARGS__) << LOG_ARG_TAG_BITS))
+#define LOG_ARG_TAGS_6(arg, ...) (LOG_ARG_TAGS_1(arg) | (LOG_ARG_TAGS_5(__VA_ARGS__) << LOG_ARG_TAG_BITS))
+#define LOG_ARG_TAGS_7(arg, ...) (LOG_ARG_TAGS_1(arg) | (LOG_ARG_TAGS_6(__VA_ARGS__) << LOG_ARG_TAG_BITS))
+#define LOG_ARG_TAGS_8(arg, ...) (LOG_ARG_TAGS_1(arg) | (LOG_ARG_TAGS_7(__VA_ARGS__) << LOG_ARG_TAG_BITS))
+
+// The tags of up to LOG_MAX_ARGS arguments, the first in the lowest bits. More arguments do not compile
+#define LOG_ARG_TAGS(format, ...) LOG_ARG_TAGS_SELECT(LOG_ARG_COUNT(format, ##__VA_ARGS__))(__VA_ARGS__)
+
+#define LOG_AT(level, format, ...)                                                                          \
+    do {                                                                                                    \
+        if ((level) <= log_levels[LOG_MODULE]) {                                                            \
+            multi_log(LOG_MODULE, (level), LOG_STRING(format), LOG_ARG_TAGS(format, ##__VA_ARGS__),         \
+                      ##__VA_ARGS__);                                                                       \
+        }                                                                                                   \
+    } while (0)
+
+#define LOG_ERROR(format, ...) LOG_AT(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...) LOG_AT(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_AT(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) LOG_AT(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+
+/**
+ * @brief Print a formatted string to the console and to (if connected) the Bluetooth SPP client.
+ * Safe to call from any context, the string is formatted later by multi_printf_flush()
+ * @param format The format string, must be a string literal
+ * @param ... The arguments to the format string
+ */
+#define multi_printf(format, ...) LOG_INFO(format, ##__VA_ARGS__)
+
 /**
- * @brief Print a formatted string to the console and to (if connected) the Bluetooth SPP client
- * @param format The format string
+ * @brief Log a formatted string to the console and to (if connected) the Bluetooth SPP client.
+ * Only the arguments are captured here, the string is formatted later by multi_printf_flush().
+ * Use the LOG_ macros instead, they skip disabled levels without a call, put the format in the dictionary and tag
+ * the arguments
+ * @param module The module logging the message
+ * @param level The level of the message
+ * @param format The format string, must stay valid until the record has been flushed
+ * @param arg_tags The log_arg_tag_t of every argument, LOG_ARG_TAG_BITS each, the first in the lowest bits
  * @param ... The arguments to the format string
  */
-void multi_printf(const char *format, ...) __attribute__((format(printf, 1, 2)))
-_ATTRIBUTE ((__format__(__printf__, 1, 2)));
+void multi_log(log_module_t module, log_level_t level, const char *format, uint32_t arg_tags, ...)
+_ATTRIBUTE ((__format__(__printf__, 3, 5)));
+
+/**
+ * Format and print all the records logged since the last call. Must be called from the main loop
+ */
+void multi_printf_flush();
+
+/**
+ * @brief Set the most verbose level that is logged for a module
+ * @param module The module, or LOG_MODULE_COUNT for all modules
+ * @param level The level
+ */
+void multi_printf_set_level(log_module_t module, log_level_t level);
+
+/**
+ * @brief Switch the Bluetooth SPP output between text and the binary tokenized format.
+ * The console output is always text
+ * @param tokenized True for the binary format
+ */
+void multi_printf_set_tokenized(bool tokenized);
+
+/**
+ * @return True if the Bluetooth SPP output is in the binary tokenized format
+ */
+bool multi_printf_is_tokenized();
+
+/**
+ * @brief Switch the text output on the USB/UART console on or off. With the console off and the Bluetooth SPP
+ * output tokenized, records are not formatted at all
+ * @param on True to print the records on the console
+ */
+void multi_printf_set_console(bool on);
+
+/**
+ * @return True if the records are printed on the USB/UART console
+ */
+bool multi_printf_is_console();
+
+/**
+ * @param module The module
+ * @return The name of the module as used by the console commands
+ */
+const char *multi_printf_module_name(log_module_t module);
+
+/**
+ * @param level The level
+ * @return The name of the level as used by the console commands
+ */
+const char *multi_printf_level_name(log_level_t level);
 
 #endif //LIVE_ROOM_SENSOR_DUAL_PRINTF_H
@@ -0,0 +1,60 @@
+#ifndef LIVE_ROOM_SENSOR_OCCUPANCY_ESTIMATOR_H
+#define LIVE_ROOM_SENSOR_OCCUPANCY_ESTIMATOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Time constant used by the radar drivers unless overridden at build time
+#ifndef OCCUPANCY_TIME_CONSTANT_MS
+#define OCCUPANCY_TIME_CONSTANT_MS 20000
+#endif
+
+/**
+ * Time weighted exponential moving average of a count, in Q16.16 fixed point.
+ * Every sample pulls the average towards it by dt / (dt + time constant), so the response only depends on
+ * how much time has passed and not on how many frames the radar happened to send in that time.
+ */
+typedef struct {
+    volatile uint32_t average_q16;
+    volatile uint32_t last_sample_ms;
+    uint32_t time_constant_ms;
+    bool has_sample;
+} occupancy_estimator_t;
+
+/**
+ * @brief Initialize an estimator
+ * @param estimator The estimator
+ * @param time_constant_ms The time constant of the average. Larger is more stable but slower to respond
+ */
+void occupancy_estimator_init(occupancy_estimator_t *estimator, uint32_t time_constant_ms);
+
+/**
+ * @brief Change the time constant of an estimator without losing its current average
+ * @param estimator The estimator
+ * @param time_constant_ms The new time constant
+ */
+void occupancy_estimator_set_time_constant(occupancy_estimator_t *estimator, uint32_t time_constant_ms);
+
+/**
+ * @brief Add a sample to the estimator. Safe to call from an interrupt
+ * @param estimator The estimator
+ * @param count The count seen in this sample
+ * @param now_ms The time of the sample in milliseconds
+ */
+void occupancy_estimator_add_sample(occupancy_estimator_t *estimator, uint8_t count, uint32_t now_ms);
+
+/**
+ * @brief Get the current average rounded to the nearest whole count
+ * @param estimator The estimator
+ * @return The current count
+ */
+int16_t occupancy_estimator_get_count(const occupancy_estimator_t *estimator);
+
+/**
+ * @brief Get the current average in Q16.16 fixed point
+ * @param estimator The estimator
+ * @return The current average
+ */
+uint32_t occupancy_estimator_get_average_q16(const occupancy_estimator_t *estimator);
+
+#endif//LIVE_ROOM_SENSOR_OCCUPANCY_ESTIMATOR_H
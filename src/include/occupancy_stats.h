@@ -0,0 +1,56 @@
+#ifndef LIVE_ROOM_SENSOR_OCCUPANCY_STATS_H
+#define LIVE_ROOM_SENSOR_OCCUPANCY_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Counts of this or more people share the last histogram bin
+#define OCCUPANCY_STATS_HISTOGRAM_BINS 16
+
+/**
+ * Statistics of one reporting interval. All fractions are in per mille and all statistics of the count
+ * are weighted by how long each count was seen, so they do not depend on the radar frame rate.
+ */
+typedef struct {
+    uint32_t interval_ms;
+    uint32_t radar_samples;
+    uint8_t min_count;
+    uint8_t max_count;
+    uint16_t mean_count_centi;// Mean count * 100
+    uint8_t median_count;
+    uint8_t p90_count;
+    uint16_t occupied_permille;
+    uint16_t pir_duty_permille;
+    uint16_t pir_episodes;               // Bursts of motion, edges less than 30 s apart belong to the same one
+    uint16_t pir_events_per_minute_centi;// Rising edges per minute * 100
+    uint16_t radar_valid_permille;
+} occupancy_stats_t;
+
+/**
+ * @brief Start the first interval
+ * @param now_ms Current time in milliseconds
+ */
+void occupancy_stats_init(uint32_t now_ms);
+
+/**
+ * @brief Add a radar frame to the current interval. O(1) and safe to call from an interrupt
+ * @param count The count in the frame
+ * @param now_ms Time of the frame in milliseconds
+ */
+void occupancy_stats_add_radar_sample(uint8_t count, uint32_t now_ms);
+
+/**
+ * @brief Record a change of the PIR output. O(1) and safe to call from an interrupt
+ * @param motion True if the PIR output is now high
+ * @param now_ms Time of the change in milliseconds
+ */
+void occupancy_stats_set_pir_state(bool motion, uint32_t now_ms);
+
+/**
+ * @brief Close the current interval, compute its statistics and start a new one
+ * @param stats Filled with the statistics of the interval that was closed
+ * @param now_ms Current time in milliseconds
+ */
+void occupancy_stats_take(occupancy_stats_t *stats, uint32_t now_ms);
+
+#endif//LIVE_ROOM_SENSOR_OCCUPANCY_STATS_H
@@ -0,0 +1,80 @@
+#ifndef LIVE_ROOM_SENSOR_OTA_H
+#define LIVE_ROOM_SENSOR_OTA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    OTA_RESULT_NONE,           // No update was tried since boot
+    OTA_RESULT_INSTALLING,     // The update is written and verified, it is installed on the reset that follows
+    OTA_RESULT_DOWNLOAD_FAILED,// The request failed or the connection broke off
+    OTA_RESULT_HTTP_ERROR,     // The server did not answer with 200 OK and a plain body
+    OTA_RESULT_WRONG_IMAGE,    // The patch is for another firmware than the one running
+    OTA_RESULT_REVERTED,       // The patch makes the update that was reverted before
+    OTA_RESULT_TOO_LARGE,      // The new image does not fit in a slot
+    OTA_RESULT_INVALID_PATCH,  // The patch is damaged or incomplete
+    OTA_RESULT_FLASH_ERROR,    // Slot B did not read back what was written
+    OTA_RESULT_HASH_MISMATCH,  // The patched image does not have the hash from the patch
+} ota_result_t;
+
+typedef enum {
+    OTA_STATE_NONE,      // The firmware was flashed by hand or the last update is confirmed
+    OTA_STATE_TRIAL,     // The firmware is an update that has not sent a report yet, a reset brings back the previous one
+    OTA_STATE_REVERTED,  // The last update did not confirm itself, the previous firmware was brought back
+} ota_state_t;
+
+typedef struct {
+    ota_state_t state;
+    ota_result_t last_result;
+    char last_path[64];       // Path of the last patch that was tried
+    uint32_t patch_bytes;     // Bytes of the last patch received
+    uint32_t image_bytes;     // Bytes of the new image written to slot B
+} ota_status_t;
+
+/**
+ * Check what became of the last update, must be called once at boot
+ */
+void ota_init();
+
+/**
+ * @brief Update the firmware from a patch on the reporting server. The patch is downloaded by ota_task() and the
+ * Pico resets once the new image is written and verified
+ * @param path Path of the patch on the reporting server
+ * @param retry False to ignore a path whose patch failed before, so a server that keeps asking does not cause a
+ * download on every report
+ * @return True if the update was started
+ */
+bool ota_request(const char *path, bool retry);
+
+/**
+ * Download and apply a requested patch. Must be called from the main loop, which it holds up until the download is
+ * done
+ */
+void ota_task();
+
+/**
+ * Confirm an update on trial, the bootloader then keeps it. Called once the update has sent a report
+ */
+void ota_confirm();
+
+/**
+ * @brief Get the state of the firmware and the outcome of the last update
+ * @param out Where to store the status
+ */
+void ota_get_status(ota_status_t *out);
+
+/**
+ * @brief Get the name of an update result
+ * @param result The result
+ * @return The name
+ */
+const char *ota_result_name(ota_result_t result);
+
+/**
+ * @brief Get the name of a firmware state
+ * @param state The state
+ * @return The name
+ */
+const char *ota_state_name(ota_state_t state);
+
+#endif//LIVE_ROOM_SENSOR_OTA_H
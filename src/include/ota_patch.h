@@ -0,0 +1,97 @@
+#ifndef LIVE_ROOM_SENSOR_OTA_PATCH_H
+#define LIVE_ROOM_SENSOR_OTA_PATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A patch is compressed with heatshrink, window 2^10 bytes and lookahead 2^8 bytes (heatshrink -w 10 -l 8).
+// Uncompressed it is an ota_patch_header_t followed by bsdiff style records, all numbers little endian:
+//   uint32 diff_len, uint32 extra_len, int32 seek
+//   diff_len bytes that are added to the bytes of the old image from the current old position
+//   extra_len bytes that are taken as they are
+// after which the old position moves on by diff_len + seek. tools/ota_patch.py creates patches
+#define OTA_PATCH_WINDOW_BITS 10
+#define OTA_PATCH_LOOKAHEAD_BITS 8
+
+#define OTA_PATCH_MAGIC 0x3150524c // "LRP1"
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t old_size;
+    uint8_t old_sha256[32]; // The patch only applies to the image with this hash
+    uint32_t new_size;
+    uint8_t new_sha256[32];
+} ota_patch_header_t;
+
+typedef enum {
+    OTA_PATCH_MORE,  // All data is used, the patch needs more
+    OTA_PATCH_DONE,  // The new image is complete
+    OTA_PATCH_ERROR, // The patch is invalid or a callback failed
+} ota_patch_result_t;
+
+/**
+ * @brief Called once the header has been read
+ * @return False to stop applying the patch
+ */
+typedef bool (*ota_patch_header_fn_t)(const ota_patch_header_t *header, void *arg);
+
+/**
+ * @brief Called for every byte of the new image, in order
+ * @return False to stop applying the patch
+ */
+typedef bool (*ota_patch_output_fn_t)(uint8_t byte, void *arg);
+
+typedef enum {
+    OTA_PATCH_STAGE_HEADER,
+    OTA_PATCH_STAGE_CONTROL,
+    OTA_PATCH_STAGE_DIFF,
+    OTA_PATCH_STAGE_EXTRA,
+    OTA_PATCH_STAGE_DONE,
+} ota_patch_stage_t;
+
+typedef struct {
+    // Decompression, the window holds the last decompressed bytes
+    uint8_t window[1 << OTA_PATCH_WINDOW_BITS];
+    uint32_t window_pos;
+    uint32_t bits;
+    uint8_t bit_count;
+
+    // The patch
+    ota_patch_stage_t stage;
+    uint8_t field[sizeof(ota_patch_header_t)];
+    uint8_t field_len;
+    ota_patch_header_t header;
+    uint32_t diff_left;
+    uint32_t extra_left;
+    int32_t seek;
+    int32_t old_pos;
+    uint32_t new_pos;
+
+    const uint8_t *old_image;
+    ota_patch_header_fn_t on_header;
+    ota_patch_output_fn_t on_output;
+    void *arg;
+} ota_patch_t;
+
+/**
+ * @brief Start applying a patch
+ * @param patch The patch state
+ * @param old_image The image the patch applies to, readable up to the old size in the header
+ * @param on_header Called with the header before any output
+ * @param on_output Called for every byte of the new image
+ * @param arg Passed to the callbacks
+ */
+void ota_patch_init(ota_patch_t *patch, const uint8_t *old_image, ota_patch_header_fn_t on_header,
+                    ota_patch_output_fn_t on_output, void *arg);
+
+/**
+ * @brief Apply the next part of a compressed patch, it can be split anywhere
+ * @param patch The patch state
+ * @param data The compressed data
+ * @param len Length of the data
+ * @return Whether the patch needs more data, is complete or failed
+ */
+ota_patch_result_t ota_patch_feed(ota_patch_t *patch, const uint8_t *data, size_t len);
+
+#endif//LIVE_ROOM_SENSOR_OTA_PATCH_H
@@ -0,0 +1,105 @@
+#ifndef LIVE_ROOM_SENSOR_OTA_STATUS_H
+#define LIVE_ROOM_SENSOR_OTA_STATUS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hardware/flash.h"
+
+// Flash layout for updates, OTA_BOOTLOADER_SIZE_KB and OTA_SLOT_SIZE_KB come from CMakeLists.txt:
+//   bootloader | slot A, the firmware that runs | slot B, updates are written here | scratch | status
+// followed by the sectors of flash_storage and btstack at the end of flash
+#define OTA_BOOTLOADER_SIZE (OTA_BOOTLOADER_SIZE_KB * 1024)
+#define OTA_SLOT_SIZE (OTA_SLOT_SIZE_KB * 1024)
+#define OTA_SLOT_SECTORS (OTA_SLOT_SIZE / FLASH_SECTOR_SIZE)
+#define OTA_SLOT_A_OFFSET OTA_BOOTLOADER_SIZE
+#define OTA_SLOT_B_OFFSET (OTA_SLOT_A_OFFSET + OTA_SLOT_SIZE)
+#define OTA_SCRATCH_OFFSET (OTA_SLOT_B_OFFSET + OTA_SLOT_SIZE)
+#define OTA_STATUS_OFFSET (OTA_SCRATCH_OFFSET + FLASH_SECTOR_SIZE)
+
+// Every image starts with the 256 byte second stage bootloader, the vector table follows it
+#define OTA_IMAGE_VECTORS_OFFSET 0x100
+
+// Pages of the status sector. The flags and the progress of a swap are bytes that are programmed from 0xff towards
+// 0x00 without erasing, so every step is a single page program and a step that was cut short is simply done again
+#define OTA_STATUS_HEADER_PAGE 0
+#define OTA_STATUS_FLAGS_PAGE 1
+#define OTA_STATUS_INSTALL_PAGE 2 // Progress of swapping the update into slot A, one byte per sector
+#define OTA_STATUS_REVERT_PAGE 3  // Progress of swapping the previous firmware back
+
+typedef enum {
+    OTA_FLAG_VALID,     // The header is complete, the bootloader acts on it
+    OTA_FLAG_BOOTED,    // The bootloader started the update once, it reverts if it is started again unconfirmed
+    OTA_FLAG_CONFIRMED, // The update sent a report, it stays
+} ota_flag_t;
+
+// Progress of one sector of a swap of slot A and slot B through the scratch sector
+#define OTA_SWAP_NOT_STARTED 0xff
+#define OTA_SWAP_IN_SCRATCH 0x0f  // Slot A is copied to the scratch sector
+#define OTA_SWAP_A_WRITTEN 0x03   // Slot B is copied to slot A
+#define OTA_SWAP_DONE 0x00        // The scratch sector is copied to slot B
+
+typedef struct {
+    uint32_t magic;
+    uint32_t swap_sectors;   // Sectors to swap, enough for the larger of the two images
+    uint32_t image_size;     // Size of the update
+    uint8_t sha256[32];      // Hash of the update
+} ota_status_header_t;
+
+_Static_assert(OTA_SLOT_SECTORS <= FLASH_PAGE_SIZE, "The progress of a swap fits in one page");
+_Static_assert(sizeof(ota_status_header_t) <= FLASH_PAGE_SIZE, "The header fits in one page");
+
+/**
+ * @return The header of the update in slot B, NULL if there is no complete one
+ */
+const ota_status_header_t *ota_status_get_header();
+
+/**
+ * @brief Check a flag of the update
+ * @param flag The flag
+ * @return True if the flag is set
+ */
+bool ota_status_get_flag(ota_flag_t flag);
+
+/**
+ * @brief Set a flag of the update
+ * @param flag The flag
+ */
+void ota_status_set_flag(ota_flag_t flag);
+
+/**
+ * @brief Get how far a sector of a swap is
+ * @param page OTA_STATUS_INSTALL_PAGE or OTA_STATUS_REVERT_PAGE
+ * @param sector The sector of the slots
+ * @return One of the OTA_SWAP_ values
+ */
+uint8_t ota_status_get_progress(uint8_t page, uint32_t sector);
+
+/**
+ * @brief Record how far a sector of a swap is
+ * @param page OTA_STATUS_INSTALL_PAGE or OTA_STATUS_REVERT_PAGE
+ * @param sector The sector of the slots
+ * @param progress One of the OTA_SWAP_ values, further than the current one
+ */
+void ota_status_set_progress(uint8_t page, uint32_t sector, uint8_t progress);
+
+/**
+ * @brief Check if a swap has finished
+ * @param page OTA_STATUS_INSTALL_PAGE or OTA_STATUS_REVERT_PAGE
+ * @return True if all sectors of the swap are done, false also if there is no update
+ */
+bool ota_status_swap_done(uint8_t page);
+
+/**
+ * @brief Erase the status, the update in slot B is forgotten
+ */
+void ota_status_clear();
+
+/**
+ * @brief Start a new status for an update that has been written to slot B and verified. The bootloader swaps it in
+ * on the next boot
+ * @param header The header of the update, magic is filled in
+ */
+void ota_status_start(ota_status_header_t *header);
+
+#endif//LIVE_ROOM_SENSOR_OTA_STATUS_H
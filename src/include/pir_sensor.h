@@ -6,6 +6,24 @@
 
 bool pir_sensor_is_motion_detected();
 
+/**
+ * Drain the edge ring and feed the edges to the motion state and the occupancy statistics.
+ * Must be called from the main loop.
+ */
+void pir_sensor_update();
+
+/**
+ * @brief Check for motion in a shorter window than the report uses, for fusing with the radar every frame
+ * @param window_ms How recent the motion must be
+ * @return True if the PIR output is high or went low within the window
+ */
+bool pir_sensor_is_motion_recent(uint32_t window_ms);
+
+/**
+ * @return True while the output of any PIR is high
+ */
+bool pir_sensor_get_state();
+
 void pir_sensor_init();
 
 #endif//LIVE_ROOM_SENSOR_PIR_SENSOR_H
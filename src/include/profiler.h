@@ -0,0 +1,47 @@
+#ifndef LIVE_ROOM_SENSOR_PROFILER_H
+#define LIVE_ROOM_SENSOR_PROFILER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PROFILER_MAX_RATE_HZ 10000
+
+/**
+ * Claim the timer alarm for the profiler. Sampling only starts with profiler_start()
+ */
+void profiler_init();
+
+/**
+ * @brief Clear the samples and start sampling. Sampling stops by itself once the buffer is full
+ * @param rate_hz Samples per second, up to PROFILER_MAX_RATE_HZ
+ * @return False if the rate is out of range
+ */
+bool profiler_start(uint32_t rate_hz);
+
+/**
+ * Stop sampling, the samples are kept until the next start
+ */
+void profiler_stop();
+
+/**
+ * @return True while sampling
+ */
+bool profiler_is_running();
+
+/**
+ * @return Number of samples in the buffer
+ */
+uint32_t profiler_get_sample_count();
+
+/**
+ * Start sending the samples to the Bluetooth SPP client. The first line is a header and the last one PROFILE end,
+ * tools/profile_symbolize.py turns the dump into a profile
+ */
+void profiler_dump_start();
+
+/**
+ * Send as much of a dump as there is room for in the send ring. Runs as a task whenever the send ring has drained
+ */
+void profiler_dump_task();
+
+#endif//LIVE_ROOM_SENSOR_PROFILER_H
@@ -0,0 +1,64 @@
+#ifndef LIVE_ROOM_SENSOR_RADAR_MIRROR_H
+#define LIVE_ROOM_SENSOR_RADAR_MIRROR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "micradar.h"
+#include "minewsemi_radar.h"
+
+#define RADAR_MIRROR_DEFAULT_PORT 5005
+
+// Longer frames are dropped. A Minew frame with a full room is well under 4096 bytes, a micradar frame is never
+// longer than its receive buffer
+#ifdef USE_NEW_MINEW_RADAR
+#define RADAR_MIRROR_MAX_FRAME_LEN 4096
+#else
+#define RADAR_MIRROR_MAX_FRAME_LEN MICRADAR_RX_BUF_SIZE
+#endif
+
+typedef struct {
+    uint32_t sent;
+    uint32_t dropped;
+    uint32_t too_long;
+    uint32_t send_errors;
+} radar_mirror_stats_t;
+
+/**
+ * Initialize the radar mirror. Starts mirroring to RADAR_MIRROR_COLLECTOR if the build defines it
+ */
+void radar_mirror_init();
+
+/**
+ * @brief Set the collector the raw radar frames are sent to. Must be called from the main loop
+ * @param collector "ip" or "ip:port" of the collector, NULL to stop mirroring
+ * @return False if the address is invalid, mirroring is then stopped
+ */
+bool radar_mirror_set_collector(const char *collector);
+
+/**
+ * @brief Get the collector the frames are sent to
+ * @param buf Filled with "ip:port", or an empty string if mirroring is off
+ * @param size Size of the buffer
+ * @return True if mirroring is on
+ */
+bool radar_mirror_get_collector(char *buf, uint32_t size);
+
+/**
+ * @brief Queue a complete radar UART frame for the collector. Called from the radar UART interrupt
+ * @param frame The frame as received
+ * @param len Length of the frame
+ */
+void radar_mirror_frame(const volatile uint8_t *frame, uint32_t len);
+
+/**
+ * Send the queued frames. Must be called from the main loop
+ */
+void radar_mirror_task();
+
+/**
+ * @brief Get the counters of the mirror since boot
+ * @param out Where to store the counters
+ */
+void radar_mirror_get_stats(radar_mirror_stats_t *out);
+
+#endif//LIVE_ROOM_SENSOR_RADAR_MIRROR_H
@@ -0,0 +1,66 @@
+#ifndef LIVE_ROOM_SENSOR_RADAR_STREAM_H
+#define LIVE_ROOM_SENSOR_RADAR_STREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Frames with more are truncated, and marked as such in the stream
+#define RADAR_STREAM_MAX_POINTS 64
+#define RADAR_STREAM_MAX_PERSONS 16
+
+// Positions in millimetres and velocities in millimetres per second, which covers ±32 m in 16 bits
+typedef struct {
+    int16_t x;
+    int16_t y;
+    int16_t z;
+    int16_t doppler;// Doppler bin as reported by the radar
+    int16_t snr;    // Tenths of the reported SNR
+} radar_stream_point_t;
+
+typedef struct {
+    uint32_t id;
+    int16_t x;
+    int16_t y;
+    int16_t z;
+    int16_t vx;
+    int16_t vy;
+    int16_t vz;
+} radar_stream_person_t;
+
+typedef struct {
+    uint32_t frame_number;
+    uint32_t time_ms;
+    bool truncated;
+    uint8_t point_count;
+    uint8_t person_count;
+    radar_stream_point_t points[RADAR_STREAM_MAX_POINTS];
+    radar_stream_person_t persons[RADAR_STREAM_MAX_PERSONS];
+} radar_stream_frame_t;
+
+/**
+ * @brief Turn streaming of decoded radar frames to the Bluetooth SPP client on or off
+ * @param enabled True to stream
+ */
+void radar_stream_set_enabled(bool enabled);
+
+/**
+ * @return True if radar frames are streamed. Safe to call from any context
+ */
+bool radar_stream_is_enabled();
+
+/**
+ * @brief Send a frame to the Bluetooth SPP client. Must be called from the main loop
+ * @param frame The frame
+ * @param frames_lost True if frames were dropped since the last call, the next frame is then a key frame
+ */
+void radar_stream_send(const radar_stream_frame_t *frame, bool frames_lost);
+
+/**
+ * @brief Convert a radar value to 16 bit fixed point, saturating
+ * @param value The value
+ * @param scale What one unit of the result is in units of the value, 1000 for millimetres of a value in metres
+ * @return The scaled value
+ */
+int16_t radar_stream_quantize(float value, float scale);
+
+#endif//LIVE_ROOM_SENSOR_RADAR_STREAM_H
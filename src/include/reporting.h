@@ -3,9 +3,56 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "https.h"
+#include "occupancy_stats.h"
+
+typedef enum {
+    REPORT_RESULT_NONE,         // No report has been due yet
+    REPORT_RESULT_SENT,
+    REPORT_RESULT_NO_WIFI,      // Skipped, the wifi was not connected
+    REPORT_RESULT_FORMAT_ERROR, // Skipped, the request did not fit its buffer
+} report_result_t;
+
+typedef struct {
+    report_result_t last_result;
+    uint32_t last_time_ms;     // When the last report finished, in ms since boot
+    uint32_t last_duration_ms; // How long the last report took, retries included
+    uint32_t sent;             // Reports sent since boot
+    uint32_t skipped;          // Reports skipped since boot
+    uint32_t retries;          // Requests that failed and were retried since boot. Running out of retries resets
+} reporting_status_t;
 
 void reporting_init();
 
-void send_sensor_report(int16_t occupants, int16_t radar_state, bool pir_state);
+/**
+ * Take over a changed reporting server from config, it is resolved again in the background
+ */
+void reporting_apply_server();
+
+/**
+ * @brief Send a report to the reporting server
+ * @param occupants The fused number of occupants
+ * @param confidence How likely the occupants are to be right, in per mille
+ * @param radar_state The averaged radar count, or -1 if it is not valid
+ * @param pir_state True if the PIR has seen motion in the report window
+ * @param stats Statistics of the interval since the last report
+ */
+void send_sensor_report(int16_t occupants, uint16_t confidence, int16_t radar_state, bool pir_state,
+                        const occupancy_stats_t *stats);
+
+/**
+ * @brief Fetch a file from the reporting server, with the same credentials as the reports
+ * @param path Path of the file on the server
+ * @param on_response Called with every part of the response as it arrives, headers included
+ * @param arg Passed to on_response
+ * @return True if the whole response was taken
+ */
+bool reporting_fetch(const char *path, https_response_fn_t on_response, void *arg);
+
+/**
+ * @brief Get the outcome of the last report and the report counters since boot
+ * @param out Where to store the status
+ */
+void reporting_get_status(reporting_status_t *out);
 
 #endif//LIVE_ROOM_SENSOR_REPORTING_H
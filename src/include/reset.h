@@ -3,20 +3,79 @@
 #ifndef LIVE_ROOM_SENSOR_RESET_H
 #define LIVE_ROOM_SENSOR_RESET_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include "latency.h"
+
+// Task index in the reset record while no task runs
+#define RESET_RECORD_NO_TASK 0xff
+
+typedef enum {
+    RESET_REASON_POWER_ON,      // No record survived, the power was cut or the RUN pin pulled
+    RESET_REASON_WATCHDOG,      // The main loop stopped feeding the watchdog
+    RESET_REASON_UNKNOWN,       // A record survived but neither the firmware nor the watchdog reset, a debugger did
+    RESET_REASON_WIFI_INIT,     // The wifi chip did not start
+    RESET_REASON_REPORT_FAILED, // A report failed after all retries
+    RESET_REASON_CONSOLE,       // AT+PICO-RESET
+    RESET_REASON_OTA_INSTALL,   // A firmware update was downloaded and is installed by the bootloader
+    RESET_REASON_COUNT
+} reset_reason_t;
+
+typedef struct {
+    reset_reason_t reason;
+    // How the latest run ended if the runs since this one reset before they could report it, else RESET_REASON_COUNT
+    reset_reason_t latest_reason;
+    uint8_t task;                                 // Index of the task that was running, RESET_RECORD_NO_TASK for none
+    uint32_t uptime_s;                            // Time since boot, within the refresh period
+    uint32_t latency_max_us[LATENCY_PROBE_COUNT]; // Longest duration at every probe, rounded up to the histogram bucket
+} reset_record_t;
+
+/**
+ * Take the record the previous run left and start the record of this one, must be called once at boot before
+ * anything can reset
+ */
+void reset_record_init();
+
+/**
+ * Note that the record of how the previous run ended was reported, so this run can start its own record
+ */
+void reset_record_reported();
+
+/**
+ * @brief Note which task is running, so a watchdog reset says where the main loop hung. Called by the event loop
+ * @param task Index of the task, RESET_RECORD_NO_TASK once it returned
+ */
+void reset_record_set_task(uint8_t task);
+
+/**
+ * @brief Get the record of how the previous run ended
+ * @param out Where to store the record
+ */
+void reset_get_last_record(reset_record_t *out);
+
+/**
+ * @brief Get the name of a reset reason
+ * @param reason The reason
+ * @return The name
+ */
+const char *reset_reason_name(reset_reason_t reason);
+
 /**
- * Handle any reset requests
+ * Handle any reset requests and refresh the uptime and latency maxima of the reset record
  */
 void reset_request_tick();
 
 /**
  * Request a reset of the Pico on the next tick
  * This is useful for when you want to reset the Pico but are in a function that is not safe to reset from
+ * @param reason Why the Pico resets, recorded for the next boot
  */
-void request_pico_reset();
+void request_pico_reset(reset_reason_t reason);
 
 /**
  * Reset the Pico
+ * @param reason Why the Pico resets, recorded for the next boot
  */
-_Noreturn void reset_pico();
+_Noreturn void reset_pico(reset_reason_t reason);
 
 #endif//LIVE_ROOM_SENSOR_RESET_H
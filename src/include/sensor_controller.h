@@ -1,8 +1,41 @@
 #ifndef LIVE_ROOM_SENSOR_SENSOR_CONTROLLER_H
 #define LIVE_ROOM_SENSOR_SENSOR_CONTROLLER_H
 
+#include <stdint.h>
+
+typedef struct {
+    int16_t count;         // The averaged radar count, -1 if the radar has not sent a valid frame recently
+    uint32_t frames;       // Complete frames since boot
+    uint32_t frame_errors; // Frames dropped as corrupt since boot
+} radar_health_t;
+
 void sensor_controller_init();
 
+/**
+ * Feed the latest PIR edges and radar count to the fusion filter and publish the result over BLE.
+ * Called for every PIR edge, every radar frame and periodically
+ */
 void sensor_controller_update();
 
+/**
+ * Send a report with the fused state and the statistics of the interval since the last report
+ */
+void sensor_controller_report();
+
+/**
+ * Take over a changed count window from config
+ */
+void sensor_controller_apply_count_window();
+
+/**
+ * Take over a changed report interval from config, the next report is one interval from now
+ */
+void sensor_controller_apply_report_interval();
+
+/**
+ * @brief Get how the radar is doing, for the local status endpoint
+ * @param health Where to store the radar health
+ */
+void sensor_controller_get_radar_health(radar_health_t *health);
+
 #endif//LIVE_ROOM_SENSOR_SENSOR_CONTROLLER_H
@@ -0,0 +1,35 @@
+#ifndef LIVE_ROOM_SENSOR_SENSOR_FUSION_H
+#define LIVE_ROOM_SENSOR_SENSOR_FUSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Initialize the fusion filter. The room starts out as unknown, 50% occupied
+ */
+void sensor_fusion_init(void);
+
+/**
+ * @brief Add the current sensor readings to the filter
+ * @param radar_count The averaged radar count, or -1 if the radar count is not valid
+ * @param pir_motion True if the PIR has seen motion recently
+ * @param now_ms Current time in milliseconds
+ */
+void sensor_fusion_update(int16_t radar_count, bool pir_motion, uint32_t now_ms);
+
+/**
+ * @return The fused number of occupants
+ */
+int16_t sensor_fusion_get_count(void);
+
+/**
+ * @return How likely the fused state (occupied or empty) is to be right, in per mille
+ */
+uint16_t sensor_fusion_get_confidence(void);
+
+/**
+ * @return How much the filter currently trusts the radar, in per mille
+ */
+uint16_t sensor_fusion_get_radar_trust(void);
+
+#endif//LIVE_ROOM_SENSOR_SENSOR_FUSION_H
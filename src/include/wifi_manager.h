@@ -0,0 +1,42 @@
+#ifndef LIVE_ROOM_SENSOR_WIFI_MANAGER_H
+#define LIVE_ROOM_SENSOR_WIFI_MANAGER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Start connecting to the configured wifi network in the background
+ */
+void wifi_manager_init(void);
+
+/**
+ * Tick function to be called periodically. Supervises the link and reconnects with backoff when it is lost
+ */
+void wifi_manager_tick(void);
+
+/**
+ * @return True if the link is up and we have an IP address
+ */
+bool wifi_manager_is_connected(void);
+
+/**
+ * @return The last sampled RSSI of the link in dBm, or 0 if it has never been sampled
+ */
+int32_t wifi_manager_get_rssi(void);
+
+/**
+ * @return The cyw43 link status that caused the last disconnect or failed connect, or 0 if there has been none
+ */
+int wifi_manager_get_last_disconnect_reason(void);
+
+/**
+ * @return The number of times the link has been lost since boot
+ */
+uint32_t wifi_manager_get_disconnect_count(void);
+
+/**
+ * @return Milliseconds from boot until the link first came up, or 0 if it has not come up yet
+ */
+uint32_t wifi_manager_get_boot_to_connected_ms(void);
+
+#endif//LIVE_ROOM_SENSOR_WIFI_MANAGER_H
@@ -0,0 +1,81 @@
+#define LOG_MODULE LOG_MODULE_MAIN
+
+#include "isr_benchmark.h"
+
+#include "hardware/irq.h"
+#include "hardware/timer.h"
+#include "hot_path.h"
+#include "latency.h"
+#include "multi_printf.h"
+#include "occupancy_estimator.h"
+
+#define ISR_BENCHMARK_PERIOD_US 1000
+
+static int alarm_num = -1;
+static uint32_t alarm_time_us = 0;
+static volatile uint32_t remaining_runs = 0;
+
+// A private estimator, so the benchmark runs the real per frame code without touching the real count
+static occupancy_estimator_t bench_estimator;
+
+static void __hot_path_func(isr_benchmark_irq_handler)() {
+    uint32_t entry_us = time_us_32();
+    timer_hw->intr = 1u << alarm_num;
+    latency_record(LATENCY_BENCH_ENTRY, entry_us - alarm_time_us);
+
+    occupancy_estimator_add_sample(&bench_estimator, remaining_runs & 3, entry_us / 1000);
+    latency_end(LATENCY_BENCH_HOT_PATH, entry_us);
+
+    if (--remaining_runs == 0) {
+        LOG_INFO("ISR benchmark done, see AT+LATENCY\n");
+        return;
+    }
+
+    alarm_time_us += ISR_BENCHMARK_PERIOD_US;
+    if ((int32_t) (alarm_time_us - timer_hw->timerawl) <= 0) {
+        alarm_time_us = timer_hw->timerawl + ISR_BENCHMARK_PERIOD_US;
+    }
+    timer_hw->alarm[alarm_num] = alarm_time_us;
+}
+
+/**
+ * @brief Measure interrupt latency for a while, to compare builds with and without RAM_HOT_PATH.
+ * Clears all latency histograms, then fires a timer interrupt every millisecond that records how late its handler
+ * started and how long the per frame radar code takes in it. Run it across at least one report, so TLS runs
+ * meanwhile, and read the results with AT+LATENCY: bench-entry, bench-hot-path, uart-isr and frame-parse
+ * @param seconds How long to run, up to ISR_BENCHMARK_MAX_SECONDS
+ * @return False if the duration is out of range or there is no free timer alarm
+ */
+bool isr_benchmark_start(uint32_t seconds) {
+    if (seconds == 0 || seconds > ISR_BENCHMARK_MAX_SECONDS || remaining_runs) {
+        return false;
+    }
+
+    if (alarm_num < 0) {
+        alarm_num = hardware_alarm_claim_unused(false);
+        if (alarm_num < 0) {
+            return false;
+        }
+
+        uint irq = TIMER_IRQ_0 + alarm_num;
+        irq_set_exclusive_handler(irq, isr_benchmark_irq_handler);
+        // The same priority as the radar UART, so it sees the same delays
+        irq_set_priority(irq, PICO_DEFAULT_IRQ_PRIORITY);
+        irq_set_enabled(irq, true);
+        hw_set_bits(&timer_hw->inte, 1u << alarm_num);
+    }
+
+    occupancy_estimator_init(&bench_estimator, OCCUPANCY_TIME_CONSTANT_MS);
+    latency_reset();
+
+#ifdef RAM_HOT_PATH
+    multi_printf("ISR benchmark running for %lu s with the hot path in RAM\n", seconds);
+#else
+    multi_printf("ISR benchmark running for %lu s with the hot path in flash\n", seconds);
+#endif
+
+    remaining_runs = seconds * (1000000 / ISR_BENCHMARK_PERIOD_US);
+    alarm_time_us = timer_hw->timerawl + ISR_BENCHMARK_PERIOD_US;
+    timer_hw->alarm[alarm_num] = alarm_time_us;
+    return true;
+}
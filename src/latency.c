@@ -0,0 +1,122 @@
+#define LOG_MODULE LOG_MODULE_MAIN
+
+#include "latency.h"
+#include <string.h>
+
+#include "hardware/sync.h"
+#include "hot_path.h"
+#include "multi_printf.h"
+
+static latency_histogram_t histograms[LATENCY_PROBE_COUNT];
+
+static const char *const probe_names[LATENCY_PROBE_COUNT] = {
+        [LATENCY_UART_ISR] = "uart-isr",
+        [LATENCY_FRAME_PARSE] = "frame-parse",
+        [LATENCY_SENSOR_DELAY] = "sensor-delay",
+        [LATENCY_REPORT_FORMAT] = "report-format",
+        [LATENCY_DNS] = "dns",
+        [LATENCY_CONNECT] = "connect",
+        [LATENCY_TLS_HANDSHAKE] = "tls-handshake",
+        [LATENCY_RESPONSE] = "response",
+        [LATENCY_REQUEST] = "request",
+        [LATENCY_BENCH_ENTRY] = "bench-entry",
+        [LATENCY_BENCH_HOT_PATH] = "bench-hot-path",
+};
+
+/**
+ * @brief Record a duration at a probe. Safe to call from any context, it takes a few dozen cycles
+ * @param probe The probe
+ * @param duration_us The duration in µs
+ */
+void __hot_path_func(latency_record)(latency_probe_t probe, uint32_t duration_us) {
+    uint8_t bucket = latency_bucket(duration_us);
+
+    latency_histogram_t *histogram = &histograms[probe];
+    uint32_t interrupts = save_and_disable_interrupts();
+    histogram->count++;
+    histogram->total_us += duration_us;
+    if (duration_us > histogram->max_us) {
+        histogram->max_us = duration_us;
+    }
+    histogram->buckets[bucket]++;
+    restore_interrupts(interrupts);
+}
+
+/**
+ * @brief Get a copy of the histogram of a probe, it covers the time since boot
+ * @param probe The probe
+ * @param histogram Where to store the copy
+ */
+void latency_get(latency_probe_t probe, latency_histogram_t *histogram) {
+    uint32_t interrupts = save_and_disable_interrupts();
+    *histogram = histograms[probe];
+    restore_interrupts(interrupts);
+}
+
+/**
+ * @brief Get the sum of all durations recorded at a probe, without copying its histogram
+ * @param probe The probe
+ * @return The sum in µs
+ */
+uint64_t latency_total_us(latency_probe_t probe) {
+    uint32_t interrupts = save_and_disable_interrupts();
+    uint64_t total_us = histograms[probe].total_us;
+    restore_interrupts(interrupts);
+    return total_us;
+}
+
+/**
+ * @brief Estimate a percentile from a histogram
+ * @param histogram The histogram
+ * @param permille The percentile in per mille, 500 for the median
+ * @return The upper end of the bucket the percentile falls in, in µs, capped at the longest duration recorded
+ */
+uint32_t latency_percentile_us(const latency_histogram_t *histogram, uint16_t permille) {
+    // Rank of the sample at the percentile, rounded up
+    uint64_t rank = ((uint64_t) histogram->count * permille + 999) / 1000;
+    uint64_t seen = 0;
+
+    for (uint8_t bucket = 0; bucket < LATENCY_BUCKET_COUNT; bucket++) {
+        seen += histogram->buckets[bucket];
+        if (seen >= rank) {
+            uint32_t upper_us = (1u << bucket) - 1;
+            return upper_us < histogram->max_us ? upper_us : histogram->max_us;
+        }
+    }
+
+    return histogram->max_us;
+}
+
+/**
+ * Clear the histograms of all probes
+ */
+void latency_reset() {
+    uint32_t interrupts = save_and_disable_interrupts();
+    memset(histograms, 0, sizeof(histograms));
+    restore_interrupts(interrupts);
+}
+
+/**
+ * @param probe The probe
+ * @return The name of the probe as shown on the console
+ */
+const char *latency_probe_name(latency_probe_t probe) {
+    return probe < LATENCY_PROBE_COUNT ? probe_names[probe] : "?";
+}
+
+/**
+ * Log a one line summary of every probe that has recorded anything, for the periodic health report
+ */
+void latency_log_summary() {
+    latency_histogram_t histogram;
+
+    for (latency_probe_t probe = 0; probe < LATENCY_PROBE_COUNT; probe++) {
+        latency_get(probe, &histogram);
+        if (!histogram.count) {
+            continue;
+        }
+
+        LOG_INFO("Latency %s: count %lu, p50 %lu us, p99 %lu us, max %lu us\n", probe_names[probe], histogram.count,
+                 latency_percentile_us(&histogram, 500), latency_percentile_us(&histogram, 990), histogram.max_us);
+    }
+}
@@ -7,16 +7,50 @@
 #endif
 
 #include "bluetooth_spp.h"
+#include "config.h"
+#include "dns_cache.h"
+#include "event_loop.h"
+#include "http_status.h"
+#include "latency.h"
 #include "multi_printf.h"
+#include "ota.h"
+#include "profiler.h"
+#include "radar_mirror.h"
 #include "pico/cyw43_arch.h"
 #include "pico/stdlib.h"
 #include "reporting.h"
 #include "reset.h"
 #include "sensor_controller.h"
 #include "version.h"
+#include "wifi_manager.h"
 #include <stdio.h>
 
 
+// Task periods and deadlines. A deadline counts from when the task became due or its event woke the loop, so waiting
+// behind a slow task counts against it
+#define SENSOR_TASK_PERIOD_MS 100
+#define SENSOR_TASK_DEADLINE_MS 20
+#define REPORT_TASK_DEADLINE_MS 10000
+#define RADAR_TASK_PERIOD_MS 1000
+#define RADAR_TASK_DEADLINE_MS 50
+#define WIFI_TASK_PERIOD_MS 500
+#define WIFI_TASK_DEADLINE_MS 100
+#define DNS_TASK_PERIOD_MS 1000
+#define DNS_TASK_DEADLINE_MS 100
+#define CONSOLE_TASK_DEADLINE_MS 100
+#define LOG_TASK_DEADLINE_MS 50
+#define MIRROR_TASK_DEADLINE_MS 20
+#define HTTP_STATUS_TASK_PERIOD_MS 1000
+#define HTTP_STATUS_TASK_DEADLINE_MS 20
+#define HEALTH_TASK_PERIOD_MS 600000
+#define RESET_TASK_PERIOD_MS 1000
+
+static void dns_task() {
+    if (wifi_manager_is_connected()) {
+        dns_cache_tick();
+    }
+}
+
 int main() {
 
     // Fixes an issue with OpenOCD 0.12.0 and the RP2040 where all timer are frozen when debugging causing all code that uses sleep_ms to hang forever.
@@ -26,12 +60,9 @@ int main() {
     timer_hw->dbgpause = 0;
 
     stdio_init_all();
-
-    if (watchdog_caused_reboot()) {
-        printf("Rebooted by Watchdog!\n");
-    } else {
-        printf("Clean boot\n");
-    }
+    event_loop_init();
+    reset_record_init();
+    config_init();
 
     printf("Firmware version: "FIRMWARE_STRING"\n");
 
@@ -39,40 +70,45 @@ int main() {
     printf("Initializing CYW43\n");
     if (cyw43_arch_init_with_country(CYW43_COUNTRY_SWEDEN)) {
         printf("CYW43 init failed\n");
-        reset_pico();
+        reset_pico(RESET_REASON_WIFI_INIT);
     }
     cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, false);
     btstack_init();
     cyw43_arch_enable_sta_mode();
     printf("Initialized CYW43\n");
 
-    // Connect to wireless network
-    multi_printf("Connecting to " WIFI_SSID "\n");
-    int wifi_connect_result = cyw43_arch_wifi_connect_timeout_ms(
-            WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK, 60000);
-    if (wifi_connect_result) {
-        multi_printf("Failed to connect to %s with error code %d\n", WIFI_SSID,
-                     wifi_connect_result);
-        reset_pico();
-    }
-    multi_printf("Connected to %s\n", WIFI_SSID);
-
+    // Start sensing straight away so no data is lost while we join the wireless network
     sensor_controller_init();
     reporting_init();
+    profiler_init();
+    radar_mirror_init();
+    http_status_init();
+    ota_init();
 
-    cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, true);
+    // Join the wireless network in the background, the main loop supervises the link from here on
+    wifi_manager_init();
 
     // Enable the watchdog, requiring the watchdog to be updated every 5000ms or
     // the chip will reboot second arg is pause on debug which means the watchdog
     // will pause when stepping through code
     watchdog_enable(5000, 1);
 
-    while (true) {
-        watchdog_update();
-        sensor_controller_update();
+    event_loop_add_task("sensor", EVENT_SENSOR, SENSOR_TASK_PERIOD_MS, SENSOR_TASK_DEADLINE_MS,
+                        sensor_controller_update);
+    event_loop_add_task("report", 0, config.report_interval_ms, REPORT_TASK_DEADLINE_MS, sensor_controller_report);
 #ifdef USE_NEW_MINEW_RADAR
-        minewsemi_radar_tick();
+    event_loop_add_task("radar", EVENT_RADAR, RADAR_TASK_PERIOD_MS, RADAR_TASK_DEADLINE_MS, minewsemi_radar_tick);
 #endif
-        reset_request_tick();
-    }
+    event_loop_add_task("wifi", EVENT_WIFI, WIFI_TASK_PERIOD_MS, WIFI_TASK_DEADLINE_MS, wifi_manager_tick);
+    event_loop_add_task("dns", 0, DNS_TASK_PERIOD_MS, DNS_TASK_DEADLINE_MS, dns_task);
+    event_loop_add_task("mirror", EVENT_MIRROR, 0, MIRROR_TASK_DEADLINE_MS, radar_mirror_task);
+    event_loop_add_task("http", 0, HTTP_STATUS_TASK_PERIOD_MS, HTTP_STATUS_TASK_DEADLINE_MS, http_status_task);
+    event_loop_add_task("console", EVENT_CONSOLE, 0, CONSOLE_TASK_DEADLINE_MS, bluetooth_console_task);
+    event_loop_add_task("log", EVENT_LOG, 0, LOG_TASK_DEADLINE_MS, multi_printf_flush);
+    event_loop_add_task("profile-dump", EVENT_SPP_DRAINED, 0, 0, profiler_dump_task);
+    event_loop_add_task("health", 0, HEALTH_TASK_PERIOD_MS, 0, latency_log_summary);
+    event_loop_add_task("ota", EVENT_OTA, 0, 0, ota_task);
+    event_loop_add_task("reset", EVENT_RESET, RESET_TASK_PERIOD_MS, 0, reset_request_tick);
+
+    event_loop_run();
 }
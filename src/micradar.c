@@ -1,11 +1,19 @@
+#define LOG_MODULE LOG_MODULE_RADAR
+
 #include "micradar.h"
+#include "config.h"
+#include "event_loop.h"
 #include "hardware/gpio.h"
 #include "hardware/timer.h"
 #include "hardware/uart.h"
-#include "math.h"
 #include "pico/printf.h"
 #include <string.h>
+#include "hot_path.h"
+#include "latency.h"
 #include "multi_printf.h"
+#include "occupancy_estimator.h"
+#include "occupancy_stats.h"
+#include "radar_mirror.h"
 
 #ifndef USE_NEW_MINEW_RADAR
 
@@ -14,9 +22,7 @@
 #define UART_TX_PIN 4
 #define UART_RX_PIN 5
 
-#define RX_BUF_SIZE 256
-
-#define COUNT_AVERAGE_BUFFER_SIZE 256
+#define RX_BUF_SIZE MICRADAR_RX_BUF_SIZE
 
 #define TRAJECTORY_INFO_REPORT 0x8202
 #define TRAJECTORY_INFO_REPORT_POINT_SIZE 11
@@ -26,17 +32,18 @@
 static volatile uint8_t uart_rx_buf[RX_BUF_SIZE];
 static volatile uint8_t uart_rx_buf_head = 0;
 
-static volatile uint8_t previous_counts[COUNT_AVERAGE_BUFFER_SIZE];
-static volatile uint32_t previous_counts_head = 0;
-static volatile uint32_t previous_counts_sum = 0;
+static occupancy_estimator_t count_estimator;
 static volatile uint64_t last_count_time = 0;
 
-void append_to_rx_buf(uint8_t c) {
+static volatile uint32_t frame_count = 0;
+static volatile uint32_t frame_error_count = 0;
+
+void __hot_path_func(append_to_rx_buf)(uint8_t c) {
     uart_rx_buf[uart_rx_buf_head] = c;
     uart_rx_buf_head = (uart_rx_buf_head + 1) % RX_BUF_SIZE;
 }
 
-bool checksum_is_valid(const uint8_t *buf, uint8_t len) {
+bool __hot_path_func(checksum_is_valid)(const uint8_t *buf, uint8_t len) {
     if (len < 5) return false;
 
     // Checksum is the sum of all bytes except the last 3 bytes of the frame
@@ -48,27 +55,27 @@ bool checksum_is_valid(const uint8_t *buf, uint8_t len) {
     return checksum == buf[len - 4];
 }
 
-void update_previous_counts(uint8_t count) {
-    previous_counts_sum -= previous_counts[previous_counts_head];
-    previous_counts[previous_counts_head] = count;
-    previous_counts_sum += count;
-    previous_counts_head = (previous_counts_head + 1) % COUNT_AVERAGE_BUFFER_SIZE;
+void __hot_path_func(update_count)(uint8_t count) {
     last_count_time = time_us_64();
+    occupancy_estimator_add_sample(&count_estimator, count, last_count_time / 1000);
+    occupancy_stats_add_radar_sample(count, last_count_time / 1000);
+    event_loop_post(EVENT_SENSOR);
 }
 
-void parse_trajectory_info(const uint8_t *buf, uint8_t len) {
+void __hot_path_func(parse_trajectory_info)(const uint8_t *buf, uint8_t len) {
     if (len < 9) return;
 
     uint16_t message_content_len = buf[4] << 8 | buf[5];
 
-    update_previous_counts(message_content_len / TRAJECTORY_INFO_REPORT_POINT_SIZE);
+    update_count(message_content_len / TRAJECTORY_INFO_REPORT_POINT_SIZE);
 }
 
-void handle_received_frame() {
+void __hot_path_func(handle_received_frame)() {
     if (uart_rx_buf_head < 5) return;
 
     if (!checksum_is_valid((uint8_t *) uart_rx_buf, uart_rx_buf_head)) {
-        multi_printf("Invalid checksum\n");
+        LOG_WARN("Invalid checksum\n");
+        frame_error_count++;
         uart_rx_buf_head = 0;
         return;
     }
@@ -86,7 +93,8 @@ void handle_received_frame() {
     uart_rx_buf_head = 0;
 }
 
-void on_uart_rx() {
+void __hot_path_func(on_uart_rx)() {
+    uint32_t start = latency_start();
     uint8_t c;
     while (uart_is_readable(UART_ID)) {
         c = uart_getc(UART_ID);
@@ -100,7 +108,7 @@ void on_uart_rx() {
 
         } else if (uart_rx_buf_head >= RX_BUF_SIZE - 1) {
             uart_rx_buf_head = 0;
-            multi_printf("Radar UART receive buffer full where is should not be possible! Clearing and resetting!\n");
+            LOG_ERROR("Radar UART receive buffer full where is should not be possible! Clearing and resetting!\n");
             continue;
         }
 
@@ -108,14 +116,21 @@ void on_uart_rx() {
 
         if (uart_rx_buf_head > 5 && uart_rx_buf[uart_rx_buf_head - 3] == 0x54 && uart_rx_buf[uart_rx_buf_head - 2] == 0x43) {
             // We have a complete message frame
+            frame_count++;
+            radar_mirror_frame(uart_rx_buf, uart_rx_buf_head);
+            uint32_t parse_start = latency_start();
             handle_received_frame();
+            latency_end(LATENCY_FRAME_PARSE, parse_start);
             uart_rx_buf_head = 0;
         } else if (uart_rx_buf_head >= RX_BUF_SIZE - 1) {
             uart_rx_buf_head = 0;
-            multi_printf("Radar UART receive buffer full without a complete frame found. Clearing and resetting!\n");
+            frame_error_count++;
+            LOG_ERROR("Radar UART receive buffer full without a complete frame found. Clearing and resetting!\n");
             continue;
         }
     }
+
+    latency_end(LATENCY_UART_ISR, start);
 }
 
 /**
@@ -127,18 +142,32 @@ int16_t micradar_get_current_count() {
         return -1;
     }
 
-    float average = ((float) previous_counts_sum) / (float) COUNT_AVERAGE_BUFFER_SIZE;
-    //printf("Average: %f\n", average);
+    return occupancy_estimator_get_count(&count_estimator);
+}
 
-    return roundf(average);
+/**
+ * @brief Change the time constant of the averaged count
+ * @param window_ms The new time constant
+ */
+void micradar_set_count_window(uint32_t window_ms) {
+    occupancy_estimator_set_time_constant(&count_estimator, window_ms);
 }
 
+/**
+ * @brief Get the frame counters of the radar since boot
+ * @param frames Set to the number of complete frames received
+ * @param errors Set to the number of frames dropped for a bad checksum or for not fitting the receive buffer
+ */
+void micradar_get_frame_counters(uint32_t *frames, uint32_t *errors) {
+    *frames = frame_count;
+    *errors = frame_error_count;
+}
 
 /**
  * Initialize the radar sensor
  */
 void micradar_init() {
-    memset((void *) previous_counts, 0, COUNT_AVERAGE_BUFFER_SIZE);
+    occupancy_estimator_init(&count_estimator, config.count_window_ms);
 
     uart_init(UART_ID, BAUD_RATE);
 
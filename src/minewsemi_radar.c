@@ -1,11 +1,21 @@
+#define LOG_MODULE LOG_MODULE_RADAR
+
 #include "minewsemi_radar.h"
+#include "config.h"
+#include "event_loop.h"
 #include "hardware/gpio.h"
+#include "hardware/sync.h"
 #include "hardware/timer.h"
 #include "hardware/uart.h"
 #include "hardware/watchdog.h"
-#include "math.h"
+#include "hot_path.h"
+#include "latency.h"
 #include "multi_printf.h"
+#include "occupancy_estimator.h"
+#include "occupancy_stats.h"
 #include "pico/time.h"
+#include "radar_mirror.h"
+#include "radar_stream.h"
 #include <string.h>
 
 #ifdef USE_NEW_MINEW_RADAR
@@ -15,15 +25,12 @@
 #define UART_TX_PIN 4
 #define UART_RX_PIN 5
 
-#define RX_BUF_SIZE 8192
-
-#define COUNT_AVERAGE_BUFFER_SIZE 800
+#define RX_BUF_SIZE MINEWSEMI_RX_BUF_SIZE
 
 #define TRAJECTORY_INFO_REPORT 0x8202
 #define TRAJECTORY_INFO_REPORT_POINT_SIZE 11
 
 #define COUNT_VALIDITY_TIMEOUT_MS 5000
-#define RESET_TIMEOUT_MS 60000
 
 #define MAX_AT_RESPONSE_LENGTH 16
 
@@ -38,11 +45,12 @@ static const uint8_t STUDYING_SAME_FOR_5_PASSES_SAVING[] = {0x55, 0xAA, 0x06, 0x
 static volatile uint8_t uart_rx_buf[RX_BUF_SIZE];
 static volatile uint16_t uart_rx_buf_head = 0;
 
-static volatile uint8_t previous_counts[COUNT_AVERAGE_BUFFER_SIZE];
-static volatile uint32_t previous_counts_head = 0;
-static volatile uint32_t previous_counts_sum = 0;
+static occupancy_estimator_t count_estimator;
 static volatile uint64_t last_count_time = 0;
 
+static volatile uint32_t frame_count = 0;
+static volatile uint32_t frame_error_count = 0;
+
 static volatile uint64_t last_reset_time = 0;
 static volatile bool studying = false;
 static volatile bool reset_requested = false;
@@ -73,6 +81,22 @@ typedef struct {
 
 } __attribute__((packed, aligned(1))) radar_person_t;
 
+// The parser copies a frame here for streaming, the radar task quantizes and sends it. Frames that arrive while it
+// is still full are dropped
+typedef struct {
+    uint32_t frame_number;
+    uint32_t time_ms;
+    uint32_t point_count;
+    uint32_t person_count;
+    radar_point_t points[RADAR_STREAM_MAX_POINTS];
+    radar_person_t persons[RADAR_STREAM_MAX_PERSONS];
+} radar_stream_slot_t;
+
+static radar_stream_slot_t stream_slot;
+static volatile bool stream_slot_full = false;
+static volatile bool stream_frames_dropped = false;
+static radar_stream_frame_t stream_frame;
+
 typedef struct {
     uint32_t frame_number;
     uint32_t point_count;
@@ -81,38 +105,59 @@ typedef struct {
     radar_person_t *persons;
 } radar_frame_t;
 
-void append_to_rx_buf(uint8_t c) {
+void __hot_path_func(append_to_rx_buf)(uint8_t c) {
     uart_rx_buf[uart_rx_buf_head] = c;
     uart_rx_buf_head = (uart_rx_buf_head + 1) % RX_BUF_SIZE;
 }
 
-uint32_t uint32_from_buf(const volatile uint8_t *buf) {
+uint32_t __hot_path_func(uint32_from_buf)(const volatile uint8_t *buf) {
     return buf[3] << 24 | buf[2] << 16 | buf[1] << 8 | buf[0];
 }
 
-void update_previous_counts(uint8_t count) {
-    previous_counts_sum -= previous_counts[previous_counts_head];
-    previous_counts[previous_counts_head] = count;
-    previous_counts_sum += count;
-    previous_counts_head = (previous_counts_head + 1) % COUNT_AVERAGE_BUFFER_SIZE;
+void __hot_path_func(update_count)(uint8_t count) {
     last_count_time = time_us_64();
+    occupancy_estimator_add_sample(&count_estimator, count, last_count_time / 1000);
+    occupancy_stats_add_radar_sample(count, last_count_time / 1000);
+    event_loop_post(EVENT_SENSOR);
 }
 
-void parse_radar_frame(void) {
+// Only copies, the floats are converted outside the interrupt
+static void __hot_path_func(stage_stream_frame)(const radar_frame_t *frame) {
+    if (stream_slot_full) {
+        stream_frames_dropped = true;
+        return;
+    }
+
+    stream_slot.frame_number = frame->frame_number;
+    stream_slot.time_ms = time_us_32() / 1000;
+    stream_slot.point_count = frame->point_count;
+    stream_slot.person_count = frame->person_count;
+    memcpy(stream_slot.points, frame->points, MIN(frame->point_count, RADAR_STREAM_MAX_POINTS) * sizeof(radar_point_t));
+    memcpy(stream_slot.persons, frame->persons,
+           MIN(frame->person_count, RADAR_STREAM_MAX_PERSONS) * sizeof(radar_person_t));
+
+    __dmb();
+    stream_slot_full = true;
+    event_loop_post(EVENT_RADAR);
+}
+
+void __hot_path_func(parse_radar_frame)(void) {
     radar_frame_t frame;
 
     frame.frame_number = uint32_from_buf(&uart_rx_buf[12]);
 
     uint32_t first_tlv = uint32_from_buf(&uart_rx_buf[16]);
     if (first_tlv != 1) {
-        multi_printf("Invalid first TLV\n");
+        LOG_WARN("Invalid first TLV\n");
+        frame_error_count++;
         return;
     }
 
     uint32_t points_size = uint32_from_buf(&uart_rx_buf[20]);
 
     if (points_size % sizeof(radar_point_t) != 0) {
-        multi_printf("Invalid point count\n");
+        LOG_WARN("Invalid point count\n");
+        frame_error_count++;
         return;
     }
 
@@ -123,14 +168,16 @@ void parse_radar_frame(void) {
 
     uint32_t second_tlv = uint32_from_buf(&uart_rx_buf[end_of_points]);
     if (second_tlv != 2) {
-        multi_printf("Invalid second TLV\n");
+        LOG_WARN("Invalid second TLV\n");
+        frame_error_count++;
         return;
     }
 
     uint32_t persons_size = uint32_from_buf(&uart_rx_buf[end_of_points + 4]);
 
     if (persons_size % sizeof(radar_person_t) != 0) {
-        multi_printf("Invalid person count\n");
+        LOG_WARN("Invalid person count\n");
+        frame_error_count++;
         return;
     }
 
@@ -138,7 +185,54 @@ void parse_radar_frame(void) {
     frame.persons = (radar_person_t *) &uart_rx_buf[end_of_points + 8];
 
     //printf("We have %lu points and %lu persons\n", frame.point_count, frame.person_count);
-    update_previous_counts(frame.person_count);
+    update_count(frame.person_count);
+
+    if (radar_stream_is_enabled()) {
+        stage_stream_frame(&frame);
+    }
+}
+
+/**
+ * Quantize and send the frame staged for streaming, if there is one
+ */
+static void send_stream_frame(void) {
+    if (!stream_slot_full) {
+        return;
+    }
+
+    stream_frame.frame_number = stream_slot.frame_number;
+    stream_frame.time_ms = stream_slot.time_ms;
+    stream_frame.truncated = stream_slot.point_count > RADAR_STREAM_MAX_POINTS ||
+                             stream_slot.person_count > RADAR_STREAM_MAX_PERSONS;
+    stream_frame.point_count = MIN(stream_slot.point_count, RADAR_STREAM_MAX_POINTS);
+    stream_frame.person_count = MIN(stream_slot.person_count, RADAR_STREAM_MAX_PERSONS);
+
+    for (uint8_t i = 0; i < stream_frame.point_count; i++) {
+        const radar_point_t *point = &stream_slot.points[i];
+        stream_frame.points[i].x = radar_stream_quantize(point->x, 1000);
+        stream_frame.points[i].y = radar_stream_quantize(point->y, 1000);
+        stream_frame.points[i].z = radar_stream_quantize(point->z, 1000);
+        stream_frame.points[i].doppler = point->v;
+        stream_frame.points[i].snr = radar_stream_quantize(point->snr, 10);
+    }
+
+    for (uint8_t i = 0; i < stream_frame.person_count; i++) {
+        const radar_person_t *person = &stream_slot.persons[i];
+        stream_frame.persons[i].id = person->id;
+        stream_frame.persons[i].x = radar_stream_quantize(person->x, 1000);
+        stream_frame.persons[i].y = radar_stream_quantize(person->y, 1000);
+        stream_frame.persons[i].z = radar_stream_quantize(person->z, 1000);
+        stream_frame.persons[i].vx = radar_stream_quantize(person->vx, 1000);
+        stream_frame.persons[i].vy = radar_stream_quantize(person->vy, 1000);
+        stream_frame.persons[i].vz = radar_stream_quantize(person->vz, 1000);
+    }
+
+    __dmb();
+    stream_slot_full = false;
+
+    bool frames_lost = stream_frames_dropped;
+    stream_frames_dropped = false;
+    radar_stream_send(&stream_frame, frames_lost);
 }
 
 void handle_AT_response(void) {
@@ -172,7 +266,8 @@ void handle_studying_response(void) {
     }
 }
 
-void on_uart_rx() {
+void __hot_path_func(on_uart_rx)() {
+    uint32_t start = latency_start();
     uint8_t c;
     while (uart_is_readable(UART_ID)) {
         c = uart_getc(UART_ID);
@@ -187,7 +282,7 @@ void on_uart_rx() {
             continue;
         } else if (uart_rx_buf_head >= RX_BUF_SIZE - 1) {
             uart_rx_buf_head = 0;
-            multi_printf("Radar UART receive buffer full where is should not be possible! Clearing and resetting!\n");
+            LOG_ERROR("Radar UART receive buffer full where is should not be possible! Clearing and resetting!\n");
             continue;
         }
 
@@ -209,17 +304,23 @@ void on_uart_rx() {
                     uint32_t frame_length = uint32_from_buf(&uart_rx_buf[8]);
                     if (uart_rx_buf_head == frame_length + 1) {
                         // We have a complete frame
+                        frame_count++;
+                        radar_mirror_frame(uart_rx_buf, uart_rx_buf_head);
+                        uint32_t parse_start = latency_start();
                         parse_radar_frame();
+                        latency_end(LATENCY_FRAME_PARSE, parse_start);
                         uart_rx_buf_head = 0;
                         continue;
                     } else if (uart_rx_buf_head > frame_length + 1) {
                         // We have more than one complete frame in the buffer. Should not happen
                         uart_rx_buf_head = 0;
+                        frame_error_count++;
                         multi_printf("More than one radar frame length in buffer!\n");
                         continue;
                     } else if (frame_length > RX_BUF_SIZE) {
                         // Frame length is too long
                         uart_rx_buf_head = 0;
+                        frame_error_count++;
                         multi_printf("Radar frame length too long!\n");
                         continue;
                     }
@@ -283,10 +384,12 @@ void on_uart_rx() {
 
         if (uart_rx_buf_head >= RX_BUF_SIZE - 1) {
             uart_rx_buf_head = 0;
-            multi_printf("Radar UART receive buffer full without a complete frame found. Clearing and resetting!\n");
+            LOG_ERROR("Radar UART receive buffer full without a complete frame found. Clearing and resetting!\n");
             continue;
         }
     }
+
+    latency_end(LATENCY_UART_ISR, start);
 }
 
 /**
@@ -298,9 +401,25 @@ int16_t minewsemi_get_current_count(void) {
         return -1;
     }
 
-    float average = ((float) previous_counts_sum) / (float) COUNT_AVERAGE_BUFFER_SIZE;
+    return occupancy_estimator_get_count(&count_estimator);
+}
 
-    return (int16_t) roundf(average);
+/**
+ * @brief Change the time constant of the averaged count
+ * @param window_ms The new time constant
+ */
+void minewsemi_set_count_window(uint32_t window_ms) {
+    occupancy_estimator_set_time_constant(&count_estimator, window_ms);
+}
+
+/**
+ * @brief Get the frame counters of the radar since boot
+ * @param frames Set to the number of complete frames received
+ * @param errors Set to the number of frames dropped for an invalid layout or length
+ */
+void minewsemi_get_frame_counters(uint32_t *frames, uint32_t *errors) {
+    *frames = frame_count;
+    *errors = frame_error_count;
 }
 
 /**
@@ -308,6 +427,7 @@ int16_t minewsemi_get_current_count(void) {
  */
 void minewsemi_request_reset_on_next_tick(void) {
     reset_requested = true;
+    event_loop_post(EVENT_RADAR);
 }
 
 /**
@@ -337,6 +457,7 @@ bool minewsemi_request_send_message(uint8_t *buf, uint16_t len) {
         len++;
     }
     send_request_len = len;
+    event_loop_post(EVENT_RADAR);
 
     return true;
 }
@@ -366,20 +487,22 @@ void minewsemi_start_studying(void) {
 void minewsemi_radar_tick(void) {
     uint64_t now = time_us_64();
     bool radar_timeout = now > ((COUNT_VALIDITY_TIMEOUT_MS * 10 * 1000) + last_count_time);
-    bool reset_cooldown = now < ((RESET_TIMEOUT_MS * 1000) + last_reset_time);
+    bool reset_cooldown = now < (((uint64_t) config.radar_reset_timeout_ms * 1000) + last_reset_time);
 
     // If we have not received a valid count in a while, reset the radar
     if (reset_requested || (radar_timeout && !reset_cooldown && !studying)) {
 
         multi_printf("Last count time %llu, Last reset time %llu, Current time %llu, Count limit %llu, Reset limit %llu\n",
                      last_count_time, last_reset_time, now, ((COUNT_VALIDITY_TIMEOUT_MS * 10 * 1000) + last_count_time),
-                     ((RESET_TIMEOUT_MS * 1000) + last_reset_time));
+                     (((uint64_t) config.radar_reset_timeout_ms * 1000) + last_reset_time));
 
         reset_requested = false;
         multi_printf("Resetting radar\n");
         minewsemi_reset_and_configure();
     }
 
+    send_stream_frame();
+
     if (send_request_len > 0) {
         multi_printf("Sending requested message to radar\n");
         uart_write_blocking(UART_ID, (uint8_t *) send_request_buf, send_request_len);
@@ -392,7 +515,7 @@ void minewsemi_radar_tick(void) {
  */
 void minewsemi_init(void) {
 
-    memset((void *) previous_counts, 0, COUNT_AVERAGE_BUFFER_SIZE);
+    occupancy_estimator_init(&count_estimator, config.count_window_ms);
 
     uart_init(UART_ID, BAUD_RATE);
 
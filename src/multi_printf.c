@@ -1,18 +1,683 @@
 #include "multi_printf.h"
 #include "bluetooth_spp.h"
+#include "event_loop.h"
+#include "flash_storage.h"
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+
+#include "hardware/regs/addressmap.h"
+#include "hardware/sync.h"
+#include "pico/time.h"
+
+// Log records are captured by the callers without formatting and formatted later by multi_printf_flush() from the
+// main loop. A record is a header word, a timestamp, the format pointer, the argument tags and the raw arguments, all
+// in 32 bit words. The tags say how each argument is stored, so the capture never parses the format string. Callers
+// can be in any context, they only disable interrupts for the copy into the ring.
+//
+// The Bluetooth SPP output can be switched to a binary tokenized format, where a record is sent as the offset of its
+// format string in the log_strings section and the packed arguments instead of as text:
+//   0x1e, varint length, varint token, varint timestamp_ms, (module << 4 | level), arguments
+// Integers are sent as varints, zigzag encoded for %d and %i, doubles as 8 little endian bytes and strings as a varint
+// length and the characters. A * in a conversion is sent as an integer before its argument. Text that is not in a
+// frame, like the replies to console commands, is passed through by the decoder as is. When the format is switched
+// on, a dictionary frame is sent so the decoder can check that it has the dictionary of the running firmware:
+//   0x1f, crc32 of the log_strings section (4 bytes, little endian)
+
+// Must be a power of two
+#define LOG_RING_WORDS 1024
+#define LOG_MAX_RECORD_WORDS 32
+#define LOG_MAX_STRING_LEN 64
+#define LOG_MAX_LINE_LEN 256
+#define LOG_MAX_FRAME_LEN 160
+
+#define LOG_FRAME_RECORD 0x1e
+#define LOG_FRAME_DICTIONARY 0x1f
+
+#ifndef LOG_TOKENIZED_DEFAULT
+#define LOG_TOKENIZED_DEFAULT false
+#endif
+
+#ifndef LOG_CONSOLE_DEFAULT
+#define LOG_CONSOLE_DEFAULT true
+#endif
+
+#define LOG_RECORD_HEADER_WORDS 4
+#define LOG_RECORD_PADDING 0xf
+
+#define LOG_HEADER(words, module, level) ((words) | ((uint32_t) (level) << 16) | ((uint32_t) (module) << 20))
+#define LOG_HEADER_WORDS(header) ((header) & 0xffff)
+#define LOG_HEADER_LEVEL(header) (((header) >> 16) & 0xf)
+#define LOG_HEADER_MODULE(header) (((header) >> 20) & 0xf)
+
+// String arguments that point into flash are stored as pointers, anything else is copied into the record
+#define LOG_IS_FLASH_POINTER(p) ((uintptr_t) (p) >= XIP_BASE && (uintptr_t) (p) < XIP_BASE + PICO_FLASH_SIZE_BYTES)
+#define LOG_INLINE_STRING 0
+
+static uint32_t log_ring[LOG_RING_WORDS];
+static volatile uint32_t log_head = 0;
+static volatile uint32_t log_tail = 0;
+static volatile uint32_t log_dropped = 0;
+
+static bool log_at_line_start = true;
+static bool log_tokenized = LOG_TOKENIZED_DEFAULT;
+static bool log_console = LOG_CONSOLE_DEFAULT;
+
+extern const char __start_log_strings[];
+extern const char __stop_log_strings[];
+
+volatile uint8_t log_levels[LOG_MODULE_COUNT] = {
+        [0 ... LOG_MODULE_COUNT - 1] = LOG_LEVEL_INFO
+};
+
+static const char *const LOG_MODULE_NAMES[LOG_MODULE_COUNT] = {
+        [LOG_MODULE_MAIN] = "MAIN",
+        [LOG_MODULE_RADAR] = "RADAR",
+        [LOG_MODULE_PIR] = "PIR",
+        [LOG_MODULE_SENSOR] = "SENSOR",
+        [LOG_MODULE_WIFI] = "WIFI",
+        [LOG_MODULE_NET] = "NET",
+        [LOG_MODULE_REPORTING] = "REPORTING",
+        [LOG_MODULE_BLUETOOTH] = "BLUETOOTH",
+        [LOG_MODULE_STORAGE] = "STORAGE",
+        [LOG_MODULE_OTA] = "OTA",
+};
+
+static const char *const LOG_LEVEL_NAMES[] = {
+        [LOG_LEVEL_ERROR] = "ERROR",
+        [LOG_LEVEL_WARN] = "WARN",
+        [LOG_LEVEL_INFO] = "INFO",
+        [LOG_LEVEL_DEBUG] = "DEBUG",
+};
+
+typedef enum {
+    ARG_NONE,
+    ARG_INT,
+    ARG_SIGNED_INT,
+    ARG_LONG_LONG,
+    ARG_SIGNED_LONG_LONG,
+    ARG_DOUBLE,
+    ARG_POINTER,
+    ARG_STRING
+} arg_type_t;
+
+// Reads the arguments of a record back in the order they were stored
+typedef struct {
+    const uint32_t *next;
+    const uint32_t *end;
+    uint32_t tags;
+} log_arg_reader_t;
+
+// An argument of a record. A string is terminated unless it was copied into the record, then it has a length
+typedef struct {
+    log_arg_tag_t tag;
+    uint64_t bits;
+    const char *string;
+    int32_t string_len;
+} log_arg_t;
+
+/**
+ * Parse one conversion specification
+ * @param spec Points at the character after the %
+ * @param type Set to the type of the argument the conversion takes
+ * @param stars Set to the number of * in the width and precision, each takes an int argument
+ * @param star_precision Set to whether the precision is a *, its argument is then the last of the stars
+ * @return Points at the character after the conversion
+ */
+static const char *parse_conversion(const char *spec, arg_type_t *type, uint8_t *stars, bool *star_precision) {
+    uint8_t longs = 0;
+    bool intmax = false;
+    bool in_precision = false;
+    *stars = 0;
+    *star_precision = false;
+
+    while (*spec && strchr("-+ #0", *spec)) spec++;
+    while (*spec == '*' || (*spec >= '0' && *spec <= '9') || *spec == '.') {
+        if (*spec == '.') in_precision = true;
+        if (*spec == '*') {
+            (*stars)++;
+            *star_precision = in_precision;
+        }
+        spec++;
+    }
+    while (*spec && strchr("hlLjzt", *spec)) {
+        if (*spec == 'l') longs++;
+        if (*spec == 'j') intmax = true;
+        spec++;
+    }
+
+    switch (*spec) {
+        case 'd':
+        case 'i':
+            *type = longs >= 2 || intmax ? ARG_SIGNED_LONG_LONG : ARG_SIGNED_INT;
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'c':
+            // long is 32 bits on the RP2040, only long long and intmax_t take two words
+            *type = longs >= 2 || intmax ? ARG_LONG_LONG : ARG_INT;
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+            *type = ARG_DOUBLE;
+            break;
+        case 'p':
+            *type = ARG_POINTER;
+            break;
+        case 's':
+            *type = ARG_STRING;
+            break;
+        default:
+            *type = ARG_NONE;
+            break;
+    }
+
+    return *spec ? spec + 1 : spec;
+}
+
+static void log_capture(log_module_t module, log_level_t level, const char *format, uint32_t arg_tags,
+                        va_list args) {
+    uint32_t record[LOG_MAX_RECORD_WORDS];
+    uint32_t words = LOG_RECORD_HEADER_WORDS;
+    uint32_t stored_tags = 0;
+
+    record[1] = time_us_32();
+    record[2] = (uint32_t) format;
+
+    // Arguments that do not fit any more are left out, the line is cut short where they would have been
+    for (uint8_t i = 0; i < LOG_MAX_ARGS; i++) {
+        log_arg_tag_t tag = (arg_tags >> (i * LOG_ARG_TAG_BITS)) & ((1 << LOG_ARG_TAG_BITS) - 1);
+        if (tag == LOG_ARG_NONE) {
+            break;
+        }
+
+        if (tag == LOG_ARG_WORD) {
+            if (words + 1 > LOG_MAX_RECORD_WORDS) {
+                break;
+            }
+            record[words++] = va_arg(args, uint32_t);
+        } else if (tag == LOG_ARG_WIDE || tag == LOG_ARG_DOUBLE) {
+            if (words + 2 > LOG_MAX_RECORD_WORDS) {
+                break;
+            }
+            if (tag == LOG_ARG_WIDE) {
+                uint64_t value = va_arg(args, uint64_t);
+                memcpy(&record[words], &value, sizeof(value));
+            } else {
+                double value = va_arg(args, double);
+                memcpy(&record[words], &value, sizeof(value));
+            }
+            words += 2;
+        } else {
+            const char *string = va_arg(args, const char *);
+            if (string && LOG_IS_FLASH_POINTER(string)) {
+                if (words + 1 > LOG_MAX_RECORD_WORDS) {
+                    break;
+                }
+                record[words++] = (uint32_t) string;
+            } else {
+                // The precision of a %.*s is only known to the flush, so the copy is up to LOG_MAX_STRING_LEN
+                size_t len = string ? strnlen(string, LOG_MAX_STRING_LEN) : 0;
+                if (words + 2 + (len + 3) / 4 > LOG_MAX_RECORD_WORDS) {
+                    break;
+                }
+                record[words++] = LOG_INLINE_STRING;
+                record[words++] = len;
+                if (len) {
+                    memcpy(&record[words], string, len);
+                }
+                words += (len + 3) / 4;
+            }
+        }
+        stored_tags |= (uint32_t) tag << (i * LOG_ARG_TAG_BITS);
+    }
+
+    record[3] = stored_tags;
+    record[0] = LOG_HEADER(words, module, level);
+
+    uint32_t interrupts = save_and_disable_interrupts();
+
+    uint32_t head = log_head;
+    uint32_t offset = head & (LOG_RING_WORDS - 1);
+    uint32_t padding = offset + words > LOG_RING_WORDS ? LOG_RING_WORDS - offset : 0;
+
+    if (head + padding + words - log_tail > LOG_RING_WORDS) {
+        log_dropped++;
+        restore_interrupts(interrupts);
+        return;
+    }
+
+    // Records are never split over the end of the ring, the rest of it is skipped instead
+    if (padding) {
+        log_ring[offset] = LOG_HEADER(padding, 0, LOG_RECORD_PADDING);
+        head += padding;
+        offset = 0;
+    }
+    memcpy(&log_ring[offset], record, words * sizeof(uint32_t));
+    log_head = head + words;
+
+    restore_interrupts(interrupts);
+    event_loop_post(EVENT_LOG);
+}
+
+static void log_arg_reader_init(log_arg_reader_t *reader, const uint32_t *record) {
+    reader->next = record + LOG_RECORD_HEADER_WORDS;
+    reader->end = record + LOG_HEADER_WORDS(record[0]);
+    reader->tags = record[3];
+}
+
+/**
+ * Take the next argument of a record
+ * @param reader The record
+ * @param arg Set to the argument, its tag is LOG_ARG_NONE if the record has no more
+ */
+static void log_next_arg(log_arg_reader_t *reader, log_arg_t *arg) {
+    arg->tag = reader->tags & ((1 << LOG_ARG_TAG_BITS) - 1);
+    arg->bits = 0;
+    arg->string = NULL;
+    arg->string_len = -1;
+    reader->tags >>= LOG_ARG_TAG_BITS;
+
+    switch (arg->tag) {
+        case LOG_ARG_WORD:
+            arg->bits = *reader->next++;
+            break;
+        case LOG_ARG_WIDE:
+        case LOG_ARG_DOUBLE:
+            memcpy(&arg->bits, reader->next, sizeof(arg->bits));
+            reader->next += 2;
+            break;
+        case LOG_ARG_STRING: {
+            uint32_t pointer = *reader->next++;
+            if (pointer != LOG_INLINE_STRING) {
+                arg->bits = pointer;
+                arg->string = (const char *) pointer;
+            } else {
+                arg->string_len = (int32_t) *reader->next++;
+                arg->string = (const char *) reader->next;
+                reader->next += (arg->string_len + 3) / 4;
+            }
+            break;
+        }
+        case LOG_ARG_NONE:
+        default:
+            arg->tag = LOG_ARG_NONE;
+            break;
+    }
+}
+
+/**
+ * Format one record into a line, one conversion at a time from the arguments stored in it
+ */
+static int log_format(const uint32_t *record, char *line, size_t line_size) {
+    const char *format = (const char *) record[2];
+    log_arg_reader_t reader;
+    log_arg_reader_init(&reader, record);
+    size_t len = 0;
+
+    const char *p = format;
+    while (*p && len < line_size - 1) {
+        if (*p != '%' || p[1] == '%') {
+            line[len++] = *p;
+            p += *p == '%' ? 2 : 1;
+            continue;
+        }
+
+        arg_type_t type;
+        uint8_t stars;
+        bool star_precision;
+        const char *end = parse_conversion(p + 1, &type, &stars, &star_precision);
+
+        // Rebuild the conversion with the * replaced by the stored values so snprintf only needs the argument
+        char spec[24];
+        size_t spec_len = 0;
+        log_arg_t arg = {.tag = LOG_ARG_WORD};
+        for (const char *s = p; s < end && spec_len < sizeof(spec) - 12; s++) {
+            if (*s != '*') {
+                spec[spec_len++] = *s;
+                continue;
+            }
+            log_next_arg(&reader, &arg);
+            if (arg.tag == LOG_ARG_NONE) {
+                break;
+            }
+            spec_len += snprintf(spec + spec_len, sizeof(spec) - spec_len, "%ld", (int32_t) arg.bits);
+        }
+        spec[spec_len] = '\0';
+        if (arg.tag != LOG_ARG_NONE && type != ARG_NONE) {
+            log_next_arg(&reader, &arg);
+        }
+        if (arg.tag == LOG_ARG_NONE) {
+            // The arguments did not fit in the record, the line ends here
+            size_t format_len = strlen(format);
+            if (format_len && format[format_len - 1] == '\n' && len < line_size - 1) {
+                line[len++] = '\n';
+            }
+            break;
+        }
+
+        int written = 0;
+        switch (type) {
+            case ARG_INT:
+            case ARG_SIGNED_INT:
+                written = snprintf(line + len, line_size - len, spec, (uint32_t) arg.bits);
+                break;
+            case ARG_POINTER:
+                written = snprintf(line + len, line_size - len, spec, (void *) (uintptr_t) arg.bits);
+                break;
+            case ARG_LONG_LONG:
+            case ARG_SIGNED_LONG_LONG:
+                written = snprintf(line + len, line_size - len, spec, arg.bits);
+                break;
+            case ARG_DOUBLE: {
+                double value;
+                memcpy(&value, &arg.bits, sizeof(value));
+                written = snprintf(line + len, line_size - len, spec, value);
+                break;
+            }
+            case ARG_STRING: {
+                if (arg.tag != LOG_ARG_STRING) {
+                    break;
+                }
+                if (arg.string_len < 0) {
+                    written = snprintf(line + len, line_size - len, spec, arg.string);
+                    break;
+                }
+                char string[LOG_MAX_STRING_LEN + 1];
+                memcpy(string, arg.string, arg.string_len);
+                string[arg.string_len] = '\0';
+                written = snprintf(line + len, line_size - len, spec, string);
+                break;
+            }
+            case ARG_NONE:
+                break;
+        }
+
+        if (written > 0) {
+            len += written < line_size - len ? written : line_size - len - 1;
+        }
+        p = end;
+    }
+
+    line[len] = '\0';
+    return len;
+}
+
+static size_t put_varint(uint8_t *out, uint64_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[len++] = value;
+    return len;
+}
+
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
 
 /**
- * @brief Print a formatted string to the console and to (if connected) the Bluetooth SPP client
- * @param format The format string
+ * Pack one record into a binary frame, see the top of this file for the format
+ * @return The length of the frame, or 0 if the format string is not in the dictionary
+ */
+static size_t log_pack(const uint32_t *record, uint8_t *frame, size_t frame_size) {
+    const char *format = (const char *) record[2];
+    if (format < __start_log_strings || format >= __stop_log_strings) {
+        return 0;
+    }
+
+    // The payload is built after room for the marker and the longest length varint, then moved down
+    uint8_t *payload = frame + 3;
+    size_t payload_size = frame_size - 3;
+    size_t len = 0;
+
+    len += put_varint(payload + len, format - __start_log_strings);
+    len += put_varint(payload + len, record[1] / 1000);
+    payload[len++] = LOG_HEADER_MODULE(record[0]) << 4 | LOG_HEADER_LEVEL(record[0]);
+
+    log_arg_reader_t reader;
+    log_arg_reader_init(&reader, record);
+
+    for (const char *p = format; *p; p++) {
+        if (*p != '%') continue;
+        if (p[1] == '%') {
+            p++;
+            continue;
+        }
+
+        arg_type_t type;
+        uint8_t stars;
+        bool star_precision;
+        const char *end = parse_conversion(p + 1, &type, &stars, &star_precision);
+
+        // Leave room for the largest argument, a string
+        if (len + (stars + 1) * 10 + LOG_MAX_STRING_LEN > payload_size) {
+            break;
+        }
+
+        // A * precision limits how much of a string is sent, the decoder applies it again
+        int32_t precision = -1;
+        log_arg_t arg = {.tag = LOG_ARG_WORD};
+        for (uint8_t star = 0; star < stars && arg.tag != LOG_ARG_NONE; star++) {
+            log_next_arg(&reader, &arg);
+            if (arg.tag != LOG_ARG_NONE) {
+                precision = (int32_t) arg.bits;
+                len += put_varint(payload + len, zigzag(precision));
+            }
+        }
+        if (!star_precision) {
+            precision = -1;
+        }
+        if (arg.tag != LOG_ARG_NONE && type != ARG_NONE) {
+            log_next_arg(&reader, &arg);
+        }
+        if (arg.tag == LOG_ARG_NONE) {
+            break;
+        }
+
+        switch (type) {
+            case ARG_INT:
+            case ARG_POINTER:
+                len += put_varint(payload + len, (uint32_t) arg.bits);
+                break;
+            case ARG_SIGNED_INT:
+                len += put_varint(payload + len, zigzag((int32_t) arg.bits));
+                break;
+            case ARG_LONG_LONG:
+                len += put_varint(payload + len, arg.bits);
+                break;
+            case ARG_SIGNED_LONG_LONG:
+                len += put_varint(payload + len, zigzag((int64_t) arg.bits));
+                break;
+            case ARG_DOUBLE:
+                memcpy(payload + len, &arg.bits, sizeof(double));
+                len += sizeof(double);
+                break;
+            case ARG_STRING: {
+                uint32_t string_len = 0;
+                if (arg.tag == LOG_ARG_STRING) {
+                    string_len = arg.string_len < 0 ? strnlen(arg.string, LOG_MAX_STRING_LEN) : arg.string_len;
+                }
+                if (precision >= 0 && precision < string_len) {
+                    string_len = precision;
+                }
+                len += put_varint(payload + len, string_len);
+                if (string_len) {
+                    memcpy(payload + len, arg.string, string_len);
+                }
+                len += string_len;
+                break;
+            }
+            case ARG_NONE:
+                break;
+        }
+
+        p = end - 1;
+    }
+
+    frame[0] = LOG_FRAME_RECORD;
+    size_t header_len = 1 + put_varint(frame + 1, len);
+    memmove(frame + header_len, payload, len);
+    return header_len + len;
+}
+
+// Records are printed a while after they were logged, so every line is stamped with when it was logged
+static size_t log_line_prefix(uint32_t timestamp_us, char *line, size_t line_size) {
+    if (!log_at_line_start) {
+        return 0;
+    }
+    int len = snprintf(line, line_size, "[%5lu.%03lu] ", timestamp_us / 1000000, (timestamp_us / 1000) % 1000);
+    return len > 0 && len < line_size ? len : 0;
+}
+
+static void log_output(const char *line, size_t len, bool to_console, bool to_bluetooth) {
+    if (to_console) {
+        fputs(line, stdout);
+    }
+    if (to_bluetooth) {
+        bluetooth_write((const uint8_t *) line, len);
+    }
+    log_at_line_start = len && line[len - 1] == '\n';
+}
+
+/**
+ * @brief Log a formatted string to the console and to (if connected) the Bluetooth SPP client.
+ * Only the arguments are captured here, the string is formatted later by multi_printf_flush().
+ * Use the LOG_ macros instead, they skip disabled levels without a call, put the format in the dictionary and tag
+ * the arguments
+ * @param module The module logging the message
+ * @param level The level of the message
+ * @param format The format string, must stay valid until the record has been flushed
+ * @param arg_tags The log_arg_tag_t of every argument, LOG_ARG_TAG_BITS each, the first in the lowest bits
  * @param ... The arguments to the format string
  */
-void multi_printf(const char *format, ...) {
+void multi_log(log_module_t module, log_level_t level, const char *format, uint32_t arg_tags, ...) {
     va_list args;
-    va_start(args, format);
-    vprintf(format, args);
-    bluetooth_vprintf(format, args);
+    va_start(args, arg_tags);
+    log_capture(module, level, format, arg_tags, args);
     va_end(args);
 }
+
+/**
+ * Format and print all the records logged since the last call. Must be called from the main loop
+ */
+void multi_printf_flush() {
+    char line[LOG_MAX_LINE_LEN];
+    uint8_t frame[LOG_MAX_FRAME_LEN];
+    uint32_t tail = log_tail;
+
+    while (tail != log_head) {
+        const uint32_t *record = &log_ring[tail & (LOG_RING_WORDS - 1)];
+        uint32_t header = record[0];
+
+        if (LOG_HEADER_LEVEL(header) != LOG_RECORD_PADDING) {
+            size_t frame_len = log_tokenized ? log_pack(record, frame, sizeof(frame)) : 0;
+            if (frame_len) {
+                bluetooth_write(frame, frame_len);
+            }
+
+            // Formatting the text is most of the cost of a record, it is skipped when no one reads the text
+            if (log_console || !frame_len) {
+                size_t len = log_line_prefix(record[1], line, sizeof(line));
+                len += log_format(record, line + len, sizeof(line) - len);
+                log_output(line, len, log_console, !frame_len);
+            } else {
+                const char *format = (const char *) record[2];
+                size_t format_len = strlen(format);
+                log_at_line_start = format_len && format[format_len - 1] == '\n';
+            }
+        }
+
+        tail += LOG_HEADER_WORDS(header);
+        log_tail = tail;
+    }
+
+    if (log_dropped) {
+        uint32_t interrupts = save_and_disable_interrupts();
+        uint32_t dropped = log_dropped;
+        log_dropped = 0;
+        restore_interrupts(interrupts);
+
+        size_t len = log_line_prefix(time_us_32(), line, sizeof(line));
+        len += snprintf(line + len, sizeof(line) - len, "%lu log messages dropped, the log ring was full\n", dropped);
+        log_output(line, len, log_console, true);
+    }
+}
+
+/**
+ * @brief Set the most verbose level that is logged for a module
+ * @param module The module, or LOG_MODULE_COUNT for all modules
+ * @param level The level
+ */
+void multi_printf_set_level(log_module_t module, log_level_t level) {
+    for (uint8_t i = 0; i < LOG_MODULE_COUNT; i++) {
+        if (module == LOG_MODULE_COUNT || module == i) {
+            log_levels[i] = level;
+        }
+    }
+}
+
+/**
+ * @brief Switch the Bluetooth SPP output between text and the binary tokenized format.
+ * The console output is always text
+ * @param tokenized True for the binary format
+ */
+void multi_printf_set_tokenized(bool tokenized) {
+    log_tokenized = tokenized;
+    if (!tokenized) {
+        return;
+    }
+
+    uint8_t frame[5];
+    uint32_t dictionary_crc = flash_storage_crc32(0, __start_log_strings, __stop_log_strings - __start_log_strings);
+    frame[0] = LOG_FRAME_DICTIONARY;
+    memcpy(frame + 1, &dictionary_crc, sizeof(dictionary_crc));
+    bluetooth_write(frame, sizeof(frame));
+}
+
+/**
+ * @return True if the Bluetooth SPP output is in the binary tokenized format
+ */
+bool multi_printf_is_tokenized() {
+    return log_tokenized;
+}
+
+/**
+ * @brief Switch the text output on the USB/UART console on or off. With the console off and the Bluetooth SPP
+ * output tokenized, records are not formatted at all
+ * @param on True to print the records on the console
+ */
+void multi_printf_set_console(bool on) {
+    log_console = on;
+}
+
+/**
+ * @return True if the records are printed on the USB/UART console
+ */
+bool multi_printf_is_console() {
+    return log_console;
+}
+
+/**
+ * @param module The module
+ * @return The name of the module as used by the console commands
+ */
+const char *multi_printf_module_name(log_module_t module) {
+    return module < LOG_MODULE_COUNT ? LOG_MODULE_NAMES[module] : "ALL";
+}
+
+/**
+ * @param level The level
+ * @return The name of the level as used by the console commands
+ */
+const char *multi_printf_level_name(log_level_t level) {
+    return level <= LOG_LEVEL_DEBUG ? LOG_LEVEL_NAMES[level] : "?";
+}
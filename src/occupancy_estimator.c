@@ -0,0 +1,76 @@
+#include "occupancy_estimator.h"
+#include "hot_path.h"
+
+// Gaps longer than this are treated as this long. Keeps dt << 16 within 32 bits and by then the old average
+// has no weight left anyway
+#define MAX_SAMPLE_GAP_MS 0xffff
+
+/**
+ * @brief Initialize an estimator
+ * @param estimator The estimator
+ * @param time_constant_ms The time constant of the average. Larger is more stable but slower to respond
+ */
+void occupancy_estimator_init(occupancy_estimator_t *estimator, uint32_t time_constant_ms) {
+    estimator->average_q16 = 0;
+    estimator->last_sample_ms = 0;
+    estimator->time_constant_ms = time_constant_ms;
+    estimator->has_sample = false;
+}
+
+/**
+ * @brief Change the time constant of an estimator without losing its current average
+ * @param estimator The estimator
+ * @param time_constant_ms The new time constant
+ */
+void occupancy_estimator_set_time_constant(occupancy_estimator_t *estimator, uint32_t time_constant_ms) {
+    estimator->time_constant_ms = time_constant_ms;
+}
+
+/**
+ * @brief Add a sample to the estimator. Safe to call from an interrupt
+ * @param estimator The estimator
+ * @param count The count seen in this sample
+ * @param now_ms The time of the sample in milliseconds
+ */
+void __hot_path_func(occupancy_estimator_add_sample)(occupancy_estimator_t *estimator, uint8_t count, uint32_t now_ms) {
+    uint32_t sample_q16 = (uint32_t) count << 16;
+
+    if (!estimator->has_sample) {
+        estimator->average_q16 = sample_q16;
+        estimator->last_sample_ms = now_ms;
+        estimator->has_sample = true;
+        return;
+    }
+
+    uint32_t dt_ms = now_ms - estimator->last_sample_ms;
+    if (dt_ms > MAX_SAMPLE_GAP_MS) {
+        dt_ms = MAX_SAMPLE_GAP_MS;
+    }
+    estimator->last_sample_ms = now_ms;
+
+    // alpha = dt / (dt + tau) in Q16, one 32 bit division which the RP2040 does in its hardware divider
+    uint32_t alpha_q16 = (dt_ms << 16) / (dt_ms + estimator->time_constant_ms);
+
+    int32_t error_q16 = (int32_t) sample_q16 - (int32_t) estimator->average_q16;
+    int32_t step_q16 = (int32_t) (((int64_t) error_q16 * alpha_q16) >> 16);
+
+    estimator->average_q16 = (uint32_t) ((int32_t) estimator->average_q16 + step_q16);
+}
+
+/**
+ * @brief Get the current average rounded to the nearest whole count
+ * @param estimator The estimator
+ * @return The current count
+ */
+int16_t occupancy_estimator_get_count(const occupancy_estimator_t *estimator) {
+    return (int16_t) ((estimator->average_q16 + 0x8000) >> 16);
+}
+
+/**
+ * @brief Get the current average in Q16.16 fixed point
+ * @param estimator The estimator
+ * @return The current average
+ */
+uint32_t occupancy_estimator_get_average_q16(const occupancy_estimator_t *estimator) {
+    return estimator->average_q16;
+}
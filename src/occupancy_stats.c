@@ -0,0 +1,178 @@
+#include "occupancy_stats.h"
+#include "hot_path.h"
+#include <string.h>
+
+#include "hardware/sync.h"
+
+// A count is held until the next frame, but not for longer than the radar drivers consider a count valid
+#define MAX_SAMPLE_HOLD_MS 5000
+
+// Motion that starts within this long of the last motion ending is part of the same episode
+#define PIR_EPISODE_GAP_MS 30000
+
+typedef struct {
+    uint32_t start_ms;
+    uint32_t radar_samples;
+    uint8_t min_count;
+    uint8_t max_count;
+    uint64_t count_ms_sum;
+    uint32_t valid_ms;
+    uint32_t occupied_ms;
+    uint32_t histogram_ms[OCCUPANCY_STATS_HISTOGRAM_BINS];
+    uint32_t pir_high_ms;
+    uint32_t pir_rising_edges;
+    uint32_t pir_episodes;
+} interval_t;
+
+static interval_t interval;
+
+static uint8_t last_count = 0;
+static uint32_t last_count_ms = 0;
+static bool has_count = false;
+
+static bool pir_state = false;
+static uint32_t pir_state_since_ms = 0;
+static bool has_pir_fall = false;
+static uint32_t last_pir_fall_ms = 0;
+
+static void start_interval(uint32_t now_ms) {
+    memset(&interval, 0, sizeof(interval));
+    interval.start_ms = now_ms;
+    interval.min_count = UINT8_MAX;
+    pir_state_since_ms = now_ms;
+}
+
+// Credit the time since the last frame to the count of that frame
+static void __hot_path_func(hold_last_count)(uint32_t now_ms) {
+    if (!has_count) {
+        return;
+    }
+
+    uint32_t held_ms = now_ms - last_count_ms;
+    if (held_ms > MAX_SAMPLE_HOLD_MS) {
+        held_ms = MAX_SAMPLE_HOLD_MS;
+    }
+
+    interval.valid_ms += held_ms;
+    interval.count_ms_sum += (uint64_t) last_count * held_ms;
+    if (last_count) {
+        interval.occupied_ms += held_ms;
+    }
+    uint8_t bin = last_count < OCCUPANCY_STATS_HISTOGRAM_BINS ? last_count : OCCUPANCY_STATS_HISTOGRAM_BINS - 1;
+    interval.histogram_ms[bin] += held_ms;
+
+    last_count_ms = now_ms;
+}
+
+static void __hot_path_func(hold_pir_state)(uint32_t now_ms) {
+    // Edges are timestamped in the interrupt but handed over from the main loop, so one can predate the interval
+    if ((int32_t) (now_ms - pir_state_since_ms) <= 0) {
+        return;
+    }
+    if (pir_state) {
+        interval.pir_high_ms += now_ms - pir_state_since_ms;
+    }
+    pir_state_since_ms = now_ms;
+}
+
+static uint8_t histogram_percentile(const interval_t *closed, uint32_t permille) {
+    if (!closed->valid_ms) {
+        return 0;
+    }
+
+    uint32_t target_ms = (uint32_t) (((uint64_t) closed->valid_ms * permille) / 1000);
+    uint32_t cumulative_ms = 0;
+    for (uint8_t bin = 0; bin < OCCUPANCY_STATS_HISTOGRAM_BINS; bin++) {
+        cumulative_ms += closed->histogram_ms[bin];
+        if (cumulative_ms > target_ms) {
+            return bin;
+        }
+    }
+    return OCCUPANCY_STATS_HISTOGRAM_BINS - 1;
+}
+
+static uint16_t permille_of(uint32_t part_ms, uint32_t total_ms) {
+    return total_ms ? (uint16_t) (((uint64_t) part_ms * 1000) / total_ms) : 0;
+}
+
+/**
+ * @brief Start the first interval
+ * @param now_ms Current time in milliseconds
+ */
+void occupancy_stats_init(uint32_t now_ms) {
+    start_interval(now_ms);
+}
+
+/**
+ * @brief Add a radar frame to the current interval. O(1) and safe to call from an interrupt
+ * @param count The count in the frame
+ * @param now_ms Time of the frame in milliseconds
+ */
+void __hot_path_func(occupancy_stats_add_radar_sample)(uint8_t count, uint32_t now_ms) {
+    uint32_t interrupts = save_and_disable_interrupts();
+
+    hold_last_count(now_ms);
+    last_count = count;
+    last_count_ms = now_ms;
+    has_count = true;
+
+    interval.radar_samples++;
+    if (count < interval.min_count) interval.min_count = count;
+    if (count > interval.max_count) interval.max_count = count;
+
+    restore_interrupts(interrupts);
+}
+
+/**
+ * @brief Record a change of the PIR output. O(1) and safe to call from an interrupt
+ * @param motion True if the PIR output is now high
+ * @param now_ms Time of the change in milliseconds
+ */
+void __hot_path_func(occupancy_stats_set_pir_state)(bool motion, uint32_t now_ms) {
+    uint32_t interrupts = save_and_disable_interrupts();
+
+    hold_pir_state(now_ms);
+    if (motion && !pir_state) {
+        interval.pir_rising_edges++;
+        if (!has_pir_fall || now_ms - last_pir_fall_ms > PIR_EPISODE_GAP_MS) {
+            interval.pir_episodes++;
+        }
+    } else if (!motion && pir_state) {
+        has_pir_fall = true;
+        last_pir_fall_ms = now_ms;
+    }
+    pir_state = motion;
+
+    restore_interrupts(interrupts);
+}
+
+/**
+ * @brief Close the current interval, compute its statistics and start a new one
+ * @param stats Filled with the statistics of the interval that was closed
+ * @param now_ms Current time in milliseconds
+ */
+void occupancy_stats_take(occupancy_stats_t *stats, uint32_t now_ms) {
+    interval_t closed;
+
+    uint32_t interrupts = save_and_disable_interrupts();
+    hold_last_count(now_ms);
+    hold_pir_state(now_ms);
+    closed = interval;
+    start_interval(now_ms);
+    restore_interrupts(interrupts);
+
+    uint32_t interval_ms = now_ms - closed.start_ms;
+
+    stats->interval_ms = interval_ms;
+    stats->radar_samples = closed.radar_samples;
+    stats->min_count = closed.radar_samples ? closed.min_count : 0;
+    stats->max_count = closed.max_count;
+    stats->mean_count_centi = closed.valid_ms ? (uint16_t) ((closed.count_ms_sum * 100) / closed.valid_ms) : 0;
+    stats->median_count = histogram_percentile(&closed, 500);
+    stats->p90_count = histogram_percentile(&closed, 900);
+    stats->occupied_permille = permille_of(closed.occupied_ms, closed.valid_ms);
+    stats->pir_duty_permille = permille_of(closed.pir_high_ms, interval_ms);
+    stats->pir_episodes = closed.pir_episodes;
+    stats->pir_events_per_minute_centi = interval_ms ? (uint16_t) (((uint64_t) closed.pir_rising_edges * 6000000) / interval_ms) : 0;
+    stats->radar_valid_permille = permille_of(closed.valid_ms, interval_ms);
+}
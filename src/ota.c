@@ -0,0 +1,382 @@
+#define LOG_MODULE LOG_MODULE_OTA
+
+#include "ota.h"
+
+#include <string.h>
+#include <strings.h>
+#include "event_loop.h"
+#include "flash_storage.h"
+#include "hardware/sync.h"
+#include "hardware/watchdog.h"
+#include "mbedtls/sha256.h"
+#include "multi_printf.h"
+#include "ota_patch.h"
+#include "ota_status.h"
+#include "reporting.h"
+#include "reset.h"
+#include "wifi_manager.h"
+
+// An update is a patch from the running image to the new one, see ota_patch.h. It is downloaded from the reporting
+// server and applied on the fly into slot B one sector at a time, and the bootloader swaps it into slot A on the
+// reset that follows. See ota_status.h for the flash layout and ota_bootloader.c for the swap
+
+_Static_assert(OTA_STATUS_OFFSET + FLASH_SECTOR_SIZE <= FLASH_STORAGE_CONFIG_OFFSET,
+               "The update slots leave room for the flash storage sectors");
+
+// Longer header lines are cut off, only the status line and Transfer-Encoding are looked at
+#define OTA_HEADER_LINE_LEN 96
+
+// The slot is hashed this many bytes at a time, feeding the watchdog in between
+#define OTA_HASH_CHUNK_LEN (64 * 1024)
+
+typedef struct {
+    // The HTTP response header
+    bool header_done;
+    char line[OTA_HEADER_LINE_LEN];
+    uint32_t line_len;
+    bool status_line;
+    bool status_ok;
+    bool chunked;
+
+    // The new image
+    ota_patch_header_t patch_header;
+    uint32_t sector_len; // Bytes in sector_buffer not yet written to slot B
+    bool complete;
+} download_t;
+
+static const char *const result_names[] = {
+        [OTA_RESULT_NONE] = "NONE",
+        [OTA_RESULT_INSTALLING] = "INSTALLING",
+        [OTA_RESULT_DOWNLOAD_FAILED] = "DOWNLOAD_FAILED",
+        [OTA_RESULT_HTTP_ERROR] = "HTTP_ERROR",
+        [OTA_RESULT_WRONG_IMAGE] = "WRONG_IMAGE",
+        [OTA_RESULT_REVERTED] = "REVERTED",
+        [OTA_RESULT_TOO_LARGE] = "TOO_LARGE",
+        [OTA_RESULT_INVALID_PATCH] = "INVALID_PATCH",
+        [OTA_RESULT_FLASH_ERROR] = "FLASH_ERROR",
+        [OTA_RESULT_HASH_MISMATCH] = "HASH_MISMATCH",
+};
+
+static const char *const state_names[] = {
+        [OTA_STATE_NONE] = "NONE",
+        [OTA_STATE_TRIAL] = "TRIAL",
+        [OTA_STATE_REVERTED] = "REVERTED",
+};
+
+static ota_status_t status;
+static char requested_path[sizeof(status.last_path)];
+static char failed_path[sizeof(status.last_path)];
+
+static download_t download;
+static ota_patch_t patch;
+static mbedtls_sha256_context image_sha256;
+static uint8_t sector_buffer[FLASH_SECTOR_SIZE];
+
+/**
+ * @return The state of the running firmware, from the status the bootloader left
+ */
+static ota_state_t read_state() {
+    if (!ota_status_get_header() || !ota_status_get_flag(OTA_FLAG_BOOTED) ||
+        ota_status_get_flag(OTA_FLAG_CONFIRMED)) {
+        return OTA_STATE_NONE;
+    }
+    return ota_status_swap_done(OTA_STATUS_REVERT_PAGE) ? OTA_STATE_REVERTED : OTA_STATE_TRIAL;
+}
+
+/**
+ * Check what became of the last update, must be called once at boot
+ */
+void ota_init() {
+    status.state = read_state();
+    switch (status.state) {
+        case OTA_STATE_TRIAL:
+            LOG_INFO("Running an update on trial, it is kept once a report has been sent\n");
+            break;
+        case OTA_STATE_REVERTED:
+            LOG_WARN("The last update did not send a report, the previous firmware was brought back\n");
+            break;
+        case OTA_STATE_NONE:
+            break;
+    }
+}
+
+/**
+ * @brief Update the firmware from a patch on the reporting server. The patch is downloaded by ota_task() and the
+ * Pico resets once the new image is written and verified
+ * @param path Path of the patch on the reporting server
+ * @param retry False to ignore a path whose patch failed before, so a server that keeps asking does not cause a
+ * download on every report
+ * @return True if the update was started
+ */
+bool ota_request(const char *path, bool retry) {
+    if (path[0] != '/' || strlen(path) >= sizeof(requested_path)) {
+        LOG_WARN("Invalid update path %s\n", path);
+        return false;
+    }
+    if (!retry && strcmp(path, failed_path) == 0) {
+        return false;
+    }
+    if (status.state == OTA_STATE_TRIAL) {
+        // Another update would replace the previous firmware in slot B, which is all there is to go back to
+        LOG_WARN("The running update is not confirmed yet, ignoring %s\n", path);
+        return false;
+    }
+    if (requested_path[0] != '\0' || status.last_result == OTA_RESULT_INSTALLING) {
+        return false;
+    }
+
+    strcpy(requested_path, path);
+    event_loop_post(EVENT_OTA);
+    return true;
+}
+
+/**
+ * @brief Hash the start of slot A
+ * @param len How many bytes to hash
+ * @param output Filled with the SHA-256
+ */
+static void hash_slot_a(uint32_t len, uint8_t output[32]) {
+    const uint8_t *slot = (const uint8_t *) (XIP_BASE + OTA_SLOT_A_OFFSET);
+    mbedtls_sha256_context sha256;
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_starts(&sha256, 0);
+    for (uint32_t offset = 0; offset < len; offset += OTA_HASH_CHUNK_LEN) {
+        watchdog_update();
+        mbedtls_sha256_update(&sha256, slot + offset, MIN(OTA_HASH_CHUNK_LEN, len - offset));
+    }
+    mbedtls_sha256_finish(&sha256, output);
+    mbedtls_sha256_free(&sha256);
+}
+
+static bool on_patch_header(const ota_patch_header_t *header, void *arg) {
+    if (header->old_size > OTA_SLOT_SIZE) {
+        status.last_result = OTA_RESULT_WRONG_IMAGE;
+        return false;
+    }
+    if (header->new_size == 0 || header->new_size > OTA_SLOT_SIZE) {
+        status.last_result = OTA_RESULT_TOO_LARGE;
+        return false;
+    }
+
+    // The update that was reverted is still in slot B, with its hash in the status
+    const ota_status_header_t *previous = ota_status_get_header();
+    if (status.state == OTA_STATE_REVERTED && previous &&
+        memcmp(previous->sha256, header->new_sha256, sizeof(previous->sha256)) == 0) {
+        status.last_result = OTA_RESULT_REVERTED;
+        return false;
+    }
+
+    uint8_t old_sha256[32];
+    hash_slot_a(header->old_size, old_sha256);
+    if (memcmp(old_sha256, header->old_sha256, sizeof(old_sha256)) != 0) {
+        status.last_result = OTA_RESULT_WRONG_IMAGE;
+        return false;
+    }
+
+    LOG_INFO("Patching %lu byte image to %lu bytes\n", header->old_size, header->new_size);
+    download.patch_header = *header;
+
+    // Slot B is about to change, whatever the status says about it no longer holds
+    ota_status_clear();
+    status.state = OTA_STATE_NONE;
+    return true;
+}
+
+/**
+ * @brief Write the collected bytes of the new image to the next sector of slot B and check them
+ * @return False if the sector did not read back as written
+ */
+static bool write_sector() {
+    uint32_t offset = OTA_SLOT_B_OFFSET + status.image_bytes;
+    memset(sector_buffer + download.sector_len, 0xff, FLASH_SECTOR_SIZE - download.sector_len);
+
+    uint32_t interrupts = save_and_disable_interrupts();
+    flash_range_erase(offset, FLASH_SECTOR_SIZE);
+    flash_range_program(offset, sector_buffer, FLASH_SECTOR_SIZE);
+    restore_interrupts(interrupts);
+
+    if (memcmp((const uint8_t *) (XIP_BASE + offset), sector_buffer, FLASH_SECTOR_SIZE) != 0) {
+        status.last_result = OTA_RESULT_FLASH_ERROR;
+        return false;
+    }
+    mbedtls_sha256_update(&image_sha256, sector_buffer, download.sector_len);
+    status.image_bytes += download.sector_len;
+    download.sector_len = 0;
+    return true;
+}
+
+static bool on_patch_output(uint8_t byte, void *arg) {
+    sector_buffer[download.sector_len++] = byte;
+    return download.sector_len < FLASH_SECTOR_SIZE || write_sector();
+}
+
+/**
+ * @brief Take one byte of the HTTP response header
+ * @param c The byte
+ * @return False if the response has no plain body to take the patch from
+ */
+static bool parse_header_byte(char c) {
+    if (c != '\n') {
+        if (c != '\r' && download.line_len < sizeof(download.line) - 1) {
+            download.line[download.line_len++] = c;
+        }
+        return true;
+    }
+    download.line[download.line_len] = '\0';
+
+    if (!download.status_line) {
+        download.status_line = true;
+        download.status_ok = strncmp(download.line, "HTTP/1.", 7) == 0 && strncmp(download.line + 8, " 200", 4) == 0;
+    } else if (download.line_len == 0) {
+        download.header_done = true;
+    } else if (strncasecmp(download.line, "Transfer-Encoding:", 18) == 0 && strstr(download.line, "chunked")) {
+        download.chunked = true;
+    }
+    download.line_len = 0;
+
+    if (download.header_done && (!download.status_ok || download.chunked)) {
+        LOG_WARN("The server did not send the patch as a plain 200 response\n");
+        status.last_result = OTA_RESULT_HTTP_ERROR;
+        return false;
+    }
+    return true;
+}
+
+static bool on_response(const uint8_t *data, size_t len, void *arg) {
+    size_t i = 0;
+    while (!download.header_done && i < len) {
+        if (!parse_header_byte((char) data[i++])) {
+            return false;
+        }
+    }
+    if (i == len) {
+        return true;
+    }
+
+    status.patch_bytes += len - i;
+    switch (ota_patch_feed(&patch, data + i, len - i)) {
+        case OTA_PATCH_MORE:
+            return true;
+        case OTA_PATCH_DONE:
+            download.complete = true;
+            return true;
+        case OTA_PATCH_ERROR:
+        default:
+            if (status.last_result == OTA_RESULT_NONE) {
+                status.last_result = OTA_RESULT_INVALID_PATCH;
+            }
+            return false;
+    }
+}
+
+/**
+ * @brief Write the rest of the new image and check it against the hash from the patch
+ * @return True if slot B holds the new image
+ */
+static bool finish_image() {
+    if (download.sector_len > 0 && !write_sector()) {
+        return false;
+    }
+
+    uint8_t sha256[32];
+    mbedtls_sha256_finish(&image_sha256, sha256);
+    if (status.image_bytes != download.patch_header.new_size ||
+        memcmp(sha256, download.patch_header.new_sha256, sizeof(sha256)) != 0) {
+        status.last_result = OTA_RESULT_HASH_MISMATCH;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Download and apply a requested patch. Must be called from the main loop, which it holds up until the download is
+ * done
+ */
+void ota_task() {
+    if (requested_path[0] == '\0') {
+        return;
+    }
+
+    strcpy(status.last_path, requested_path);
+    requested_path[0] = '\0';
+    status.last_result = OTA_RESULT_NONE;
+    status.patch_bytes = 0;
+    status.image_bytes = 0;
+
+    if (!wifi_manager_is_connected()) {
+        LOG_WARN("Wifi is not connected, not downloading %s\n", status.last_path);
+        status.last_result = OTA_RESULT_DOWNLOAD_FAILED;
+        return;
+    }
+
+    LOG_INFO("Downloading update %s\n", status.last_path);
+    memset(&download, 0, sizeof(download));
+    ota_patch_init(&patch, (const uint8_t *) (XIP_BASE + OTA_SLOT_A_OFFSET), on_patch_header, on_patch_output, NULL);
+    mbedtls_sha256_init(&image_sha256);
+    mbedtls_sha256_starts(&image_sha256, 0);
+
+    bool received = reporting_fetch(status.last_path, on_response, NULL);
+
+    if (download.complete) {
+        if (finish_image()) {
+            ota_status_header_t header = {
+                    .swap_sectors = (MAX(download.patch_header.old_size, download.patch_header.new_size) +
+                                     FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE,
+                    .image_size = download.patch_header.new_size,
+            };
+            memcpy(header.sha256, download.patch_header.new_sha256, sizeof(header.sha256));
+            ota_status_start(&header);
+            status.last_result = OTA_RESULT_INSTALLING;
+        }
+    } else if (status.last_result == OTA_RESULT_NONE) {
+        status.last_result = received ? OTA_RESULT_INVALID_PATCH : OTA_RESULT_DOWNLOAD_FAILED;
+    }
+    mbedtls_sha256_free(&image_sha256);
+
+    if (status.last_result == OTA_RESULT_INSTALLING) {
+        LOG_INFO("Update written, %lu byte patch, %lu byte image. Resetting to install it\n", status.patch_bytes,
+                 status.image_bytes);
+        request_pico_reset(RESET_REASON_OTA_INSTALL);
+    } else {
+        LOG_ERROR("Update %s failed: %s\n", status.last_path, ota_result_name(status.last_result));
+        strcpy(failed_path, status.last_path);
+    }
+}
+
+/**
+ * Confirm an update on trial, the bootloader then keeps it. Called once the update has sent a report
+ */
+void ota_confirm() {
+    if (status.state != OTA_STATE_TRIAL) {
+        return;
+    }
+    ota_status_set_flag(OTA_FLAG_CONFIRMED);
+    status.state = OTA_STATE_NONE;
+    LOG_INFO("Update confirmed\n");
+}
+
+/**
+ * @brief Get the state of the firmware and the outcome of the last update
+ * @param out Where to store the status
+ */
+void ota_get_status(ota_status_t *out) {
+    *out = status;
+}
+
+/**
+ * @brief Get the name of an update result
+ * @param result The result
+ * @return The name
+ */
+const char *ota_result_name(ota_result_t result) {
+    return result_names[result];
+}
+
+/**
+ * @brief Get the name of a firmware state
+ * @param state The state
+ * @return The name
+ */
+const char *ota_state_name(ota_state_t state) {
+    return state_names[state];
+}
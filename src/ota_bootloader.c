@@ -0,0 +1,115 @@
+// A separate program at the start of flash, see the flash layout in ota_status.h. It runs on every boot, swaps a
+// downloaded update into slot A or swaps the previous firmware back if an update was not confirmed, and then starts
+// the firmware in slot A. It must fit in OTA_BOOTLOADER_SIZE_KB and never changes itself. It only enables the watchdog
+// for a swap or the first boot of an update, and leaves the watchdog scratch registers 0-3 alone, they carry the reset
+// record of the firmware through it (see reset.c).
+
+#include <string.h>
+
+#include "hardware/address_mapped.h"
+#include "hardware/regs/m0plus.h"
+#include "hardware/structs/scb.h"
+#include "hardware/sync.h"
+#include "hardware/watchdog.h"
+#include "ota_status.h"
+
+// Close to the longest the RP2040 watchdog counts. A sector takes well under it, and so does the firmware up to
+// where it enables the watchdog itself
+#define OTA_BOOTLOADER_WATCHDOG_MS 8000
+
+static uint8_t sector_buffer[FLASH_SECTOR_SIZE];
+
+/**
+ * @brief Copy a flash sector to another one
+ * @param to_offset Offset of the sector to write from the start of flash
+ * @param from_offset Offset of the sector to read from the start of flash
+ */
+static void copy_sector(uint32_t to_offset, uint32_t from_offset) {
+    memcpy(sector_buffer, (const uint8_t *) (XIP_BASE + from_offset), FLASH_SECTOR_SIZE);
+
+    uint32_t interrupts = save_and_disable_interrupts();
+    flash_range_erase(to_offset, FLASH_SECTOR_SIZE);
+    flash_range_program(to_offset, sector_buffer, FLASH_SECTOR_SIZE);
+    restore_interrupts(interrupts);
+}
+
+/**
+ * @brief Swap slot A and slot B through the scratch sector, or finish a swap that was interrupted by a reset or a
+ * power cut. Every step is recorded after it is done and only needs the sectors that are still intact, so a step
+ * that was cut short is simply done again
+ * @param page OTA_STATUS_INSTALL_PAGE or OTA_STATUS_REVERT_PAGE, where the progress is recorded
+ */
+static void swap_slots(uint8_t page) {
+    const ota_status_header_t *header = ota_status_get_header();
+
+    for (uint32_t sector = 0; sector < header->swap_sectors; sector++) {
+        uint32_t a_offset = OTA_SLOT_A_OFFSET + sector * FLASH_SECTOR_SIZE;
+        uint32_t b_offset = OTA_SLOT_B_OFFSET + sector * FLASH_SECTOR_SIZE;
+        uint8_t progress = ota_status_get_progress(page, sector);
+
+        // Armed by main(), a swap that hangs resets and carries on from the last step that was recorded
+        watchdog_update();
+
+        if (progress == OTA_SWAP_NOT_STARTED) {
+            copy_sector(OTA_SCRATCH_OFFSET, a_offset);
+            ota_status_set_progress(page, sector, OTA_SWAP_IN_SCRATCH);
+            progress = OTA_SWAP_IN_SCRATCH;
+        }
+        if (progress == OTA_SWAP_IN_SCRATCH) {
+            copy_sector(a_offset, b_offset);
+            ota_status_set_progress(page, sector, OTA_SWAP_A_WRITTEN);
+            progress = OTA_SWAP_A_WRITTEN;
+        }
+        if (progress == OTA_SWAP_A_WRITTEN) {
+            copy_sector(b_offset, OTA_SCRATCH_OFFSET);
+            ota_status_set_progress(page, sector, OTA_SWAP_DONE);
+        }
+    }
+}
+
+/**
+ * Start the firmware in slot A as if the boot ROM had started it
+ */
+static void __attribute__((noreturn)) start_firmware() {
+    const uint32_t *vectors = (const uint32_t *) (XIP_BASE + OTA_SLOT_A_OFFSET + OTA_IMAGE_VECTORS_OFFSET);
+
+    // Leave no interrupt of ours enabled or pending for the firmware
+    *(io_rw_32 *) (PPB_BASE + M0PLUS_NVIC_ICER_OFFSET) = 0xffffffff;
+    *(io_rw_32 *) (PPB_BASE + M0PLUS_NVIC_ICPR_OFFSET) = 0xffffffff;
+
+    scb_hw->vtor = (uintptr_t) vectors;
+    __asm volatile (
+            "msr msp, %0\n"
+            "bx %1\n"
+            :
+            : "r" (vectors[0]), "r" (vectors[1])
+            );
+    __builtin_unreachable();
+}
+
+int main() {
+    if (ota_status_get_header()) {
+        bool confirmed = ota_status_get_flag(OTA_FLAG_CONFIRMED);
+        if (!ota_status_swap_done(OTA_STATUS_INSTALL_PAGE) ||
+            (!confirmed && !ota_status_swap_done(OTA_STATUS_REVERT_PAGE))) {
+            // Left armed for the firmware, so an update that hangs before it enables the watchdog itself still ends
+            // in a reset, and so in a revert
+            watchdog_enable(OTA_BOOTLOADER_WATCHDOG_MS, true);
+        }
+
+        if (!ota_status_swap_done(OTA_STATUS_INSTALL_PAGE)) {
+            swap_slots(OTA_STATUS_INSTALL_PAGE);
+        }
+
+        // The update gets one boot to confirm itself, a reset before it did so brings back the previous firmware
+        if (!confirmed) {
+            if (!ota_status_get_flag(OTA_FLAG_BOOTED)) {
+                ota_status_set_flag(OTA_FLAG_BOOTED);
+            } else if (!ota_status_swap_done(OTA_STATUS_REVERT_PAGE)) {
+                swap_slots(OTA_STATUS_REVERT_PAGE);
+            }
+        }
+    }
+
+    start_firmware();
+}
@@ -0,0 +1,179 @@
+#include "ota_patch.h"
+#include <string.h>
+
+#define WINDOW_MASK ((1u << OTA_PATCH_WINDOW_BITS) - 1)
+#define BACKREF_BITS (1 + OTA_PATCH_WINDOW_BITS + OTA_PATCH_LOOKAHEAD_BITS)
+
+#define CONTROL_LEN 12
+
+static uint32_t uint32_from_field(const uint8_t *field) {
+    return field[0] | field[1] << 8 | field[2] << 16 | (uint32_t) field[3] << 24;
+}
+
+/**
+ * @brief Take the next field of the patch from its bytes
+ * @param patch The patch state
+ * @param byte The next byte
+ * @param len Length of the field
+ * @return True once the field is complete
+ */
+static bool collect_field(ota_patch_t *patch, uint8_t byte, uint8_t len) {
+    patch->field[patch->field_len++] = byte;
+    if (patch->field_len < len) {
+        return false;
+    }
+    patch->field_len = 0;
+    return true;
+}
+
+/**
+ * @brief Move on to the next part of a record, or the next record once the current one is used up
+ * @param patch The patch state
+ */
+static void next_stage(ota_patch_t *patch) {
+    if (patch->stage == OTA_PATCH_STAGE_DIFF && patch->diff_left == 0) {
+        patch->stage = OTA_PATCH_STAGE_EXTRA;
+    }
+    if (patch->stage == OTA_PATCH_STAGE_EXTRA && patch->extra_left == 0) {
+        patch->old_pos += patch->seek;
+        patch->stage = patch->new_pos == patch->header.new_size ? OTA_PATCH_STAGE_DONE : OTA_PATCH_STAGE_CONTROL;
+    }
+}
+
+/**
+ * @brief Apply one decompressed byte of the patch
+ * @param patch The patch state
+ * @param byte The byte
+ * @return False if the patch is invalid or a callback failed
+ */
+static bool apply_byte(ota_patch_t *patch, uint8_t byte) {
+    switch (patch->stage) {
+        case OTA_PATCH_STAGE_HEADER:
+            if (!collect_field(patch, byte, sizeof(ota_patch_header_t))) {
+                return true;
+            }
+            memcpy(&patch->header, patch->field, sizeof(ota_patch_header_t));
+            if (patch->header.magic != OTA_PATCH_MAGIC || !patch->on_header(&patch->header, patch->arg)) {
+                return false;
+            }
+            patch->stage = patch->header.new_size ? OTA_PATCH_STAGE_CONTROL : OTA_PATCH_STAGE_DONE;
+            return true;
+
+        case OTA_PATCH_STAGE_CONTROL:
+            if (!collect_field(patch, byte, CONTROL_LEN)) {
+                return true;
+            }
+            patch->diff_left = uint32_from_field(patch->field);
+            patch->extra_left = uint32_from_field(patch->field + 4);
+            patch->seek = (int32_t) uint32_from_field(patch->field + 8);
+            if (patch->diff_left > patch->header.new_size - patch->new_pos ||
+                patch->extra_left > patch->header.new_size - patch->new_pos - patch->diff_left) {
+                return false;
+            }
+            patch->stage = OTA_PATCH_STAGE_DIFF;
+            next_stage(patch);
+            return true;
+
+        case OTA_PATCH_STAGE_DIFF:
+            // Like bspatch, bytes outside the old image count as 0
+            if (patch->old_pos >= 0 && (uint32_t) patch->old_pos < patch->header.old_size) {
+                byte += patch->old_image[patch->old_pos];
+            }
+            patch->old_pos++;
+            patch->new_pos++;
+            patch->diff_left--;
+            if (!patch->on_output(byte, patch->arg)) {
+                return false;
+            }
+            next_stage(patch);
+            return true;
+
+        case OTA_PATCH_STAGE_EXTRA:
+            patch->new_pos++;
+            patch->extra_left--;
+            if (!patch->on_output(byte, patch->arg)) {
+                return false;
+            }
+            next_stage(patch);
+            return true;
+
+        case OTA_PATCH_STAGE_DONE:
+        default:
+            // Nothing may follow the new image
+            return false;
+    }
+}
+
+/**
+ * @brief Add a decompressed byte to the window and apply it
+ * @param patch The patch state
+ * @param byte The byte
+ * @return False if the patch is invalid or a callback failed
+ */
+static bool emit(ota_patch_t *patch, uint8_t byte) {
+    patch->window[patch->window_pos++ & WINDOW_MASK] = byte;
+    return apply_byte(patch, byte);
+}
+
+/**
+ * @brief Start applying a patch
+ * @param patch The patch state
+ * @param old_image The image the patch applies to, readable up to the old size in the header
+ * @param on_header Called with the header before any output
+ * @param on_output Called for every byte of the new image
+ * @param arg Passed to the callbacks
+ */
+void ota_patch_init(ota_patch_t *patch, const uint8_t *old_image, ota_patch_header_fn_t on_header,
+                    ota_patch_output_fn_t on_output, void *arg) {
+    memset(patch, 0, sizeof(*patch));
+    patch->stage = OTA_PATCH_STAGE_HEADER;
+    patch->old_image = old_image;
+    patch->on_header = on_header;
+    patch->on_output = on_output;
+    patch->arg = arg;
+}
+
+/**
+ * @brief Apply the next part of a compressed patch, it can be split anywhere
+ * @param patch The patch state
+ * @param data The compressed data
+ * @param len Length of the data
+ * @return Whether the patch needs more data, is complete or failed
+ */
+ota_patch_result_t ota_patch_feed(ota_patch_t *patch, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        // At most BACKREF_BITS - 1 bits are left over, so a byte more always fits
+        patch->bits = patch->bits << 8 | data[i];
+        patch->bit_count += 8;
+
+        while (patch->bit_count > 0) {
+            bool literal = (patch->bits >> (patch->bit_count - 1)) & 1;
+
+            if (literal) {
+                if (patch->bit_count < 9) {
+                    break;
+                }
+                patch->bit_count -= 9;
+                if (!emit(patch, patch->bits >> patch->bit_count)) {
+                    return OTA_PATCH_ERROR;
+                }
+            } else {
+                if (patch->bit_count < BACKREF_BITS) {
+                    break;
+                }
+                patch->bit_count -= BACKREF_BITS;
+                uint32_t backref = patch->bits >> patch->bit_count;
+                uint32_t distance = ((backref >> OTA_PATCH_LOOKAHEAD_BITS) & WINDOW_MASK) + 1;
+                uint32_t count = (backref & ((1u << OTA_PATCH_LOOKAHEAD_BITS) - 1)) + 1;
+                while (count--) {
+                    if (!emit(patch, patch->window[(patch->window_pos - distance) & WINDOW_MASK])) {
+                        return OTA_PATCH_ERROR;
+                    }
+                }
+            }
+            patch->bits &= (1u << patch->bit_count) - 1;
+        }
+    }
+
+    return patch->stage == OTA_PATCH_STAGE_DONE ? OTA_PATCH_DONE : OTA_PATCH_MORE;
+}
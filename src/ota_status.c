@@ -0,0 +1,125 @@
+#include "ota_status.h"
+#include <string.h>
+
+#include "hardware/sync.h"
+
+// Shared by the firmware and the bootloader, so it does not log
+
+#define OTA_STATUS_MAGIC 0x4c524f31 // "LRO1"
+
+#define OTA_STATUS_PAGE(page) ((const uint8_t *) (XIP_BASE + OTA_STATUS_OFFSET + (page) * FLASH_PAGE_SIZE))
+
+static uint8_t page_buffer[FLASH_PAGE_SIZE];
+
+/**
+ * @brief Program one byte of the status sector. Bits can only be cleared, the other bytes of the page are left
+ * as they are
+ * @param page The page
+ * @param index The byte in the page
+ * @param value The new value of the byte
+ */
+static void program_byte(uint8_t page, uint32_t index, uint8_t value) {
+    memset(page_buffer, 0xff, sizeof(page_buffer));
+    page_buffer[index] = value;
+
+    uint32_t interrupts = save_and_disable_interrupts();
+    flash_range_program(OTA_STATUS_OFFSET + page * FLASH_PAGE_SIZE, page_buffer, FLASH_PAGE_SIZE);
+    restore_interrupts(interrupts);
+}
+
+/**
+ * @return The header of the update in slot B, NULL if there is no complete one
+ */
+const ota_status_header_t *ota_status_get_header() {
+    const ota_status_header_t *header = (const ota_status_header_t *) OTA_STATUS_PAGE(OTA_STATUS_HEADER_PAGE);
+    if (!ota_status_get_flag(OTA_FLAG_VALID) || header->magic != OTA_STATUS_MAGIC ||
+        header->swap_sectors == 0 || header->swap_sectors > OTA_SLOT_SECTORS) {
+        return NULL;
+    }
+    return header;
+}
+
+/**
+ * @brief Check a flag of the update
+ * @param flag The flag
+ * @return True if the flag is set
+ */
+bool ota_status_get_flag(ota_flag_t flag) {
+    return OTA_STATUS_PAGE(OTA_STATUS_FLAGS_PAGE)[flag] == 0x00;
+}
+
+/**
+ * @brief Set a flag of the update
+ * @param flag The flag
+ */
+void ota_status_set_flag(ota_flag_t flag) {
+    program_byte(OTA_STATUS_FLAGS_PAGE, flag, 0x00);
+}
+
+/**
+ * @brief Get how far a sector of a swap is
+ * @param page OTA_STATUS_INSTALL_PAGE or OTA_STATUS_REVERT_PAGE
+ * @param sector The sector of the slots
+ * @return One of the OTA_SWAP_ values
+ */
+uint8_t ota_status_get_progress(uint8_t page, uint32_t sector) {
+    uint8_t progress = OTA_STATUS_PAGE(page)[sector];
+
+    // A program that was cut short can leave bits of the next step set, count it as the step before
+    if (progress == OTA_SWAP_DONE) {
+        return OTA_SWAP_DONE;
+    } else if ((progress & OTA_SWAP_A_WRITTEN) == progress) {
+        return OTA_SWAP_A_WRITTEN;
+    } else if ((progress & OTA_SWAP_IN_SCRATCH) == progress) {
+        return OTA_SWAP_IN_SCRATCH;
+    }
+    return OTA_SWAP_NOT_STARTED;
+}
+
+/**
+ * @brief Record how far a sector of a swap is
+ * @param page OTA_STATUS_INSTALL_PAGE or OTA_STATUS_REVERT_PAGE
+ * @param sector The sector of the slots
+ * @param progress One of the OTA_SWAP_ values, further than the current one
+ */
+void ota_status_set_progress(uint8_t page, uint32_t sector, uint8_t progress) {
+    program_byte(page, sector, progress);
+}
+
+/**
+ * @brief Check if a swap has finished
+ * @param page OTA_STATUS_INSTALL_PAGE or OTA_STATUS_REVERT_PAGE
+ * @return True if all sectors of the swap are done, false also if there is no update
+ */
+bool ota_status_swap_done(uint8_t page) {
+    const ota_status_header_t *header = ota_status_get_header();
+    return header && ota_status_get_progress(page, header->swap_sectors - 1) == OTA_SWAP_DONE;
+}
+
+/**
+ * @brief Erase the status, the update in slot B is forgotten
+ */
+void ota_status_clear() {
+    uint32_t interrupts = save_and_disable_interrupts();
+    flash_range_erase(OTA_STATUS_OFFSET, FLASH_SECTOR_SIZE);
+    restore_interrupts(interrupts);
+}
+
+/**
+ * @brief Start a new status for an update that has been written to slot B and verified. The bootloader swaps it in
+ * on the next boot
+ * @param header The header of the update, magic is filled in
+ */
+void ota_status_start(ota_status_header_t *header) {
+    header->magic = OTA_STATUS_MAGIC;
+    memset(page_buffer, 0xff, sizeof(page_buffer));
+    memcpy(page_buffer, header, sizeof(*header));
+
+    uint32_t interrupts = save_and_disable_interrupts();
+    flash_range_erase(OTA_STATUS_OFFSET, FLASH_SECTOR_SIZE);
+    flash_range_program(OTA_STATUS_OFFSET + OTA_STATUS_HEADER_PAGE * FLASH_PAGE_SIZE, page_buffer, FLASH_PAGE_SIZE);
+    restore_interrupts(interrupts);
+
+    // Only a header that was written completely counts
+    ota_status_set_flag(OTA_FLAG_VALID);
+}
@@ -1,49 +1,208 @@
+#define LOG_MODULE LOG_MODULE_PIR
+
 #include "pir_sensor.h"
+#include "config.h"
+#include "event_loop.h"
 #include "hardware/gpio.h"
-#include "hardware/timer.h"
-#include "pico/printf.h"
+#include "hardware/irq.h"
+#include "hardware/pio.h"
+#include "hardware/sync.h"
+#include "hot_path.h"
+#include "multi_printf.h"
+#include "occupancy_stats.h"
 #include "pico/time.h"
+#include "pir_filter.pio.h"
+
+// One PIO state machine filters each input. They all run the same program on one PIO block, which has four state
+// machines, so there can be up to four inputs. The wireless chip takes a state machine for its SPI bus, the inputs
+// go on the other PIO block when they do not fit next to it
+#ifndef PIR_SENSOR_GPIOS
+#define PIR_SENSOR_GPIOS {28}
+#endif
+
+// The filter samples the inputs at 10 kHz. Glitches on long cable runs are far shorter than the minimum widths,
+// a real PIR trigger holds the output high for at least a second
+#define PIR_FILTER_SAMPLE_HZ 10000
+#define PIR_FILTER_MIN_HIGH_MS 50
+#define PIR_FILTER_MIN_LOW_MS 200
+
+// Must be a power of two. The PIR holds its output for a few seconds per trigger, so this is many minutes of edges
+#define PIR_EDGE_RING_SIZE 64
+
+typedef struct {
+    uint32_t time_ms;
+    uint8_t input;
+    bool rising;
+} pir_edge_t;
+
+static const uint pir_sensor_gpios[] = PIR_SENSOR_GPIOS;
+#define PIR_SENSOR_COUNT (sizeof(pir_sensor_gpios) / sizeof(pir_sensor_gpios[0]))
+_Static_assert(PIR_SENSOR_COUNT <= NUM_PIO_STATE_MACHINES, "The PIR inputs fit on one PIO block");
+
+static PIO pir_pio;
+static uint pir_sm[PIR_SENSOR_COUNT];
+
+// Single producer (the PIO interrupt), single consumer (the main loop). The interrupt only ever writes head and
+// the main loop only ever writes tail, so no locking is needed
+static pir_edge_t pir_edge_ring[PIR_EDGE_RING_SIZE];
+static volatile uint32_t pir_edge_head = 0;
+static volatile uint32_t pir_edge_tail = 0;
+static volatile uint32_t pir_edges_dropped = 0;
+
+static bool pir_input_state[PIR_SENSOR_COUNT];
+static bool pir_state = false;
+static bool has_motion = false;
+static uint32_t pir_sensor_last_motion_ms = 0;
 
-#define PIR_SENSOR_GPIO 28
-#define PIR_SENSOR_TIMER_MS 1000
-#define PIR_SENSOR_MOTION_TIMEOUT_MS 90000
+static void __hot_path_func(push_edge)(uint8_t input, bool rising, uint32_t time_ms) {
+    uint32_t head = pir_edge_head;
+    if (head - pir_edge_tail >= PIR_EDGE_RING_SIZE) {
+        pir_edges_dropped++;
+        return;
+    }
 
-static repeating_timer_t pir_sensor_timer;
+    pir_edge_t *edge = &pir_edge_ring[head & (PIR_EDGE_RING_SIZE - 1)];
+    edge->time_ms = time_ms;
+    edge->input = input;
+    edge->rising = rising;
 
-static uint64_t pir_sensor_last_motion_time = 0;
+    __dmb();
+    pir_edge_head = head + 1;
+    event_loop_post(EVENT_SENSOR);
+}
 
-void pir_sensor_interrupt_handler(uint gpio, uint32_t events) {
+/**
+ * Only runs for changes that made it through the filter. The filter reports a change once the new level has been
+ * stable for the minimum width, so that is when the change really happened
+ */
+static void __hot_path_func(pir_sensor_pio_irq_handler)() {
+    uint32_t now_ms = time_us_64() / 1000;
 
-    if (gpio == PIR_SENSOR_GPIO) {
-        pir_sensor_last_motion_time = time_us_64();
-        printf("Edge motion detected\n");
+    for (uint8_t input = 0; input < PIR_SENSOR_COUNT; input++) {
+        while (!pio_sm_is_rx_fifo_empty(pir_pio, pir_sm[input])) {
+            bool rising = pio_sm_get(pir_pio, pir_sm[input]) != 0;
+            push_edge(input, rising, now_ms - (rising ? PIR_FILTER_MIN_HIGH_MS : PIR_FILTER_MIN_LOW_MS));
+        }
     }
 }
 
-bool pir_sensor_timer_callback(repeating_timer_t *rt) {
+/**
+ * Drain the edge ring and feed the edges to the motion state and the occupancy statistics.
+ * Must be called from the main loop.
+ */
+void pir_sensor_update() {
+    uint32_t tail = pir_edge_tail;
+
+    while (tail != pir_edge_head) {
+        __dmb();
+        pir_edge_t edge = pir_edge_ring[tail & (PIR_EDGE_RING_SIZE - 1)];
+        tail++;
+        pir_edge_tail = tail;
+
+        if (edge.rising == pir_input_state[edge.input]) {
+            continue;
+        }
+        pir_input_state[edge.input] = edge.rising;
+
+        // The room has motion as long as any of the inputs has
+        bool any_high = false;
+        for (uint8_t input = 0; input < PIR_SENSOR_COUNT; input++) {
+            any_high |= pir_input_state[input];
+        }
 
-    if (gpio_get(PIR_SENSOR_GPIO)) {
-        pir_sensor_last_motion_time = time_us_64();
-        printf("Motion still detected\n");
+        has_motion = true;
+        pir_sensor_last_motion_ms = edge.time_ms;
+        if (any_high != pir_state) {
+            pir_state = any_high;
+            occupancy_stats_set_pir_state(pir_state, edge.time_ms);
+        }
     }
 
-    return true;// keep repeating
+    if (pir_edges_dropped) {
+        uint32_t interrupts = save_and_disable_interrupts();
+        uint32_t dropped = pir_edges_dropped;
+        pir_edges_dropped = 0;
+        restore_interrupts(interrupts);
+        multi_printf("PIR edge ring full, dropped %lu edges\n", dropped);
+    }
 }
 
 bool pir_sensor_is_motion_detected() {
+    return pir_sensor_is_motion_recent(config.pir_timeout_ms);
+}
 
-    if (!pir_sensor_last_motion_time) {
+/**
+ * @brief Check for motion in a shorter window than the report uses, for fusing with the radar every frame
+ * @param window_ms How recent the motion must be
+ * @return True if the PIR output is high or went low within the window
+ */
+bool pir_sensor_is_motion_recent(uint32_t window_ms) {
+
+    if (pir_state) {
+        return true;
+    }
+
+    if (!has_motion) {
         return false;
     }
 
-    return time_us_64() - pir_sensor_last_motion_time < PIR_SENSOR_MOTION_TIMEOUT_MS * 1000;
+    return (uint32_t) (time_us_64() / 1000) - pir_sensor_last_motion_ms < window_ms;
+}
+
+/**
+ * @return True while the output of any PIR is high
+ */
+bool pir_sensor_get_state() {
+    return pir_state;
+}
+
+/**
+ * @param pio A PIO block
+ * @return True if the filter program and a state machine for every input fit on the block
+ */
+static bool pio_has_room(PIO pio) {
+    if (!pio_can_add_program(pio, &pir_filter_program)) {
+        return false;
+    }
+
+    uint free_sms = 0;
+    for (uint sm = 0; sm < NUM_PIO_STATE_MACHINES; sm++) {
+        free_sms += !pio_sm_is_claimed(pio, sm);
+    }
+    return free_sms >= PIR_SENSOR_COUNT;
 }
 
 void pir_sensor_init() {
 
-    gpio_init(PIR_SENSOR_GPIO);
-    gpio_set_dir(PIR_SENSOR_GPIO, GPIO_IN);
+    // The wireless chip already uses a PIO for its SPI bus, use whichever one still has room
+    pir_pio = pio0;
+    if (!pio_has_room(pir_pio)) {
+        pir_pio = pio1;
+    }
+    uint offset = pio_add_program(pir_pio, &pir_filter_program);
+
+    uint32_t now_ms = time_us_64() / 1000;
+    for (uint8_t input = 0; input < PIR_SENSOR_COUNT; input++) {
+        gpio_init(pir_sensor_gpios[input]);
+        gpio_set_dir(pir_sensor_gpios[input], GPIO_IN);
+
+        pir_input_state[input] = gpio_get(pir_sensor_gpios[input]);
+        pir_state |= pir_input_state[input];
+
+        pir_sm[input] = pio_claim_unused_sm(pir_pio, true);
+        pir_filter_program_init(pir_pio, pir_sm[input], offset, pir_sensor_gpios[input], PIR_FILTER_SAMPLE_HZ,
+                                PIR_FILTER_MIN_HIGH_MS * PIR_FILTER_SAMPLE_HZ / 1000,
+                                PIR_FILTER_MIN_LOW_MS * PIR_FILTER_SAMPLE_HZ / 1000);
+        pio_set_irq0_source_enabled(pir_pio, pis_sm0_rx_fifo_not_empty + pir_sm[input], true);
+    }
+
+    if (pir_state) {
+        has_motion = true;
+        pir_sensor_last_motion_ms = now_ms;
+    }
+    occupancy_stats_set_pir_state(pir_state, now_ms);
 
-    gpio_set_irq_enabled_with_callback(PIR_SENSOR_GPIO, GPIO_IRQ_EDGE_RISE, true, &pir_sensor_interrupt_handler);
-    add_repeating_timer_ms(PIR_SENSOR_TIMER_MS, &pir_sensor_timer_callback, NULL, &pir_sensor_timer);
-}
\ No newline at end of file
+    uint irq = pir_pio == pio0 ? PIO0_IRQ_0 : PIO1_IRQ_0;
+    irq_add_shared_handler(irq, pir_sensor_pio_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(irq, true);
+}
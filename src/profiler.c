@@ -0,0 +1,188 @@
+#define LOG_MODULE LOG_MODULE_MAIN
+
+#include "profiler.h"
+
+#include <stdio.h>
+#include "bluetooth_spp.h"
+#include "hardware/irq.h"
+#include "hardware/timer.h"
+#include "multi_printf.h"
+
+// Each sample is two words, so the buffer is 8 kB
+#define PROFILER_SAMPLE_COUNT 1024
+
+// Samples per write to the send ring, one per line. The lines are formatted on the stack of the main loop
+#define PROFILER_DUMP_BUFFER_SAMPLES 16
+#define PROFILER_DUMP_SAMPLE_SIZE 18// "pppppppp llllllll\n"
+
+typedef struct {
+    uint32_t pc;
+    uint32_t lr;
+} profiler_sample_t;
+
+static profiler_sample_t samples[PROFILER_SAMPLE_COUNT];
+static volatile uint32_t sample_count = 0;
+
+static int alarm_num = -1;
+static uint32_t period_us = 0;
+static uint32_t next_alarm_us = 0;
+static volatile bool running = false;
+
+static bool dumping = false;
+static bool dump_header_sent = false;
+static uint32_t dump_next = 0;
+
+/**
+ * Called from the interrupt with the stack frame the core pushed on entry: r0-r3, r12, lr, pc and xpsr
+ */
+void __not_in_flash_func(profiler_record_sample)(const uint32_t *frame) {
+    timer_hw->intr = 1u << alarm_num;
+
+    if (!running) {
+        return;
+    }
+
+    uint32_t count = sample_count;
+    samples[count].pc = frame[6];
+    samples[count].lr = frame[5];
+    sample_count = ++count;
+
+    if (count == PROFILER_SAMPLE_COUNT) {
+        running = false;
+        return;
+    }
+
+    // Counting from the last alarm keeps the rate steady however long the interrupt took to get here. If interrupts
+    // were off for longer than a period the alarm time has passed, and a passed alarm only fires after the wrap
+    next_alarm_us += period_us;
+    if ((int32_t) (next_alarm_us - timer_hw->timerawl) <= 0) {
+        next_alarm_us = timer_hw->timerawl + period_us;
+    }
+    timer_hw->alarm[alarm_num] = next_alarm_us;
+}
+
+/**
+ * The handler has to find the frame the core stacked before the compiler touches the stack. Bit 2 of the
+ * exception return value in lr tells which stack it is on, the interrupted code may be a thread or another handler
+ */
+static void __attribute__((naked)) __not_in_flash_func(profiler_irq_handler)() {
+    __asm volatile(
+            "movs r0, #4\n"
+            "mov r1, lr\n"
+            "tst r0, r1\n"
+            "beq 1f\n"
+            "mrs r0, psp\n"
+            "b 2f\n"
+            "1:\n"
+            "mrs r0, msp\n"
+            "2:\n"
+            "ldr r1, =profiler_record_sample\n"
+            "bx r1\n"
+            ".ltorg\n");
+}
+
+/**
+ * Claim the timer alarm for the profiler. Sampling only starts with profiler_start()
+ */
+void profiler_init() {
+    alarm_num = hardware_alarm_claim_unused(true);
+
+    uint irq = TIMER_IRQ_0 + alarm_num;
+    irq_set_exclusive_handler(irq, profiler_irq_handler);
+    // Above every other interrupt, so the samples show the time spent in interrupt handlers too
+    irq_set_priority(irq, PICO_HIGHEST_IRQ_PRIORITY);
+    irq_set_enabled(irq, true);
+    hw_set_bits(&timer_hw->inte, 1u << alarm_num);
+}
+
+/**
+ * @brief Clear the samples and start sampling. Sampling stops by itself once the buffer is full
+ * @param rate_hz Samples per second, up to PROFILER_MAX_RATE_HZ
+ * @return False if the rate is out of range
+ */
+bool profiler_start(uint32_t rate_hz) {
+    if (alarm_num < 0 || rate_hz == 0 || rate_hz > PROFILER_MAX_RATE_HZ) {
+        return false;
+    }
+
+    profiler_stop();
+    sample_count = 0;
+    period_us = 1000000 / rate_hz;
+    running = true;
+    next_alarm_us = timer_hw->timerawl + period_us;
+    timer_hw->alarm[alarm_num] = next_alarm_us;
+
+    multi_printf("Profiling at %lu Hz for %lu ms\n", rate_hz, PROFILER_SAMPLE_COUNT * period_us / 1000);
+    return true;
+}
+
+/**
+ * Stop sampling, the samples are kept until the next start
+ */
+void profiler_stop() {
+    running = false;
+    if (alarm_num >= 0) {
+        // Disarms the alarm
+        timer_hw->armed = 1u << alarm_num;
+    }
+}
+
+/**
+ * @return True while sampling
+ */
+bool profiler_is_running() {
+    return running;
+}
+
+/**
+ * @return Number of samples in the buffer
+ */
+uint32_t profiler_get_sample_count() {
+    return sample_count;
+}
+
+/**
+ * Start sending the samples to the Bluetooth SPP client. The first line is a header and the last one PROFILE end,
+ * tools/profile_symbolize.py turns the dump into a profile
+ */
+void profiler_dump_start() {
+    dump_next = 0;
+    dump_header_sent = false;
+    dumping = true;
+    profiler_dump_task();
+}
+
+/**
+ * Send as much of a dump as there is room for in the send ring. Runs as a task whenever the send ring has drained
+ */
+void profiler_dump_task() {
+    if (!dumping) {
+        return;
+    }
+
+    uint32_t count = sample_count;
+    if (!dump_header_sent) {
+        if (!bluetooth_printf("PROFILE period_us=%lu samples=%lu\n", period_us, count)) {
+            return;
+        }
+        dump_header_sent = true;
+    }
+
+    char buffer[PROFILER_DUMP_BUFFER_SAMPLES * PROFILER_DUMP_SAMPLE_SIZE + 1];
+    while (dump_next < count) {
+        size_t len = 0;
+        uint32_t last = dump_next + PROFILER_DUMP_BUFFER_SAMPLES < count ? dump_next + PROFILER_DUMP_BUFFER_SAMPLES : count;
+        for (uint32_t i = dump_next; i < last; i++) {
+            len += snprintf(buffer + len, sizeof(buffer) - len, "%08lx %08lx\n", samples[i].pc, samples[i].lr);
+        }
+
+        if (!bluetooth_write((uint8_t *) buffer, len)) {
+            return;
+        }
+        dump_next = last;
+    }
+
+    if (bluetooth_printf("PROFILE end\n")) {
+        dumping = false;
+    }
+}
@@ -0,0 +1,252 @@
+#define LOG_MODULE LOG_MODULE_NET
+
+#include "radar_mirror.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "event_loop.h"
+#include "hardware/sync.h"
+#include "hot_path.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+#include "multi_printf.h"
+#include "pico/cyw43_arch.h"
+#include "pico/printf.h"
+#include "pico/time.h"
+
+// Every complete radar UART frame goes to the collector as one UDP datagram
+//   'R', 'M', version, radar type, uint32 sequence, uint32 timestamp_ms, the frame as received
+// with the integers little endian. The sequence counts the dropped frames too, so the collector sees the gaps.
+// tools/radar_collector.py receives them
+
+#define RADAR_MIRROR_VERSION 1
+#define RADAR_MIRROR_HEADER_LEN 12
+
+#ifdef USE_NEW_MINEW_RADAR
+#define RADAR_MIRROR_RADAR_TYPE 2
+#else
+#define RADAR_MIRROR_RADAR_TYPE 1
+#endif
+
+// Slots for frames waiting for the main loop or still held by lwIP. The interrupt drops a frame when the next slot
+// is not free yet, so a slow or unreachable collector never holds up parsing
+#define RADAR_MIRROR_QUEUE_LEN 4
+
+// Room in front of the datagram for the UDP, IP and link headers, lwIP adds them in place instead of chaining a
+// header pbuf
+#define RADAR_MIRROR_PAYLOAD_OFFSET \
+    LWIP_MEM_ALIGN_SIZE(PBUF_LINK_ENCAPSULATION_HLEN + PBUF_LINK_HLEN + PBUF_IP_HLEN + PBUF_TRANSPORT_HLEN)
+
+// The pbuf is handed to lwIP as is. The data follows the pbuf struct like in a pbuf lwIP allocated itself, and the
+// slot is free again once lwIP let go of the pbuf, which can be later than the send if it waits for ARP
+typedef struct {
+    struct pbuf_custom pbuf;
+    uint8_t mem[RADAR_MIRROR_PAYLOAD_OFFSET + RADAR_MIRROR_HEADER_LEN + RADAR_MIRROR_MAX_FRAME_LEN];
+    uint16_t len;
+    volatile bool in_use;
+} radar_mirror_slot_t;
+
+// Allocated the first time mirroring is switched on, so a sensor that never mirrors does not give up the RAM. Kept
+// from then on, as lwIP can hold on to a slot after mirroring is switched off again
+static radar_mirror_slot_t *slots = NULL;
+
+// Single producer (the radar interrupt), single consumer (the main loop). Only the interrupt writes head and only
+// the main loop writes tail
+static volatile uint32_t slot_head = 0;
+static volatile uint32_t slot_tail = 0;
+
+static volatile bool mirror_enabled = false;
+static uint32_t sequence = 0;
+static radar_mirror_stats_t stats;
+
+static struct udp_pcb *pcb = NULL;
+static ip_addr_t collector_addr;
+static uint16_t collector_port = RADAR_MIRROR_DEFAULT_PORT;
+
+static void slot_free(struct pbuf *p) {
+    // The pbuf is the first member of its slot
+    ((radar_mirror_slot_t *) p)->in_use = false;
+}
+
+static void put_uint32(uint8_t *out, uint32_t value) {
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+}
+
+/**
+ * Initialize the radar mirror. Starts mirroring to RADAR_MIRROR_COLLECTOR if the build defines it
+ */
+void radar_mirror_init() {
+#ifdef RADAR_MIRROR_COLLECTOR
+    if (!radar_mirror_set_collector(RADAR_MIRROR_COLLECTOR)) {
+        multi_printf("Invalid radar mirror collector %s\n", RADAR_MIRROR_COLLECTOR);
+    }
+#endif
+}
+
+/**
+ * @brief Set the collector the raw radar frames are sent to. Must be called from the main loop
+ * @param collector "ip" or "ip:port" of the collector, NULL to stop mirroring
+ * @return False if the address is invalid, mirroring is then stopped
+ */
+bool radar_mirror_set_collector(const char *collector) {
+    mirror_enabled = false;
+    if (!collector) {
+        return true;
+    }
+
+    char host[IPADDR_STRLEN_MAX];
+    const char *colon = strchr(collector, ':');
+    size_t host_len = colon ? (size_t) (colon - collector) : strlen(collector);
+    if (host_len >= sizeof(host)) {
+        return false;
+    }
+    memcpy(host, collector, host_len);
+    host[host_len] = '\0';
+
+    uint32_t port = RADAR_MIRROR_DEFAULT_PORT;
+    if (colon) {
+        char *end;
+        port = strtoul(colon + 1, &end, 10);
+        if (*end != '\0' || port == 0 || port > UINT16_MAX) {
+            return false;
+        }
+    }
+
+    ip_addr_t addr;
+    if (!ipaddr_aton(host, &addr)) {
+        return false;
+    }
+
+    if (!slots) {
+        slots = calloc(RADAR_MIRROR_QUEUE_LEN, sizeof(radar_mirror_slot_t));
+        if (!slots) {
+            multi_printf("Could not allocate the radar mirror queue\n");
+            return false;
+        }
+    }
+
+    cyw43_arch_lwip_begin();
+    if (!pcb) {
+        pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    }
+    cyw43_arch_lwip_end();
+    if (!pcb) {
+        multi_printf("Could not create the radar mirror UDP pcb\n");
+        return false;
+    }
+
+    ip_addr_copy(collector_addr, addr);
+    collector_port = port;
+    // The interrupt only looks at the slots once it sees mirroring on
+    __dmb();
+    mirror_enabled = true;
+    return true;
+}
+
+/**
+ * @brief Get the collector the frames are sent to
+ * @param buf Filled with "ip:port", or an empty string if mirroring is off
+ * @param size Size of the buffer
+ * @return True if mirroring is on
+ */
+bool radar_mirror_get_collector(char *buf, uint32_t size) {
+    if (!mirror_enabled) {
+        if (size) {
+            buf[0] = '\0';
+        }
+        return false;
+    }
+
+    char host[IPADDR_STRLEN_MAX];
+    snprintf(buf, size, "%s:%u", ipaddr_ntoa_r(&collector_addr, host, sizeof(host)), collector_port);
+    return true;
+}
+
+/**
+ * @brief Queue a complete radar UART frame for the collector. Called from the radar UART interrupt
+ * @param frame The frame as received
+ * @param len Length of the frame
+ */
+void __hot_path_func(radar_mirror_frame)(const volatile uint8_t *frame, uint32_t len) {
+    if (!mirror_enabled) {
+        return;
+    }
+
+    uint32_t frame_sequence = sequence++;
+    if (len > RADAR_MIRROR_MAX_FRAME_LEN) {
+        stats.too_long++;
+        return;
+    }
+
+    uint32_t head = slot_head;
+    radar_mirror_slot_t *slot = &slots[head % RADAR_MIRROR_QUEUE_LEN];
+    if (slot->in_use) {
+        stats.dropped++;
+        return;
+    }
+
+    uint8_t *out = slot->mem + RADAR_MIRROR_PAYLOAD_OFFSET;
+    out[0] = 'R';
+    out[1] = 'M';
+    out[2] = RADAR_MIRROR_VERSION;
+    out[3] = RADAR_MIRROR_RADAR_TYPE;
+    put_uint32(out + 4, frame_sequence);
+    put_uint32(out + 8, time_us_64() / 1000);
+    memcpy(out + RADAR_MIRROR_HEADER_LEN, (const uint8_t *) frame, len);
+    slot->len = RADAR_MIRROR_HEADER_LEN + len;
+    slot->in_use = true;
+
+    __dmb();
+    slot_head = head + 1;
+    event_loop_post(EVENT_MIRROR);
+}
+
+/**
+ * Send the queued frames. Must be called from the main loop
+ */
+void radar_mirror_task() {
+    uint32_t tail = slot_tail;
+
+    while (tail != slot_head) {
+        __dmb();
+        radar_mirror_slot_t *slot = &slots[tail % RADAR_MIRROR_QUEUE_LEN];
+        tail++;
+
+        if (!mirror_enabled) {
+            // Switched off since the frame was queued
+            slot->in_use = false;
+            continue;
+        }
+
+        slot->pbuf.custom_free_function = slot_free;
+        struct pbuf *p = pbuf_alloced_custom(PBUF_TRANSPORT, slot->len, PBUF_RAM, &slot->pbuf, slot->mem,
+                                             sizeof(slot->mem));
+
+        cyw43_arch_lwip_begin();
+        err_t err = udp_sendto(pcb, p, &collector_addr, collector_port);
+        // lwIP holds its own reference if it still needs the frame, the slot is freed when that goes too
+        pbuf_free(p);
+        cyw43_arch_lwip_end();
+
+        if (err == ERR_OK) {
+            stats.sent++;
+        } else {
+            stats.send_errors++;
+        }
+    }
+
+    slot_tail = tail;
+}
+
+/**
+ * @brief Get the counters of the mirror since boot
+ * @param out Where to store the counters
+ */
+void radar_mirror_get_stats(radar_mirror_stats_t *out) {
+    uint32_t interrupts = save_and_disable_interrupts();
+    *out = stats;
+    restore_interrupts(interrupts);
+}
@@ -0,0 +1,164 @@
+#define LOG_MODULE LOG_MODULE_RADAR
+
+#include "radar_stream.h"
+
+#include <string.h>
+#include "bluetooth_spp.h"
+#include "multi_printf.h"
+
+// Decoded radar frames are sent to the Bluetooth SPP client in between the log output, as
+//   0x1d, varint length, payload
+// with the payload
+//   flags (bit 0 key frame, bit 1 truncated), varint sequence, varint radar frame number, varint timestamp_ms,
+//   varint point count, per point zigzag varints of x, y, z, doppler and snr,
+//   varint person count, per person varint id and zigzag varints of x, y, z, vx, vy and vz
+// In a key frame the values are absolute. Otherwise a point is relative to the point with the same index in the
+// previous frame, and a person to the person with the same id in it, if there is one. The sequence counts every frame
+// offered for sending, so the decoder sees gaps, and the frame after a gap is always a key frame.
+// tools/radar_stream.py decodes the stream
+
+#define RADAR_STREAM_FRAME 0x1d
+#define RADAR_STREAM_FLAG_KEY_FRAME 0x01
+#define RADAR_STREAM_FLAG_TRUNCATED 0x02
+
+// A decoder that connects in the middle of the stream waits for at most this many frames
+#define RADAR_STREAM_KEY_FRAME_INTERVAL 16
+
+// Every value of a frame encoded as a 3 byte varint, the most a 16 bit zigzag value takes
+#define RADAR_STREAM_MAX_PAYLOAD_LEN (1 + 3 * 5 + 2 + RADAR_STREAM_MAX_POINTS * 5 * 3 + RADAR_STREAM_MAX_PERSONS * (5 + 6 * 3))
+
+static volatile bool stream_enabled = false;
+static uint32_t sequence = 0;
+static uint32_t frames_since_key_frame = 0;
+static bool need_key_frame = true;
+
+static radar_stream_frame_t previous;
+static uint8_t frame_buffer[1 + 3 + RADAR_STREAM_MAX_PAYLOAD_LEN];
+
+static size_t put_varint(uint8_t *out, uint32_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[len++] = value;
+    return len;
+}
+
+static size_t put_delta(uint8_t *out, int16_t value, int16_t reference) {
+    int32_t delta = (int32_t) value - reference;
+    return put_varint(out, ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31));
+}
+
+static const radar_stream_person_t *find_previous_person(uint32_t id) {
+    for (uint8_t i = 0; i < previous.person_count; i++) {
+        if (previous.persons[i].id == id) {
+            return &previous.persons[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Turn streaming of decoded radar frames to the Bluetooth SPP client on or off
+ * @param enabled True to stream
+ */
+void radar_stream_set_enabled(bool enabled) {
+    need_key_frame = true;
+    stream_enabled = enabled;
+}
+
+/**
+ * @return True if radar frames are streamed. Safe to call from any context
+ */
+bool radar_stream_is_enabled() {
+    return stream_enabled;
+}
+
+/**
+ * @brief Send a frame to the Bluetooth SPP client. Must be called from the main loop
+ * @param frame The frame
+ * @param frames_lost True if frames were dropped since the last call, the next frame is then a key frame
+ */
+void radar_stream_send(const radar_stream_frame_t *frame, bool frames_lost) {
+    static const radar_stream_point_t zero_point;
+    static const radar_stream_person_t zero_person;
+
+    if (!stream_enabled) {
+        return;
+    }
+
+    if (frames_lost) {
+        // The sequence jumps so the decoder knows it missed something
+        sequence++;
+        need_key_frame = true;
+    }
+    bool key_frame = need_key_frame || frames_since_key_frame >= RADAR_STREAM_KEY_FRAME_INTERVAL;
+
+    // The payload goes after room for the marker and the longest length varint, then moves down
+    uint8_t *payload = frame_buffer + 4;
+    size_t len = 0;
+    payload[len++] = (key_frame ? RADAR_STREAM_FLAG_KEY_FRAME : 0) | (frame->truncated ? RADAR_STREAM_FLAG_TRUNCATED : 0);
+    len += put_varint(payload + len, sequence);
+    len += put_varint(payload + len, frame->frame_number);
+    len += put_varint(payload + len, frame->time_ms);
+
+    len += put_varint(payload + len, frame->point_count);
+    for (uint8_t i = 0; i < frame->point_count; i++) {
+        const radar_stream_point_t *point = &frame->points[i];
+        const radar_stream_point_t *reference = !key_frame && i < previous.point_count ? &previous.points[i] : &zero_point;
+        len += put_delta(payload + len, point->x, reference->x);
+        len += put_delta(payload + len, point->y, reference->y);
+        len += put_delta(payload + len, point->z, reference->z);
+        len += put_delta(payload + len, point->doppler, reference->doppler);
+        len += put_delta(payload + len, point->snr, reference->snr);
+    }
+
+    len += put_varint(payload + len, frame->person_count);
+    for (uint8_t i = 0; i < frame->person_count; i++) {
+        const radar_stream_person_t *person = &frame->persons[i];
+        const radar_stream_person_t *reference = key_frame ? NULL : find_previous_person(person->id);
+        if (!reference) {
+            reference = &zero_person;
+        }
+        len += put_varint(payload + len, person->id);
+        len += put_delta(payload + len, person->x, reference->x);
+        len += put_delta(payload + len, person->y, reference->y);
+        len += put_delta(payload + len, person->z, reference->z);
+        len += put_delta(payload + len, person->vx, reference->vx);
+        len += put_delta(payload + len, person->vy, reference->vy);
+        len += put_delta(payload + len, person->vz, reference->vz);
+    }
+
+    uint8_t header[4];
+    header[0] = RADAR_STREAM_FRAME;
+    size_t header_len = 1 + put_varint(header + 1, len);
+    uint8_t *start = payload - header_len;
+    memcpy(start, header, header_len);
+
+    sequence++;
+    if (!bluetooth_write(start, header_len + len)) {
+        // The decoder needs the frame a delta is against, so start over with a key frame
+        need_key_frame = true;
+        return;
+    }
+
+    need_key_frame = false;
+    frames_since_key_frame = key_frame ? 1 : frames_since_key_frame + 1;
+    memcpy(&previous, frame, sizeof(previous));
+}
+
+/**
+ * @brief Convert a radar value to 16 bit fixed point, saturating
+ * @param value The value
+ * @param scale What one unit of the result is in units of the value, 1000 for millimetres of a value in metres
+ * @return The scaled value
+ */
+int16_t radar_stream_quantize(float value, float scale) {
+    float scaled = value * scale;
+    if (scaled != scaled) return 0;// NaN
+    if (scaled >= INT16_MAX) return INT16_MAX;
+    if (scaled <= INT16_MIN) return INT16_MIN;
+    // Round to nearest
+    return (int16_t) (scaled < 0 ? scaled - 0.5f : scaled + 0.5f);
+}
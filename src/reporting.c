@@ -1,25 +1,56 @@
+#define LOG_MODULE LOG_MODULE_REPORTING
+
 #include "reporting.h"
 
+#include <string.h>
+#include "config.h"
 #include "cyw43.h"
 #include "cyw43_ll.h"
+#include "dns_cache.h"
 #include "https.h"
+#include "event_loop.h"
+#include "latency.h"
 #include "reset.h"
 #include "multi_printf.h"
+#include "ota.h"
+#include "sensor_controller.h"
+#include "pico/time.h"
 #include "version.h"
+#include "wifi_manager.h"
 
 #define MAX_REPORTING_RETRIES 3
 
-#define REPORTING_REQUEST_BODY_TEMPLATE "{\"firmwareVersion\":\"%s\",\"sensorId\":\"%s\",\"occupants\":%d,\"radarState\":%d,\"pirState\":%s}"
+#ifndef REPORTING_SERVER_FALLBACK_IP
+#define REPORTING_SERVER_FALLBACK_IP NULL
+#endif
+
+#define REPORTING_REQUEST_BODY_TEMPLATE "{\"firmwareVersion\":\"%s\",\"sensorId\":\"%s\",\"occupants\":%d,\"confidence\":%u.%03u,\"radarState\":%d,\"pirState\":%s,\"cpuIdle\":%u.%03u"
+#define REPORTING_REQUEST_BODY_STATS_TEMPLATE ",\"stats\":{\"intervalMs\":%lu,\"radarFrames\":%lu,\"min\":%u,\"max\":%u,\"mean\":%u.%02u,\"median\":%u,\"p90\":%u,\"occupiedFraction\":%u.%03u,\"pirDutyCycle\":%u.%03u,\"pirEpisodes\":%u,\"pirEventsPerMinute\":%u.%02u,\"radarValidFraction\":%u.%03u}"
+#define REPORTING_REQUEST_BODY_BOOT_TEMPLATE ",\"bootTimeMs\":%lu,\"wifiConnectMs\":%lu"
+#define REPORTING_REQUEST_BODY_LAST_RESET_TEMPLATE ",\"lastReset\":{\"reason\":\"%s\",\"task\":\"%s\",\"uptimeS\":%lu"
+#define REPORTING_REQUEST_BODY_LATEST_RESET_TEMPLATE ",\"latestReason\":\"%s\""
+#define REPORTING_REQUEST_BODY_RAW_TEMPLATE ",\"raw\":{\"radarFrames\":%lu,\"radarFrameErrors\":%lu,\"reportsSent\":%lu,\"reportsSkipped\":%lu,\"retries\":%lu,\"responseMaxUs\":%lu,\"requestMaxUs\":%lu}"
 
 static const char REPORTING_REQUEST_TEMPLATE[] =
-        "POST " REPORTING_PATH " HTTP/1.1\r\n"
-        "Host: " REPORTING_SERVER "\r\n"
+        "POST %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
         "Content-Type: application/json\r\n"
         "Content-Length: %d\r\n"
         "Connection: close\r\n"
         "Authorization: " REPORT_API_KEY "\r\n"
-        "\r\n" REPORTING_REQUEST_BODY_TEMPLATE;
+        "\r\n%s";
+
+static const char REPORTING_FETCH_TEMPLATE[] =
+        "GET %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Connection: close\r\n"
+        "Authorization: " REPORT_API_KEY "\r\n"
+        "\r\n";
+
+#define REPORTING_REQUEST_TIMEOUT_S 10
+#define REPORTING_FETCH_TIMEOUT_S 30
 
+#define REPORTING_DIRECTIVE_FIRMWARE_PATCH "FIRMWARE-PATCH"
 
 // Let's Encrypt Authority R3 and ISRG Root X1
 static const uint8_t SERVER_CA_CERT[] =
@@ -86,42 +117,326 @@ static const uint8_t SERVER_CA_CERT[] =
         "-----END CERTIFICATE-----\n";
 
 
-static char request_buffer[1024];
+static char request_buffer[2048];
+static char body_buffer[1664];
+
+// The response to a report is split into lines as it streams in. Only the status and the directive lines of the
+// body are kept, they are applied once the report went through
+#define RESPONSE_LINE_SIZE 128
+#define RESPONSE_DIRECTIVES_SIZE 512
+
+typedef struct {
+    char line[RESPONSE_LINE_SIZE];
+    uint16_t line_len;
+    bool line_cut;
+    bool status_seen;
+    bool status_ok;
+    bool in_body;
+    char directives[RESPONSE_DIRECTIVES_SIZE]; // <key>=<value> lines, each terminated
+    uint16_t directives_len;
+    bool directives_cut;
+} response_parser_t;
+
+static response_parser_t response;
 static char sensor_id[13];
 
+static bool first_report_sent = false;
+static reporting_status_t status;
+
+/**
+ * @brief Record how a report ended
+ * @param result The result
+ * @param start_ms When the report started, in ms since boot
+ */
+static void finish_report(report_result_t result, uint32_t start_ms) {
+    uint32_t now_ms = time_us_64() / 1000;
+    status.last_result = result;
+    status.last_time_ms = now_ms;
+    status.last_duration_ms = now_ms - start_ms;
+    if (result == REPORT_RESULT_SENT) {
+        status.sent++;
+    } else {
+        status.skipped++;
+    }
+}
+
 void reporting_init() {
     snprintf(sensor_id, sizeof(sensor_id), "%02x%02x%02x%02x%02x%02x", cyw43_state.mac[0], cyw43_state.mac[1],
              cyw43_state.mac[2], cyw43_state.mac[3], cyw43_state.mac[4], cyw43_state.mac[5]);
+
+    reporting_apply_server();
+}
+
+/**
+ * Take over a changed reporting server from config, it is resolved again in the background
+ */
+void reporting_apply_server() {
+    // The fallback address belongs to the server the firmware was built for
+    bool built_in = strcmp(config.reporting_server, REPORTING_SERVER) == 0;
+    dns_cache_init(config.reporting_server, built_in ? REPORTING_SERVER_FALLBACK_IP : NULL);
+}
+
+/**
+ * @brief Take a complete line of the response to a report
+ * @param parser The parser, its line is terminated
+ */
+static void parse_response_line(response_parser_t *parser) {
+    char *line = parser->line;
+    size_t len = parser->line_len;
+    if (len && line[len - 1] == '\r') {
+        line[--len] = '\0';
+    }
+
+    if (!parser->status_seen) {
+        parser->status_seen = true;
+        // Only a successful response carries directives
+        parser->status_ok = strncmp(line, "HTTP/1.", 7) == 0 && len >= 12 && line[9] == '2';
+        return;
+    }
+    if (!parser->in_body) {
+        parser->in_body = len == 0;
+        return;
+    }
+    if (!parser->status_ok || !strchr(line, '=')) {
+        return;
+    }
+
+    if (parser->directives_len + len + 1 > sizeof(parser->directives)) {
+        parser->directives_cut = true;
+        return;
+    }
+    memcpy(parser->directives + parser->directives_len, line, len + 1);
+    parser->directives_len += len + 1;
+}
+
+/**
+ * @brief Split the next part of the response to a report into lines
+ * @param data The data
+ * @param len Length of the data
+ * @param arg The response_parser_t
+ * @return True, the whole response is read
+ */
+static bool parse_response(const uint8_t *data, size_t len, void *arg) {
+    response_parser_t *parser = arg;
+
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != '\n') {
+            if (parser->line_len < sizeof(parser->line) - 1) {
+                parser->line[parser->line_len++] = data[i];
+            } else {
+                parser->line_cut = true;
+            }
+            continue;
+        }
+
+        parser->line[parser->line_len] = '\0';
+        if (!parser->line_cut) {
+            parse_response_line(parser);
+        } else if (parser->in_body && parser->status_ok) {
+            // Long header lines are of no interest, but a body line this long is no directive we know
+            LOG_WARN("Skipped a response line longer than %u bytes\n", sizeof(parser->line) - 1);
+        }
+        parser->line_len = 0;
+        parser->line_cut = false;
+    }
+    return true;
+}
+
+/**
+ * @brief Apply the directives in the body of a response to a report. Every line of the form <key>=<value> with a
+ * key from config_set_directive() is applied straight away, other lines are ignored
+ * @param parser The parser that read the whole response
+ */
+static void apply_directives(response_parser_t *parser) {
+    // The body may end without a line break
+    if (parser->line_len && !parser->line_cut) {
+        parser->line[parser->line_len] = '\0';
+        parse_response_line(parser);
+        parser->line_len = 0;
+    }
+
+    if (parser->directives_cut) {
+        LOG_WARN("The response carried more than %u bytes of directives, the rest are dropped\n",
+                 sizeof(parser->directives));
+    }
+
+    char *next;
+    for (char *line = parser->directives; line < parser->directives + parser->directives_len; line = next) {
+        next = line + strlen(line) + 1;
+        char *value = strchr(line, '=');
+        *value++ = '\0';
+
+        if (strcmp(line, REPORTING_DIRECTIVE_FIRMWARE_PATCH) == 0) {
+            if (ota_request(value, false)) {
+                LOG_INFO("Server requested the update %s\n", value);
+            }
+            continue;
+        }
+
+        switch (config_set_directive(line, value)) {
+            case CONFIG_OK:
+                LOG_INFO("Server set %s to %s\n", line, value);
+                break;
+            case CONFIG_INVALID_VALUE:
+                LOG_WARN("Server sent an invalid value for %s: %s\n", line, value);
+                break;
+            case CONFIG_UNKNOWN_KEY:
+                break;
+        }
+    }
 }
 
-void send_sensor_report(int16_t occupants, int16_t radar_state, bool pir_state) {
+/**
+ * @brief Append the record of how the previous run ended to the report body
+ * @param body_len Length of the body so far
+ * @return The new length of the body, sizeof(body_buffer) or more if it does not fit
+ */
+static int append_last_reset(int body_len) {
+    reset_record_t record;
+    event_loop_task_stats_t task;
+    reset_get_last_record(&record);
+    const char *task_name = event_loop_get_task_stats(record.task, &task) ? task.name : "none";
+
+    body_len += snprintf(body_buffer + body_len, sizeof(body_buffer) - body_len,
+                         REPORTING_REQUEST_BODY_LAST_RESET_TEMPLATE, reset_reason_name(record.reason), task_name,
+                         record.uptime_s);
+    if (record.latest_reason != RESET_REASON_COUNT && body_len < sizeof(body_buffer)) {
+        body_len += snprintf(body_buffer + body_len, sizeof(body_buffer) - body_len,
+                             REPORTING_REQUEST_BODY_LATEST_RESET_TEMPLATE, reset_reason_name(record.latest_reason));
+    }
+    if (body_len < sizeof(body_buffer)) {
+        body_len += snprintf(body_buffer + body_len, sizeof(body_buffer) - body_len, ",\"latencyMaxUs\":{");
+    }
+    for (uint8_t probe = 0; probe < LATENCY_PROBE_COUNT && body_len < sizeof(body_buffer); probe++) {
+        body_len += snprintf(body_buffer + body_len, sizeof(body_buffer) - body_len, "%s\"%s\":%lu",
+                             probe ? "," : "", latency_probe_name(probe), record.latency_max_us[probe]);
+    }
+    if (body_len < sizeof(body_buffer)) {
+        body_len += snprintf(body_buffer + body_len, sizeof(body_buffer) - body_len, "}}");
+    }
+    return body_len;
+}
+
+/**
+ * @brief Append the p99 and the longest duration of every latency probe that recorded anything to the report body
+ * @param body_len Length of the body so far
+ * @return The new length of the body, sizeof(body_buffer) or more if it does not fit
+ */
+static int append_latency(int body_len) {
+    latency_histogram_t histogram;
+    bool first = true;
+
+    body_len += snprintf(body_buffer + body_len, sizeof(body_buffer) - body_len, ",\"latencyUs\":{");
+    for (uint8_t probe = 0; probe < LATENCY_PROBE_COUNT && body_len < sizeof(body_buffer); probe++) {
+        latency_get(probe, &histogram);
+        if (!histogram.count) {
+            continue;
+        }
+        body_len += snprintf(body_buffer + body_len, sizeof(body_buffer) - body_len, "%s\"%s\":[%lu,%lu]",
+                             first ? "" : ",", latency_probe_name(probe), latency_percentile_us(&histogram, 990),
+                             histogram.max_us);
+        first = false;
+    }
+    if (body_len < sizeof(body_buffer)) {
+        body_len += snprintf(body_buffer + body_len, sizeof(body_buffer) - body_len, "}");
+    }
+    return body_len;
+}
+
+/**
+ * @brief Send a report to the reporting server
+ * @param occupants The fused number of occupants
+ * @param confidence How likely the occupants are to be right, in per mille
+ * @param radar_state The averaged radar count, or -1 if it is not valid
+ * @param pir_state True if the PIR has seen motion in the report window
+ * @param stats Statistics of the interval since the last report
+ */
+void send_sensor_report(int16_t occupants, uint16_t confidence, int16_t radar_state, bool pir_state,
+                        const occupancy_stats_t *stats) {
+
+    uint32_t report_start_ms = time_us_64() / 1000;
+    if (!wifi_manager_is_connected()) {
+        multi_printf("Wifi is not connected, skipping report\n");
+        finish_report(REPORT_RESULT_NO_WIFI, report_start_ms);
+        return;
+    }
 
     char *pir_state_str = pir_state ? "true" : "false";
+    uint16_t idle_permille = event_loop_take_idle_permille();
+    uint32_t format_start = latency_start();
+
+    int body_len = snprintf(body_buffer, sizeof(body_buffer), REPORTING_REQUEST_BODY_TEMPLATE,
+                            FIRMWARE_STRING, sensor_id, occupants, confidence / 1000, confidence % 1000,
+                            radar_state, pir_state_str, idle_permille / 1000, idle_permille % 1000);
+
+    if (body_len >= 0 && body_len < sizeof(body_buffer)) {
+        body_len += snprintf(body_buffer + body_len, sizeof(body_buffer) - body_len, REPORTING_REQUEST_BODY_STATS_TEMPLATE,
+                             stats->interval_ms, stats->radar_samples, stats->min_count, stats->max_count,
+                             stats->mean_count_centi / 100, stats->mean_count_centi % 100, stats->median_count, stats->p90_count,
+                             stats->occupied_permille / 1000, stats->occupied_permille % 1000,
+                             stats->pir_duty_permille / 1000, stats->pir_duty_permille % 1000, stats->pir_episodes,
+                             stats->pir_events_per_minute_centi / 100, stats->pir_events_per_minute_centi % 100,
+                             stats->radar_valid_permille / 1000, stats->radar_valid_permille % 1000);
+    }
+
+    if (!first_report_sent && body_len >= 0 && body_len < sizeof(body_buffer)) {
+        // The first report after boot tells the server how long it took us to get here
+        body_len += snprintf(body_buffer + body_len, sizeof(body_buffer) - body_len, REPORTING_REQUEST_BODY_BOOT_TEMPLATE,
+                             report_start_ms, wifi_manager_get_boot_to_connected_ms());
+    }
 
-    int body_len = snprintf(NULL, 0, REPORTING_REQUEST_BODY_TEMPLATE,
-                            FIRMWARE_STRING, sensor_id, occupants, radar_state, pir_state_str);
+    if (!first_report_sent && body_len >= 0 && body_len < sizeof(body_buffer)) {
+        // And how the run before ended, so lost uptime can be traced to its causes
+        body_len = append_last_reset(body_len);
+    }
+
+    if (body_len >= 0 && body_len < sizeof(body_buffer)) {
+        body_len = append_latency(body_len);
+    }
+
+    if (config.send_raw_stats && body_len >= 0 && body_len < sizeof(body_buffer)) {
+        radar_health_t radar;
+        latency_histogram_t response_latency;
+        latency_histogram_t request_latency;
+        sensor_controller_get_radar_health(&radar);
+        latency_get(LATENCY_RESPONSE, &response_latency);
+        latency_get(LATENCY_REQUEST, &request_latency);
+        body_len += snprintf(body_buffer + body_len, sizeof(body_buffer) - body_len, REPORTING_REQUEST_BODY_RAW_TEMPLATE,
+                             radar.frames, radar.frame_errors, status.sent, status.skipped, status.retries,
+                             response_latency.max_us, request_latency.max_us);
+    }
 
-    if (body_len < 0) {
-        multi_printf("Failed to calculate request body size\n");
+    if (body_len >= 0 && body_len < sizeof(body_buffer)) {
+        body_len += snprintf(body_buffer + body_len, sizeof(body_buffer) - body_len, "}");
+    }
+
+    if (body_len < 0 || body_len >= sizeof(body_buffer)) {
+        multi_printf("Failed to format request body\n");
+        finish_report(REPORT_RESULT_FORMAT_ERROR, report_start_ms);
         return;
     }
 
     int request_len = snprintf(request_buffer, sizeof(request_buffer), REPORTING_REQUEST_TEMPLATE,
-                               body_len, FIRMWARE_STRING, sensor_id, occupants, radar_state, pir_state_str);
+                               config.reporting_path, config.reporting_server, body_len, body_buffer);
 
     if (request_len < 0 || request_len >= sizeof(request_buffer)) {
         multi_printf("Failed to format request\n");
+        finish_report(REPORT_RESULT_FORMAT_ERROR, report_start_ms);
         return;
     }
+    latency_end(LATENCY_REPORT_FORMAT, format_start);
 
     uint8_t tries = 0;
     bool success = false;
     do {
-        success = send_https_request(SERVER_CA_CERT, sizeof(SERVER_CA_CERT), REPORTING_SERVER, request_buffer,
-                                     request_len, 5000);
+        memset(&response, 0, sizeof(response));
+        success = send_https_request_streamed(SERVER_CA_CERT, sizeof(SERVER_CA_CERT), config.reporting_server,
+                                              request_buffer, request_len, REPORTING_REQUEST_TIMEOUT_S,
+                                              parse_response, &response);
 
         if (!success) {
             multi_printf("Failed to send report, retrying\n");
+            status.retries++;
         }
 
     } while (!success && tries++ < MAX_REPORTING_RETRIES);
@@ -129,8 +444,42 @@ void send_sensor_report(int16_t occupants, int16_t radar_state, bool pir_state)
 
     if (success) {
         multi_printf("Report sent\n");
+        finish_report(REPORT_RESULT_SENT, report_start_ms);
+        ota_confirm();
+        apply_directives(&response);
+        if (!first_report_sent) {
+            first_report_sent = true;
+            reset_record_reported();
+            multi_printf("First report sent %lu ms after boot\n", (uint32_t) (time_us_64() / 1000));
+        }
     } else {
         multi_printf("Failed to send report, resenting\n");
-        reset_pico();
+        reset_pico(RESET_REASON_REPORT_FAILED);
+    }
+}
+
+/**
+ * @brief Fetch a file from the reporting server, with the same credentials as the reports
+ * @param path Path of the file on the server
+ * @param on_response Called with every part of the response as it arrives, headers included
+ * @param arg Passed to on_response
+ * @return True if the whole response was taken
+ */
+bool reporting_fetch(const char *path, https_response_fn_t on_response, void *arg) {
+    int request_len = snprintf(request_buffer, sizeof(request_buffer), REPORTING_FETCH_TEMPLATE, path,
+                               config.reporting_server);
+    if (request_len < 0 || request_len >= sizeof(request_buffer)) {
+        multi_printf("Failed to format request\n");
+        return false;
     }
+    return send_https_request_streamed(SERVER_CA_CERT, sizeof(SERVER_CA_CERT), config.reporting_server,
+                                       request_buffer, request_len, REPORTING_FETCH_TIMEOUT_S, on_response, arg);
+}
+
+/**
+ * @brief Get the outcome of the last report and the report counters since boot
+ * @param out Where to store the status
+ */
+void reporting_get_status(reporting_status_t *out) {
+    *out = status;
 }
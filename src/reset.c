@@ -1,33 +1,198 @@
 #include "reset.h"
+#include "event_loop.h"
+#include "hardware/sync.h"
 #include "hardware/watchdog.h"
 #include "pico/cyw43_arch.h"
 #include "pico/printf.h"
 #include "multi_printf.h"
 
+// The record of the running firmware lives in the watchdog scratch registers 0-3, which keep their value through a
+// watchdog reset and the bootloader, but not a power cut. The SDK and the boot ROM only use registers 4-7.
+//   scratch[0]  magic << 24 | latest reason << 16 | reason << 8 | running task
+//   scratch[1]  uptime in s
+//   scratch[2]  latency bucket of the longest duration at every probe, 5 bits each, from bit 0 of scratch[2] on
+//   scratch[3]  into scratch[3]
+// The reason stays RESET_REASON_WATCHDOG while the firmware runs, reset_pico() sets the real one.
+// A run only starts its own record once it has reported the one the previous run left. Until then that record is
+// kept and only the latest reason is written, so a run that resets before its first report does not erase the
+// cause of the reset before it. The latest reason is RESET_RECORD_NO_REASON in a record of the run that wrote it
+#define RESET_RECORD_MAGIC 0x52 // "R"
+#define RESET_RECORD_NO_REASON 0xff
+#define RESET_RECORD_BUCKET_BITS 5
+
+_Static_assert(LATENCY_BUCKET_COUNT <= (1 << RESET_RECORD_BUCKET_BITS), "A latency bucket fits in its field");
+_Static_assert(LATENCY_PROBE_COUNT * RESET_RECORD_BUCKET_BITS <= 64, "The latency buckets fit in two registers");
+
+static const char *const reason_names[RESET_REASON_COUNT] = {
+        [RESET_REASON_POWER_ON] = "POWER_ON",
+        [RESET_REASON_WATCHDOG] = "WATCHDOG",
+        [RESET_REASON_UNKNOWN] = "UNKNOWN",
+        [RESET_REASON_WIFI_INIT] = "WIFI_INIT",
+        [RESET_REASON_REPORT_FAILED] = "REPORT_FAILED",
+        [RESET_REASON_CONSOLE] = "CONSOLE",
+        [RESET_REASON_OTA_INSTALL] = "OTA_INSTALL",
+};
+
 static bool reset_requested = false;
+static reset_reason_t requested_reason;
+static reset_record_t last_record;
+// The record the previous run left is still in the scratch registers, as it has not been reported yet
+static bool last_record_pending = false;
+
+// Only the main loop writes scratch[0], so the reason and the task can be kept here and written together
+static reset_reason_t record_reason = RESET_REASON_WATCHDOG;
+static uint8_t record_task = RESET_RECORD_NO_TASK;
+
+static void write_record_header() {
+    if (last_record_pending) {
+        watchdog_hw->scratch[0] = (uint32_t) RESET_RECORD_MAGIC << 24 | record_reason << 16 | last_record.reason << 8 |
+                                  last_record.task;
+    } else {
+        watchdog_hw->scratch[0] = (uint32_t) RESET_RECORD_MAGIC << 24 | RESET_RECORD_NO_REASON << 16 |
+                                  record_reason << 8 | record_task;
+    }
+}
 
 /**
- * Handle any reset requests
+ * Write the uptime and the latency maxima to the record
+ */
+static void refresh_record() {
+    if (last_record_pending) {
+        return;
+    }
+
+    uint64_t buckets = 0;
+    for (uint8_t probe = 0; probe < LATENCY_PROBE_COUNT; probe++) {
+        latency_histogram_t histogram;
+        latency_get(probe, &histogram);
+        buckets |= (uint64_t) latency_bucket(histogram.max_us) << (probe * RESET_RECORD_BUCKET_BITS);
+    }
+
+    watchdog_hw->scratch[1] = time_us_64() / 1000000;
+    watchdog_hw->scratch[2] = (uint32_t) buckets;
+    watchdog_hw->scratch[3] = (uint32_t) (buckets >> 32);
+}
+
+/**
+ * Take the record the previous run left and start the record of this one, must be called once at boot before
+ * anything can reset
+ */
+void reset_record_init() {
+    uint32_t header = watchdog_hw->scratch[0];
+    uint8_t latest_reason = (header >> 16) & 0xff;
+    last_record.reason = RESET_REASON_POWER_ON;
+    last_record.task = RESET_RECORD_NO_TASK;
+    last_record.latest_reason = RESET_REASON_COUNT;
+
+    if (header >> 24 == RESET_RECORD_MAGIC && ((header >> 8) & 0xff) < RESET_REASON_COUNT &&
+        (latest_reason < RESET_REASON_COUNT || latest_reason == RESET_RECORD_NO_REASON)) {
+        last_record.reason = (header >> 8) & 0xff;
+        last_record.task = header & 0xff;
+        last_record.uptime_s = watchdog_hw->scratch[1];
+
+        uint64_t buckets = watchdog_hw->scratch[2] | (uint64_t) watchdog_hw->scratch[3] << 32;
+        for (uint8_t probe = 0; probe < LATENCY_PROBE_COUNT; probe++) {
+            uint8_t bucket = (buckets >> (probe * RESET_RECORD_BUCKET_BITS)) & ((1 << RESET_RECORD_BUCKET_BITS) - 1);
+            // Like latency_percentile_us(), the upper end of the bucket
+            last_record.latency_max_us[probe] = (1u << bucket) - 1;
+        }
+
+        // watchdog_caused_reboot() is about the reset that just happened, an older one was checked by the run after it
+        if (latest_reason == RESET_RECORD_NO_REASON) {
+            if (last_record.reason == RESET_REASON_WATCHDOG && !watchdog_caused_reboot()) {
+                last_record.reason = RESET_REASON_UNKNOWN;
+            }
+        } else {
+            last_record.latest_reason = latest_reason;
+            if (last_record.latest_reason == RESET_REASON_WATCHDOG && !watchdog_caused_reboot()) {
+                last_record.latest_reason = RESET_REASON_UNKNOWN;
+            }
+        }
+        last_record_pending = true;
+    }
+
+    write_record_header();
+    refresh_record();
+
+    if (last_record.latest_reason == RESET_REASON_COUNT) {
+        multi_printf("Last reset: %s after %lu s\n", reset_reason_name(last_record.reason), last_record.uptime_s);
+    } else {
+        multi_printf("Last reset: %s, not reported since an earlier %s after %lu s\n",
+                     reset_reason_name(last_record.latest_reason), reset_reason_name(last_record.reason),
+                     last_record.uptime_s);
+    }
+}
+
+/**
+ * Note that the record of how the previous run ended was reported, so this run can start its own record
+ */
+void reset_record_reported() {
+    if (!last_record_pending) {
+        return;
+    }
+    last_record_pending = false;
+    write_record_header();
+    refresh_record();
+}
+
+/**
+ * @brief Note which task is running, so a watchdog reset says where the main loop hung. Called by the event loop
+ * @param task Index of the task, RESET_RECORD_NO_TASK once it returned
+ */
+void reset_record_set_task(uint8_t task) {
+    record_task = task;
+    write_record_header();
+}
+
+/**
+ * @brief Get the record of how the previous run ended
+ * @param out Where to store the record
+ */
+void reset_get_last_record(reset_record_t *out) {
+    *out = last_record;
+}
+
+/**
+ * @brief Get the name of a reset reason
+ * @param reason The reason
+ * @return The name
+ */
+const char *reset_reason_name(reset_reason_t reason) {
+    return reason_names[reason];
+}
+
+/**
+ * Handle any reset requests and refresh the uptime and latency maxima of the reset record
  */
 void reset_request_tick() {
     if (reset_requested) {
-        reset_pico();
+        reset_pico(requested_reason);
     }
+    refresh_record();
 }
 
 /**
  * Request a reset of the Pico on the next tick
  * This is useful for when you want to reset the Pico but are in a function that is not safe to reset from
+ * @param reason Why the Pico resets, recorded for the next boot
  */
-void request_pico_reset() {
+void request_pico_reset(reset_reason_t reason) {
+    requested_reason = reason;
     reset_requested = true;
+    event_loop_post(EVENT_RESET);
 }
 
 /**
  * Reset the Pico
+ * @param reason Why the Pico resets, recorded for the next boot
  */
-_Noreturn void reset_pico() {
+_Noreturn void reset_pico(reset_reason_t reason) {
+    record_reason = reason;
+    write_record_header();
+    refresh_record();
+
     multi_printf("Resetting pico!\n");
+    multi_printf_flush();
     busy_wait_ms(1000);
     cyw43_arch_deinit();
     while (true) {
@@ -35,4 +200,4 @@ _Noreturn void reset_pico() {
         busy_wait_ms(1000);
         printf("Failed to reboot\n");
     }
-}
\ No newline at end of file
+}
@@ -1,3 +1,5 @@
+#define LOG_MODULE LOG_MODULE_SENSOR
+
 #include "sensor_controller.h"
 
 #ifdef USE_NEW_MINEW_RADAR
@@ -8,17 +10,63 @@
 #include "micradar.h"
 #endif
 
+#include "ble_occupancy.h"
+#include "config.h"
+#include "event_loop.h"
+#include "latency.h"
+#include "occupancy_stats.h"
 #include "pico/printf.h"
 #include "pico/time.h"
 #include "pir_sensor.h"
 #include "reporting.h"
 #include "multi_printf.h"
+#include "sensor_fusion.h"
+
+// Motion this recent counts as PIR evidence for the fusion filter, the filter itself holds on to it after that
+#define SENSOR_FUSION_PIR_WINDOW_MS 10000
 
-#define SENSOR_REPORT_INTERVAL_MS 60000
+static int16_t get_radar_count() {
+#ifdef USE_NEW_MINEW_RADAR
+    return minewsemi_get_current_count();
+#else
+    return micradar_get_current_count();
+#endif
+}
 
-static uint64_t last_report_time = 0;
+/**
+ * @brief Get how the radar is doing, for the local status endpoint
+ * @param health Where to store the radar health
+ */
+void sensor_controller_get_radar_health(radar_health_t *health) {
+    health->count = get_radar_count();
+#ifdef USE_NEW_MINEW_RADAR
+    minewsemi_get_frame_counters(&health->frames, &health->frame_errors);
+#else
+    micradar_get_frame_counters(&health->frames, &health->frame_errors);
+#endif
+}
+
+/**
+ * Take over a changed count window from config
+ */
+void sensor_controller_apply_count_window() {
+#ifdef USE_NEW_MINEW_RADAR
+    minewsemi_set_count_window(config.count_window_ms);
+#else
+    micradar_set_count_window(config.count_window_ms);
+#endif
+}
+
+/**
+ * Take over a changed report interval from config, the next report is one interval from now
+ */
+void sensor_controller_apply_report_interval() {
+    event_loop_set_task_period(sensor_controller_report, config.report_interval_ms);
+}
 
 void sensor_controller_init() {
+    occupancy_stats_init(time_us_64() / 1000);
+    sensor_fusion_init();
     pir_sensor_init();
 #ifdef USE_NEW_MINEW_RADAR
     minewsemi_init();
@@ -27,23 +75,34 @@ void sensor_controller_init() {
 #endif
 }
 
+/**
+ * Feed the latest PIR edges and radar count to the fusion filter and publish the result over BLE.
+ * Called for every PIR edge, every radar frame and periodically
+ */
 void sensor_controller_update() {
-    if (time_us_64() - last_report_time > SENSOR_REPORT_INTERVAL_MS * 1000) {
-        multi_printf("Time to report\n");
-        last_report_time = time_us_64();
-#ifdef USE_NEW_MINEW_RADAR
-        int16_t radar_count = minewsemi_get_current_count();
-#else
-        int16_t radar_count = micradar_get_current_count();
-#endif
-        bool motion_detected = pir_sensor_is_motion_detected();
-        multi_printf("Radar count: %d, Motion detected: %d\n", radar_count, motion_detected);
+    latency_record(LATENCY_SENSOR_DELAY, event_loop_get_task_delay_us());
+    pir_sensor_update();
+    sensor_fusion_update(get_radar_count(), pir_sensor_is_motion_recent(SENSOR_FUSION_PIR_WINDOW_MS),
+                         time_us_64() / 1000);
+    ble_occupancy_update(sensor_fusion_get_count(), sensor_fusion_get_confidence(), pir_sensor_get_state());
+}
+
+/**
+ * Send a report with the fused state and the statistics of the interval since the last report
+ */
+void sensor_controller_report() {
+    multi_printf("Time to report\n");
+    uint64_t report_time = time_us_64();
+    int16_t radar_count = get_radar_count();
+    bool motion_detected = pir_sensor_is_motion_detected();
+
+    int16_t occupants = sensor_fusion_get_count();
+    uint16_t confidence = sensor_fusion_get_confidence();
+    multi_printf("Radar count: %d, Motion detected: %d, Occupants: %d, Confidence: %u, Radar trust: %u\n",
+                 radar_count, motion_detected, occupants, confidence, sensor_fusion_get_radar_trust());
 
-        int16_t occupants = radar_count < 0 ? 0 : radar_count;
-        if (!occupants && motion_detected) {
-            occupants++;
-        }
+    occupancy_stats_t stats;
+    occupancy_stats_take(&stats, report_time / 1000);
 
-        send_sensor_report(occupants, radar_count, motion_detected);
-    }
+    send_sensor_report(occupants, confidence, radar_count, motion_detected, &stats);
 }
\ No newline at end of file
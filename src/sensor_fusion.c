@@ -0,0 +1,134 @@
+#include "sensor_fusion.h"
+#include "config.h"
+
+// Bayesian occupancy filter on the log odds of the room being occupied, in Q8 fixed point (256 = 1.0).
+// Every sensor adds evidence in proportion to how long it has reported its current reading, so the result does
+// not depend on how often the filter is updated. The weights are log likelihood ratios per second.
+#define LOG_ODDS_ONE 256
+#define LOG_ODDS_MAX (6 * LOG_ODDS_ONE)
+
+// The radar present weight is scaled by the RADAR-SENSITIVITY setting, in percent
+#define RADAR_PRESENT_WEIGHT (2 * LOG_ODDS_ONE)
+#define RADAR_ABSENT_WEIGHT (-LOG_ODDS_ONE / 10)
+#define PIR_MOTION_WEIGHT (3 * LOG_ODDS_ONE)
+#define PIR_QUIET_WEIGHT (-LOG_ODDS_ONE / 20)
+
+// Trust in the radar in Q8. It is lost as soon as the radar count becomes invalid and is regained gradually
+// once it is valid again, as a radar that has just been reset reports empty rooms until it has settled
+#define TRUST_ONE 256
+#define RADAR_TRUST_RECOVERY_MS 10000
+
+// Longest gap between updates that is credited as evidence, so a stalled main loop does not saturate the filter
+#define MAX_UPDATE_GAP_MS 1000
+
+// P(occupied) in per mille for log odds 0, 0.5, 1.0 ... 6.0
+static const uint16_t SIGMOID_PERMILLE[] = {500, 622, 731, 818, 881, 924, 953, 971, 982, 989, 993, 996, 998};
+#define SIGMOID_STEP (LOG_ODDS_ONE / 2)
+
+// Log odds in Q8 times 1000, so evidence from short updates is not lost to rounding
+static int32_t log_odds_milli = 0;
+// Radar trust in Q8 times 1000 as well, a radar frame interval of trust would round to 0 in Q8
+static uint32_t radar_trust_milli = 0;
+static uint32_t last_update_ms = 0;
+static bool has_update = false;
+static int16_t last_radar_count = -1;
+
+static uint16_t occupied_permille(void) {
+    int32_t log_odds = log_odds_milli / 1000;
+    int32_t magnitude = log_odds < 0 ? -log_odds : log_odds;
+    uint32_t index = magnitude / SIGMOID_STEP;
+    uint32_t fraction = magnitude % SIGMOID_STEP;
+
+    uint16_t p;
+    if (index >= sizeof(SIGMOID_PERMILLE) / sizeof(SIGMOID_PERMILLE[0]) - 1) {
+        p = SIGMOID_PERMILLE[sizeof(SIGMOID_PERMILLE) / sizeof(SIGMOID_PERMILLE[0]) - 1];
+    } else {
+        p = SIGMOID_PERMILLE[index] + ((SIGMOID_PERMILLE[index + 1] - SIGMOID_PERMILLE[index]) * fraction) / SIGMOID_STEP;
+    }
+
+    return log_odds < 0 ? 1000 - p : p;
+}
+
+/**
+ * Initialize the fusion filter. The room starts out as unknown, 50% occupied
+ */
+void sensor_fusion_init(void) {
+    log_odds_milli = 0;
+    radar_trust_milli = 0;
+    has_update = false;
+    last_radar_count = -1;
+}
+
+/**
+ * @brief Add the current sensor readings to the filter
+ * @param radar_count The averaged radar count, or -1 if the radar count is not valid
+ * @param pir_motion True if the PIR has seen motion recently
+ * @param now_ms Current time in milliseconds
+ */
+void sensor_fusion_update(int16_t radar_count, bool pir_motion, uint32_t now_ms) {
+    if (!has_update) {
+        has_update = true;
+        last_update_ms = now_ms;
+        last_radar_count = radar_count;
+        return;
+    }
+
+    uint32_t dt_ms = now_ms - last_update_ms;
+    if (dt_ms > MAX_UPDATE_GAP_MS) {
+        dt_ms = MAX_UPDATE_GAP_MS;
+    }
+    last_update_ms = now_ms;
+    last_radar_count = radar_count;
+
+    if (radar_count < 0) {
+        radar_trust_milli = 0;
+    } else {
+        radar_trust_milli += (TRUST_ONE * 1000 * dt_ms) / RADAR_TRUST_RECOVERY_MS;
+        if (radar_trust_milli > TRUST_ONE * 1000) {
+            radar_trust_milli = TRUST_ONE * 1000;
+        }
+    }
+
+    int32_t rate = 0;
+    if (radar_count > 0) {
+        int32_t weight = (RADAR_PRESENT_WEIGHT * (int32_t) config.radar_sensitivity_percent) / 100;
+        rate += (weight * (int32_t) radar_trust_milli) / (TRUST_ONE * 1000);
+    } else if (radar_count == 0) {
+        rate += (RADAR_ABSENT_WEIGHT * (int32_t) radar_trust_milli) / (TRUST_ONE * 1000);
+    }
+    rate += pir_motion ? PIR_MOTION_WEIGHT : PIR_QUIET_WEIGHT;
+
+    log_odds_milli += rate * (int32_t) dt_ms;
+    if (log_odds_milli > LOG_ODDS_MAX * 1000) {
+        log_odds_milli = LOG_ODDS_MAX * 1000;
+    } else if (log_odds_milli < -LOG_ODDS_MAX * 1000) {
+        log_odds_milli = -LOG_ODDS_MAX * 1000;
+    }
+}
+
+/**
+ * @return The fused number of occupants
+ */
+int16_t sensor_fusion_get_count(void) {
+    if (log_odds_milli <= 0) {
+        return 0;
+    }
+
+    // The radar knows best how many people there are, the filter only decides if there is anyone at all
+    return last_radar_count > 0 ? last_radar_count : 1;
+}
+
+/**
+ * @return How likely the fused state (occupied or empty) is to be right, in per mille
+ */
+uint16_t sensor_fusion_get_confidence(void) {
+    uint16_t p = occupied_permille();
+    return log_odds_milli > 0 ? p : 1000 - p;
+}
+
+/**
+ * @return How much the filter currently trusts the radar, in per mille
+ */
+uint16_t sensor_fusion_get_radar_trust(void) {
+    return radar_trust_milli / TRUST_ONE;
+}
@@ -0,0 +1,295 @@
+#define LOG_MODULE LOG_MODULE_WIFI
+
+#include "wifi_manager.h"
+#include <string.h>
+
+#include "cyw43.h"
+#include "cyw43_ll.h"
+#include "event_loop.h"
+#include "flash_storage.h"
+#include "lwip/dhcp.h"
+#include "lwip/dns.h"
+#include "lwip/netif.h"
+#include "multi_printf.h"
+#include "pico/cyw43_arch.h"
+#include "pico/time.h"
+
+#define WIFI_CONNECT_TIMEOUT_MS 30000
+#define WIFI_RECONNECT_MIN_BACKOFF_MS 1000
+#define WIFI_RECONNECT_MAX_BACKOFF_MS 60000
+#define WIFI_RSSI_SAMPLE_INTERVAL_MS 10000
+
+typedef struct {
+    uint32_t ssid_crc;
+    uint8_t bssid[6];
+    uint16_t channel;
+} wifi_join_cache_t;
+
+typedef struct {
+    uint32_t ip;
+    uint32_t netmask;
+    uint32_t gw;
+    uint32_t dns;
+    uint64_t expiry_time;
+} wifi_lease_t;
+
+typedef enum {
+    WIFI_STATE_CONNECTING,
+    WIFI_STATE_CONNECTED,
+    WIFI_STATE_BACKOFF
+} wifi_state_t;
+
+static wifi_state_t wifi_state = WIFI_STATE_BACKOFF;
+static uint64_t state_entered_time = 0;
+static uint32_t backoff_ms = WIFI_RECONNECT_MIN_BACKOFF_MS;
+static uint64_t last_rssi_sample_time = 0;
+
+static int32_t rssi = 0;
+static int last_disconnect_reason = 0;
+static uint32_t disconnect_count = 0;
+
+static uint32_t boot_to_connected_ms = 0;
+
+// Last good join parameters, read from flash at boot so a rejoin can skip the scan
+static wifi_join_cache_t join_cache;
+static bool join_cache_valid = false;
+static bool join_cache_update_pending = false;
+static volatile bool joined_with_cache = false;
+// The last DHCP lease of this run, so a rejoin can skip the DHCP exchange while it is valid. It is not kept in flash,
+// no clock runs through a reset so after a reboot its age is unknown. Only changed with the lwIP lock held
+static wifi_lease_t lease;
+
+// Set from the lwIP netif callbacks, consumed by the tick
+static volatile bool link_lost = false;
+
+static void enter_state(wifi_state_t state) {
+    wifi_state = state;
+    state_entered_time = time_us_64();
+}
+
+static void start_connect(void) {
+    int err;
+
+    if (join_cache_valid) {
+        multi_printf("Connecting to " WIFI_SSID " on cached BSSID %02x:%02x:%02x:%02x:%02x:%02x channel %u\n",
+                     join_cache.bssid[0], join_cache.bssid[1], join_cache.bssid[2],
+                     join_cache.bssid[3], join_cache.bssid[4], join_cache.bssid[5], join_cache.channel);
+        joined_with_cache = true;
+        err = cyw43_wifi_join(&cyw43_state, strlen(WIFI_SSID), (const uint8_t *) WIFI_SSID,
+                              strlen(WIFI_PASSWORD), (const uint8_t *) WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK,
+                              join_cache.bssid, join_cache.channel);
+    } else {
+        multi_printf("Connecting to " WIFI_SSID "\n");
+        joined_with_cache = false;
+        err = cyw43_arch_wifi_connect_async(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK);
+    }
+
+    if (err) {
+        multi_printf("Failed to start connecting to %s with error code %d\n", WIFI_SSID, err);
+        last_disconnect_reason = err;
+        enter_state(WIFI_STATE_BACKOFF);
+        return;
+    }
+    link_lost = false;
+    enter_state(WIFI_STATE_CONNECTING);
+}
+
+static void schedule_reconnect(int reason) {
+    if (joined_with_cache) {
+        // The access point may have moved channel or gone away, do a full scan next time
+        multi_printf("Dropping cached wifi join parameters\n");
+        join_cache_valid = false;
+    }
+    last_disconnect_reason = reason;
+    cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, false);
+    multi_printf("Wifi link unavailable (status %d), reconnecting in %lu ms\n", reason, backoff_ms);
+    enter_state(WIFI_STATE_BACKOFF);
+}
+
+static void wifi_netif_link_callback(struct netif *netif) {
+    event_loop_post(EVENT_WIFI);
+
+    if (!netif_is_link_up(netif)) {
+        link_lost = true;
+        return;
+    }
+
+    if (joined_with_cache && lease.ip && time_us_64() < lease.expiry_time &&
+        ip4_addr_isany_val(*netif_ip4_addr(netif))) {
+        // Use the lease until DHCP has finished in the background. The DHCP client keeps running alongside it: it sends
+        // from the any address and lwIP accepts replies on the DHCP client port whatever the netif address is
+        // (LWIP_IP_ACCEPT_UDP_PORT), and once the server answers dhcp_bind() replaces the address with the one it got
+        ip4_addr_t ip, netmask, gw;
+        ip_addr_t dns;
+        ip4_addr_set_u32(&ip, lease.ip);
+        ip4_addr_set_u32(&netmask, lease.netmask);
+        ip4_addr_set_u32(&gw, lease.gw);
+        ip_addr_set_ip4_u32(&dns, lease.dns);
+        dns_setserver(0, &dns);
+        netif_set_addr(netif, &ip, &netmask, &gw);
+    }
+}
+
+static void wifi_netif_status_callback(struct netif *netif) {
+    event_loop_post(EVENT_WIFI);
+
+    if (!netif_is_up(netif)) {
+        link_lost = true;
+    }
+}
+
+static void update_join_cache(void) {
+    struct netif *netif = &cyw43_state.netif[CYW43_ITF_STA];
+    wifi_join_cache_t new_cache = {0};
+    uint32_t channel_info[3] = {0};
+
+    cyw43_arch_lwip_begin();
+    bool dhcp_bound = dhcp_supplied_address(netif);
+    if (dhcp_bound) {
+        uint32_t ip = ip4_addr_get_u32(netif_ip4_addr(netif));
+        if (joined_with_cache && lease.ip && lease.ip != ip) {
+            // The server gave the leased address to someone else, connections opened on it are gone
+            multi_printf("DHCP assigned a different address than the cached lease\n");
+        }
+        lease.ip = ip;
+        lease.netmask = ip4_addr_get_u32(netif_ip4_netmask(netif));
+        lease.gw = ip4_addr_get_u32(netif_ip4_gw(netif));
+        lease.dns = ip_addr_get_ip4_u32(dns_getserver(0));
+        // Counted from now rather than from when the server answered, so the lease is taken to end a little early
+        uint32_t lease_s = netif_dhcp_data(netif)->offered_t0_lease;
+        lease.expiry_time = lease_s == 0xffffffff ? UINT64_MAX : time_us_64() + (uint64_t) lease_s * 1000000;
+    }
+    cyw43_arch_lwip_end();
+
+    if (!dhcp_bound) {
+        // Still running on the cached lease, try again on the next tick
+        return;
+    }
+    join_cache_update_pending = false;
+
+    new_cache.ssid_crc = flash_storage_crc32(0, WIFI_SSID, strlen(WIFI_SSID));
+    if (cyw43_wifi_get_bssid(&cyw43_state, new_cache.bssid) ||
+        cyw43_ioctl(&cyw43_state, CYW43_IOCTL_GET_CHANNEL, sizeof(channel_info), (uint8_t *) channel_info, CYW43_ITF_STA)) {
+        multi_printf("Failed to read wifi join parameters\n");
+        return;
+    }
+    new_cache.channel = channel_info[0];
+
+    // The flash is only written when the access point changes, erasing the sector stops the interrupts
+    if (memcmp(&new_cache, &join_cache, sizeof(join_cache)) == 0) {
+        join_cache_valid = true;
+        return;
+    }
+
+    multi_printf("Saving wifi join parameters to flash\n");
+    if (flash_storage_write(FLASH_STORAGE_WIFI_CACHE_OFFSET, &new_cache, sizeof(new_cache))) {
+        join_cache = new_cache;
+        join_cache_valid = true;
+    } else {
+        multi_printf("Failed to save wifi join parameters\n");
+    }
+}
+
+/**
+ * Start connecting to the configured wifi network in the background
+ */
+void wifi_manager_init(void) {
+    struct netif *netif = &cyw43_state.netif[CYW43_ITF_STA];
+
+    join_cache_valid = flash_storage_read(FLASH_STORAGE_WIFI_CACHE_OFFSET, &join_cache, sizeof(join_cache)) &&
+                       join_cache.ssid_crc == flash_storage_crc32(0, WIFI_SSID, strlen(WIFI_SSID));
+    if (!join_cache_valid) {
+        memset(&join_cache, 0, sizeof(join_cache));
+    }
+
+    cyw43_arch_lwip_begin();
+    netif_set_link_callback(netif, wifi_netif_link_callback);
+    netif_set_status_callback(netif, wifi_netif_status_callback);
+    cyw43_arch_lwip_end();
+
+    start_connect();
+}
+
+/**
+ * Tick function to be called periodically. Supervises the link and reconnects with backoff when it is lost
+ */
+void wifi_manager_tick(void) {
+    uint64_t now = time_us_64();
+    int status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+
+    switch (wifi_state) {
+        case WIFI_STATE_CONNECTING:
+            if (status == CYW43_LINK_UP) {
+                cyw43_wifi_get_rssi(&cyw43_state, &rssi);
+                last_rssi_sample_time = now;
+                if (!boot_to_connected_ms) {
+                    boot_to_connected_ms = now / 1000;
+                }
+                multi_printf("Connected to %s, RSSI %ld dBm, %lu ms after boot\n", WIFI_SSID, rssi, (uint32_t) (now / 1000));
+                join_cache_update_pending = true;
+                cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, true);
+                backoff_ms = WIFI_RECONNECT_MIN_BACKOFF_MS;
+                link_lost = false;
+                enter_state(WIFI_STATE_CONNECTED);
+            } else if (status == CYW43_LINK_FAIL || status == CYW43_LINK_NONET || status == CYW43_LINK_BADAUTH) {
+                schedule_reconnect(status);
+            } else if (now - state_entered_time > WIFI_CONNECT_TIMEOUT_MS * 1000) {
+                schedule_reconnect(PICO_ERROR_TIMEOUT);
+            }
+            break;
+
+        case WIFI_STATE_CONNECTED:
+            if (link_lost || status != CYW43_LINK_UP) {
+                disconnect_count++;
+                schedule_reconnect(status);
+            } else if (join_cache_update_pending) {
+                update_join_cache();
+            } else if (now - last_rssi_sample_time > WIFI_RSSI_SAMPLE_INTERVAL_MS * 1000) {
+                cyw43_wifi_get_rssi(&cyw43_state, &rssi);
+                last_rssi_sample_time = now;
+            }
+            break;
+
+        case WIFI_STATE_BACKOFF:
+            if (now - state_entered_time > backoff_ms * 1000) {
+                backoff_ms = MIN(backoff_ms * 2, WIFI_RECONNECT_MAX_BACKOFF_MS);
+                start_connect();
+            }
+            break;
+    }
+}
+
+/**
+ * @return True if the link is up and we have an IP address
+ */
+bool wifi_manager_is_connected(void) {
+    return wifi_state == WIFI_STATE_CONNECTED;
+}
+
+/**
+ * @return The last sampled RSSI of the link in dBm, or 0 if it has never been sampled
+ */
+int32_t wifi_manager_get_rssi(void) {
+    return rssi;
+}
+
+/**
+ * @return The cyw43 link status that caused the last disconnect or failed connect, or 0 if there has been none
+ */
+int wifi_manager_get_last_disconnect_reason(void) {
+    return last_disconnect_reason;
+}
+
+/**
+ * @return The number of times the link has been lost since boot
+ */
+uint32_t wifi_manager_get_disconnect_count(void) {
+    return disconnect_count;
+}
+
+/**
+ * @return Milliseconds from boot until the link first came up, or 0 if it has not come up yet
+ */
+uint32_t wifi_manager_get_boot_to_connected_ms(void) {
+    return boot_to_connected_ms;
+}
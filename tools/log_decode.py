@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+"""
+Decodes the binary tokenized log stream of the sensor back to text.
+
+The dictionary is the log_strings section of the firmware. The build extracts it next to the ELF file as
+live-room-sensor.logdict, or it can be read straight from the ELF file with --elf.
+
+Usage:
+  log_decode.py --dict build/live-room-sensor.logdict /dev/rfcomm0
+  log_decode.py --elf build/live-room-sensor.elf capture.bin
+
+Switch the sensor to the binary format with AT+LOG-FORMAT=BINARY on the Bluetooth console. Text that is not part of
+a frame, like the replies to console commands, is printed as is. See src/multi_printf.c for the frame format.
+"""
+
+import argparse
+import os
+import re
+import struct
+import subprocess
+import sys
+import tempfile
+import zlib
+
+FRAME_RADAR = 0x1D
+FRAME_RECORD = 0x1E
+FRAME_DICTIONARY = 0x1F
+
+MODULES = ["MAIN", "RADAR", "PIR", "SENSOR", "WIFI", "NET", "REPORTING", "BLUETOOTH", "STORAGE", "OTA"]
+LEVELS = ["ERROR", "WARN", "INFO", "DEBUG"]
+
+# The same conversion syntax the firmware parses when it captures the arguments
+CONVERSION = re.compile(r"%([-+ #0]*)((?:\*|\d+)?)((?:\.(?:\*|\d+))?)([hlLjzt]*)([a-zA-Z%])")
+
+
+def load_dictionary(args):
+    if args.dict:
+        with open(args.dict, "rb") as file:
+            return file.read()
+
+    objcopy = os.environ.get("OBJCOPY", "arm-none-eabi-objcopy")
+    with tempfile.NamedTemporaryFile(suffix=".logdict") as output:
+        subprocess.run([objcopy, "-O", "binary", "--only-section=log_strings", args.elf, output.name], check=True)
+        return output.read()
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def varint(self):
+        value = 0
+        shift = 0
+        while True:
+            byte = self.data[self.pos]
+            self.pos += 1
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            if not byte & 0x80:
+                return value
+
+    def zigzag(self):
+        value = self.varint()
+        return (value >> 1) ^ -(value & 1)
+
+    def bytes(self, count):
+        value = self.data[self.pos:self.pos + count]
+        if len(value) != count:
+            raise IndexError("frame too short")
+        self.pos += count
+        return value
+
+
+def format_record(fmt, reader):
+    """Rebuilds the text of one record, a conversion at a time like the firmware does in text mode"""
+    out = []
+    pos = 0
+    for match in CONVERSION.finditer(fmt):
+        out.append(fmt[pos:match.start()])
+        pos = match.end()
+        flags, width, precision, _, conversion = match.groups()
+        if conversion == "%":
+            out.append("%")
+            continue
+
+        if width == "*":
+            width = str(reader.zigzag())
+        if precision == ".*":
+            precision = "." + str(reader.zigzag())
+        spec = "%" + flags + width + precision
+
+        if conversion in "di":
+            out.append((spec + "d") % reader.zigzag())
+        elif conversion in "uoxXc":
+            value = reader.varint()
+            out.append((spec + ("d" if conversion == "u" else conversion)) % value)
+        elif conversion == "p":
+            out.append("0x%08x" % reader.varint())
+        elif conversion in "fFeEgG":
+            out.append((spec + conversion) % struct.unpack("<d", reader.bytes(8))[0])
+        elif conversion == "s":
+            length = reader.varint()
+            out.append((spec + "s") % reader.bytes(length).decode("utf-8", "replace"))
+        else:
+            out.append(match.group(0))
+    out.append(fmt[pos:])
+    return "".join(out)
+
+
+def lookup(dictionary, token):
+    end = dictionary.find(b"\0", token)
+    if token >= len(dictionary) or end < 0:
+        return None
+    return dictionary[token:end].decode("utf-8", "replace")
+
+
+def decode(stream, dictionary, out, show_module):
+    at_line_start = True
+    buffer = b""
+    while True:
+        chunk = stream.read1(4096) if hasattr(stream, "read1") else stream.read(4096)
+        if not chunk:
+            break
+        buffer += chunk
+
+        while buffer:
+            marker = buffer[0]
+            if marker == FRAME_DICTIONARY:
+                if len(buffer) < 5:
+                    break
+                crc = struct.unpack("<I", buffer[1:5])[0]
+                if crc != zlib.crc32(dictionary):
+                    sys.stderr.write("warning: the dictionary does not match the firmware on the device\n")
+                buffer = buffer[5:]
+                continue
+
+            if marker not in (FRAME_RECORD, FRAME_RADAR):
+                # Plain text up to the next frame
+                end = min([i for i in (buffer.find(bytes([m])) for m in (FRAME_RECORD, FRAME_DICTIONARY, FRAME_RADAR))
+                           if i >= 0] or [len(buffer)])
+                out.write(buffer[:end].decode("utf-8", "replace"))
+                at_line_start = buffer[end - 1:end] == b"\n"
+                buffer = buffer[end:]
+                continue
+
+            try:
+                header = Reader(buffer)
+                header.pos = 1
+                length = header.varint()
+            except IndexError:
+                break
+            if len(buffer) < header.pos + length:
+                break
+            payload = Reader(buffer[header.pos:header.pos + length])
+            buffer = buffer[header.pos + length:]
+            if marker == FRAME_RADAR:
+                # Radar stream frames are for tools/radar_stream.py
+                continue
+
+            try:
+                token = payload.varint()
+                timestamp_ms = payload.varint()
+                module_level = payload.bytes(1)[0]
+                fmt = lookup(dictionary, token)
+                text = format_record(fmt, payload) if fmt is not None else "<unknown token %d>\n" % token
+            except (IndexError, TypeError, ValueError) as error:
+                text = "<undecodable frame: %s>\n" % error
+                timestamp_ms = 0
+                module_level = 0
+
+            if at_line_start:
+                module = module_level >> 4
+                level = module_level & 0xF
+                prefix = "[%5d.%03d] " % (timestamp_ms // 1000, timestamp_ms % 1000)
+                if show_module:
+                    prefix += "%s %s: " % (MODULES[module] if module < len(MODULES) else module,
+                                           LEVELS[level] if level < len(LEVELS) else level)
+                out.write(prefix)
+            out.write(text)
+            at_line_start = text.endswith("\n")
+        out.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument("--dict", help="dictionary extracted by the build (live-room-sensor.logdict)")
+    source.add_argument("--elf", help="firmware ELF file to extract the dictionary from")
+    parser.add_argument("--module", action="store_true", help="prefix each line with its module and level")
+    parser.add_argument("input", nargs="?", default="-", help="capture file or serial device, - for stdin")
+    args = parser.parse_args()
+
+    dictionary = load_dictionary(args)
+    stream = sys.stdin.buffer if args.input == "-" else open(args.input, "rb", buffering=0)
+    try:
+        decode(stream, dictionary, sys.stdout, args.module)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,228 @@
+/*
+ * Replays a recorded radar count trace through the occupancy estimator and the old sample count window,
+ * and prints how responsive and how stable each configuration is.
+ *
+ * Build on the host from the repository root:
+ *   cc -O2 -Isrc/include -o occupancy_replay tools/occupancy_replay.c src/occupancy_estimator.c
+ *
+ * Usage:
+ *   occupancy_replay [-w window_samples] [-t tau_ms,tau_ms,...] [-o output.csv] trace.csv
+ *
+ * A trace is a CSV file with one frame per line: timestamp_ms,count[,true_count]
+ * Lines starting with # are ignored. The optional true_count column is a hand labelled ground truth, when it is
+ * present the error and settle time are measured against it instead of against the raw count.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "occupancy_estimator.h"
+
+#define MAX_TIME_CONSTANTS 16
+#define DEFAULT_WINDOW_SAMPLES 800
+
+typedef struct {
+    uint32_t time_ms;
+    uint8_t count;
+    int16_t truth;
+} trace_sample_t;
+
+typedef struct {
+    double mean_abs_error;
+    double changes_per_hour;
+    double mean_settle_ms;
+    uint32_t settle_events;
+} replay_result_t;
+
+static trace_sample_t *samples = NULL;
+static size_t sample_count = 0;
+static bool has_truth = false;
+
+static bool load_trace(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+
+    size_t capacity = 1024;
+    samples = malloc(capacity * sizeof(trace_sample_t));
+    has_truth = true;
+
+    char line[128];
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+
+        unsigned long time_ms;
+        unsigned int count;
+        int truth;
+        int fields = sscanf(line, "%lu,%u,%d", &time_ms, &count, &truth);
+        if (fields < 2) continue;
+
+        if (sample_count == capacity) {
+            capacity *= 2;
+            samples = realloc(samples, capacity * sizeof(trace_sample_t));
+        }
+        samples[sample_count].time_ms = (uint32_t) time_ms;
+        samples[sample_count].count = (uint8_t) count;
+        samples[sample_count].truth = fields == 3 ? (int16_t) truth : -1;
+        has_truth &= fields == 3;
+        sample_count++;
+    }
+
+    fclose(file);
+    return sample_count > 0;
+}
+
+static int16_t reference(const trace_sample_t *sample) {
+    return has_truth ? sample->truth : sample->count;
+}
+
+/**
+ * Feeds an output series into the metrics. Settle time is the time from a change of the reference count until the
+ * output first equals the new reference.
+ */
+static void score(replay_result_t *result, const int16_t *outputs) {
+    double error_sum = 0;
+    uint32_t changes = 0;
+    double settle_sum = 0;
+    uint32_t settle_events = 0;
+    bool settling = false;
+    uint32_t settle_start_ms = 0;
+
+    for (size_t i = 0; i < sample_count; i++) {
+        int16_t ref = reference(&samples[i]);
+        error_sum += abs(outputs[i] - ref);
+
+        if (i > 0 && outputs[i] != outputs[i - 1]) changes++;
+
+        if (i > 0 && ref != reference(&samples[i - 1])) {
+            settling = true;
+            settle_start_ms = samples[i].time_ms;
+        }
+        if (settling && outputs[i] == ref) {
+            settling = false;
+            settle_sum += samples[i].time_ms - settle_start_ms;
+            settle_events++;
+        }
+    }
+
+    double duration_h = (samples[sample_count - 1].time_ms - samples[0].time_ms) / 3600000.0;
+    result->mean_abs_error = error_sum / sample_count;
+    result->changes_per_hour = duration_h > 0 ? changes / duration_h : 0;
+    result->mean_settle_ms = settle_events ? settle_sum / settle_events : 0;
+    result->settle_events = settle_events;
+}
+
+/**
+ * The averaging the radar drivers used before the estimator, the mean of the last N frames rounded to nearest
+ */
+static void replay_window(int16_t *outputs, uint32_t window) {
+    uint8_t *history = calloc(window, 1);
+    uint32_t head = 0;
+    uint32_t sum = 0;
+
+    for (size_t i = 0; i < sample_count; i++) {
+        sum -= history[head];
+        history[head] = samples[i].count;
+        sum += samples[i].count;
+        head = (head + 1) % window;
+        outputs[i] = (int16_t) ((sum + window / 2) / window);
+    }
+
+    free(history);
+}
+
+static void replay_estimator(int16_t *outputs, uint32_t time_constant_ms) {
+    occupancy_estimator_t estimator;
+    occupancy_estimator_init(&estimator, time_constant_ms);
+
+    for (size_t i = 0; i < sample_count; i++) {
+        occupancy_estimator_add_sample(&estimator, samples[i].count, samples[i].time_ms);
+        outputs[i] = occupancy_estimator_get_count(&estimator);
+    }
+}
+
+static void print_result(const char *name, const replay_result_t *result) {
+    printf("%-24s %10.3f %14.1f %12.0f %8u\n", name, result->mean_abs_error, result->changes_per_hour,
+           result->mean_settle_ms, result->settle_events);
+}
+
+int main(int argc, char **argv) {
+    uint32_t window = DEFAULT_WINDOW_SAMPLES;
+    uint32_t time_constants[MAX_TIME_CONSTANTS] = {5000, 10000, OCCUPANCY_TIME_CONSTANT_MS, 60000};
+    size_t time_constant_count = 4;
+    const char *output_path = NULL;
+    const char *trace_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            window = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            time_constant_count = 0;
+            for (char *tau = strtok(argv[++i], ","); tau && time_constant_count < MAX_TIME_CONSTANTS; tau = strtok(NULL, ",")) {
+                time_constants[time_constant_count++] = strtoul(tau, NULL, 10);
+            }
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else {
+            trace_path = argv[i];
+        }
+    }
+
+    if (!trace_path || window == 0) {
+        fprintf(stderr, "Usage: %s [-w window_samples] [-t tau_ms,tau_ms,...] [-o output.csv] trace.csv\n", argv[0]);
+        return 1;
+    }
+
+    if (!load_trace(trace_path)) {
+        fprintf(stderr, "No samples in %s\n", trace_path);
+        return 1;
+    }
+
+    double duration_s = (samples[sample_count - 1].time_ms - samples[0].time_ms) / 1000.0;
+    printf("%zu frames over %.0f s (%.1f frames/s), errors against %s\n\n", sample_count, duration_s,
+           duration_s > 0 ? sample_count / duration_s : 0, has_truth ? "ground truth" : "raw count");
+    printf("%-24s %10s %14s %12s %8s\n", "configuration", "mean error", "changes/hour", "settle ms", "steps");
+
+    int16_t *outputs = malloc((time_constant_count + 1) * sample_count * sizeof(int16_t));
+    replay_result_t result;
+    char name[32];
+
+    replay_window(outputs, window);
+    score(&result, outputs);
+    snprintf(name, sizeof(name), "window %u samples", window);
+    print_result(name, &result);
+
+    for (size_t t = 0; t < time_constant_count; t++) {
+        int16_t *series = outputs + (t + 1) * sample_count;
+        replay_estimator(series, time_constants[t]);
+        score(&result, series);
+        snprintf(name, sizeof(name), "ewma tau %u ms", time_constants[t]);
+        print_result(name, &result);
+    }
+
+    if (output_path) {
+        FILE *file = fopen(output_path, "w");
+        if (!file) {
+            perror(output_path);
+            return 1;
+        }
+        fprintf(file, "timestamp_ms,count,window_%u", window);
+        for (size_t t = 0; t < time_constant_count; t++) fprintf(file, ",ewma_%u", time_constants[t]);
+        fprintf(file, "\n");
+        for (size_t i = 0; i < sample_count; i++) {
+            fprintf(file, "%u,%u", samples[i].time_ms, samples[i].count);
+            for (size_t t = 0; t <= time_constant_count; t++) fprintf(file, ",%d", outputs[t * sample_count + i]);
+            fprintf(file, "\n");
+        }
+        fclose(file);
+    }
+
+    free(outputs);
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,241 @@
+#!/usr/bin/env python3
+"""
+Creates a compressed delta patch that updates a sensor from one firmware image to another over the air.
+
+The images are the live-room-sensor.bin files of the two builds. The patch only applies to the exact old image, the
+sensor checks its SHA-256 before it writes anything. Serve the patch from the reporting server and tell the sensors
+that run the old image to fetch it with a FIRMWARE-PATCH=<path> line in the response to their report, or start an
+update by hand with AT+OTA=<path> on the Bluetooth console.
+
+Usage:
+  ota_patch.py old/live-room-sensor.bin new/live-room-sensor.bin update.lrp
+
+The patch is verified by applying it to the old image before it is written. See src/include/ota_patch.h for the
+format.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = 0x3150524C  # "LRP1"
+HEADER = struct.Struct("<II32sI32s")
+CONTROL = struct.Struct("<IIi")
+
+# heatshrink -w 10 -l 8, the same as OTA_PATCH_WINDOW_BITS and OTA_PATCH_LOOKAHEAD_BITS
+WINDOW_BITS = 10
+LOOKAHEAD_BITS = 8
+WINDOW = 1 << WINDOW_BITS
+LOOKAHEAD = 1 << LOOKAHEAD_BITS
+MIN_MATCH = 3
+MAX_CANDIDATES = 16
+
+# Matching the images: a run of this many bytes starts a match, which lasts as long as at least half of every
+# STEP bytes are the same. Code that moved keeps most of its bytes, only the addresses in it change, and the diff
+# of such a block is mostly zero bytes, which compress well
+SEED = 8
+STEP = 64
+
+
+def similar(old, new, new_pos, old_pos, length):
+    if old_pos < 0 or old_pos + length > len(old):
+        return False
+    same = sum(a == b for a, b in zip(new[new_pos:new_pos + length], old[old_pos:old_pos + length]))
+    return same * 2 >= length
+
+
+def match_images(old, new):
+    """Split the new image into (start, end, old start) blocks that resemble the old image, the rest is new"""
+    index = {}
+    for i in range(len(old) - SEED + 1):
+        index.setdefault(old[i:i + SEED], i)
+
+    blocks = []
+    block_start = None
+    offset = 0
+    pos = 0
+    while pos < len(new):
+        if block_start is not None:
+            length = min(STEP, len(new) - pos)
+            if similar(old, new, pos, pos + offset, length):
+                pos += length
+                continue
+
+            # Keep the bytes of the last step that are still the same
+            while pos < len(new) and 0 <= pos + offset < len(old) and new[pos] == old[pos + offset]:
+                pos += 1
+            blocks.append((block_start, pos, block_start + offset))
+            block_start = None
+            if pos == len(new):
+                break
+
+        candidate = index.get(new[pos:pos + SEED])
+        if candidate is not None and similar(old, new, pos, candidate, min(STEP, len(new) - pos)):
+            block_start = pos
+            offset = candidate - pos
+        else:
+            pos += 1
+
+    if block_start is not None:
+        blocks.append((block_start, len(new), block_start + offset))
+    return blocks
+
+
+def make_records(old, new):
+    """The uncompressed records, a diff against the old image followed by new bytes for every block"""
+    if not new:
+        return bytearray()
+
+    blocks = match_images(old, new)
+    if not blocks or blocks[0][0] > 0:
+        blocks.insert(0, (0, 0, 0))
+
+    records = bytearray()
+    for i, (start, end, old_start) in enumerate(blocks):
+        next_start, _, next_old_start = blocks[i + 1] if i + 1 < len(blocks) else (len(new), 0, old_start + end - start)
+        seek = next_old_start - (old_start + end - start)
+        records += CONTROL.pack(end - start, next_start - end, seek)
+        records += bytes((a - b) & 0xFF for a, b in zip(new[start:end], old[old_start:old_start + end - start]))
+        records += new[end:next_start]
+    return records
+
+
+class BitWriter:
+    def __init__(self):
+        self.output = bytearray()
+        self.bits = 0
+        self.count = 0
+
+    def write(self, value, count):
+        self.bits = self.bits << count | value
+        self.count += count
+        while self.count >= 8:
+            self.count -= 8
+            self.output.append((self.bits >> self.count) & 0xFF)
+        self.bits &= (1 << self.count) - 1
+
+    def finish(self):
+        if self.count:
+            self.output.append((self.bits << (8 - self.count)) & 0xFF)
+        return bytes(self.output)
+
+
+def compress(data):
+    """heatshrink compatible LZSS: a 1 bit and a literal byte, or a 0 bit, the distance - 1 and the length - 1"""
+    writer = BitWriter()
+    chains = {}
+    pos = 0
+    while pos < len(data):
+        best_length = 0
+        best_distance = 0
+        max_length = min(LOOKAHEAD, len(data) - pos)
+        if max_length >= MIN_MATCH:
+            for candidate in reversed(chains.get(data[pos:pos + MIN_MATCH], ())):
+                distance = pos - candidate
+                if distance > WINDOW:
+                    break
+                length = MIN_MATCH
+                while length < max_length and data[candidate + length] == data[pos + length]:
+                    length += 1
+                if length > best_length:
+                    best_length = length
+                    best_distance = distance
+                    if length == max_length:
+                        break
+
+        if best_length >= MIN_MATCH:
+            writer.write(0, 1)
+            writer.write(best_distance - 1, WINDOW_BITS)
+            writer.write(best_length - 1, LOOKAHEAD_BITS)
+            advance = best_length
+        else:
+            writer.write(1, 1)
+            writer.write(data[pos], 8)
+            advance = 1
+
+        for i in range(pos, min(pos + advance, len(data) - MIN_MATCH + 1)):
+            chain = chains.setdefault(data[i:i + MIN_MATCH], [])
+            chain.append(i)
+            if len(chain) > MAX_CANDIDATES:
+                del chain[0]
+        pos += advance
+    return writer.finish()
+
+
+def decompress(data):
+    output = bytearray()
+    bits = 0
+    count = 0
+    for byte in data:
+        bits = bits << 8 | byte
+        count += 8
+        while count:
+            if (bits >> (count - 1)) & 1:
+                if count < 9:
+                    break
+                count -= 9
+                output.append((bits >> count) & 0xFF)
+            else:
+                if count < 1 + WINDOW_BITS + LOOKAHEAD_BITS:
+                    break
+                count -= 1 + WINDOW_BITS + LOOKAHEAD_BITS
+                backref = bits >> count
+                distance = ((backref >> LOOKAHEAD_BITS) & (WINDOW - 1)) + 1
+                for _ in range((backref & (LOOKAHEAD - 1)) + 1):
+                    output.append(output[-distance] if distance <= len(output) else 0)
+            bits &= (1 << count) - 1
+    return bytes(output)
+
+
+def apply_patch(old, patch):
+    """Apply a patch the way src/ota_patch.c does"""
+    data = decompress(patch)
+    magic, old_size, old_sha256, new_size, new_sha256 = HEADER.unpack_from(data)
+    if magic != MAGIC or old_size != len(old) or hashlib.sha256(old).digest() != old_sha256:
+        raise ValueError("patch does not apply to this image")
+
+    new = bytearray()
+    pos = HEADER.size
+    old_pos = 0
+    while len(new) < new_size:
+        diff_len, extra_len, seek = CONTROL.unpack_from(data, pos)
+        pos += CONTROL.size
+        for i in range(diff_len):
+            old_byte = old[old_pos + i] if 0 <= old_pos + i < len(old) else 0
+            new.append((data[pos + i] + old_byte) & 0xFF)
+        pos += diff_len
+        new += data[pos:pos + extra_len]
+        pos += extra_len
+        old_pos += diff_len + seek
+
+    if hashlib.sha256(new).digest() != new_sha256:
+        raise ValueError("patched image has the wrong hash")
+    return bytes(new)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("old", help="live-room-sensor.bin the sensors run now")
+    parser.add_argument("new", help="live-room-sensor.bin to update them to")
+    parser.add_argument("patch", help="where to write the patch")
+    args = parser.parse_args()
+
+    with open(args.old, "rb") as file:
+        old = file.read()
+    with open(args.new, "rb") as file:
+        new = file.read()
+
+    header = HEADER.pack(MAGIC, len(old), hashlib.sha256(old).digest(), len(new), hashlib.sha256(new).digest())
+    patch = compress(header + make_records(old, new))
+
+    if apply_patch(old, patch) != new:
+        sys.exit("The patch does not reproduce the new image")
+
+    with open(args.patch, "wb") as file:
+        file.write(patch)
+    print(f"{len(new)} byte image, {len(patch)} byte patch ({100 * len(patch) / max(len(new), 1):.1f}%)")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+"""
+Turns a dump of the sampling profiler of the sensor into a flat profile or a flame graph.
+
+Every sample is the program counter and the link register of the code the profiler interrupted. The program counter
+gives the function the time was spent in. The link register is the return address of a function that has not called
+anything yet, and a stale value otherwise, so the caller it points to is a hint only.
+
+Usage:
+  profile_symbolize.py --elf build/live-room-sensor.elf capture.txt
+  profile_symbolize.py --elf build/live-room-sensor.elf --folded capture.txt | flamegraph.pl > profile.svg
+
+Start the profiler with AT+PROFILE-START=<Hz> and send AT+PROFILE-DUMP once it has stopped by itself or with
+AT+PROFILE-STOP, and capture the console output up to the PROFILE end line.
+"""
+
+import argparse
+import bisect
+import collections
+import os
+import re
+import subprocess
+import sys
+
+HEADER = re.compile(r"PROFILE period_us=(\d+) samples=(\d+)")
+SAMPLE = re.compile(r"^([0-9a-f]{8}) ([0-9a-f]{8})$")
+
+# The RP2040 bootrom is not in the ELF file, its floating point and memory routines show up often
+BOOTROM_END = 0x4000
+
+
+class Symbols:
+    def __init__(self, elf):
+        nm = os.environ.get("NM", "arm-none-eabi-nm")
+        output = subprocess.run([nm, "--numeric-sort", "--print-size", "--defined-only", elf],
+                                check=True, capture_output=True, text=True).stdout
+
+        self.starts = []
+        self.entries = []
+        for line in output.splitlines():
+            fields = line.split()
+            if len(fields) != 4 or fields[2] not in "tTwW":
+                continue
+            start = int(fields[0], 16) & ~1
+            self.starts.append(start)
+            self.entries.append((start, int(fields[1], 16), fields[3]))
+
+    def lookup(self, address):
+        address &= ~1  # Thumb bit
+        if address < BOOTROM_END:
+            return "<bootrom>"
+        if address >= 0xFFFFFFF0:
+            # An exception return value, the interrupted code was an interrupt handler that had not called anything
+            return "<exception return>"
+
+        index = bisect.bisect_right(self.starts, address) - 1
+        if index >= 0:
+            start, size, name = self.entries[index]
+            if address < start + max(size, 2):
+                return name
+        return "0x%08x" % address
+
+
+def read_samples(stream):
+    """Collects the samples of all the dumps in a capture, later dumps of the same run continue the earlier ones"""
+    period_us = None
+    samples = []
+    in_dump = False
+    for line in stream:
+        line = line.strip()
+        header = HEADER.search(line)
+        if header:
+            if period_us is not None and int(header.group(1)) != period_us:
+                sys.stderr.write("warning: the capture has dumps of runs with different rates\n")
+            period_us = int(header.group(1))
+            samples = []
+            in_dump = True
+            continue
+        if line.startswith("PROFILE end"):
+            in_dump = False
+            continue
+
+        match = SAMPLE.match(line)
+        if match and in_dump:
+            samples.append((int(match.group(1), 16), int(match.group(2), 16)))
+    return period_us, samples
+
+
+def flat_profile(samples, symbols, show_callers, out):
+    functions = collections.Counter()
+    callers = collections.defaultdict(collections.Counter)
+    for pc, lr in samples:
+        function = symbols.lookup(pc)
+        functions[function] += 1
+        callers[function][symbols.lookup(lr)] += 1
+
+    total = len(samples)
+    out.write("%7s %6s  %s\n" % ("samples", "%", "function"))
+    for function, count in functions.most_common():
+        out.write("%7d %5.1f%%  %s\n" % (count, 100.0 * count / total, function))
+        if show_callers:
+            for caller, caller_count in callers[function].most_common(3):
+                out.write("%7s %6s    <- %s (%d)\n" % ("", "", caller, caller_count))
+
+
+def folded(samples, symbols, out):
+    """The folded stack format of flamegraph.pl, with the link register as the frame below the program counter"""
+    stacks = collections.Counter()
+    for pc, lr in samples:
+        stacks[symbols.lookup(lr) + ";" + symbols.lookup(pc)] += 1
+    for stack, count in sorted(stacks.items()):
+        out.write("%s %d\n" % (stack, count))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--elf", required=True, help="firmware ELF file the samples were taken with")
+    output = parser.add_mutually_exclusive_group()
+    output.add_argument("--callers", action="store_true", help="show the likely callers of each function")
+    output.add_argument("--folded", action="store_true", help="print folded stacks for flamegraph.pl")
+    parser.add_argument("input", nargs="?", default="-", help="capture of the dump, - for stdin")
+    args = parser.parse_args()
+
+    symbols = Symbols(args.elf)
+    stream = sys.stdin if args.input == "-" else open(args.input, errors="replace")
+    period_us, samples = read_samples(stream)
+    if not samples:
+        sys.stderr.write("no profiler samples found in the input\n")
+        sys.exit(1)
+
+    if args.folded:
+        folded(samples, symbols, sys.stdout)
+    else:
+        sys.stdout.write("%d samples, %d ms at %d Hz\n\n" % (len(samples), len(samples) * period_us // 1000,
+                                                           1000000 // period_us))
+        flat_profile(samples, symbols, args.callers, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
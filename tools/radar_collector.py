@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""
+Receives the raw radar frames a sensor mirrors over UDP and writes them as an occupancy_replay trace.
+
+Start mirroring with AT+RADAR-MIRROR=<ip of this machine>[:port] on the Bluetooth console, or build the firmware with
+RADAR_MIRROR_COLLECTOR set. Every frame the radar reports a count in becomes a timestamp_ms,count line of the trace,
+gaps in the sequence and sensor restarts are written as # comments, which occupancy_replay skips. With --raw every
+datagram is also kept as timestamp_ms,radar,hex of the frame as received, for working on the frames themselves.
+See src/radar_mirror.c for the datagram format.
+
+Usage:
+  radar_collector.py trace.csv
+  radar_collector.py --port 5005 --source 192.168.1.42 --raw raw.csv trace.csv
+"""
+
+import argparse
+import socket
+import struct
+import sys
+
+HEADER = struct.Struct("<2sBBII")
+MAGIC = b"RM"
+VERSION = 1
+
+RADAR_MICRADAR = 1
+RADAR_MINEWSEMI = 2
+RADAR_NAMES = {RADAR_MICRADAR: "micradar", RADAR_MINEWSEMI: "minewsemi"}
+
+MICRADAR_TRAJECTORY_INFO_REPORT = 0x8202
+MICRADAR_TRAJECTORY_INFO_REPORT_POINT_SIZE = 11
+
+MINEWSEMI_POINT_SIZE = 25
+MINEWSEMI_PERSON_SIZE = 32
+
+
+def micradar_count(frame):
+    """The person count of a trajectory report, the same way src/micradar.c gets it"""
+    if len(frame) < 9 or (frame[2] << 8 | frame[3]) != MICRADAR_TRAJECTORY_INFO_REPORT:
+        return None
+    return (frame[4] << 8 | frame[5]) // MICRADAR_TRAJECTORY_INFO_REPORT_POINT_SIZE
+
+
+def minewsemi_count(frame):
+    """The person count of a radar frame, the same way src/minewsemi_radar.c gets it"""
+    if len(frame) < 24:
+        return None
+    first_tlv, points_size = struct.unpack_from("<II", frame, 16)
+    end_of_points = 24 + points_size
+    if first_tlv != 1 or points_size % MINEWSEMI_POINT_SIZE or len(frame) < end_of_points + 8:
+        return None
+    second_tlv, persons_size = struct.unpack_from("<II", frame, end_of_points)
+    if second_tlv != 2 or persons_size % MINEWSEMI_PERSON_SIZE:
+        return None
+    return persons_size // MINEWSEMI_PERSON_SIZE
+
+
+COUNTERS = {RADAR_MICRADAR: micradar_count, RADAR_MINEWSEMI: minewsemi_count}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", type=int, default=5005, help="UDP port to listen on (default 5005)")
+    parser.add_argument("--source", help="only accept frames from this sensor address")
+    parser.add_argument("--raw", help="also write every frame as received to this file")
+    parser.add_argument("trace", help="occupancy_replay trace to write, - for stdout")
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 20)
+    sock.bind(("", args.port))
+
+    trace = sys.stdout if args.trace == "-" else open(args.trace, "w")
+    raw = open(args.raw, "w") if args.raw else None
+    trace.write("# timestamp_ms,count\n")
+
+    expected_sequence = None
+    frames = 0
+    lost = 0
+    try:
+        while True:
+            datagram, (address, _) = sock.recvfrom(65535)
+            if args.source and address != args.source:
+                continue
+            if len(datagram) < HEADER.size:
+                continue
+            magic, version, radar, sequence, timestamp_ms = HEADER.unpack_from(datagram)
+            if magic != MAGIC or version != VERSION:
+                sys.stderr.write("ignoring datagram from %s with an unknown format\n" % address)
+                continue
+            frame = datagram[HEADER.size:]
+
+            if expected_sequence is not None and sequence != expected_sequence:
+                if sequence < expected_sequence:
+                    trace.write("# sensor %s restarted\n" % address)
+                else:
+                    lost += sequence - expected_sequence
+                    trace.write("# %d frames lost\n" % (sequence - expected_sequence))
+            expected_sequence = sequence + 1
+            frames += 1
+
+            if raw:
+                raw.write("%d,%s,%s\n" % (timestamp_ms, RADAR_NAMES.get(radar, radar), frame.hex()))
+            count = COUNTERS.get(radar, lambda _: None)(frame)
+            if count is not None:
+                trace.write("%d,%d\n" % (timestamp_ms, count))
+            trace.flush()
+            if raw:
+                raw.flush()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        sys.stderr.write("%d frames received, %d lost\n" % (frames, lost))
+        if trace is not sys.stdout:
+            trace.close()
+        if raw:
+            raw.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+"""
+Decodes the live radar stream of the sensor, started with AT+MINEW-STREAM=ON on the Bluetooth console.
+
+Every radar frame is printed as one line with its persons, --points adds the point cloud. With --save the decoded
+frames are also written to a file as JSON lines, one object per frame. Positions are in metres and velocities in
+metres per second. Log output in between the frames is skipped, see src/radar_stream.c for the frame format.
+
+Usage:
+  radar_stream.py /dev/rfcomm0
+  radar_stream.py --points --save room.jsonl /dev/rfcomm0
+  radar_stream.py capture.bin
+"""
+
+import argparse
+import json
+import sys
+
+FRAME_RADAR = 0x1D
+FRAME_LOG_RECORD = 0x1E
+FRAME_LOG_DICTIONARY = 0x1F
+
+FLAG_KEY_FRAME = 0x01
+FLAG_TRUNCATED = 0x02
+
+POINT_FIELDS = ("x", "y", "z", "doppler", "snr")
+PERSON_FIELDS = ("x", "y", "z", "vx", "vy", "vz")
+# Divisors from the 16 bit fixed point values back to the units of the radar
+POINT_SCALE = {"x": 1000.0, "y": 1000.0, "z": 1000.0, "doppler": 1, "snr": 10.0}
+PERSON_SCALE = 1000.0
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def byte(self):
+        if self.pos >= len(self.data):
+            raise IndexError("frame too short")
+        value = self.data[self.pos]
+        self.pos += 1
+        return value
+
+    def varint(self):
+        value = 0
+        shift = 0
+        while True:
+            byte = self.byte()
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            if not byte & 0x80:
+                return value
+
+    def zigzag(self):
+        value = self.varint()
+        return (value >> 1) ^ -(value & 1)
+
+
+def split_frames(stream):
+    """Yields the payloads of the radar frames in a stream that also has text and log frames"""
+    buffer = b""
+    while True:
+        chunk = stream.read1(4096) if hasattr(stream, "read1") else stream.read(4096)
+        if not chunk:
+            return
+        buffer += chunk
+
+        while buffer:
+            marker = buffer[0]
+            if marker == FRAME_LOG_DICTIONARY:
+                if len(buffer) < 5:
+                    break
+                buffer = buffer[5:]
+                continue
+
+            if marker not in (FRAME_RADAR, FRAME_LOG_RECORD):
+                end = min([i for i in (buffer.find(bytes([m])) for m in (FRAME_RADAR, FRAME_LOG_RECORD,
+                                                                          FRAME_LOG_DICTIONARY)) if i >= 0]
+                          or [len(buffer)])
+                buffer = buffer[end:]
+                continue
+
+            try:
+                header = Reader(buffer)
+                header.pos = 1
+                length = header.varint()
+            except IndexError:
+                break
+            if len(buffer) < header.pos + length:
+                break
+            payload = buffer[header.pos:header.pos + length]
+            buffer = buffer[header.pos + length:]
+            if marker == FRAME_RADAR:
+                yield payload
+
+
+class Decoder:
+    def __init__(self):
+        self.previous = None
+        self.expected_sequence = None
+        self.frames_lost = 0
+
+    def decode(self, payload):
+        """Returns the decoded frame, or None while waiting for a key frame after a gap"""
+        reader = Reader(payload)
+        flags = reader.byte()
+        sequence = reader.varint()
+        key_frame = bool(flags & FLAG_KEY_FRAME)
+
+        if self.expected_sequence is not None and sequence != self.expected_sequence:
+            self.frames_lost += (sequence - self.expected_sequence) & 0xFFFFFFFF
+            self.previous = None
+        self.expected_sequence = sequence + 1
+
+        if not key_frame and self.previous is None:
+            return None
+
+        frame = {"sequence": sequence, "frame": reader.varint(), "time_ms": reader.varint(),
+                 "truncated": bool(flags & FLAG_TRUNCATED)}
+
+        previous_points = [] if key_frame else self.previous["raw_points"]
+        points = []
+        for i in range(reader.varint()):
+            reference = previous_points[i] if i < len(previous_points) else dict.fromkeys(POINT_FIELDS, 0)
+            points.append({field: reference[field] + reader.zigzag() for field in POINT_FIELDS})
+
+        previous_persons = {} if key_frame else {person["id"]: person for person in self.previous["raw_persons"]}
+        persons = []
+        for _ in range(reader.varint()):
+            person_id = reader.varint()
+            reference = previous_persons.get(person_id, dict.fromkeys(PERSON_FIELDS, 0))
+            person = {"id": person_id}
+            person.update({field: reference[field] + reader.zigzag() for field in PERSON_FIELDS})
+            persons.append(person)
+
+        self.previous = {"raw_points": points, "raw_persons": persons}
+        frame["points"] = [{field: point[field] / POINT_SCALE[field] for field in POINT_FIELDS} for point in points]
+        frame["persons"] = [dict({"id": person["id"]}, **{field: person[field] / PERSON_SCALE for field in PERSON_FIELDS})
+                            for person in persons]
+        return frame
+
+
+def print_frame(frame, show_points, out):
+    persons = " ".join("#%d(%.2f,%.2f,%.2f)" % (person["id"], person["x"], person["y"], person["z"])
+                       for person in frame["persons"])
+    out.write("[%5d.%03d] frame %d: %d points, %d persons%s %s\n" % (
+        frame["time_ms"] // 1000, frame["time_ms"] % 1000, frame["frame"], len(frame["points"]),
+        len(frame["persons"]), " (truncated)" if frame["truncated"] else "", persons))
+    if show_points:
+        for point in frame["points"]:
+            out.write("    (%.3f, %.3f, %.3f) doppler %d snr %.1f\n" % (
+                point["x"], point["y"], point["z"], point["doppler"], point["snr"]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--points", action="store_true", help="print the point cloud of every frame")
+    parser.add_argument("--save", help="also write the decoded frames to this file as JSON lines")
+    parser.add_argument("input", nargs="?", default="-", help="capture file or serial device, - for stdin")
+    args = parser.parse_args()
+
+    stream = sys.stdin.buffer if args.input == "-" else open(args.input, "rb", buffering=0)
+    save = open(args.save, "w") if args.save else None
+    decoder = Decoder()
+    try:
+        for payload in split_frames(stream):
+            try:
+                frame = decoder.decode(payload)
+            except IndexError as error:
+                sys.stderr.write("undecodable frame: %s\n" % error)
+                decoder.previous = None
+                continue
+            if frame is None:
+                continue
+            print_frame(frame, args.points, sys.stdout)
+            sys.stdout.flush()
+            if save:
+                save.write(json.dumps(frame) + "\n")
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if save:
+            save.close()
+        if decoder.frames_lost:
+            sys.stderr.write("%d frames were lost\n" % decoder.frames_lost)
+
+
+if __name__ == "__main__":
+    main()